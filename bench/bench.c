@@ -0,0 +1,205 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : bench.c
+ * Purpose : The standard benchmark suite, run by `make bench` against a local echo server.
+ *
+ * Scenarios:
+ *     latency     - a single client calling back to back with a small payload
+ *     throughput  - 8 clients calling back to back with a small payload
+ *     payload     - a single client, with payloads from 0 B up to 64 MB
+ *     connections - 1 up to 64 clients with a small payload
+ *     cast        - a single client casting back to back with a small payload, one-way
+ *
+ * Every client is a connection of its own, driven by its own thread, closed loop. Latencies are
+ * recorded into a histogram per client, merged once a run is over. Each run is a row of the CSV.
+ *
+ * Usage: bench-rpc [csv] [seconds per run] [port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "histogram.h"
+#include "rpc_utils.h"
+
+#define SMALL_PAYLOAD (size_t) 64
+#define MAX_CLIENTS   (int) 64
+
+
+/* client data structure, one per connection */
+typedef struct {
+    rpc_client* client;
+    rpc_handle* handle;
+    rpc_data payload;
+    int cast;                   // whether the client casts rather than calls
+    histogram_t latency;
+    unsigned long long calls;
+    unsigned long long failed;
+} bench_client_t;
+
+static atomic_int running = 0;
+
+
+/* echo handler, answering with a copy of the payload */
+static rpc_data* echo(rpc_data* payload) {
+    return rpc_data_copy(payload);
+}
+
+/* a client calls back to back until the run is over, and at least once */
+static void* drive(void* client_obj) {
+    bench_client_t* c = (bench_client_t*) client_obj;
+    while (atomic_load(&running) || c->calls + c->failed == 0) {
+        uint64_t start = rpc_now_ns();
+        if (c->cast) {
+            // a cast's latency is only its write; the final call below waits for them all
+            if (rpc_cast(c->client, c->handle, &c->payload) < 0) (c->failed)++;
+            else {
+                hist_record(&c->latency, rpc_now_ns() - start);
+                (c->calls)++;
+            }
+            continue;
+        }
+        rpc_data* response = rpc_call(c->client, c->handle, &c->payload);
+        uint64_t end = rpc_now_ns();
+        if (response == NULL || response->data2_len != c->payload.data2_len) {
+            (c->failed)++;
+            rpc_data_free(response);
+            continue;
+        }
+        hist_record(&c->latency, end - start);
+        (c->calls)++;
+        rpc_data_free(response);
+    }
+    if (c->cast) rpc_data_free(rpc_call(c->client, c->handle, &c->payload));
+    return NULL;
+}
+
+/**
+ * Run a scenario's point, and write its row.
+ * @param csv           the CSV file
+ * @param scenario      the scenario's name
+ * @param num_clients   the number of clients (connections)
+ * @param payload_bytes the payload's data2 size
+ * @param cast          whether the clients cast rather than call
+ * @param seconds       how long the run lasts
+ * @param port          the server's port
+ * @return              0 if successful, and ERROR if otherwise
+ */
+static int run(FILE* csv, char* scenario, int num_clients, size_t payload_bytes, int cast,
+               double seconds, int port) {
+    bench_client_t* clients = (bench_client_t*) calloc(num_clients, sizeof(bench_client_t));
+    pthread_t* threads = (pthread_t*) malloc(num_clients * sizeof(pthread_t));
+    void* data2 = payload_bytes ? calloc(1, payload_bytes) : NULL;
+    if (clients == NULL || threads == NULL || (payload_bytes && data2 == NULL)) {
+        fprintf(stderr, "bench: out of memory\n");
+        return ERROR;
+    }
+
+    int connected = 0;
+    for (; connected < num_clients; connected++) {
+        bench_client_t* c = &clients[connected];
+        c->client = rpc_init_client("::1", port);
+        c->handle = c->client ? rpc_find(c->client, "echo") : NULL;
+        if (c->handle == NULL) break;
+        c->payload.data1 = connected;
+        c->payload.data2_len = payload_bytes;
+        c->payload.data2 = data2;
+        c->cast = cast;
+        hist_reset(&c->latency);
+    }
+
+    int err = 0;
+    histogram_t* total = (histogram_t*) malloc(sizeof(histogram_t));
+    hist_reset(total);
+    unsigned long long calls = 0, failed = 0;
+    uint64_t start = rpc_now_ns();
+    if (connected == num_clients) {
+        atomic_store(&running, 1);
+        for (int i = 0; i < num_clients; i++)
+            pthread_create(&threads[i], NULL, drive, &clients[i]);
+        usleep((useconds_t) (seconds * 1e6));
+        atomic_store(&running, 0);
+        for (int i = 0; i < num_clients; i++) {
+            pthread_join(threads[i], NULL);
+            hist_merge(total, &clients[i].latency);
+            calls += clients[i].calls;
+            failed += clients[i].failed;
+        }
+    }
+    else {
+        fprintf(stderr, "bench: cannot connect client %d\n", connected);
+        err = ERROR;
+    }
+    double elapsed = (double) (rpc_now_ns() - start) / 1e9;
+
+    if (!err) {
+        double rate = calls / elapsed;
+        fprintf(csv, "%s,%d,%zu,%llu,%llu,%.3f,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f\n",
+                scenario, num_clients, payload_bytes, calls, failed, elapsed, rate,
+                rate * payload_bytes * 2 / 1e6, hist_percentile(total, 50) / 1e3,
+                hist_percentile(total, 99) / 1e3, hist_percentile(total, 99.9) / 1e3,
+                atomic_load(&total->max) / 1e3);
+        fflush(csv);
+        printf("%-12s clients=%-3d payload=%-9zu calls/s=%-9.0f p50=%.1fus p99=%.1fus "
+               "p999=%.1fus\n", scenario, num_clients, payload_bytes, rate,
+               hist_percentile(total, 50) / 1e3, hist_percentile(total, 99) / 1e3,
+               hist_percentile(total, 99.9) / 1e3);
+    }
+
+    for (int i = 0; i < connected; i++) {
+        free(clients[i].handle);
+        if (clients[i].client) rpc_close_client(clients[i].client);
+    }
+    free(total);
+    free(data2);
+    free(threads);
+    free(clients);
+    return err;
+}
+
+
+int main(int argc, char* argv[]) {
+    char* path     = argc > 1 ? argv[1] : "out/bench.csv";
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    int port       = argc > 3 ? atoi(argv[3]) : 7200;
+
+    // the server runs in a child process of its own
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "echo", echo) < 0) {
+        fprintf(stderr, "bench: cannot set up server\n");
+        return 1;
+    }
+    pid_t child = fork();
+    if (child == 0) rpc_serve_all(server);
+    FILE* csv = fopen(path, "w");
+    if (csv == NULL) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        kill(child, SIGTERM);
+        return 1;
+    }
+    fprintf(csv, "scenario,clients,payload_bytes,calls,failed,seconds,calls_per_sec,"
+                 "mb_per_sec,p50_us,p99_us,p999_us,max_us\n");
+
+    int err = 0;
+    err |= run(csv, "latency", 1, SMALL_PAYLOAD, 0, seconds, port);
+    err |= run(csv, "throughput", 8, SMALL_PAYLOAD, 0, seconds, port);
+    for (size_t size = 0; size <= ((size_t) 64 << 20); size = size ? size * 4 : 1)
+        err |= run(csv, "payload", 1, size, 0, seconds, port);
+    for (int clients = 1; clients <= MAX_CLIENTS; clients *= 2)
+        err |= run(csv, "connections", clients, SMALL_PAYLOAD, 0, seconds, port);
+    err |= run(csv, "cast", 1, SMALL_PAYLOAD, 1, seconds, port);
+
+    fclose(csv);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    printf("results written to %s\n", path);
+    return err ? 1 : 0;
+}
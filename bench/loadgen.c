@@ -0,0 +1,291 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : loadgen.c
+ * Purpose : Open-loop load generator, calling a server's function at a target rate.
+ *
+ * Calls are scheduled at fixed intervals from the start, whatever the server does: call k is
+ * intended to be sent at start + k / rate. Threads take the next scheduled call, wait for its
+ * send time and for a free connection, and call. Latency is measured from the intended send time
+ * rather than the actual one, so when the server falls behind, the time calls spend waiting to be
+ * sent counts too (no coordinated omission). The service time, from the actual send, is reported
+ * next to it; the gap between the two is the queueing a closed-loop client would hide. The run
+ * stops at the end of its duration, and calls scheduled but not sent by then are reported.
+ *
+ * Usage: rpc-loadgen -i ip -p port -f function -r rate [-c connections] [-t threads]
+ *                    [-d seconds] [-s size[:weight],...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "histogram.h"
+#include "rpc_utils.h"
+
+#define MAX_SIZES (int) 32
+
+
+/* payload size, with its weight in the distribution */
+typedef struct {
+    size_t size;
+    unsigned int weight;
+} payload_size_t;
+
+/* connection pool, shared by all threads */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t free_cond;
+    rpc_client** free;
+    int num_free;
+} pool_t;
+
+/* worker thread data */
+typedef struct {
+    unsigned int seed;
+    histogram_t response;       // from the intended send time
+    histogram_t service;        // from the actual send time
+    unsigned long long calls;
+    unsigned long long overloaded;
+    unsigned long long expired;
+    unsigned long long failed;
+} worker_t;
+
+/* load generator configuration */
+static char* ip = NULL;
+static char* function = NULL;
+static int port = 0;
+static double rate = 0;
+static int num_connections = 1;
+static int num_threads = 1;
+static double seconds = 10;
+static payload_size_t sizes[MAX_SIZES] = { { 0, 1 } };
+static int num_sizes = 1;
+static unsigned int total_weight = 1;
+
+static pool_t pool;
+static rpc_handle* handle = NULL;
+static void* payload_data = NULL;
+static uint64_t start_ns = 0;
+static uint64_t end_ns = 0;
+static atomic_ullong next_call = 0;
+
+
+/**
+ * Parse the payload size distribution, e.g. "64:90,65536:10".
+ * @return 0 if successful, and ERROR if otherwise
+ */
+static int parse_sizes(char* spec) {
+    num_sizes = 0;
+    total_weight = 0;
+    for (char* item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (num_sizes == MAX_SIZES) return ERROR;
+        char* colon = strchr(item, ':');
+        sizes[num_sizes].size = strtoull(item, NULL, 10);
+        sizes[num_sizes].weight = colon ? (unsigned int) atoi(colon + 1) : 1;
+        total_weight += sizes[num_sizes].weight;
+        num_sizes++;
+    }
+    return num_sizes > 0 && total_weight > 0 ? 0 : ERROR;
+}
+
+/**
+ * Pick a payload size from the distribution.
+ */
+static size_t pick_size(unsigned int* seed) {
+    unsigned int pick = (unsigned int) rand_r(seed) % total_weight;
+    int i = 0;
+    while (pick >= sizes[i].weight) pick -= sizes[(i++)].weight;
+    return sizes[i].size;
+}
+
+/**
+ * Take a free connection from the pool, waiting for one if there is none.
+ */
+static rpc_client* pool_take(void) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.num_free == 0)
+        pthread_cond_wait(&pool.free_cond, &pool.lock);
+    rpc_client* client = pool.free[--pool.num_free];
+    pthread_mutex_unlock(&pool.lock);
+    return client;
+}
+
+/**
+ * Give a connection back to the pool.
+ */
+static void pool_give(rpc_client* client) {
+    pthread_mutex_lock(&pool.lock);
+    pool.free[pool.num_free++] = client;
+    pthread_cond_signal(&pool.free_cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * The worker, sending scheduled calls until the duration is over.
+ */
+static void* worker_loop(void* worker_obj) {
+    worker_t* w = (worker_t*) worker_obj;
+    double interval_ns = 1e9 / rate;
+    while (1) {
+        uint64_t k = atomic_fetch_add(&next_call, 1);
+        uint64_t intended = start_ns + (uint64_t) ((double) k * interval_ns);
+        if (intended >= end_ns || rpc_now_ns() >= end_ns) break;
+
+        struct timespec at = {
+                .tv_sec  = (time_t) (intended / 1000000000ULL),
+                .tv_nsec = (long) (intended % 1000000000ULL)
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) != 0);
+
+        rpc_client* client = pool_take();
+        rpc_data payload = { .data1 = (int) k, .data2_len = pick_size(&w->seed) };
+        payload.data2 = payload.data2_len ? payload_data : NULL;
+        uint64_t sent = rpc_now_ns();
+        rpc_data* response = rpc_call(client, handle, &payload);
+        uint64_t done = rpc_now_ns();
+        int status = rpc_client_status(client);
+        pool_give(client);
+
+        if (response == NULL) {
+            if      (status == RPC_OVERLOADED) (w->overloaded)++;
+            else if (status == RPC_EXPIRED)    (w->expired)++;
+            else                               (w->failed)++;
+            continue;
+        }
+        rpc_data_free(response);
+        hist_record(&w->response, done - intended);
+        hist_record(&w->service, done - sent);
+        (w->calls)++;
+    }
+    return NULL;
+}
+
+/**
+ * Print the percentiles of a histogram, HDR style.
+ */
+static void print_percentiles(char* title, histogram_t* h) {
+    double percentiles[] = { 50, 75, 90, 99, 99.9, 99.99, 99.999, 100 };
+    printf("%s latency (us):\n", title);
+    for (int i = 0; i < (int) (sizeof(percentiles) / sizeof(double)); i++)
+        printf("  %8.3f%%  %12.1f\n", percentiles[i], hist_percentile(h, percentiles[i]) / 1e3);
+    printf("  mean       %12.1f\n", hist_mean(h) / 1e3);
+}
+
+
+/**
+ * Main entry to the load generator.
+ * @return 0 if successful
+ */
+int main(int argc, char** argv) {
+    char* size_spec = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "i:p:f:r:c:t:d:s:")) != -1) {
+        switch (c) {
+            case 'i': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'f': function = optarg; break;
+            case 'r': rate = atof(optarg); break;
+            case 'c': num_connections = atoi(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 's': size_spec = optarg; break;
+            case '?':
+                fprintf(stderr, "loadgen: error in option -%c. Aborting...\n", optopt);
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (ip == NULL || port == 0 || function == NULL || rate <= 0) {
+        fprintf(stderr, "usage: %s -i ip -p port -f function -r rate [-c connections] "
+                        "[-t threads] [-d seconds] [-s size[:weight],...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (size_spec && parse_sizes(size_spec) < 0) {
+        fprintf(stderr, "loadgen: invalid payload sizes\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_connections < 1) num_connections = 1;
+    if (num_threads < num_connections) num_threads = num_connections;
+
+    // payloads all share one buffer of the largest size
+    size_t max_size = 0;
+    for (int i = 0; i < num_sizes; i++)
+        if (sizes[i].size > max_size) max_size = sizes[i].size;
+    payload_data = max_size ? calloc(1, max_size) : NULL;
+    assert(max_size == 0 || payload_data);
+
+    // connect, and find the function once (all connections are to the same server)
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.free_cond, NULL);
+    pool.free = (rpc_client**) malloc(num_connections * sizeof(rpc_client*));
+    assert(pool.free);
+    for (int i = 0; i < num_connections; i++) {
+        rpc_client* client = rpc_init_client(ip, port);
+        if (client == NULL) {
+            fprintf(stderr, "loadgen: cannot connect to %s:%d\n", ip, port);
+            exit(EXIT_FAILURE);
+        }
+        if (handle == NULL && (handle = rpc_find(client, function)) == NULL) {
+            fprintf(stderr, "loadgen: function %s not found\n", function);
+            exit(EXIT_FAILURE);
+        }
+        pool.free[pool.num_free++] = client;
+    }
+
+    worker_t* workers = (worker_t*) calloc(num_threads, sizeof(worker_t));
+    pthread_t* threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+    assert(workers && threads);
+    start_ns = rpc_now_ns() + 1000000;
+    end_ns = start_ns + (uint64_t) (seconds * 1e9);
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].seed = (unsigned int) i * 2654435761U + 1;
+        hist_reset(&workers[i].response);
+        hist_reset(&workers[i].service);
+        pthread_create(&threads[i], NULL, worker_loop, &workers[i]);
+    }
+
+    histogram_t* response = (histogram_t*) malloc(sizeof(histogram_t));
+    histogram_t* service = (histogram_t*) malloc(sizeof(histogram_t));
+    assert(response && service);
+    hist_reset(response);
+    hist_reset(service);
+    unsigned long long calls = 0, overloaded = 0, expired = 0, failed = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        hist_merge(response, &workers[i].response);
+        hist_merge(service, &workers[i].service);
+        calls += workers[i].calls;
+        overloaded += workers[i].overloaded;
+        expired += workers[i].expired;
+        failed += workers[i].failed;
+    }
+    double elapsed = (double) (rpc_now_ns() - start_ns) / 1e9;
+
+    printf("target %.0f calls/s, %d connections, %d threads, %.1f s\n",
+           rate, num_connections, num_threads, seconds);
+    unsigned long long scheduled = (unsigned long long) (seconds * rate);
+    unsigned long long sent = calls + overloaded + expired + failed;
+    printf("achieved %.0f calls/s (%llu ok, %llu overloaded, %llu expired, %llu failed, "
+           "%llu never sent)\n", calls / elapsed, calls, overloaded, expired, failed,
+           scheduled > sent ? scheduled - sent : 0);
+    print_percentiles("response (from intended send)", response);
+    print_percentiles("service (from actual send)", service);
+
+    for (int i = 0; i < pool.num_free; i++)
+        rpc_close_client(pool.free[i]);
+    free(handle);
+    free(pool.free);
+    free(response);
+    free(service);
+    free(workers);
+    free(threads);
+    free(payload_data);
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : micro.c
+ * Purpose : Microbenchmarks of the serialization layer (rpc_utils.c) over socketpair(AF_UNIX),
+ *           without any network in the way.
+ *
+ * The send half of each helper runs on one thread and the receive half on another, each end of a
+ * socketpair. Every op is one send matched by one receive, and is reported in ns/op, syscalls/op
+ * and allocations/op (both halves together). Syscalls and allocations are counted by wrapping
+ * them at link time (see the bench-micro target), per thread, so counting costs no atomics.
+ *
+ * A second table times the byte swapping of typed array elements (rpc_array.c) in memory, with
+ * the CPU's kernel and with the portable one, against a plain copy of the same bytes.
+ *
+ * Usage: bench-micro [scale]   (scale multiplies the iterations, 1 by default)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "rpc.h"
+#include "rpc_utils.h"
+#include "rpc_array.h"
+
+
+/* ----------------------------- COUNTING WRAPPERS ----------------------------- */
+
+static __thread unsigned long long syscalls = 0;
+static __thread unsigned long long allocs = 0;
+
+ssize_t __real_send(int fd, const void* buf, size_t len, int flags);
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr* msg, int flags);
+ssize_t __real_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __real_writev(int fd, const struct iovec* iov, int iovcnt);
+ssize_t __real_readv(int fd, const struct iovec* iov, int iovcnt);
+int __real_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+ssize_t __wrap_send(int fd, const void* buf, size_t len, int flags) {
+    syscalls++;
+    return __real_send(fd, buf, len, flags);
+}
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags) {
+    syscalls++;
+    return __real_recv(fd, buf, len, flags);
+}
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags) {
+    syscalls++;
+    return __real_sendmsg(fd, msg, flags);
+}
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags) {
+    syscalls++;
+    return __real_recvmsg(fd, msg, flags);
+}
+ssize_t __wrap_writev(int fd, const struct iovec* iov, int iovcnt) {
+    syscalls++;
+    return __real_writev(fd, iov, iovcnt);
+}
+ssize_t __wrap_readv(int fd, const struct iovec* iov, int iovcnt) {
+    syscalls++;
+    return __real_readv(fd, iov, iovcnt);
+}
+int __wrap_poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+    syscalls++;
+    return __real_poll(fds, nfds, timeout);
+}
+void* __wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+
+/* ----------------------------- HARNESS ----------------------------- */
+
+/* one half of a benchmark, run on its own thread */
+typedef struct half {
+    int fd;
+    long iterations;
+    size_t size;
+    void* buffer;
+    int err;
+    unsigned long long syscalls;
+    unsigned long long allocs;
+    void (*run)(struct half* half);
+} half_t;
+
+static void send_int_half(half_t* h) {
+    for (long i = 0; i < h->iterations && !h->err; i++)
+        h->err = rpc_send_int(h->fd, (int) i);
+}
+static void receive_int_half(half_t* h) {
+    int value;
+    for (long i = 0; i < h->iterations && !h->err; i++)
+        h->err = rpc_receive_int(h->fd, &value);
+}
+static void send_uint_half(half_t* h) {
+    for (long i = 0; i < h->iterations && !h->err; i++)
+        h->err = rpc_send_uint(h->fd, (uint64_t) i);
+}
+static void receive_uint_half(half_t* h) {
+    uint64_t value;
+    for (long i = 0; i < h->iterations && !h->err; i++)
+        h->err = rpc_receive_uint(h->fd, &value);
+}
+static void send_payload_half(half_t* h) {
+    rpc_data payload = { .data1 = 1, .data2_len = h->size, .data2 = h->size ? h->buffer : NULL };
+    for (long i = 0; i < h->iterations && !h->err; i++)
+        h->err = rpc_send_payload(h->fd, &payload);
+}
+static void send_payload_vec_half(half_t* h) {
+    // the same data2 as send_payload_half, split into 4 segments
+    struct iovec segments[4];
+    for (int i = 0; i < 4; i++) {
+        segments[i].iov_base = (char*) h->buffer + h->size / 4 * i;
+        segments[i].iov_len = i < 3 ? h->size / 4 : h->size - h->size / 4 * 3;
+    }
+    rpc_vdata payload = { .data1 = 1, .num_segments = h->size ? 4 : 0, .segments = segments };
+    for (long i = 0; i < h->iterations && !h->err; i++)
+        h->err = rpc_send_payload_vec(h->fd, &payload);
+}
+static void receive_payload_half(half_t* h) {
+    for (long i = 0; i < h->iterations && !h->err; i++) {
+        rpc_data* payload = rpc_receive_payload(h->fd);
+        if (payload == NULL || payload->data2_len != h->size) h->err = ERROR;
+        rpc_data_free(payload);
+    }
+}
+static void send_payload_crc_half(half_t* h) {
+    rpc_set_io_checksum(1);
+    send_payload_half(h);
+}
+static void receive_payload_crc_half(half_t* h) {
+    rpc_set_io_checksum(1);
+    receive_payload_half(h);
+}
+
+static void* run_half(void* half_obj) {
+    half_t* h = (half_t*) half_obj;
+    unsigned long long syscalls_before = syscalls, allocs_before = allocs;
+    h->run(h);
+    h->syscalls = syscalls - syscalls_before;
+    h->allocs = allocs - allocs_before;
+    return NULL;
+}
+
+/**
+ * Run a benchmark, with its send half and receive half on the two ends of a socketpair.
+ */
+static void bench(char* name, void (*send_run)(half_t*), void (*receive_run)(half_t*),
+                  size_t size, long iterations) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    void* buffer = size ? calloc(1, size) : NULL;
+    half_t sender = { fds[0], iterations, size, buffer, 0, 0, 0, send_run };
+    half_t receiver = { fds[1], iterations, size, NULL, 0, 0, 0, receive_run };
+
+    pthread_t threads[2];
+    uint64_t start = rpc_now_ns();
+    pthread_create(&threads[0], NULL, run_half, &sender);
+    pthread_create(&threads[1], NULL, run_half, &receiver);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    double ns = (double) (rpc_now_ns() - start);
+
+    if (sender.err || receiver.err)
+        printf("%-14s %10zu  failed\n", name, size);
+    else
+        printf("%-14s %10zu %12.1f %12.2f %12.2f\n", name, size, ns / iterations,
+               (double) (sender.syscalls + receiver.syscalls) / iterations,
+               (double) (sender.allocs + receiver.allocs) / iterations);
+    free(buffer);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/**
+ * Time a conversion of elements of a size, over and over, in GB/s of elements converted.
+ */
+static double convert_rate(void (*convert)(void*, const void*, size_t, size_t), void* dst,
+                           const void* src, size_t bytes, size_t size, long iterations) {
+    uint64_t start = rpc_now_ns();
+    for (long i = 0; i < iterations; i++)
+        convert(dst, src, bytes / size, size);
+    return (double) bytes * iterations / (double) (rpc_now_ns() - start);
+}
+
+static void copy(void* dst, const void* src, size_t count, size_t size) {
+    memcpy(dst, src, count * size);
+}
+
+/**
+ * Run the byte swapping benchmark, for each element size and array size.
+ */
+static void bench_swap(double scale) {
+    printf("\n%-14s %10s %12s %12s %12s   (GB/s, kernel %s)\n", "swap", "size", "copy",
+           "kernel", "portable", array_swap_kernel());
+    size_t max = (size_t) 1 << 24;
+    void* src = calloc(1, max);
+    void* dst = calloc(1, max);
+    for (size_t elem = 2; elem <= 8; elem *= 2) {
+        char name[16];
+        snprintf(name, sizeof name, "swap_%zu", elem * 8);
+        for (size_t size = 4096; size <= max; size *= 64) {
+            long iterations = (long) ((double) (1UL << 30) * scale / (double) size);
+            if (iterations < 1) iterations = 1;
+            double copy_rate = convert_rate(copy, dst, src, size, elem, iterations);
+            double kernel_rate = convert_rate(array_swap, dst, src, size, elem, iterations);
+            double portable_rate = convert_rate(array_swap_portable, dst, src, size, elem,
+                                                iterations);
+            printf("%-14s %10zu %12.2f %12.2f %12.2f\n", name, size, copy_rate, kernel_rate,
+                   portable_rate);
+        }
+    }
+    free(src);
+    free(dst);
+}
+
+
+int main(int argc, char* argv[]) {
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    long base = (long) (200000 * scale);
+    if (base < 1) base = 1;
+
+    printf("%-14s %10s %12s %12s %12s\n", "helper", "size", "ns/op", "syscalls/op", "allocs/op");
+    bench("int", send_int_half, receive_int_half, sizeof(uint64_t), base);
+    bench("uint", send_uint_half, receive_uint_half, sizeof(uint64_t), base);
+    for (size_t size = 0; size <= ((size_t) 1 << 20); size = size ? size * 16 : 16) {
+        long iterations = (long) ((double) (256 << 20) * scale / (double) (size + 4096));
+        if (iterations > base / 4) iterations = base / 4;
+        if (iterations < 1) iterations = 1;
+        bench("payload", send_payload_half, receive_payload_half, size, iterations);
+        bench("payload_vec", send_payload_vec_half, receive_payload_half, size, iterations);
+        bench("payload_crc", send_payload_crc_half, receive_payload_crc_half, size, iterations);
+    }
+    bench_swap(scale);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : numa.c
+ * Purpose : NUMA placement benchmark of the server's threads. The same load runs twice against
+ *           an in-process server: once with its threads floating, and once pinned with
+ *           rpc_server_set_affinity over the same CPUs.
+ *
+ * The handler reads the whole request payload, which the connection thread received into a
+ * buffer it allocated. Every few calls, it also asks the kernel which node the buffer's page is
+ * on (move_pages with no target nodes moves nothing) and compares it with the node it runs on:
+ * a buffer on another node is cross-node traffic, read over the interconnect. The benchmark
+ * reports throughput, latency, and the share of sampled calls whose buffer was remote.
+ *
+ * On a machine with a single node, both runs show no remote buffers, and only the cost of
+ * pinning shows.
+ *
+ * Usage: bench-numa [seconds] [size] [clients] [cpus] [port]   (cpus defaults to all available)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+
+#define SAMPLE_EVERY 8      // calls between samples of a buffer's node, per handler thread
+
+
+static atomic_int running = 1;
+static atomic_ullong sampled = 0;
+static atomic_ullong remote = 0;
+static atomic_int unsupported = 0;
+
+/* client data structure, one per connection */
+typedef struct {
+    rpc_client* client;
+    rpc_handle* handle;
+    size_t size;
+    unsigned long long calls;
+    unsigned long long latency_ns;
+    int failed;
+} bench_client_t;
+
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sample whether a buffer is on another node than the calling thread's CPU.
+ */
+static void sample_node(void* buffer) {
+    unsigned int cpu, node;
+    int status = -1;
+    void* page = (void*) ((unsigned long) buffer & ~((unsigned long) sysconf(_SC_PAGESIZE) - 1));
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 ||
+        syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) < 0 || status < 0) {
+        atomic_store(&unsupported, 1);
+        return;
+    }
+    atomic_fetch_add(&sampled, 1);
+    if ((unsigned int) status != node) atomic_fetch_add(&remote, 1);
+}
+
+/* handler reading the whole payload, as a handler parsing its request would */
+static rpc_data* touch(rpc_data* payload) {
+    static __thread unsigned int calls = 0;
+    unsigned char* data = (unsigned char*) payload->data2;
+    int sum = 0;
+    for (size_t i = 0; i < payload->data2_len; i += 64) sum += data[i];
+    if (payload->data2_len > 0 && calls++ % SAMPLE_EVERY == 0) sample_node(payload->data2);
+
+    rpc_data* response = (rpc_data*) malloc(sizeof(rpc_data));
+    response->data1 = sum;
+    response->data2_len = 0;
+    response->data2 = NULL;
+    return response;
+}
+
+static void* serve(void* server) {
+    rpc_serve_all((rpc_server*) server);
+}
+
+static void* drive(void* client_obj) {
+    bench_client_t* c = (bench_client_t*) client_obj;
+    void* buffer = calloc(1, c->size);
+    rpc_data payload = { .data1 = 0, .data2_len = c->size, .data2 = buffer };
+    while (atomic_load(&running)) {
+        unsigned long long start = now_ns();
+        rpc_data* response = rpc_call(c->client, c->handle, &payload);
+        if (response == NULL) {
+            (c->failed)++;
+            continue;
+        }
+        c->latency_ns += now_ns() - start;
+        (c->calls)++;
+        rpc_data_free(response);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Run the load against a fresh server, its threads pinned to the CPUs or floating.
+ */
+static int run(char* name, char* cpus, int port, int seconds, size_t size, int num_clients) {
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "touch", touch) < 0) return -1;
+    if (cpus != NULL && (rpc_server_set_affinity(server, RPC_THREADS_IO, cpus) < 0 ||
+                         rpc_server_set_affinity(server, RPC_THREADS_WORKERS, cpus) < 0))
+        return -1;
+    pthread_t server_thread;
+    pthread_create(&server_thread, NULL, serve, server);
+
+    bench_client_t* clients = calloc(num_clients, sizeof(bench_client_t));
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].size = size;
+        clients[i].client = rpc_init_client("::1", port);
+        clients[i].handle = clients[i].client ? rpc_find(clients[i].client, "touch") : NULL;
+        if (clients[i].handle == NULL) return -1;
+    }
+    atomic_store(&running, 1);
+    atomic_store(&sampled, 0);
+    atomic_store(&remote, 0);
+
+    pthread_t* threads = calloc(num_clients, sizeof(pthread_t));
+    for (int i = 0; i < num_clients; i++)
+        pthread_create(&threads[i], NULL, drive, &clients[i]);
+    sleep(seconds);
+    atomic_store(&running, 0);
+    unsigned long long calls = 0, latency_ns = 0;
+    int failed = 0;
+    for (int i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+        calls += clients[i].calls;
+        latency_ns += clients[i].latency_ns;
+        failed += clients[i].failed;
+        free(clients[i].handle);
+        rpc_close_client(clients[i].client);
+    }
+
+    unsigned long long n = atomic_load(&sampled), r = atomic_load(&remote);
+    printf("%-9s calls/s=%.0f mean_us=%.1f failed=%d ", name, (double) calls / seconds,
+           calls ? latency_ns / 1000.0 / calls : 0.0, failed);
+    if (atomic_load(&unsupported)) printf("remote_buffers=n/a\n");
+    else printf("remote_buffers=%.1f%% (%llu of %llu sampled)\n", n ? 100.0 * r / n : 0.0, r, n);
+
+    rpc_shutdown_server(server);
+    pthread_join(server_thread, NULL);
+    free(threads);
+    free(clients);
+    return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+    int seconds     = argc > 1 ? atoi(argv[1]) : 3;
+    size_t size     = argc > 2 ? strtoul(argv[2], NULL, 10) : 16384;
+    int num_clients = argc > 3 ? atoi(argv[3]) : 16;
+    char* cpus      = argc > 4 ? argv[4] : NULL;
+    int port        = argc > 5 ? atoi(argv[5]) : 7200;
+
+    // all CPUs the process may run on, as a cpulist
+    char all[4096] = "";
+    if (cpus == NULL) {
+        cpu_set_t allowed;
+        sched_getaffinity(0, sizeof allowed, &allowed);
+        size_t len = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && len + 8 < sizeof all; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                len += snprintf(all + len, sizeof all - len, len ? ",%d" : "%d", cpu);
+        cpus = all;
+    }
+
+    printf("seconds=%d size=%zu clients=%d cpus=%s\n", seconds, size, num_clients, cpus);
+    if (run("floating", NULL, port, seconds, size, num_clients) < 0 ||
+        run("pinned", cpus, port + 1, seconds, size, num_clients) < 0) {
+        fprintf(stderr, "bench-numa: cannot set up server or clients\n");
+        return 1;
+    }
+    return 0;
+}
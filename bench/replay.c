@@ -0,0 +1,305 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : replay.c
+ * Purpose : Replay tool, calling a server with the calls of a capture (see rpc_server_capture).
+ *
+ * Each recorded call is sent again at its recorded arrival time, scaled by the speed: call k is
+ * intended to be sent at start + offset_k / speed, whatever the server does, so the capture's
+ * bursts and gaps are kept. The recorded connections are mapped onto the replay's connections
+ * (connection id modulo their number), each with a thread of its own that sends its calls in
+ * their recorded order. Calls keep their kind (call, cast or stream) and deadline, and functions
+ * are found again by name, so a capture can be replayed against another build of the server.
+ * As with loadgen.c, latency is measured from the intended send time (no coordinated omission),
+ * and reported per function; a speed of 0 sends each connection's calls back to back instead.
+ *
+ * Usage: rpc-replay -i ip -p port -f capture [-x speed] [-c connections]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "histogram.h"
+#include "capture.h"
+#include "rpc_utils.h"
+
+#define MAX_CONNECTIONS (int) 64    // default number of replay connections, at most
+
+
+/* function of the capture, found again on the server */
+typedef struct {
+    const char* name;
+    rpc_handle* handle;         // NULL if the server does not have it
+} replay_function_t;
+
+/* call to replay, in a connection's order */
+typedef struct {
+    capture_call_t call;
+    int function;               // index in the function table
+} replay_call_t;
+
+/* connection thread data */
+typedef struct {
+    rpc_client* client;
+    replay_call_t** calls;
+    int num_calls;
+    histogram_t* response;      // by function, from the intended send time
+    histogram_t* service;       // by function, from the actual send time
+    unsigned long long overloaded;
+    unsigned long long expired;
+    unsigned long long failed;
+    unsigned long long missing; // calls to functions the server does not have
+} lane_t;
+
+/* replay configuration */
+static char* ip = NULL;
+static int port = 0;
+static char* path = NULL;
+static double speed = 1;
+static int num_lanes = MAX_CONNECTIONS;
+
+static replay_function_t* functions = NULL;
+static int num_functions = 0;
+static uint64_t start_ns = 0;
+
+
+/**
+ * Index of a function in the table, added the first time it is seen.
+ */
+static int function_index(const char* name) {
+    for (int i = 0; i < num_functions; i++)
+        if (functions[i].name == name) return i;
+    functions = (replay_function_t*) realloc(functions,
+                                             (num_functions + 1) * sizeof(replay_function_t));
+    assert(functions);
+    functions[num_functions].name = name;
+    functions[num_functions].handle = NULL;
+    return num_functions++;
+}
+
+/**
+ * Send a call, the way it was sent when it was recorded.
+ * @return 0 if successful, and the call's status if not
+ */
+static int replay_call(rpc_client* client, rpc_handle* handle, capture_call_t* call) {
+    if (call->kind == CAPTURE_KIND_CAST)
+        return rpc_cast(client, handle, &call->payload) == RPC_OK ? 0 : RPC_ERROR;
+
+    if (call->kind == CAPTURE_KIND_STREAM) {
+        rpc_stream* stream = rpc_call_stream(client, handle, &call->payload);
+        if (stream == NULL) return rpc_client_status(client);
+        rpc_data* frame;
+        while ((frame = rpc_stream_next(stream)) != NULL)
+            rpc_data_free(frame);
+        return rpc_stream_close(stream);
+    }
+
+    rpc_data* response;
+    if (call->budget_us == 0)
+        response = rpc_call(client, handle, &call->payload);
+    else
+        response = rpc_call_with_deadline(client, handle, &call->payload,
+                                          (unsigned int) ((call->budget_us + 999) / 1000));
+    if (response == NULL) {
+        int status = rpc_client_status(client);
+        return status == RPC_OK ? RPC_ERROR : status;
+    }
+    rpc_data_free(response);
+    return 0;
+}
+
+/**
+ * The connection's thread, sending its calls at their scaled arrival times.
+ */
+static void* lane_loop(void* lane_obj) {
+    lane_t* lane = (lane_t*) lane_obj;
+    for (int i = 0; i < lane->num_calls; i++) {
+        replay_call_t* rc = lane->calls[i];
+        rpc_handle* handle = functions[rc->function].handle;
+        if (handle == NULL) {
+            (lane->missing)++;
+            continue;
+        }
+        uint64_t intended = rpc_now_ns();
+        if (speed > 0) {
+            intended = start_ns + (uint64_t) ((double) rc->call.offset_ns / speed);
+            struct timespec at = {
+                    .tv_sec  = (time_t) (intended / 1000000000ULL),
+                    .tv_nsec = (long) (intended % 1000000000ULL)
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) != 0);
+        }
+
+        uint64_t sent = rpc_now_ns();
+        int status = replay_call(lane->client, handle, &rc->call);
+        uint64_t done = rpc_now_ns();
+        if      (status == RPC_OVERLOADED) (lane->overloaded)++;
+        else if (status == RPC_EXPIRED)    (lane->expired)++;
+        else if (status != 0)              (lane->failed)++;
+        if (status != 0) continue;
+        hist_record(&lane->response[rc->function], done - intended);
+        hist_record(&lane->service[rc->function], done - sent);
+    }
+    return NULL;
+}
+
+/**
+ * Print the percentiles of a function's histograms, on one line.
+ */
+static void print_row(const char* name, histogram_t* response, histogram_t* service) {
+    printf("%-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long long) atomic_load(&response->count),
+           hist_percentile(response, 50) / 1e3, hist_percentile(response, 99) / 1e3,
+           hist_percentile(response, 99.9) / 1e3, hist_percentile(response, 100) / 1e3,
+           hist_percentile(service, 50) / 1e3, hist_percentile(service, 99) / 1e3);
+}
+
+
+/**
+ * Main entry to the replay tool.
+ * @return 0 if successful
+ */
+int main(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "i:p:f:x:c:")) != -1) {
+        switch (c) {
+            case 'i': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'f': path = optarg; break;
+            case 'x': speed = atof(optarg); break;
+            case 'c': num_lanes = atoi(optarg); break;
+            case '?':
+                fprintf(stderr, "replay: error in option -%c. Aborting...\n", optopt);
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (ip == NULL || port == 0 || path == NULL || speed < 0) {
+        fprintf(stderr, "usage: %s -i ip -p port -f capture [-x speed] [-c connections]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (num_lanes < 1) num_lanes = 1;
+
+    // load the capture, its calls in arrival order
+    capture_reader_t* reader = capture_open(path);
+    if (reader == NULL) {
+        fprintf(stderr, "replay: %s is not a capture\n", path);
+        exit(EXIT_FAILURE);
+    }
+    replay_call_t* calls = NULL;
+    int num_calls = 0, capacity = 0, err;
+    uint64_t max_conn = 0;
+    while (1) {
+        if (num_calls == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            calls = (replay_call_t*) realloc(calls, capacity * sizeof(replay_call_t));
+            assert(calls);
+        }
+        if ((err = capture_next(reader, &calls[num_calls].call)) <= 0) break;
+        calls[num_calls].function = function_index(calls[num_calls].call.name);
+        if (calls[num_calls].call.conn_id > max_conn) max_conn = calls[num_calls].call.conn_id;
+        num_calls++;
+    }
+    if (err < 0)
+        fprintf(stderr, "replay: capture cut short, replaying its first %d calls\n", num_calls);
+    if (num_calls == 0) {
+        fprintf(stderr, "replay: no calls to replay\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((uint64_t) num_lanes > max_conn + 1) num_lanes = (int) (max_conn + 1);
+
+    // a connection per lane, the functions found once on the first
+    lane_t* lanes = (lane_t*) calloc(num_lanes, sizeof(lane_t));
+    pthread_t* threads = (pthread_t*) malloc(num_lanes * sizeof(pthread_t));
+    assert(lanes && threads);
+    for (int i = 0; i < num_lanes; i++) {
+        lanes[i].client = rpc_init_client(ip, port);
+        if (lanes[i].client == NULL) {
+            fprintf(stderr, "replay: cannot connect to %s:%d\n", ip, port);
+            exit(EXIT_FAILURE);
+        }
+        lanes[i].calls = (replay_call_t**) malloc(num_calls * sizeof(replay_call_t*));
+        lanes[i].response = (histogram_t*) malloc(num_functions * sizeof(histogram_t));
+        lanes[i].service = (histogram_t*) malloc(num_functions * sizeof(histogram_t));
+        assert(lanes[i].calls && lanes[i].response && lanes[i].service);
+        for (int f = 0; f < num_functions; f++) {
+            hist_reset(&lanes[i].response[f]);
+            hist_reset(&lanes[i].service[f]);
+        }
+    }
+    for (int f = 0; f < num_functions; f++) {
+        functions[f].handle = rpc_find(lanes[0].client, (char*) functions[f].name);
+        if (functions[f].handle == NULL)
+            fprintf(stderr, "replay: function %s not found, its calls are skipped\n",
+                    functions[f].name);
+    }
+    for (int k = 0; k < num_calls; k++) {
+        lane_t* lane = &lanes[calls[k].call.conn_id % (uint64_t) num_lanes];
+        lane->calls[lane->num_calls++] = &calls[k];
+    }
+
+    start_ns = rpc_now_ns() + 1000000;
+    for (int i = 0; i < num_lanes; i++)
+        pthread_create(&threads[i], NULL, lane_loop, &lanes[i]);
+
+    histogram_t* response = (histogram_t*) malloc((num_functions + 1) * sizeof(histogram_t));
+    histogram_t* service = (histogram_t*) malloc((num_functions + 1) * sizeof(histogram_t));
+    assert(response && service);
+    for (int f = 0; f <= num_functions; f++) {
+        hist_reset(&response[f]);
+        hist_reset(&service[f]);
+    }
+    unsigned long long overloaded = 0, expired = 0, failed = 0, missing = 0;
+    for (int i = 0; i < num_lanes; i++) {
+        pthread_join(threads[i], NULL);
+        for (int f = 0; f < num_functions; f++) {
+            hist_merge(&response[f], &lanes[i].response[f]);
+            hist_merge(&service[f], &lanes[i].service[f]);
+            hist_merge(&response[num_functions], &lanes[i].response[f]);
+            hist_merge(&service[num_functions], &lanes[i].service[f]);
+        }
+        overloaded += lanes[i].overloaded;
+        expired += lanes[i].expired;
+        failed += lanes[i].failed;
+        missing += lanes[i].missing;
+    }
+    double elapsed = (double) (rpc_now_ns() - start_ns) / 1e9;
+    double recorded = (double) calls[num_calls - 1].call.offset_ns / 1e9;
+
+    unsigned long long ok = atomic_load(&response[num_functions].count);
+    printf("replayed %d calls over %d connections at %gx (recorded over %.2f s) in %.2f s\n",
+           num_calls, num_lanes, speed, recorded, elapsed);
+    printf("achieved %.0f calls/s (%llu ok, %llu overloaded, %llu expired, %llu failed, "
+           "%llu not found)\n", ok / elapsed, ok, overloaded, expired, failed, missing);
+    printf("%-24s %10s %10s %10s %10s %10s %10s %10s\n", "function (us)", "ok", "p50", "p99",
+           "p99.9", "max", "svc p50", "svc p99");
+    for (int f = 0; f < num_functions; f++)
+        print_row(functions[f].name, &response[f], &service[f]);
+    print_row("all", &response[num_functions], &service[num_functions]);
+
+    for (int i = 0; i < num_lanes; i++) {
+        rpc_close_client(lanes[i].client);
+        free(lanes[i].calls);
+        free(lanes[i].response);
+        free(lanes[i].service);
+    }
+    for (int f = 0; f < num_functions; f++)
+        free(functions[f].handle);
+    for (int k = 0; k < num_calls; k++)
+        free(calls[k].call.payload.data2);
+    capture_close(reader);
+    free(functions);
+    free(calls);
+    free(lanes);
+    free(threads);
+    free(response);
+    free(service);
+    return 0;
+}
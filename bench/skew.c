@@ -0,0 +1,179 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : skew.c
+ * Purpose : Skewed-load benchmark of the handler executor. Two hot clients drive 90% of the
+ *           calls and eight cold clients the other 10%, all against a CPU-bound handler.
+ *
+ * Connections are homed on executor workers round robin, in accept order. The hot clients are
+ * connected first and (workers + 1)th, so both are homed on the same worker, which is the worst
+ * case for a pool without stealing. The benchmark reports throughput and latency of both groups,
+ * and how many calls ran on a worker other than their home worker.
+ *
+ * Usage: bench-skew [workers] [seconds] [work_us] [port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+
+#define NUM_HOT   2
+#define NUM_COLD  8
+#define HOT_SHARE 9     // hot calls per cold call
+
+
+/* client data structure, one per connection */
+typedef struct {
+    int hot;
+    rpc_client* client;
+    rpc_handle* handle;
+    unsigned long long* samples;    // latencies in nanoseconds
+    size_t num_samples;
+    size_t max_samples;
+    int failed;
+} bench_client_t;
+
+static unsigned long long work_ns = 50000;
+static atomic_int running = 1;
+static atomic_ullong hot_calls = 0;
+static atomic_ullong cold_calls = 0;
+
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CPU-bound handler, spinning for the requested work */
+static rpc_data* spin(rpc_data* payload) {
+    unsigned long long end = now_ns() + (unsigned long long) payload->data1 * 1000ULL;
+    volatile unsigned long long x = 0;
+    while (now_ns() < end) x++;
+    rpc_data* response = (rpc_data*) malloc(sizeof(rpc_data));
+    response->data1 = payload->data1;
+    response->data2_len = 0;
+    response->data2 = NULL;
+    return response;
+}
+
+static void* serve(void* server) {
+    rpc_serve_all((rpc_server*) server);
+}
+
+static int compare_ull(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*) a, y = *(const unsigned long long*) b;
+    return (x > y) - (x < y);
+}
+
+static void record(bench_client_t* c, unsigned long long latency) {
+    if (c->num_samples == c->max_samples) {
+        c->max_samples = c->max_samples ? c->max_samples * 2 : 4096;
+        c->samples = realloc(c->samples, c->max_samples * sizeof(unsigned long long));
+    }
+    c->samples[(c->num_samples)++] = latency;
+}
+
+/* a hot client calls back to back, a cold client keeps to its share of the calls */
+static void* drive(void* client_obj) {
+    bench_client_t* c = (bench_client_t*) client_obj;
+    rpc_data payload = { .data1 = (int) (work_ns / 1000), .data2_len = 0, .data2 = NULL };
+    while (atomic_load(&running)) {
+        if (!c->hot && (atomic_load(&cold_calls) + 1) * HOT_SHARE > atomic_load(&hot_calls)) {
+            usleep(50);
+            continue;
+        }
+        unsigned long long start = now_ns();
+        rpc_data* response = rpc_call(c->client, c->handle, &payload);
+        if (response == NULL) {
+            (c->failed)++;
+            continue;
+        }
+        record(c, now_ns() - start);
+        rpc_data_free(response);
+        atomic_fetch_add(c->hot ? &hot_calls : &cold_calls, 1);
+    }
+    return NULL;
+}
+
+static void report(char* group, bench_client_t* clients, int from, int to, double seconds) {
+    size_t total = 0;
+    for (int i = from; i < to; i++) total += clients[i].num_samples;
+    unsigned long long* all = malloc((total + 1) * sizeof(unsigned long long));
+    size_t n = 0;
+    int failed = 0;
+    for (int i = from; i < to; i++) {
+        memcpy(all + n, clients[i].samples, clients[i].num_samples * sizeof(unsigned long long));
+        n += clients[i].num_samples;
+        failed += clients[i].failed;
+    }
+    qsort(all, n, sizeof(unsigned long long), compare_ull);
+    unsigned long long p50 = n ? all[n / 2] : 0, p99 = n ? all[n * 99 / 100] : 0;
+    printf("%-5s calls=%zu calls/s=%.0f p50_us=%.1f p99_us=%.1f failed=%d\n",
+           group, n, n / seconds, p50 / 1000.0, p99 / 1000.0, failed);
+    free(all);
+}
+
+
+int main(int argc, char* argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    int seconds = argc > 2 ? atoi(argv[2]) : 3;
+    work_ns     = argc > 3 ? strtoull(argv[3], NULL, 10) * 1000ULL : work_ns;
+    int port    = argc > 4 ? atoi(argv[4]) : 7100;
+
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "spin", spin) < 0 ||
+        rpc_server_set_workers(server, workers) < 0) {
+        fprintf(stderr, "bench-skew: cannot set up server\n");
+        return 1;
+    }
+    pthread_t server_thread;
+    pthread_create(&server_thread, NULL, serve, server);
+
+    // hot clients are the 1st and (workers + 1)th connections, sharing a home worker
+    int num_clients = NUM_HOT + NUM_COLD;
+    int second_hot = workers < num_clients ? workers : 1;
+    bench_client_t clients[NUM_HOT + NUM_COLD];
+    int cold = NUM_HOT;
+    for (int i = 0; i < num_clients; i++) {
+        int index = i == 0 ? 0 : i == second_hot ? 1 : cold++;
+        bench_client_t* c = &clients[index];
+        memset(c, 0, sizeof(bench_client_t));
+        c->hot = index < NUM_HOT;
+        c->client = rpc_init_client("::1", port);
+        c->handle = c->client ? rpc_find(c->client, "spin") : NULL;
+        if (c->handle == NULL) {
+            fprintf(stderr, "bench-skew: cannot connect client %d\n", i);
+            return 1;
+        }
+    }
+
+    pthread_t threads[NUM_HOT + NUM_COLD];
+    for (int i = 0; i < num_clients; i++)
+        pthread_create(&threads[i], NULL, drive, &clients[i]);
+    sleep(seconds);
+    atomic_store(&running, 0);
+    for (int i = 0; i < num_clients; i++)
+        pthread_join(threads[i], NULL);
+
+    rpc_class_stats stats;
+    rpc_server_class_stats(server, 0, &stats);
+    printf("workers=%d seconds=%d work_us=%llu\n", workers, seconds, work_ns / 1000);
+    report("hot", clients, 0, NUM_HOT, seconds);
+    report("cold", clients, NUM_HOT, num_clients, seconds);
+    printf("executor completed=%llu stolen=%llu (%.1f%%)\n", stats.completed, stats.stolen,
+           stats.completed ? 100.0 * stats.stolen / stats.completed : 0.0);
+
+    for (int i = 0; i < num_clients; i++) {
+        free(clients[i].handle);
+        rpc_close_client(clients[i].client);
+        free(clients[i].samples);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : affinity.h
+ * Purpose : Header file for CPU affinity, which pins the server's threads to a set of CPUs, each
+ *           thread to the part of the set on one NUMA node, and keeps its memory on that node.
+ */
+
+#ifndef PROJECT2_AFFINITY_H
+#define PROJECT2_AFFINITY_H
+
+#include <sched.h>
+#include <stdatomic.h>
+
+#define MAX_NODES (int) 64                                  // NUMA nodes looked for
+#define NODE_DIR  "/sys/devices/system/node/"               // NUMA topology, one node%d per node
+
+
+/* the CPUs of a set on one NUMA node */
+typedef struct cpu_group {
+    int node;               // -1 if the topology is unknown
+    cpu_set_t cpus;
+} cpu_group_t;
+
+/* affinity data structure, of one kind of threads */
+typedef struct affinity {
+    int num_groups;         // 0 if the threads are not pinned
+    cpu_group_t groups[MAX_NODES];
+    atomic_uint next;       // group of the next thread, round robin
+} affinity_t;
+
+/* affinity functions */
+int affinity_set(affinity_t* aff, const char* cpus);
+int affinity_next(affinity_t* aff);
+int affinity_node(affinity_t* aff, int group);
+int affinity_apply(affinity_t* aff, int group);
+
+#endif //PROJECT2_AFFINITY_H
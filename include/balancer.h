@@ -0,0 +1,38 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : balancer.h
+ * Purpose : Header file for the multi-endpoint client, which balances calls over replicas of a
+ *           server, and ejects the replicas that fail until a probe call succeeds again.
+ */
+
+#ifndef PROJECT2_BALANCER_H
+#define PROJECT2_BALANCER_H
+
+#include <stdint.h>
+#include "rpc_ext.h"
+
+#define EJECT_FAILURES (int) 3                     // consecutive failed calls ejecting a replica
+#define EJECT_BASE_NS  (uint64_t) 1000000000ULL    // time out of rotation after a first ejection
+#define EJECT_MAX_NS   (uint64_t) 32000000000ULL   // most time out of rotation, as it doubles
+#define EWMA_WEIGHT    (double) 0.2                // weight of a call's latency in the EWMA
+#define MAX_IDLE       (int) 64                    // idle connections kept per replica
+
+#define HEDGE_MIN_CALLS (int) 100                  // calls of a handle seen before it is hedged
+#define HEDGE_WINDOW    (int) 4096                 // calls the hedging delay is taken over
+#define HEDGE_REFRESH   (int) 64                   // calls between updates of the delay
+#define HEDGE_BURST     (double) 10                // most hedges the budget saves up
+
+
+/* balancer data structure, see rpc_balancer in rpc_ext.h */
+typedef struct rpc_balancer balancer_t;
+
+/* balancer functions */
+balancer_t* balancer_init(rpc_endpoint* endpoints, int num_endpoints, int policy);
+rpc_handle* balancer_find(balancer_t* b, char* name);
+rpc_data* balancer_call(balancer_t* b, rpc_handle* handle, rpc_data* payload, int* status);
+int balancer_endpoint_stats(balancer_t* b, int index, rpc_endpoint_stats* stats);
+int balancer_hedge(balancer_t* b, uint64_t function_id, double percentile, double budget_pct);
+int balancer_hedge_stats(balancer_t* b, uint64_t function_id, rpc_hedge_stats* stats);
+void balancer_free(balancer_t* b);
+
+#endif //PROJECT2_BALANCER_H
@@ -0,0 +1,67 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : capture.h
+ * Purpose : Header file for call captures, which record the calls a server receives to a compact
+ *           binary log, and read them back for the replay tool (see bench/replay.c).
+ */
+
+#ifndef PROJECT2_CAPTURE_H
+#define PROJECT2_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "rpc.h"
+#include "function_queue.h"
+
+#define CAPTURE_MAGIC    "RPCCAP1\n"        // first 8 bytes of a capture
+#define CAPTURE_BUFFER   (size_t) 1048576   // file buffer, records are written out in blocks
+#define CAPTURE_FUNCTION (int) 1            // record naming a function id, before its first call
+#define CAPTURE_CALL     (int) 2            // record of a call
+
+/* kinds of recorded calls */
+#define CAPTURE_KIND_CALL   (int) 0
+#define CAPTURE_KIND_CAST   (int) 1
+#define CAPTURE_KIND_STREAM (int) 2
+
+
+/* capture data structure, of a server */
+typedef struct capture {
+    atomic_int active;      // whether calls are recorded, checked before taking the lock
+    pthread_mutex_t lock;
+    FILE* file;
+    size_t max_payload;     // most data2 bytes recorded per call, SIZE_MAX for all
+    uint64_t last_ns;       // time of the previous call, calls are recorded as the time since
+    unsigned char* named;   // by function slot, whether the function's name is recorded
+    int num_named;
+} capture_t;
+
+/* a recorded call, as read back */
+typedef struct capture_call {
+    int kind;               // CAPTURE_KIND_*
+    uint64_t conn_id;       // the client's connection, in accept order
+    uint64_t function_id;
+    const char* name;       // the function's name, owned by the reader
+    uint64_t offset_ns;     // arrival, since the capture started
+    uint64_t budget_us;     // time the call had left on arrival, 0 if it had no deadline
+    size_t recorded_len;    // data2 bytes recorded, the rest of data2 is zeros
+    rpc_data payload;       // data2 allocated for the caller, NULL if empty
+} capture_call_t;
+
+/* capture reader data structure */
+typedef struct capture_reader capture_reader_t;
+
+/* recording functions */
+void capture_init(capture_t* cap);
+int capture_start(capture_t* cap, const char* path, size_t max_payload);
+void capture_stop(capture_t* cap);
+void capture_record(capture_t* cap, int kind, uint64_t conn_id, function_t* function,
+                    rpc_data* payload, uint64_t deadline_ns);
+
+/* reading functions */
+capture_reader_t* capture_open(const char* path);
+int capture_next(capture_reader_t* reader, capture_call_t* call);
+void capture_close(capture_reader_t* reader);
+
+#endif //PROJECT2_CAPTURE_H
@@ -0,0 +1,32 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : coalesce.h
+ * Purpose : Header file for request coalescing, which collapses identical calls in flight at
+ *           the same time (function id, data1, data2) into a single request to the server.
+ */
+
+#ifndef PROJECT2_COALESCE_H
+#define PROJECT2_COALESCE_H
+
+#include <stdint.h>
+#include "rpc_ext.h"
+
+#define COALESCE_SHARDS (int) 16    // number of independently locked shards
+#define COALESCE_BUCKETS (int) 64   // hash buckets per shard, of the calls in flight
+
+
+/* call in flight, which identical calls wait on rather than sending their own */
+typedef struct flight flight_t;
+
+/* coalescer data structure, see rpc_coalescer in rpc_ext.h */
+typedef struct rpc_coalescer coalescer_t;
+
+/* coalescing functions */
+coalescer_t* coalescer_init(void);
+flight_t* coalesce_begin(coalescer_t* co, uint64_t id, rpc_data* payload, rpc_data** response,
+                         int* status);
+void coalesce_end(coalescer_t* co, flight_t* flight, rpc_data* response, int status);
+void coalescer_get_stats(coalescer_t* co, rpc_coalesce_stats* stats);
+void coalescer_free(coalescer_t* co);
+
+#endif //PROJECT2_COALESCE_H
@@ -0,0 +1,19 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : crc32c.h
+ * Purpose : Header file for CRC32C (Castagnoli), the checksum of payloads on connections that
+ *           negotiated it.
+ */
+
+#ifndef PROJECT2_CRC32C_H
+#define PROJECT2_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* checksum functions, chained from crc 0 like zlib's crc32 */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+uint32_t crc32c_portable(uint32_t crc, const void* data, size_t len);
+int crc32c_hardware(void);
+
+#endif //PROJECT2_CRC32C_H
@@ -0,0 +1,47 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : executor.h
+ * Purpose : Header file for the handler executor, the worker threads that run handlers on
+ *           behalf of the connection threads, grouped into executor classes.
+ */
+
+#ifndef PROJECT2_EXECUTOR_H
+#define PROJECT2_EXECUTOR_H
+
+#include <pthread.h>
+#include "rpc_ext.h"
+
+#define MAX_WORKERS (int) 256
+
+
+/* task data structure, a single handler run submitted to the executor */
+typedef struct task task_t;
+struct task {
+    void* (*run)(void* arg);
+    void* arg;
+    void* result;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    task_t* next;
+};
+
+/* executor data structure */
+typedef struct executor executor_t;
+
+/* executor functions */
+executor_t* executor_init(void);
+int executor_set_class(executor_t* ex, int class_id, int max_concurrency, int priority);
+int executor_set_workers(executor_t* ex, int num_workers);
+int executor_set_affinity(executor_t* ex, const char* cpus);
+int executor_start(executor_t* ex);
+int executor_home(executor_t* ex);
+int executor_home_near(executor_t* ex, int node);
+int executor_started(executor_t* ex);
+void executor_submit(executor_t* ex, int class_id, int home, task_t* task,
+                     void* (*run)(void*), void* arg);
+void* executor_wait(task_t* task);
+void* executor_run(executor_t* ex, int class_id, int home, void* (*run)(void*), void* arg);
+int executor_class_stats(executor_t* ex, int class_id, rpc_class_stats* stats);
+
+#endif //PROJECT2_EXECUTOR_H
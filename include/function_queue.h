@@ -10,12 +10,20 @@
 
 #include <stdint.h>
 #include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_cache.h"
 
 
 /* function data structure */
 struct function {
     uint64_t id;
+    char* name;
+    int slot;           // registration order, which indexes the function's metrics
     rpc_handler f_handler;
+    rpc_stream_handler f_stream;    // handler of a streaming function, NULL otherwise
+    int flags;
+    cache_t* cache;     // response cache of a pure function, NULL otherwise
+    int executor_class;
 };
 typedef struct function function_t;
 
@@ -33,6 +41,8 @@ queue_f* function_queue_init();
 int function_enqueue(queue_f* q, function_t* f);
 function_t* function_dequeue(queue_f* q);
 function_t* function_search(queue_f* functions, uint64_t id);
+function_t* function_search_slot(queue_f* functions, int slot);
+void function_free(function_t* f);
 __attribute__((unused)) void free_function_queue(queue_f* q);
 
 #endif //PROJECT2_FUNCTION_QUEUE_H
@@ -0,0 +1,46 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : histogram.h
+ * Purpose : Header file for the latency histogram, a log-linear (HDR-style) histogram of
+ *           nanosecond values.
+ */
+
+#ifndef PROJECT2_HISTOGRAM_H
+#define PROJECT2_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HIST_SUB_BITS (int) 5                           // 32 sub-buckets, within 3.2% of a value
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS (int) 42                          // values up to 2^42 ns, about 73 minutes
+#define HIST_BUCKETS  (2 * HIST_SUB + (HIST_MAX_BITS - HIST_SUB_BITS - 1) * HIST_SUB)
+
+
+/* histogram data structure. It has a single writer, while any thread may read it at any time,
+ * so counters are atomics only ever written with relaxed loads and stores (plain moves) */
+typedef struct histogram {
+    atomic_ullong counts[HIST_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum;
+    atomic_ullong max;
+} histogram_t;
+
+/**
+ * Add to a counter that only this thread writes. Readers may see the counter at any time, but
+ * need no read-modify-write, so this compiles to a plain load, add and store.
+ */
+static inline void counter_add(atomic_ullong* counter, uint64_t value) {
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+/* histogram functions */
+void hist_reset(histogram_t* h);
+void hist_record(histogram_t* h, uint64_t value);
+void hist_merge(histogram_t* into, histogram_t* from);
+uint64_t hist_percentile(histogram_t* h, double percentile);
+uint64_t hist_mean(histogram_t* h);
+
+#endif //PROJECT2_HISTOGRAM_H
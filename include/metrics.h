@@ -0,0 +1,41 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : metrics.h
+ * Purpose : Header file for the server's per-function call metrics.
+ */
+
+#ifndef PROJECT2_METRICS_H
+#define PROJECT2_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "histogram.h"
+#include "rpc_ext.h"
+
+#define MAX_METRIC_FUNCTIONS (int) 256     // functions registered beyond this are not recorded
+
+
+/* what a served call is recorded as */
+typedef struct call_sample {
+    int error;              // shed, expired, failed, or its handler returned NULL
+    int ran;                // whether its handler ran, so the timings below are set
+    size_t bytes_in;
+    size_t bytes_out;
+    uint64_t queue_wait_ns;
+    uint64_t handler_ns;
+} call_sample_t;
+
+/* metrics data structure, of a server */
+typedef struct metrics metrics_t;
+
+/* metrics block data structure, written by a single connection thread */
+typedef struct metrics_block metrics_block_t;
+
+/* metrics functions */
+metrics_t* metrics_init(void);
+metrics_block_t* metrics_attach(metrics_t* metrics);
+void metrics_detach(metrics_t* metrics, metrics_block_t* block);
+void metrics_record(metrics_block_t* block, int slot, call_sample_t* sample);
+void metrics_read(metrics_t* metrics, int slot, rpc_function_stats* stats);
+
+#endif //PROJECT2_METRICS_H
@@ -0,0 +1,45 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : rpc_array.h
+ * Purpose : Header file for typed array payloads, whose data2 is a header tagging the element
+ *           type and byte order, then the elements, and for the byte swapping kernels they use.
+ */
+
+#ifndef PROJECT2_RPC_ARRAY_H
+#define PROJECT2_RPC_ARRAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc.h"
+
+#define ARRAY_MAGIC  (uint8_t) 0xA7     // first byte of a typed array's data2
+#define ARRAY_HEADER (size_t) 8         // header bytes, which keep the elements 8-byte aligned
+#define ARRAY_BIG    (uint8_t) 0        // elements in network (big endian) order
+#define ARRAY_LITTLE (uint8_t) 1        // elements in little endian order
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ARRAY_HOST ARRAY_BIG
+#else
+#define ARRAY_HOST ARRAY_LITTLE
+#endif
+
+/* header of a typed array's data2, followed by its elements */
+typedef struct array_header {
+    uint8_t magic;
+    uint8_t type;           // RPC_ARRAY_* element type
+    uint8_t order;          // ARRAY_BIG or ARRAY_LITTLE
+    uint8_t reserved[5];
+} array_header_t;
+
+/* byte swapping kernels */
+void array_swap(void* dst, const void* src, size_t count, size_t size);
+void array_swap_portable(void* dst, const void* src, size_t count, size_t size);
+const char* array_swap_kernel(void);
+
+/* typed array payloads */
+size_t array_elem_size(int type);
+rpc_data* array_encode(int type, const void* elems, size_t count, int host_order);
+int array_type(rpc_data* data, size_t* count);
+void* array_decode(rpc_data* data, int type, size_t* count);
+
+#endif //PROJECT2_RPC_ARRAY_H
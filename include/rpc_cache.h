@@ -0,0 +1,30 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : rpc_cache.h
+ * Purpose : Header file for the response cache, a sharded LRU which maps a call
+ *           (function id, data1, data2) to its response.
+ */
+
+#ifndef PROJECT2_RPC_CACHE_H
+#define PROJECT2_RPC_CACHE_H
+
+#include <stdint.h>
+#include "rpc_ext.h"
+
+#define CACHE_SHARDS (int) 16     // number of independently locked shards
+
+
+/* cache data structure */
+typedef struct cache cache_t;
+
+/* cache functions */
+cache_t* cache_init(size_t max_entries, size_t max_bytes);
+rpc_data* cache_get(cache_t* cache, uint64_t id, rpc_data* key);
+void cache_put(cache_t* cache, uint64_t id, rpc_data* key, rpc_data* value,
+               uint64_t expires_ns);
+void cache_invalidate(cache_t* cache, uint64_t id);
+void cache_clear(cache_t* cache);
+void cache_get_stats(cache_t* cache, rpc_cache_stats* stats);
+void cache_free(cache_t* cache);
+
+#endif //PROJECT2_RPC_CACHE_H
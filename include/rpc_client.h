@@ -8,11 +8,47 @@
 #define PROJECT2_RPC_CLIENT_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_cache.h"
 
 
+/* per-handle time to live of cached responses */
+typedef struct cache_ttl {
+    uint64_t function_id;
+    uint64_t ttl_ns;
+} cache_ttl_t;
+
+/* RPC client response cache structure, which may be shared by many clients */
+struct rpc_client_cache {
+    cache_t* cache;
+    pthread_mutex_t lock;   // guards the TTL table
+    cache_ttl_t* ttls;
+    size_t num_ttls;
+};
+
 /* RPC client structure */
 struct rpc_client {
-    int conn_fd;
+    int conn_fd;            // ERROR if dropped, to be re-established by the next request
+    char* addr;
+    int port;
+    int status;             // status of the last call
+    struct rpc_client_cache* cache;
+    struct rpc_coalescer* coalescer;
+    int want_checksum;      // whether to negotiate checksums on every (re)connection
+    int checksum;           // whether payloads carry a checksum on the current connection
+    int want_host_order;    // whether to negotiate the byte order of typed arrays, once used
+    int host_order;         // whether typed arrays go in the host's byte order to the server
+    struct rpc_stream* stream;  // open stream, which has the connection until it ends
+};
+
+/* RPC stream structure, the client end of a streaming call */
+struct rpc_stream {
+    struct rpc_client* client;
+    uint64_t function_id;
+    int done;               // whether the stream has ended, or failed
+    int status;             // RPC_OK, or the reason the stream ended early
 };
 
 /* RPC handle structure */
@@ -20,7 +56,31 @@ struct rpc_handle {
     uint64_t function_id;
 };
 
+/* a call's payload, contiguous or vectored, and where its response is received into */
+typedef struct call_io {
+    rpc_data* payload;      // contiguous payload, sent if vpayload is NULL
+    rpc_vdata* vpayload;    // vectored payload
+    rpc_vdata* sink;        // segments the response is received into, NULL for a new rpc_data
+    size_t sink_len;        // response bytes received into the sink
+    rpc_sink* target;       // buffer or file the response is received into instead, NULL for none
+    int (*await)(void* arg, int conn_fd);   // waits for the response once the payload is sent,
+    void* await_arg;                        // returning nonzero to abandon the call; NULL for none
+} call_io_t;
+
 /* function prototypes */
 int create_connect_socket(char *addr, int port);
+int client_reconnect(struct rpc_client* client);
+int client_negotiate(struct rpc_client* client);
+int client_host_order(struct rpc_client* client);
+rpc_data* client_call(struct rpc_client* client, struct rpc_handle* handle, rpc_data* payload,
+                      uint64_t deadline_ns);
+rpc_data* client_call_io(struct rpc_client* client, struct rpc_handle* handle, call_io_t* io,
+                         uint64_t deadline_ns);
+int client_cast(struct rpc_client* client, struct rpc_handle* handle, rpc_data* payload);
+struct rpc_stream* client_stream_open(struct rpc_client* client, struct rpc_handle* handle,
+                                      rpc_data* payload);
+rpc_data* client_stream_next(struct rpc_stream* stream);
+int client_stream_close(struct rpc_stream* stream);
+uint64_t client_cache_ttl(struct rpc_client_cache* cache, uint64_t function_id);
 
 #endif //PROJECT2_RPC_CLIENT_H
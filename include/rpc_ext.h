@@ -0,0 +1,433 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : rpc_ext.h
+ * Purpose : Header for the extended RPC interface. The base interface in rpc.h is kept as is;
+ *           everything that goes beyond it (registration options, caching, ...) lives here.
+ */
+
+#ifndef PROJECT2_RPC_EXT_H
+#define PROJECT2_RPC_EXT_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "rpc.h"
+
+/* Call statuses, see rpc_client_status */
+#define RPC_OK         (int) 0
+#define RPC_ERROR      (int) (-1)  // failed call, the connection being lost or out of step
+#define RPC_OVERLENGTH (int) (-2)  // payload or response too large for the receiving end
+#define RPC_EXPIRED    (int) (-3)  // deadline passed before the call completed
+#define RPC_OVERLOADED (int) (-4)  // server shed the call, the caller should back off or retry elsewhere
+#define RPC_CORRUPT    (int) (-5)  // payload or response failed its checksum
+#define RPC_DECLINED   (int) (-6)  // handler returned NULL, or rpc_find found no such function
+
+/* Function registration flags */
+#define RPC_FUNCTION_PURE (int) 1   // response depends only on the payload, and may be cached
+
+/* Executor classes, from 0 (the default class) to RPC_MAX_CLASSES - 1 */
+#define RPC_MAX_CLASSES (int) 8
+
+/* Kinds of server threads, for rpc_server_set_affinity */
+#define RPC_THREADS_IO      (int) 0    // connection threads, reading requests and writing responses
+#define RPC_THREADS_WORKERS (int) 1    // executor workers, running handlers
+
+/* Element types of typed array payloads, see rpc_array_new */
+#define RPC_ARRAY_INT8   (int) 1
+#define RPC_ARRAY_UINT8  (int) 2
+#define RPC_ARRAY_INT16  (int) 3
+#define RPC_ARRAY_UINT16 (int) 4
+#define RPC_ARRAY_INT32  (int) 5
+#define RPC_ARRAY_UINT32 (int) 6
+#define RPC_ARRAY_INT64  (int) 7
+#define RPC_ARRAY_UINT64 (int) 8
+#define RPC_ARRAY_FLOAT  (int) 9    // IEEE 754 single precision
+#define RPC_ARRAY_DOUBLE (int) 10   // IEEE 754 double precision
+
+/* Options for registering a function */
+typedef struct {
+    int flags;
+    size_t cache_size;              // maximum cached responses of a pure function
+    int executor_class;             // class whose workers run the handler
+} rpc_function_opts;
+
+/* Queue depth and counters of an executor class */
+typedef struct {
+    int queued;
+    int running;
+    int max_concurrency;
+    int priority;
+    unsigned long long completed;
+    unsigned long long stolen;      // tasks run by a worker other than their home worker
+} rpc_class_stats;
+
+/* Latency summary, in nanoseconds */
+typedef struct {
+    unsigned long long count;
+    unsigned long long mean;
+    unsigned long long p50;
+    unsigned long long p90;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long max;
+} rpc_latency_stats;
+
+/* Counters and latencies of a registered function */
+typedef struct {
+    unsigned long long calls;
+    unsigned long long errors;      // shed, expired, failed, or the handler returned NULL
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    rpc_latency_stats queue_wait;   // from the payload's arrival to a worker picking the call up
+    rpc_latency_stats handler_time;
+} rpc_function_stats;
+
+/* Vectored payload: data2 is its segments back to back, each a buffer the caller owns */
+/* On the wire it is the same as an rpc_data, so either end may use either */
+typedef struct {
+    int data1;
+    int num_segments;
+    struct iovec* segments;
+} rpc_vdata;
+
+/* Kinds of sinks a response is received into, see rpc_sink */
+#define RPC_SINK_BUFFER (int) 0    // the caller's buffer
+#define RPC_SINK_FD     (int) 1    // a file descriptor, written at its offset, spliced if it can be
+#define RPC_SINK_MMAP   (int) 2    // a file, resized to fit and mapped from its start
+
+/* Sink of a response's data2, which is received straight into it rather than a new buffer. */
+/* The caller sets kind, buffer or fd, and capacity; data1, data2_len and map are returned */
+typedef struct {
+    int kind;
+    void* buffer;           // RPC_SINK_BUFFER
+    int fd;                 // RPC_SINK_FD (open for writing) or RPC_SINK_MMAP (reading and writing)
+    size_t capacity;        // most bytes taken, the buffer's size; 0 for no limit with a file
+    int data1;
+    size_t data2_len;
+    void* map;              // RPC_SINK_MMAP: the file's mapping, for munmap (NULL if empty)
+} rpc_sink;
+
+/* Writer of a streaming handler's response frames */
+typedef struct rpc_stream_writer rpc_stream_writer;
+
+/* Streaming handler, writing its response as a sequence of frames rather than returning it */
+/* RETURNS: 0 once all frames are written, -1 on failure (the client sees RPC_ERROR) */
+typedef int (*rpc_stream_handler)(rpc_data* payload, rpc_stream_writer* writer);
+
+/* Client end of a streaming call, iterated with rpc_stream_next */
+typedef struct rpc_stream rpc_stream;
+
+/* Client response cache, which may be shared by many clients */
+typedef struct rpc_client_cache rpc_client_cache;
+
+/* Counters of a response cache */
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t entries;
+    size_t bytes;
+} rpc_cache_stats;
+
+/* Balancing policies of a multi-endpoint client */
+#define RPC_BALANCE_LEAST_OUTSTANDING (int) 0  // the replica with the fewest calls outstanding
+#define RPC_BALANCE_EWMA              (int) 1  // the lowest EWMA latency, weighted by outstanding
+
+/* Address and port of a server replica */
+typedef struct {
+    char* addr;
+    int port;
+} rpc_endpoint;
+
+/* Multi-endpoint client, balancing calls over replicas; it may be shared by many threads */
+typedef struct rpc_balancer rpc_balancer;
+
+/* Load and health of a replica */
+typedef struct {
+    int outstanding;
+    int ejected;                    // out of rotation, until a probe call succeeds
+    unsigned long long ewma_ns;     // EWMA latency of successful calls
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long ejections;
+} rpc_endpoint_stats;
+
+/* Hedging counters of a handle, on a multi-endpoint client */
+typedef struct {
+    unsigned long long calls;
+    unsigned long long hedges;      // calls sent again to another replica
+    unsigned long long hedge_wins;  // hedged calls answered by the hedge first
+    unsigned long long delay_ns;    // current delay before a call is hedged, 0 until known
+} rpc_hedge_stats;
+
+/* Request coalescer, which may be shared by many clients */
+typedef struct rpc_coalescer rpc_coalescer;
+
+/* Counters of a request coalescer */
+typedef struct {
+    unsigned long long requests;    // calls sent to the server
+    unsigned long long coalesced;   // calls answered with the outcome of an identical call
+} rpc_coalesce_stats;
+
+/* ---------------- */
+/* Server functions */
+/* ---------------- */
+
+/* Registers a function with options, NULL options is the same as rpc_register */
+/* RETURNS: -1 on failure */
+int rpc_register_ex(rpc_server* server, char* name, rpc_handler handler,
+                    rpc_function_opts* opts);
+
+/* Registers a streaming function, NULL options for the defaults (a streaming function */
+/* cannot be pure, its responses are never cached) */
+/* RETURNS: -1 on failure */
+int rpc_register_stream(rpc_server* server, char* name, rpc_stream_handler handler,
+                        rpc_function_opts* opts);
+
+/* Writes a response frame of a streaming handler, returning once it is on its way. A writer */
+/* only takes a frame as fast as the client reads them; the frame stays the handler's own. */
+/* A frame's data2 is at most 16 MiB */
+/* RETURNS: -1 on failure, once the client has gone, after which the handler should return */
+int rpc_stream_write(rpc_stream_writer* writer, rpc_data* frame);
+
+/* Reads the response cache counters of a registered pure function */
+/* RETURNS: -1 on failure */
+int rpc_function_cache_stats(rpc_server* server, char* name, rpc_cache_stats* stats);
+
+/* Limits calls in flight server-wide, 0 for unlimited. Calls beyond the limit are answered */
+/* right away with RPC_OVERLOADED */
+/* RETURNS: -1 on failure */
+int rpc_server_set_limits(rpc_server* server, int max_inflight);
+
+/* RETURNS: number of calls answered with RPC_OVERLOADED so far */
+unsigned long long rpc_server_shed_count(rpc_server* server);
+
+/* Bounds the data2 of the payloads the server takes, 256 MiB by default, 0 for no bound. A */
+/* call over it fails with RPC_OVERLENGTH before its data2 is sent; set before serving */
+/* RETURNS: -1 on failure */
+int rpc_server_set_max_payload(rpc_server* server, size_t max_bytes);
+
+/* Closes connections whose client is idle or stalled, to reclaim the threads and sockets they */
+/* hold: after idle_ms without a request (5000 by default), or once a request has taken */
+/* request_ms to arrive, or its response to be taken (30000 by default). A call's payload is */
+/* not waited on past the call's deadline either. 0 for no limit; set before serving */
+/* RETURNS: -1 on failure */
+int rpc_server_set_timeouts(rpc_server* server, unsigned int idle_ms, unsigned int request_ms);
+
+/* RETURNS: number of connections closed by a timeout so far */
+unsigned long long rpc_server_timeout_count(rpc_server* server);
+
+/* Configures an executor class, before serving: at most max_concurrency handlers (0 for no */
+/* cap) of the class run at once, and classes of higher priority are run first. Setting a */
+/* class, the workers or their CPUs runs handlers on the executor's workers rather than their */
+/* connection's thread, where a handler that blocks holds a worker */
+/* RETURNS: -1 on failure */
+int rpc_server_set_class(rpc_server* server, int executor_class, int max_concurrency,
+                         int priority);
+
+/* Sets the number of executor workers, before serving */
+/* RETURNS: -1 on failure */
+int rpc_server_set_workers(rpc_server* server, int num_workers);
+
+/* Pins a kind of server threads to a list of CPUs such as "0-7,16-23", before serving. Each */
+/* thread gets the CPUs of the list on one NUMA node, spread over the nodes round robin, and */
+/* allocates memory on its node. A connection's calls run on a worker of its thread's node */
+/* RETURNS: -1 on failure */
+int rpc_server_set_affinity(rpc_server* server, int threads, const char* cpus);
+
+/* Reads the queue depth and counters of an executor class */
+/* RETURNS: -1 on failure */
+int rpc_server_class_stats(rpc_server* server, int executor_class, rpc_class_stats* stats);
+
+/* Reads the counters and latencies of a registered function */
+/* The same, for all functions, are returned as text by the built-in function "__rpc_stats" */
+/* RETURNS: -1 on failure */
+int rpc_server_function_stats(rpc_server* server, char* name, rpc_function_stats* stats);
+
+/* Records the calls the server receives to a file, replayed by bench/replay.c: each call's */
+/* function, payload, connection, deadline and arrival time. Payloads are recorded up to */
+/* max_payload bytes (0 for all of them) and by size beyond; a NULL path stops recording */
+/* RETURNS: -1 on failure */
+int rpc_server_capture(rpc_server* server, const char* path, size_t max_payload);
+
+/* Readiness fd of the server, to embed it in an event loop instead of rpc_serve_all: it is */
+/* readable whenever rpc_serve_poll has work to do */
+/* RETURNS: the fd, -1 on failure */
+int rpc_server_fd(rpc_server* server);
+
+/* Accepts waiting connections and serves a request of each connection that has one ready, */
+/* waiting at most timeout_ms for work (-1 indefinitely, 0 not at all). Serving a request may */
+/* take longer: handlers run on the calling thread, and a client may stall sending its request */
+/* or taking its response for up to 100 ms, before its connection is closed */
+/* RETURNS: number of connections accepted and requests served, -1 on failure or once shut down */
+int rpc_serve_poll(rpc_server* server, int timeout_ms);
+
+/* Stops accepting connections, lets the calls in flight complete, and closes all connections */
+/* With rpc_serve_poll, call it from the polling thread; a thread in rpc_serve_all exits */
+/* RETURNS: -1 on failure */
+int rpc_shutdown_server(rpc_server* server);
+
+/* Time left before the deadline of the call being handled, for use inside handlers */
+/* RETURNS: milliseconds left, 0 if expired, -1 if the call has no deadline */
+long rpc_time_left_ms(void);
+
+/* ---------------- */
+/* Client functions */
+/* ---------------- */
+
+/* Calls remote function using handle, giving up after timeout_ms milliseconds */
+/* RETURNS: rpc_data* on success, NULL on error (RPC_EXPIRED status on timeout) */
+rpc_data* rpc_call_with_deadline(rpc_client* client, rpc_handle* handle, rpc_data* payload,
+                                 unsigned int timeout_ms);
+
+/* Calls remote function with a vectored payload, its segments sent without being copied */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data* rpc_call_vec(rpc_client* client, rpc_handle* handle, rpc_vdata* payload);
+
+/* Calls remote function with a vectored payload, receiving the response's data2 into the */
+/* segments of response (in order) and setting its data1, and response_len to its length */
+/* RETURNS: RPC_OK on success, RPC_OVERLENGTH if the response does not fit, or the failure status */
+int rpc_call_vec_into(rpc_client* client, rpc_handle* handle, rpc_vdata* payload,
+                      rpc_vdata* response, size_t* response_len);
+
+/* Calls remote function, receiving the response's data2 into a sink without it ever being held */
+/* in a heap buffer; a file sink takes responses larger than memory */
+/* RETURNS: RPC_OK on success, RPC_OVERLENGTH if it exceeds the capacity, or the failure status */
+int rpc_call_into(rpc_client* client, rpc_handle* handle, rpc_data* payload, rpc_sink* sink);
+
+/* Calls a streaming function, whose response frames are then read with rpc_stream_next. The */
+/* stream has the client's connection until it ends or is closed, calls on the client fail */
+/* RETURNS: rpc_stream* on success, NULL on error (see rpc_client_status) */
+rpc_stream* rpc_call_stream(rpc_client* client, rpc_handle* handle, rpc_data* payload);
+
+/* Reads the next response frame of a stream, waiting for the server to write it */
+/* RETURNS: rpc_data* on success, NULL once the stream is over (see rpc_stream_status) */
+rpc_data* rpc_stream_next(rpc_stream* stream);
+
+/* Status of a stream: RPC_OK while it goes on or once it ended as the handler returned 0, and */
+/* otherwise the reason it ended */
+int rpc_stream_status(rpc_stream* stream);
+
+/* Frees a stream. A stream closed before its end drops the client's connection, which stops */
+/* the handler at its next write; the next call reconnects */
+/* RETURNS: the stream's status */
+int rpc_stream_close(rpc_stream* stream);
+
+/* Casts a one-way call: the call is written and the function returns, without waiting for the */
+/* server, which discards the handler's response. Casts on a client run in order with its calls */
+/* RETURNS: RPC_OK if written, RPC_OVERLENGTH if data2 is over 16 MiB, RPC_ERROR otherwise (the */
+/* call is not known to have run) */
+int rpc_cast(rpc_client* client, rpc_handle* handle, rpc_data* payload);
+
+/* Turns CRC32C checksums of payloads and responses on or off for the client's connection, */
+/* negotiated with the server now and again whenever the client reconnects */
+/* RETURNS: -1 on failure, or if the server does not support checksums */
+int rpc_client_set_checksum(rpc_client* client, int enabled);
+
+/* Status of the client's last call or rpc_find */
+/* RETURNS: RPC_OK, or the reason the last call returned NULL */
+int rpc_client_status(rpc_client* client);
+
+/* Initialises a client response cache holding at most max_bytes, 0 for unbounded */
+/* RETURNS: rpc_client_cache* on success, NULL on error */
+rpc_client_cache* rpc_client_cache_init(size_t max_bytes);
+
+/* Attaches a response cache to a client, NULL detaches it */
+/* RETURNS: -1 on failure */
+int rpc_client_set_cache(rpc_client* client, rpc_client_cache* cache);
+
+/* Opts a handle into caching for ttl_ms milliseconds, 0 opts it out */
+/* RETURNS: -1 on failure */
+int rpc_client_cache_ttl(rpc_client_cache* cache, rpc_handle* handle, unsigned int ttl_ms);
+
+/* Drops the cached responses of a handle, or of all handles if handle is NULL */
+void rpc_client_cache_invalidate(rpc_client_cache* cache, rpc_handle* handle);
+
+/* Reads the counters of a client response cache */
+/* RETURNS: -1 on failure */
+int rpc_client_cache_stats(rpc_client_cache* cache, rpc_cache_stats* stats);
+
+/* Frees a client response cache, once no client uses it anymore */
+void rpc_client_cache_free(rpc_client_cache* cache);
+
+/* Initialises a multi-endpoint client over replicas of a server, connecting to each of them */
+/* RETURNS: rpc_balancer* on success, NULL on error */
+rpc_balancer* rpc_balancer_init(rpc_endpoint* endpoints, int num_endpoints, int policy);
+
+/* Finds a remote function, the handle then being valid on every replica */
+/* RETURNS: rpc_handle* on success, NULL on error */
+rpc_handle* rpc_balancer_find(rpc_balancer* balancer, char* name);
+
+/* Calls remote function on the least loaded replica in rotation. Replicas whose calls fail */
+/* are ejected, and probed again later. status, if not NULL, is set as rpc_client_status */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data* rpc_balancer_call(rpc_balancer* balancer, rpc_handle* handle, rpc_data* payload,
+                            int* status);
+
+/* Opts an idempotent handle into hedging: a call not answered within the given percentile of */
+/* the handle's recent latencies is sent again to another replica, and the first response */
+/* wins. Hedges are capped at budget_pct percent of the handle's calls; percentile 0 opts out */
+/* RETURNS: -1 on failure */
+int rpc_balancer_hedge(rpc_balancer* balancer, rpc_handle* handle, double percentile,
+                       double budget_pct);
+
+/* Reads the hedging counters of a handle */
+/* RETURNS: -1 on failure, or if the handle was never opted into hedging */
+int rpc_balancer_hedge_stats(rpc_balancer* balancer, rpc_handle* handle, rpc_hedge_stats* stats);
+
+/* Reads the load and health of a replica, by its index in the endpoints given at init */
+/* RETURNS: -1 on failure */
+int rpc_balancer_endpoint_stats(rpc_balancer* balancer, int index, rpc_endpoint_stats* stats);
+
+/* Closes a multi-endpoint client and its connections, once no call is in flight */
+void rpc_balancer_close(rpc_balancer* balancer);
+
+/* Initialises a request coalescer, to be attached to the clients whose calls it coalesces */
+/* RETURNS: rpc_coalescer* on success, NULL on error */
+rpc_coalescer* rpc_coalescer_init(void);
+
+/* Attaches a coalescer to a client, NULL detaches it. Calls without a deadline on clients */
+/* sharing a coalescer, identical to a call in flight, wait for it rather than being sent */
+/* RETURNS: -1 on failure */
+int rpc_client_set_coalescer(rpc_client* client, rpc_coalescer* coalescer);
+
+/* Reads the counters of a request coalescer */
+/* RETURNS: -1 on failure */
+int rpc_coalescer_stats(rpc_coalescer* coalescer, rpc_coalesce_stats* stats);
+
+/* Frees a request coalescer, once no client uses it anymore */
+void rpc_coalescer_free(rpc_coalescer* coalescer);
+
+/* --------------------- */
+/* Typed array functions */
+/* --------------------- */
+
+/* Encodes count elements of a type as an RPC data, whose data2 tags the type and byte order and */
+/* data1 is 0, to be set freely. The elements go in the host's byte order if the other end */
+/* shares it, as negotiated on the client's connection (client NULL: inside a handler, the */
+/* connection of the call being served), and in network order otherwise */
+/* RETURNS: rpc_data* on success, to be freed with rpc_data_free, NULL on error */
+rpc_data* rpc_array_new(rpc_client* client, int type, const void* elems, size_t count);
+
+/* Element type of a typed array payload or response, and its number of elements if count is */
+/* not NULL */
+/* RETURNS: RPC_ARRAY_* type, -1 if data is not a typed array */
+int rpc_array_type(rpc_data* data, size_t* count);
+
+/* Elements of a typed array payload or response, converted in place to the host's byte order */
+/* if they are not in it already. They stay valid until data is freed */
+/* RETURNS: pointer to the elements, NULL if data is not a typed array of that type */
+void* rpc_array_elems(rpc_data* data, int type, size_t* count);
+
+/* ----------------- */
+/* Tracing functions */
+/* ----------------- */
+
+/* Traces every sample_every-th call of each thread (1 for all calls), 0 stops tracing */
+/* Applies to the whole process, clients and servers alike */
+void rpc_trace_enable(unsigned int sample_every);
+
+/* Writes the traced calls as Chrome trace event JSON, for chrome://tracing or Perfetto */
+/* RETURNS: -1 on failure */
+int rpc_trace_dump(const char* path);
+
+#endif //PROJECT2_RPC_EXT_H
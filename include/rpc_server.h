@@ -9,10 +9,99 @@
 #define PROJECT2_RPC_SERVER_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "function_queue.h"
+#include "executor.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "timer_wheel.h"
+#include "rpc_utils.h"
 
-#define FIND_SERVICE (int) 0    // flag from client requesting find service
-#define CALL_SERVICE (int) 1    // flag from client requesting call service
+#define FIND_SERVICE          (int) 0    // flag from client requesting find service
+#define CALL_SERVICE          (int) 1    // flag from client requesting call service
+#define CALL_DEADLINE_SERVICE (int) 2    // flag from client requesting call service with a deadline
+#define CALL_TRACED_SERVICE   (int) 3    // flag from client requesting call service with a call id
+#define OPTIONS_SERVICE       (int) 4    // flag from client negotiating the connection's options
+#define CAST_SERVICE          (int) 5    // flag from client casting a one-way call, not answered
+#define STREAM_SERVICE        (int) 6    // flag from client calling a streaming function
+
+#define STREAM_FRAME (int) 1             // marker of a stream's next frame, its end is a status
+#define STREAM_BLOCK       (size_t) 65536    // frames waiting for a flush are gathered in blocks
+#define STREAM_SMALL_FRAME (size_t) 16384    // largest frame worth gathering, bigger ones go alone
+#define STREAM_MAX_QUEUED  (size_t) 524288   // bytes gathered before the handler waits
+#define STREAM_WINDOW_NS   (uint64_t) 50000  // frames closer than this are gathered, and a flush
+                                             // waits as long for a block's worth of them
+
+#define OPTION_CHECKSUM   (uint64_t) 1   // payloads carry a CRC32C checksum after data2
+#define OPTION_HOST_ORDER (uint64_t) 2   // typed arrays go in the sender's byte order, both ends
+                                         // having the same
+#define OPTION_BIG_ENDIAN (uint64_t) 4   // the client is big endian, requested with HOST_ORDER
+#define OPTIONS_SUPPORTED (OPTION_CHECKSUM | OPTION_HOST_ORDER)
+
+#define STATS_FUNCTION "__rpc_stats"     // built-in function answering with the server's metrics
+
+#define IDLE_TIMEOUT_MS    (unsigned int) 5000    // default time a connection may sit idle
+#define REQUEST_TIMEOUT_MS (unsigned int) 30000   // default time a request may take to arrive
+#define POLL_IO_MS         (unsigned int) 100     // longest a polled client blocks the poll loop
+#define MAX_PAYLOAD_LEN    (size_t) 268435456     // default largest data2 of a call's payload
+
+/* states of a connection, between and during requests */
+#define CONN_IDLE    (int) 0             // waiting for the client's next request
+#define CONN_BUSY    (int) 1             // serving a request
+#define CONN_CLOSING (int) 2             // closed by shutdown while idle
+
+/* connection of a client to the server */
+typedef struct connection connection_t;
+struct connection {
+    int fd;
+    uint64_t id;            // in accept order, by which captures keep a client's calls in order
+    int home;               // home executor worker of the connection's calls
+    int group;              // CPU group its thread is pinned to, -1 if not pinned
+    metrics_block_t* metrics;
+    int checksum;           // whether payloads carry a checksum, as negotiated
+    int host_order;         // whether typed arrays go in the host's byte order, as negotiated
+    atomic_int state;
+    int polled;             // served by rpc_serve_poll rather than a thread of its own
+    unsigned char flag_bytes[REQUEST_BYTES];    // polled: what arrived of the next request flag
+    size_t flag_len;
+    timer_node_t timer;     // closes the connection once due_ns passes
+    atomic_ullong timer_ns; // when the timer fires, UINT64_MAX if it is not armed
+    atomic_ullong due_ns;   // when the client must have sent what the connection waits on, 0
+                            // while it waits on nothing of the client's (a handler is running)
+    connection_t* prev;
+    connection_t* next;
+};
+
+
+/* block of encoded frames waiting for a flush */
+typedef struct stream_block stream_block_t;
+struct stream_block {
+    stream_block_t* next;
+    size_t len;
+    size_t capacity;
+    char data[];
+};
+
+/* writer of a streaming call's response frames. A frame goes straight to the client's connection,
+ * unless frames come in a burst or the connection is full: then they are gathered for the
+ * connection's thread to flush */
+struct rpc_stream_writer {
+    connection_t* conn;
+    uint64_t function_id;
+    int err;                // set once a write fails, the client is gone or out of step
+    size_t bytes_out;
+    int gather;             // whether the connection's thread flushes gathered frames
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stream_block_t* head;   // gathered frames, not taken by a flush yet
+    stream_block_t* tail;
+    size_t queued;          // bytes gathered, not taken by a flush yet
+    uint64_t last_write_ns; // when the handler wrote its previous frame
+    int flushing;
+    int finished;           // set once the handler has returned
+};
 
 
 /* RPC server structure */
@@ -20,14 +109,55 @@ struct rpc_server {
     int listen_fd;
     int accept_fd;
     queue_f* functions;
+    executor_t* executor;
+    affinity_t io_affinity;     // CPUs of the connection threads
+    metrics_t* metrics;
+    int max_inflight;           // calls in flight server-wide, 0 for unlimited
+    atomic_int inflight;
+    atomic_ullong shed;         // calls answered with OVERLOADED
+    size_t max_payload;         // largest data2 of a call's payload, refused as OVERLENGTH beyond
+    int poll_fd;                // epoll instance of rpc_serve_poll, ERROR until created
+    atomic_int stopping;        // set once rpc_shutdown_server is called
+    pthread_mutex_t conns_lock;
+    pthread_cond_t conns_drained;
+    connection_t* conns;        // open connections
+    int num_conns;
+    atomic_ullong num_accepted; // connections accepted, which numbers them
+    capture_t capture;          // calls recorded, for bench/replay.c, once rpc_server_capture is on
+    timer_wheel_t timers;       // timers of the connections, see conn_expire
+    unsigned int idle_timeout_ms;       // 0 for no limit
+    unsigned int request_timeout_ms;    // 0 for no limit
+    atomic_ullong timed_out;    // connections closed by a timeout
+    int timer_fd;               // timerfd of rpc_serve_poll's wheel, ERROR until created
+    uint64_t timer_fd_ns;       // when it is set to expire, 0 if not set
 };
 
+/* context of the call a thread is currently serving, for handlers to query */
+typedef struct call_context {
+    struct rpc_server* server;
+    uint64_t deadline_ns;   // 0 if the call has no deadline
+    int host_order;         // whether the client shares the host's byte order, as negotiated
+} call_context_t;
+extern __thread call_context_t current_call;
+
 /* listen socket creation */
 int create_listen_socket(int port, int timeout_sec, int queue_size);
 
 /* function prototypes to serve clients */
 function_t* rpc_serve_find(struct rpc_server* server, int conn_fd);
-int rpc_serve_call(struct rpc_server* server, int conn_fd);
+int rpc_serve_call(struct rpc_server* server, connection_t* conn, int service);
+int rpc_serve_options(connection_t* conn);
+int rpc_serve_cast(struct rpc_server* server, connection_t* conn);
+int rpc_serve_stream(struct rpc_server* server, connection_t* conn);
+int server_stream_write(rpc_stream_writer* writer, rpc_data* frame);
+int rpc_serve_request(struct rpc_server* server, connection_t* conn);
+uint64_t conn_expire(timer_node_t* timer, uint64_t now_ns, void* server_obj);
+
+/* function prototypes to embed the server, and shut it down */
+int server_poll_fd(struct rpc_server* server);
+int server_poll(struct rpc_server* server, int timeout_ms);
+int server_shutdown(struct rpc_server* server);
+rpc_data* rpc_serve_stats(rpc_data* payload);
 
 
 /* Thread package */
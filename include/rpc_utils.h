@@ -9,17 +9,40 @@
 #define PROJECT2_RPC_UTILS_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "rpc.h"
+#include "rpc_ext.h"
 
 #define DEBUG      (int) 0
 #define ERROR      (int) (-1)
 #define OVERLENGTH (int) (-2)
+#define EXPIRED    (int) (-3)
+#define OVERLOADED (int) (-4)
+#define CORRUPT    (int) (-5)
+#define DECLINED   (int) (-6)
+
+#define REQUEST_BYTES (size_t) 8    // bytes of a request flag on the wire
+#define MAX_FRAME_LEN (size_t) 16777216     // largest data2 of a one-way frame (cast or stream)
 
 
 /* hash and debug */
 uint64_t hash(unsigned char* str);
+uint64_t hash_bytes(void* bytes, size_t len);
 void print_error(char* title, char* message);
 
+/* monotonic clock, I/O deadline and checksum */
+uint64_t rpc_now_ns(void);
+void rpc_set_io_deadline(uint64_t deadline_ns);
+unsigned long rpc_io_timeouts(void);
+void rpc_set_io_checksum(int enabled);
+
+/* send/receive raw bytes */
+int rpc_send_bytes(int socket, void* buffer, size_t len);
+int rpc_receive_bytes(int socket, void* buffer, size_t len);
+int rpc_send_bytes_vec(int socket, const struct iovec* segments, int num_segments);
+int rpc_receive_bytes_vec(int socket, const struct iovec* segments, int num_segments,
+                          size_t len);
+
 /* send/receive unsigned integer 64-bit */
 int rpc_send_uint(int socket, uint64_t val);
 int rpc_receive_uint(int socket, uint64_t* ret);
@@ -28,9 +51,20 @@ int rpc_receive_uint(int socket, uint64_t* ret);
 int rpc_send_int(int socket, int val);
 int rpc_receive_int(int socket, int* ret);
 int rpc_receive_request(int socket, int* ret);
+int rpc_receive_request_nowait(int socket, unsigned char* buffer, size_t* have, int* ret);
 
 /* send/receive rpc data */
 int rpc_send_payload(int socket, rpc_data* payload);
 rpc_data* rpc_receive_payload(int socket);
+rpc_data* rpc_receive_payload_status(int socket, int* status, size_t capacity);
+int rpc_send_payload_vec(int socket, rpc_vdata* payload);
+int rpc_receive_payload_vec(int socket, rpc_vdata* sink, size_t* data2_len);
+int rpc_receive_payload_sink(int socket, rpc_sink* sink);
+int rpc_send_status(int socket, int status);
+int rpc_send_oneway(int socket, int request, uint64_t function_id, rpc_data* payload);
+ssize_t rpc_send_oneway_nowait(int socket, int request, uint64_t function_id, rpc_data* payload);
+size_t rpc_encode_oneway(int request, uint64_t function_id, rpc_data* payload, void* buffer);
+rpc_data* rpc_receive_oneway(int socket, int request, uint64_t function_id, int* status);
+rpc_data* rpc_data_copy(rpc_data* data);
 
 #endif //PROJECT2_RPC_UTILS_H
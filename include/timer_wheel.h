@@ -0,0 +1,60 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : timer_wheel.h
+ * Purpose : Header file for the timer wheel, a hierarchical wheel of timers with constant time
+ *           arming and cancelling, which times the server's connections out.
+ */
+
+#ifndef PROJECT2_TIMER_WHEEL_H
+#define PROJECT2_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define WHEEL_BITS    (int) 6                   // 64 slots per level, a bit each in a bitmap
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  (int) 4                   // ticks up to 64^4, about 4.6 hours
+#define WHEEL_TICK_NS (uint64_t) 1000000        // timers fire on 1ms ticks, never early
+
+
+/* timer data structure, embedded in what it times */
+typedef struct timer_node timer_node_t;
+struct timer_node {
+    timer_node_t* next;
+    timer_node_t** pprev;   // link to this timer in its slot, NULL if not armed
+    uint64_t expires;       // tick it fires at
+    int slot;               // level * WHEEL_SLOTS + slot index, while armed
+};
+
+/**
+ * Called, with the wheel locked, for each timer that expires.
+ * @return when to fire the timer again (see rpc_now_ns), 0 to leave it disarmed
+ */
+typedef uint64_t (*timer_fire)(timer_node_t* timer, uint64_t now_ns, void* arg);
+
+/* timer wheel data structure */
+typedef struct timer_wheel {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // wakes the wheel's thread for an earlier timer, or to stop
+    timer_node_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS];    // bitmaps of the slots that have timers
+    uint64_t now;           // last tick processed
+    uint64_t wake_ns;       // when the wheel's thread wakes up, UINT64_MAX if only when signalled
+    int num_timers;
+    timer_fire fire;
+    void* arg;
+    int running;            // whether the wheel's thread is started
+    int stopping;
+    pthread_t thread;
+} timer_wheel_t;
+
+/* timer wheel functions */
+void wheel_init(timer_wheel_t* wheel, timer_fire fire, void* arg);
+void wheel_arm(timer_wheel_t* wheel, timer_node_t* timer, uint64_t expires_ns);
+void wheel_cancel(timer_wheel_t* wheel, timer_node_t* timer);
+int wheel_advance(timer_wheel_t* wheel, uint64_t now_ns);
+uint64_t wheel_next(timer_wheel_t* wheel);
+int wheel_start(timer_wheel_t* wheel);
+void wheel_stop(timer_wheel_t* wheel);
+
+#endif //PROJECT2_TIMER_WHEEL_H
@@ -0,0 +1,39 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : trace.h
+ * Purpose : Header file for call tracing, which timestamps the phases of calls into per-thread
+ *           ring buffers and dumps them as Chrome trace event JSON.
+ */
+
+#ifndef PROJECT2_TRACE_H
+#define PROJECT2_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_RING_SIZE (int) 4096      // events kept per thread, must be a power of 2
+
+/* which end of a call an event was traced at */
+#define TRACE_CLIENT (int) 0
+#define TRACE_SERVER (int) 1
+
+/* phases of a call */
+typedef enum trace_phase {
+    PHASE_CALL,         // the whole call
+    PHASE_HEADER,       // request flag, function id and verification
+    PHASE_PAYLOAD,      // the payload's size negotiation and transfer
+    PHASE_QUEUE,        // waiting for an executor worker
+    PHASE_HANDLER,      // the handler
+    PHASE_SEND,         // the response's size negotiation and transfer, at the server
+    PHASE_RESPONSE,     // waiting for and receiving the response, at the client
+    NUM_PHASES
+} trace_phase_t;
+
+/* trace functions */
+void trace_set_sampling(unsigned int every);
+int trace_enabled(void);
+int trace_sample(void);
+uint64_t trace_new_id(void);
+void trace_event(uint64_t call_id, int side, int phase, uint64_t start_ns, uint64_t end_ns);
+int trace_dump(const char* path);
+
+#endif //PROJECT2_TRACE_H
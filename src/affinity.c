@@ -0,0 +1,163 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : affinity.c
+ * Purpose : CPU affinity and NUMA placement of the server's threads.
+ *
+ * A set of CPUs is split by NUMA node, as read from sysfs, into groups. Threads of a kind are
+ * given a group each, round robin, so that they spread evenly over the nodes the set spans, and
+ * a thread is pinned to all CPUs of its group rather than one, leaving the scheduler to balance
+ * within the node. A pinned thread also prefers memory of its node, so the buffers it allocates
+ * and first touches stay local; the kernel's NUMA policy is set with a raw syscall, so that the
+ * library needs no libnuma. Without a NUMA topology in sysfs, the whole set is one group.
+ */
+
+#define _GNU_SOURCE     // CPU_* macros, pthread_setaffinity_np
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "rpc_utils.h"
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Parse a list of CPUs, in the kernel's cpulist format such as "0-3,8,10-11".
+ * @param list the list
+ * @param set  the returned set
+ * @return     0 if successful, and ERROR if the list is malformed or empty
+ */
+static int parse_cpulist(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = list;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) return ERROR;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return ERROR;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) return ERROR;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*p == ',') p++;
+        else if (*p != '\0' && !isspace((unsigned char) *p)) return ERROR;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : ERROR;
+}
+
+/**
+ * Read the CPUs of a NUMA node from sysfs.
+ * @return 0 if successful, and ERROR if there is no such node
+ */
+static int node_cpus(int node, cpu_set_t* set) {
+    char path[64], list[4096];
+    snprintf(path, sizeof path, NODE_DIR "node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return ERROR;
+    int err = fgets(list, sizeof list, file) == NULL ? ERROR : parse_cpulist(list, set);
+    fclose(file);
+    return err;
+}
+
+
+/* ----------------------------- AFFINITY FUNCTIONS ----------------------------- */
+
+/**
+ * Set the CPUs a kind of threads is pinned to, split by NUMA node. Only CPUs the process may
+ * run on count, of which there must be at least one.
+ * @param aff  the affinity
+ * @param cpus the CPUs, as a cpulist such as "0-7,16-23", or NULL not to pin the threads
+ * @return     0 if successful, and ERROR if otherwise
+ */
+int affinity_set(affinity_t* aff, const char* cpus) {
+    char* TITLE = "affinity_set";
+    if (cpus == NULL) {
+        aff->num_groups = 0;
+        return 0;
+    }
+    cpu_set_t set, allowed;
+    if (parse_cpulist(cpus, &set) < 0) {
+        print_error(TITLE, "malformed CPU list");
+        return ERROR;
+    }
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) CPU_AND(&set, &set, &allowed);
+    if (CPU_COUNT(&set) == 0) {
+        print_error(TITLE, "none of the CPUs is available");
+        return ERROR;
+    }
+
+    int num_groups = 0;
+    for (int node = 0; node < MAX_NODES; node++) {
+        cpu_group_t* group = &aff->groups[num_groups];
+        if (node_cpus(node, &group->cpus) < 0) continue;
+        CPU_AND(&group->cpus, &group->cpus, &set);
+        if (CPU_COUNT(&group->cpus) == 0) continue;
+        group->node = node;
+        num_groups++;
+    }
+    if (num_groups == 0) {
+        aff->groups[0].node = -1;
+        aff->groups[0].cpus = set;
+        num_groups = 1;
+    }
+    aff->num_groups = num_groups;
+    atomic_init(&aff->next, 0);
+    return 0;
+}
+
+
+/**
+ * Give the next thread of a kind its group, round robin over the nodes.
+ * @param aff the affinity
+ * @return    the group, or -1 if the threads are not pinned
+ */
+int affinity_next(affinity_t* aff) {
+    if (aff->num_groups == 0) return -1;
+    return (int) (atomic_fetch_add(&aff->next, 1) % (unsigned int) aff->num_groups);
+}
+
+
+/**
+ * Get the NUMA node of a group.
+ * @param aff   the affinity
+ * @param group the group, from affinity_next
+ * @return      the node, or -1 if unknown or the threads are not pinned
+ */
+int affinity_node(affinity_t* aff, int group) {
+    if (group < 0 || group >= aff->num_groups) return -1;
+    return aff->groups[group].node;
+}
+
+
+/**
+ * Pin the calling thread to the CPUs of its group, and have its memory preferably allocated on
+ * their node. The memory policy is best effort: a kernel or container refusing it leaves the
+ * thread pinned all the same.
+ * @param aff   the affinity
+ * @param group the thread's group, from affinity_next, -1 to leave the thread as is
+ * @return      0 if successful, and ERROR if the thread cannot be pinned
+ */
+int affinity_apply(affinity_t* aff, int group) {
+    if (group < 0 || group >= aff->num_groups) return 0;
+    cpu_group_t* g = &aff->groups[group];
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &g->cpus) != 0) {
+        print_error("affinity_apply", "cannot pin thread");
+        return ERROR;
+    }
+    if (g->node >= 0) {
+        unsigned long mask = 1UL << g->node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, (unsigned long) MAX_NODES + 1);
+    }
+    return 0;
+}
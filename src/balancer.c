@@ -0,0 +1,695 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : balancer.c
+ * Purpose : The multi-endpoint client, which balances calls over replicas of a server.
+ *
+ * Each replica keeps a pool of idle connections, which calls take and give back, so calls from
+ * many threads run at once. A call goes to the replica with the least load: either the fewest
+ * calls outstanding, or the lowest EWMA latency weighted by its calls outstanding (so a replica
+ * that has slowed down sheds load before its latency has caught up). Ties go round robin.
+ *
+ * A replica is ejected from rotation after EJECT_FAILURES failed calls in a row, or at once if
+ * it cannot be connected to. Only a failed exchange counts (a lost connection, or a corrupt
+ * payload or response), never an answer: a handler returning NULL, or a function not found.
+ * Once its time out is up, the next call picked for it is its probe: it is back in rotation if
+ * the probe is answered, and out again for twice as long if not. With all replicas ejected,
+ * calls go to the one due back soonest rather than failing outright.
+ *
+ * Calls of a hedged handle wait for their response only so long: the given percentile of the
+ * handle's recent latencies. A call still unanswered by then is sent again, to another replica
+ * in rotation, by a thread of its own, and the first successful response wins. The loser is
+ * abandoned: the hedge's connection is shut down under it, or the primary's is dropped, and
+ * neither counts against its replica. Each call of the handle earns a fraction of a hedge, up to
+ * a few saved up, which is all the hedging the handle gets however slow its replicas are.
+ */
+
+#define _GNU_SOURCE     // ppoll, for delays below a millisecond
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "balancer.h"
+#include "histogram.h"
+#include "rpc_client.h"
+#include "rpc_utils.h"
+
+#define ABANDONED (int) (-100)  // status of a call given up for its hedge, or of the hedge
+
+
+/* replica of the server */
+typedef struct endpoint {
+    char* addr;
+    int port;
+    int outstanding;
+    double ewma_ns;             // 0 until a call succeeds
+    int failures;               // failed calls in a row
+    uint64_t ejected_until_ns;  // 0 while in rotation
+    uint64_t eject_ns;          // time out of rotation of the next ejection
+    int probing;                // whether a probe call is in flight
+    rpc_client* idle[MAX_IDLE];
+    int num_idle;
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long ejections;
+} endpoint_t;
+
+/* hedging policy of a handle */
+typedef struct hedge_policy hedge_policy_t;
+struct hedge_policy {
+    uint64_t function_id;
+    double percentile;          // 0 once the handle is opted out
+    double budget;              // hedges earned per call
+    double tokens;              // hedges the budget allows right now
+    histogram_t window;         // latencies of the handle's recent calls
+    uint64_t delay_ns;          // 0 until enough calls were seen
+    unsigned long long calls;
+    unsigned long long hedges;
+    unsigned long long hedge_wins;
+    hedge_policy_t* next;
+};
+
+/* hedge of a call, run by a thread of its own */
+typedef struct hedge {
+    struct rpc_balancer* b;
+    endpoint_t* e;
+    rpc_handle handle;
+    rpc_data* payload;          // a copy, as the caller may return before the hedge does
+    int event_fd;               // written once the hedge's call is over
+    pthread_mutex_t lock;
+    int conn_fd;                // the hedge's connection while its call is on, ERROR otherwise
+    int abandoned;              // whether the caller took the primary's response instead
+    int done;
+    rpc_data* response;
+    int status;
+    int refs;                   // the caller and the hedge's thread
+} hedge_t;
+
+/* balancer data structure */
+struct rpc_balancer {
+    pthread_mutex_t lock;
+    endpoint_t* endpoints;
+    int num_endpoints;
+    int policy;
+    unsigned int next;          // where the next pick starts, so that ties go round robin
+    hedge_policy_t* hedge_policies;
+    int num_hedges;             // hedges in flight
+    pthread_cond_t hedges_done;
+};
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Get the load of a replica in rotation, per the balancer's policy. The lock must be held.
+ */
+static double endpoint_load(balancer_t* b, endpoint_t* e) {
+    if (b->policy == RPC_BALANCE_EWMA)
+        return e->ewma_ns * (e->outstanding + 1);
+    return (double) e->outstanding;
+}
+
+/**
+ * Pick the replica a call goes to, counting the call as outstanding there.
+ * @param b       the balancer
+ * @param probe   returned 1 if the call is the probe of an ejected replica, 0 if not
+ * @param exclude the replica of the call a hedge is for, NULL for a call of its own
+ * @return        the replica, or NULL if a hedge has no replica in rotation to go to
+ */
+static endpoint_t* endpoint_pick(balancer_t* b, int* probe, endpoint_t* exclude) {
+    uint64_t now = rpc_now_ns();
+    endpoint_t* best = NULL;
+    endpoint_t* soonest = NULL;
+    double best_load = 0;
+    *probe = 0;
+
+    pthread_mutex_lock(&b->lock);
+    int start = (int) (b->next++ % (unsigned int) b->num_endpoints);
+    for (int k = 0; k < b->num_endpoints; k++) {
+        endpoint_t* e = &b->endpoints[(start + k) % b->num_endpoints];
+        if (e == exclude || (exclude != NULL && e->ejected_until_ns != 0)) continue;
+        if (e->ejected_until_ns != 0) {
+            // an ejected replica whose time is up gets the call, as its probe
+            if (now >= e->ejected_until_ns && !e->probing) {
+                best = e;
+                *probe = 1;
+                break;
+            }
+            if (soonest == NULL || e->ejected_until_ns < soonest->ejected_until_ns)
+                soonest = e;
+            continue;
+        }
+        double load = endpoint_load(b, e);
+        if (best == NULL || load < best_load) {
+            best = e;
+            best_load = load;
+        }
+    }
+    if (best == NULL) best = soonest;
+    if (best != NULL) {
+        if (*probe) best->probing = 1;
+        (best->outstanding)++;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return best;
+}
+
+/**
+ * Take an idle connection to a replica, or connect a new one.
+ * @return the connection, or NULL if the replica cannot be connected to
+ */
+static rpc_client* endpoint_take(balancer_t* b, endpoint_t* e) {
+    rpc_client* client = NULL;
+    pthread_mutex_lock(&b->lock);
+    if (e->num_idle > 0) client = e->idle[--(e->num_idle)];
+    pthread_mutex_unlock(&b->lock);
+    if (client == NULL) client = rpc_init_client(e->addr, e->port);
+    return client;
+}
+
+/**
+ * Give a connection back to its replica's pool. A connection whose exchange failed (ERROR) may be
+ * out of step, and is closed rather than kept, as is one beyond the pool's size. One answered
+ * with a status, DECLINED among them, is still in step.
+ */
+static void endpoint_give(balancer_t* b, endpoint_t* e, rpc_client* client, int status) {
+    int kept = 0;
+    if (status != ERROR && client->conn_fd >= 0) {
+        pthread_mutex_lock(&b->lock);
+        if (e->num_idle < MAX_IDLE) {
+            e->idle[(e->num_idle)++] = client;
+            kept = 1;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    if (!kept) rpc_close_client(client);
+}
+
+/**
+ * Eject a replica from rotation, for twice as long as the last time. The lock must be held.
+ */
+static void endpoint_eject(endpoint_t* e) {
+    e->ejected_until_ns = rpc_now_ns() + e->eject_ns;
+    e->eject_ns = e->eject_ns * 2 > EJECT_MAX_NS ? EJECT_MAX_NS : e->eject_ns * 2;
+    (e->ejections)++;
+}
+
+/**
+ * Record the outcome of a call to a replica, ejecting or restoring it accordingly.
+ * @param b          the balancer
+ * @param e          the replica
+ * @param probe      whether the call was the replica's probe
+ * @param connected  whether the replica could be connected to at all
+ * @param status     the call's status
+ * @param latency_ns the call's latency
+ */
+static void endpoint_done(balancer_t* b, endpoint_t* e, int probe, int connected, int status,
+                          uint64_t latency_ns) {
+    pthread_mutex_lock(&b->lock);
+    (e->outstanding)--;
+    (e->calls)++;
+    if (probe) e->probing = 0;
+
+    // a call shed, expired or abandoned says nothing of the replica's health, one that failed
+    // does. A call its handler declined, or a function it does not have, was still answered
+    if (connected && (status == 0 || status == DECLINED)) {
+        if (status == 0)
+            e->ewma_ns = e->ewma_ns == 0 ? (double) latency_ns :
+                         e->ewma_ns + EWMA_WEIGHT * ((double) latency_ns - e->ewma_ns);
+        e->failures = 0;
+        if (e->ejected_until_ns != 0) {
+            e->ejected_until_ns = 0;
+            e->eject_ns = EJECT_BASE_NS;
+        }
+    }
+    else if (!connected || status == ERROR || status == CORRUPT) {
+        (e->errors)++;
+        (e->failures)++;
+        int eject = probe || !connected || e->failures >= EJECT_FAILURES;
+        if (eject && (probe || e->ejected_until_ns == 0))
+            endpoint_eject(e);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+
+/* ----------------------------- HEDGING ----------------------------- */
+
+/* a call of a hedged handle, as seen by its await */
+typedef struct hedged_call {
+    balancer_t* b;
+    hedge_policy_t* policy;
+    endpoint_t* primary;
+    rpc_handle* handle;
+    rpc_data* payload;
+    uint64_t hedge_at_ns;       // when the call is hedged if still unanswered
+    hedge_t* hedge;             // NULL unless hedged
+    int abandoned;              // whether the hedge's response was taken over the primary's
+} hedged_call_t;
+
+/**
+ * Get the hedging policy of a handle. The lock must be held.
+ * @return the policy, or NULL if the handle was never opted into hedging
+ */
+static hedge_policy_t* policy_of(balancer_t* b, uint64_t function_id) {
+    hedge_policy_t* policy = b->hedge_policies;
+    while (policy != NULL && policy->function_id != function_id) policy = policy->next;
+    return policy;
+}
+
+/**
+ * Record a call of a hedged handle: its latency, and the hedge it earns. Every so often the
+ * delay is taken again from the window of recent latencies, which starts over once full.
+ * The lock must be held.
+ */
+static void policy_record(hedge_policy_t* policy, uint64_t latency_ns, int hedge_won) {
+    (policy->calls)++;
+    policy->hedge_wins += hedge_won != 0;
+    policy->tokens += policy->budget;
+    if (policy->tokens > HEDGE_BURST) policy->tokens = HEDGE_BURST;
+    hist_record(&policy->window, latency_ns);
+
+    uint64_t count = atomic_load_explicit(&policy->window.count, memory_order_relaxed);
+    if (count >= HEDGE_MIN_CALLS && (count % HEDGE_REFRESH == 0 || count >= HEDGE_WINDOW))
+        policy->delay_ns = hist_percentile(&policy->window, policy->percentile);
+    if (count >= HEDGE_WINDOW) hist_reset(&policy->window);
+}
+
+/**
+ * Let go of a hedge, freeing it if let go of last.
+ */
+static void hedge_release(hedge_t* h) {
+    pthread_mutex_lock(&h->lock);
+    int refs = --(h->refs);
+    pthread_mutex_unlock(&h->lock);
+    if (refs > 0) return;
+    rpc_data_free(h->response);
+    rpc_data_free(h->payload);
+    close(h->event_fd);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+/**
+ * Run a hedge, on a thread of its own: the call again, on another replica.
+ * @param hedge_obj the hedge
+ * @return          NULL
+ */
+static void* run_hedge(void* hedge_obj) {
+    hedge_t* h = (hedge_t*) hedge_obj;
+    balancer_t* b = h->b;
+    uint64_t start = rpc_now_ns();
+    rpc_client* client = endpoint_take(b, h->e);
+    rpc_data* response = NULL;
+    int status = ERROR;
+    if (client != NULL) {
+        // the connection is published first, for the caller to shut down if the primary wins
+        pthread_mutex_lock(&h->lock);
+        int abandoned = h->abandoned;
+        if (!abandoned) h->conn_fd = client->conn_fd;
+        pthread_mutex_unlock(&h->lock);
+        if (!abandoned) {
+            call_io_t io = { .payload = h->payload };
+            response = client_call_io(client, &h->handle, &io, 0);
+            status = client->status;
+        }
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->conn_fd = ERROR;
+    int abandoned = h->abandoned;
+    h->done = 1;
+    h->response = response;
+    h->status = status;
+    pthread_mutex_unlock(&h->lock);
+    endpoint_done(b, h->e, 0, client != NULL, abandoned ? ABANDONED : status,
+                  rpc_now_ns() - start);
+    if (client != NULL) endpoint_give(b, h->e, client, abandoned ? ERROR : status);
+
+    uint64_t one = 1;
+    ssize_t written = write(h->event_fd, &one, sizeof one);
+    (void) written;
+    hedge_release(h);
+
+    pthread_mutex_lock(&b->lock);
+    if (--(b->num_hedges) == 0) pthread_cond_broadcast(&b->hedges_done);
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/**
+ * Hedge a call, if its handle's budget allows and another replica is in rotation.
+ * @param call the hedged call
+ * @return     1 if the hedge is on its way, 0 if not
+ */
+static int hedge_start(hedged_call_t* call) {
+    balancer_t* b = call->b;
+    pthread_mutex_lock(&b->lock);
+    int allowed = call->policy->tokens >= 1;
+    if (allowed) {
+        call->policy->tokens -= 1;
+        (b->num_hedges)++;
+    }
+    pthread_mutex_unlock(&b->lock);
+    if (!allowed) return 0;
+
+    int probe;
+    endpoint_t* e = endpoint_pick(b, &probe, call->primary);
+    hedge_t* h = NULL;
+    pthread_t thread;
+    if (e != NULL) {
+        h = (hedge_t*) calloc(1, sizeof(hedge_t));
+        assert(h);
+        h->b = b;
+        h->e = e;
+        h->handle = *call->handle;
+        h->payload = rpc_data_copy(call->payload);
+        h->event_fd = eventfd(0, EFD_CLOEXEC);
+        pthread_mutex_init(&h->lock, NULL);
+        h->conn_fd = ERROR;
+        h->status = ERROR;
+        h->refs = 2;
+        if (h->event_fd < 0 || pthread_create(&thread, NULL, run_hedge, h) != 0) {
+            endpoint_done(b, e, 0, 1, ABANDONED, 0);
+            h->refs = 1;
+            hedge_release(h);
+            h = NULL;
+        }
+        else pthread_detach(thread);
+    }
+
+    // with no hedge after all, its budget is given back
+    pthread_mutex_lock(&b->lock);
+    if (h == NULL) {
+        call->policy->tokens += 1;
+        if (--(b->num_hedges) == 0) pthread_cond_broadcast(&b->hedges_done);
+    }
+    else (call->policy->hedges)++;
+    pthread_mutex_unlock(&b->lock);
+    call->hedge = h;
+    return h != NULL;
+}
+
+/**
+ * Await the response of a hedged handle's call, once its payload is sent: up to the handle's
+ * delay for the primary, then for whichever of the primary and its hedge answers first.
+ * @param call_obj the hedged call
+ * @param conn_fd  the primary's connection
+ * @return         0 to receive the primary's response, 1 to abandon it for the hedge's
+ */
+static int await_hedged(void* call_obj, int conn_fd) {
+    hedged_call_t* call = (hedged_call_t*) call_obj;
+    struct pollfd fds[2] = { { conn_fd, POLLIN, 0 }, { -1, POLLIN, 0 } };
+
+    // most calls are answered within the delay
+    uint64_t now = rpc_now_ns();
+    if (now < call->hedge_at_ns) {
+        uint64_t wait_ns = call->hedge_at_ns - now;
+        struct timespec timeout = {
+                .tv_sec  = (time_t) (wait_ns / 1000000000ULL),
+                .tv_nsec = (long) (wait_ns % 1000000000ULL)
+        };
+        if (ppoll(fds, 1, &timeout, NULL) != 0) return 0;
+    }
+    if (!hedge_start(call)) return 0;
+
+    // the first to answer wins, unless the hedge fails, in which case the primary still may
+    hedge_t* h = call->hedge;
+    fds[1].fd = h->event_fd;
+    while (1) {
+        int n = poll(fds, 2, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || fds[0].revents) return 0;
+        pthread_mutex_lock(&h->lock);
+        int won = h->done && h->status == 0;
+        pthread_mutex_unlock(&h->lock);
+        if (won) {
+            call->abandoned = 1;
+            return 1;
+        }
+        fds[1].fd = -1;
+    }
+}
+
+/**
+ * Abandon a hedge whose primary won: shut its connection down under it, so its call ends now.
+ */
+static void hedge_abandon(hedge_t* h) {
+    pthread_mutex_lock(&h->lock);
+    h->abandoned = 1;
+    if (h->conn_fd >= 0) shutdown(h->conn_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&h->lock);
+}
+
+
+/* ----------------------------- BALANCER FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize a balancer over replicas, connecting to each of them once. A replica that cannot
+ * be connected to starts out ejected.
+ * @param endpoints     the replicas' addresses and ports
+ * @param num_endpoints the number of replicas
+ * @param policy        RPC_BALANCE_LEAST_OUTSTANDING or RPC_BALANCE_EWMA
+ * @return              the balancer, or NULL on invalid arguments
+ */
+balancer_t* balancer_init(rpc_endpoint* endpoints, int num_endpoints, int policy) {
+    char* TITLE = "rpc-client: rpc_balancer_init";
+    if (endpoints == NULL || num_endpoints <= 0 ||
+        (policy != RPC_BALANCE_LEAST_OUTSTANDING && policy != RPC_BALANCE_EWMA)) {
+        print_error(TITLE, "no endpoints, or unknown policy");
+        return NULL;
+    }
+    balancer_t* b = (balancer_t*) calloc(1, sizeof(balancer_t));
+    assert(b);
+    b->endpoints = (endpoint_t*) calloc(num_endpoints, sizeof(endpoint_t));
+    assert(b->endpoints);
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->hedges_done, NULL);
+    b->num_endpoints = num_endpoints;
+    b->policy = policy;
+
+    for (int i = 0; i < num_endpoints; i++) {
+        endpoint_t* e = &b->endpoints[i];
+        e->addr = strdup(endpoints[i].addr);
+        assert(e->addr);
+        e->port = endpoints[i].port;
+        e->eject_ns = EJECT_BASE_NS;
+        rpc_client* client = rpc_init_client(e->addr, e->port);
+        if (client == NULL) {
+            print_error(TITLE, "cannot connect to an endpoint, ejected for now");
+            endpoint_eject(e);
+        }
+        else e->idle[(e->num_idle)++] = client;
+    }
+    return b;
+}
+
+
+/**
+ * Find a function on one of the replicas. The handle is valid on all of them, as long as they
+ * register the same functions.
+ * @param b    the balancer
+ * @param name the function's name
+ * @return     the RPC handle, or NULL if no replica could find the function
+ */
+rpc_handle* balancer_find(balancer_t* b, char* name) {
+    for (int attempt = 0; attempt < b->num_endpoints; attempt++) {
+        int probe;
+        endpoint_t* e = endpoint_pick(b, &probe, NULL);
+        rpc_client* client = endpoint_take(b, e);
+        if (client == NULL) {
+            endpoint_done(b, e, probe, 0, ERROR, 0);
+            continue;
+        }
+        rpc_handle* handle = rpc_find(client, name);
+        int status = client->status;
+        endpoint_done(b, e, probe, 1, status, 0);
+        endpoint_give(b, e, client, status);
+        if (handle != NULL) return handle;
+    }
+    return NULL;
+}
+
+
+/**
+ * Call a remote function on the least loaded replica. A call is only moved to another replica if
+ * its own could not be connected to, or sent again to another if its handle is hedged.
+ * @param b       the balancer
+ * @param handle  the RPC handle
+ * @param payload the RPC payload
+ * @param status  the returned status of the call, as rpc_client_status; may be NULL
+ * @return        the response data if successful, or NULL if otherwise
+ */
+rpc_data* balancer_call(balancer_t* b, rpc_handle* handle, rpc_data* payload, int* status) {
+    uint64_t start = rpc_now_ns();
+    hedged_call_t hedged = { .b = b, .handle = handle, .payload = payload };
+    pthread_mutex_lock(&b->lock);
+    hedged.policy = policy_of(b, handle->function_id);
+    if (hedged.policy != NULL && hedged.policy->percentile == 0) hedged.policy = NULL;
+    uint64_t delay_ns = hedged.policy != NULL ? hedged.policy->delay_ns : 0;
+    pthread_mutex_unlock(&b->lock);
+
+    int call_status = ERROR;
+    rpc_data* response = NULL;
+    for (int attempt = 0; attempt < b->num_endpoints; attempt++) {
+        int probe;
+        endpoint_t* e = endpoint_pick(b, &probe, NULL);
+        rpc_client* client = endpoint_take(b, e);
+        if (client == NULL) {
+            endpoint_done(b, e, probe, 0, ERROR, 0);
+            continue;
+        }
+
+        // a hedged handle's call only waits for its replica so long, once its delay is known
+        call_io_t io = { .payload = payload };
+        if (delay_ns != 0) {
+            hedged.primary = e;
+            hedged.hedge_at_ns = rpc_now_ns() + delay_ns;
+            io.await = await_hedged;
+            io.await_arg = &hedged;
+        }
+        uint64_t call_start = rpc_now_ns();
+        response = client_call_io(client, handle, &io, 0);
+        call_status = client->status;
+        endpoint_done(b, e, probe, 1, hedged.abandoned ? ABANDONED : call_status,
+                      rpc_now_ns() - call_start);
+        endpoint_give(b, e, client, call_status);
+        break;
+    }
+
+    // the hedge's response was taken, or the hedge is left to end on its own
+    if (hedged.hedge != NULL) {
+        if (hedged.abandoned) {
+            pthread_mutex_lock(&hedged.hedge->lock);
+            response = hedged.hedge->response;
+            call_status = hedged.hedge->status;
+            hedged.hedge->response = NULL;
+            pthread_mutex_unlock(&hedged.hedge->lock);
+        }
+        else hedge_abandon(hedged.hedge);
+        hedge_release(hedged.hedge);
+    }
+    if (hedged.policy != NULL) {
+        pthread_mutex_lock(&b->lock);
+        policy_record(hedged.policy, rpc_now_ns() - start, hedged.abandoned);
+        pthread_mutex_unlock(&b->lock);
+    }
+    if (status != NULL) *status = call_status;
+    return response;
+}
+
+
+/**
+ * Opt a handle into hedging, or out of it. Its delay is not known until the handle has seen
+ * HEDGE_MIN_CALLS calls, which are not hedged.
+ * @param b           the balancer
+ * @param function_id the handle's function id
+ * @param percentile  the percentile of recent latencies a call is hedged at, 0 to opt out
+ * @param budget_pct  the most hedges, in percent of the handle's calls
+ * @return            0 if successful, and ERROR if otherwise
+ */
+int balancer_hedge(balancer_t* b, uint64_t function_id, double percentile, double budget_pct) {
+    char* TITLE = "rpc-client: rpc_balancer_hedge";
+    if (percentile < 0 || percentile >= 100 || budget_pct < 0 || budget_pct > 100) {
+        print_error(TITLE, "percentile or budget out of range");
+        return ERROR;
+    }
+    pthread_mutex_lock(&b->lock);
+    hedge_policy_t* policy = policy_of(b, function_id);
+    if (policy == NULL && percentile > 0) {
+        policy = (hedge_policy_t*) calloc(1, sizeof(hedge_policy_t));
+        assert(policy);
+        policy->function_id = function_id;
+        hist_reset(&policy->window);
+        policy->next = b->hedge_policies;
+        b->hedge_policies = policy;
+    }
+    if (policy != NULL) {
+        if (policy->percentile != percentile) {
+            hist_reset(&policy->window);
+            policy->delay_ns = 0;
+        }
+        policy->percentile = percentile;
+        policy->budget = budget_pct / 100;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+
+/**
+ * Get the hedging counters of a handle.
+ * @param b           the balancer
+ * @param function_id the handle's function id
+ * @param stats       the returned counters
+ * @return            0 if successful, and ERROR if the handle was never opted into hedging
+ */
+int balancer_hedge_stats(balancer_t* b, uint64_t function_id, rpc_hedge_stats* stats) {
+    pthread_mutex_lock(&b->lock);
+    hedge_policy_t* policy = policy_of(b, function_id);
+    if (policy != NULL) {
+        stats->calls = policy->calls;
+        stats->hedges = policy->hedges;
+        stats->hedge_wins = policy->hedge_wins;
+        stats->delay_ns = policy->delay_ns;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return policy != NULL ? 0 : ERROR;
+}
+
+
+/**
+ * Get the load and health of a replica.
+ * @param b     the balancer
+ * @param index the replica's index, in the order given to balancer_init
+ * @param stats the returned stats
+ * @return      0 if successful, and ERROR if the index is out of range
+ */
+int balancer_endpoint_stats(balancer_t* b, int index, rpc_endpoint_stats* stats) {
+    if (index < 0 || index >= b->num_endpoints) return ERROR;
+    endpoint_t* e = &b->endpoints[index];
+    pthread_mutex_lock(&b->lock);
+    stats->outstanding = e->outstanding;
+    stats->ejected = e->ejected_until_ns != 0;
+    stats->ewma_ns = (unsigned long long) e->ewma_ns;
+    stats->calls = e->calls;
+    stats->errors = e->errors;
+    stats->ejections = e->ejections;
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+
+/**
+ * Free a balancer and close its connections, once no call is in flight. Hedges abandoned by their
+ * calls may still be ending, and are waited for.
+ * @param b the balancer
+ */
+void balancer_free(balancer_t* b) {
+    if (b == NULL) return;
+    pthread_mutex_lock(&b->lock);
+    while (b->num_hedges > 0)
+        pthread_cond_wait(&b->hedges_done, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    while (b->hedge_policies != NULL) {
+        hedge_policy_t* policy = b->hedge_policies;
+        b->hedge_policies = policy->next;
+        free(policy);
+    }
+    for (int i = 0; i < b->num_endpoints; i++) {
+        endpoint_t* e = &b->endpoints[i];
+        for (int k = 0; k < e->num_idle; k++)
+            rpc_close_client(e->idle[k]);
+        free(e->addr);
+    }
+    pthread_cond_destroy(&b->hedges_done);
+    pthread_mutex_destroy(&b->lock);
+    free(b->endpoints);
+    free(b);
+}
@@ -0,0 +1,310 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : capture.c
+ * Purpose : Call captures: the calls a server receives, recorded to a compact binary log, and
+ *           read back to replay them.
+ *
+ * A capture is CAPTURE_MAGIC, then records, each a type byte followed by LEB128 varints:
+ *   CAPTURE_FUNCTION  id, name length, name
+ *   CAPTURE_CALL      kind, connection, function id, ns since the previous call, time left in us
+ *                     (0 for no deadline), data1 (zigzag), data2 length, bytes recorded, bytes
+ * A function's name is recorded once, before its first call, so that a replay can find it by name
+ * on another server. Calls are recorded as they arrive, by whichever thread received them, under
+ * the capture's lock; the file is buffered, so a record is a copy into the buffer, and the kernel
+ * only sees a write per CAPTURE_BUFFER bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "capture.h"
+#include "rpc_utils.h"
+
+#define MAX_NAME (uint64_t) 4096    // longest function name read back
+
+
+/* capture reader data structure */
+struct capture_reader {
+    FILE* file;
+    uint64_t now_ns;        // offset of the last call read
+    uint64_t* ids;          // function names seen so far
+    char** names;
+    int num_names;
+};
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+static void put_varint(FILE* file, uint64_t value) {
+    while (value >= 0x80) {
+        putc((int) (value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    putc((int) value, file);
+}
+
+/**
+ * Read a varint.
+ * @return 0 if successful, and ERROR at the end of the file or on a malformed varint
+ */
+static int get_varint(FILE* file, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(file);
+        if (c == EOF) return ERROR;
+        *value |= (uint64_t) (c & 0x7F) << shift;
+        if ((c & 0x80) == 0) return 0;
+    }
+    return ERROR;
+}
+
+/**
+ * Record a function's name, the first time it is called.
+ */
+static void record_name(capture_t* cap, function_t* function) {
+    if (function->slot >= cap->num_named) {
+        int num = (function->slot + 1) * 2;
+        cap->named = (unsigned char*) realloc(cap->named, num);
+        assert(cap->named);
+        memset(cap->named + cap->num_named, 0, num - cap->num_named);
+        cap->num_named = num;
+    }
+    if (cap->named[function->slot]) return;
+    size_t len = strlen(function->name);
+    putc(CAPTURE_FUNCTION, cap->file);
+    put_varint(cap->file, function->id);
+    put_varint(cap->file, len);
+    fwrite(function->name, 1, len, cap->file);
+    cap->named[function->slot] = 1;
+}
+
+/**
+ * Close the capture's file. The capture must be locked.
+ */
+static void close_file(capture_t* cap) {
+    atomic_store(&cap->active, 0);
+    if (cap->file != NULL && fclose(cap->file) != 0)
+        print_error("capture", "cannot write the end of the capture");
+    cap->file = NULL;
+    free(cap->named);
+    cap->named = NULL;
+    cap->num_named = 0;
+}
+
+
+/* ----------------------------- RECORDING FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize a capture, not recording.
+ * @param cap the capture
+ */
+void capture_init(capture_t* cap) {
+    atomic_init(&cap->active, 0);
+    pthread_mutex_init(&cap->lock, NULL);
+    cap->file = NULL;
+    cap->max_payload = 0;
+    cap->last_ns = 0;
+    cap->named = NULL;
+    cap->num_named = 0;
+}
+
+
+/**
+ * Start recording calls to a new file, ending the previous capture if there is one.
+ * @param cap         the capture
+ * @param path        the file, created or truncated
+ * @param max_payload most data2 bytes recorded per call, 0 for all of them
+ * @return            0 if successful, and ERROR if the file cannot be written
+ */
+int capture_start(capture_t* cap, const char* path, size_t max_payload) {
+    char* TITLE = "capture_start";
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        print_error(TITLE, "cannot create the capture file");
+        return ERROR;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), file);
+
+    pthread_mutex_lock(&cap->lock);
+    close_file(cap);
+    cap->file = file;
+    cap->max_payload = max_payload ? max_payload : SIZE_MAX;
+    cap->last_ns = rpc_now_ns();
+    atomic_store(&cap->active, 1);
+    pthread_mutex_unlock(&cap->lock);
+    return 0;
+}
+
+
+/**
+ * Stop recording, writing out what is left of the capture.
+ * @param cap the capture
+ */
+void capture_stop(capture_t* cap) {
+    pthread_mutex_lock(&cap->lock);
+    close_file(cap);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+
+/**
+ * Record a call, if the capture is on. A capture whose file cannot be written to anymore (a
+ * full disk) is stopped, rather than fail the calls.
+ * @param cap         the capture
+ * @param kind        CAPTURE_KIND_* of the call
+ * @param conn_id     the client's connection
+ * @param function    the called function
+ * @param payload     the call's payload, as received
+ * @param deadline_ns the call's deadline, 0 if it has none
+ */
+void capture_record(capture_t* cap, int kind, uint64_t conn_id, function_t* function,
+                    rpc_data* payload, uint64_t deadline_ns) {
+    if (!atomic_load_explicit(&cap->active, memory_order_relaxed)) return;
+    pthread_mutex_lock(&cap->lock);
+    if (cap->file == NULL) {
+        pthread_mutex_unlock(&cap->lock);
+        return;
+    }
+    uint64_t now = rpc_now_ns();
+    uint64_t budget_us = 0;
+    if (deadline_ns != 0)
+        budget_us = deadline_ns > now ? (deadline_ns - now + 999) / 1000 : 1;
+    size_t recorded = payload->data2_len < cap->max_payload ? payload->data2_len :
+                      cap->max_payload;
+    int64_t data1 = payload->data1;
+
+    record_name(cap, function);
+    putc(CAPTURE_CALL, cap->file);
+    put_varint(cap->file, (uint64_t) kind);
+    put_varint(cap->file, conn_id);
+    put_varint(cap->file, function->id);
+    put_varint(cap->file, now - cap->last_ns);
+    put_varint(cap->file, budget_us);
+    put_varint(cap->file, ((uint64_t) data1 << 1) ^ (uint64_t) (data1 >> 63));
+    put_varint(cap->file, payload->data2_len);
+    put_varint(cap->file, recorded);
+    if (recorded > 0) fwrite(payload->data2, 1, recorded, cap->file);
+    cap->last_ns = now;
+    if (ferror(cap->file)) {
+        print_error("capture_record", "cannot write to the capture file, capture stopped");
+        close_file(cap);
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+
+/* ----------------------------- READING FUNCTIONS ----------------------------- */
+
+/**
+ * Open a capture to read its calls back.
+ * @param path the capture file
+ * @return     the reader, or NULL if the file is not a capture
+ */
+capture_reader_t* capture_open(const char* path) {
+    char* TITLE = "capture_open";
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        print_error(TITLE, "cannot open the capture file");
+        return NULL;
+    }
+    char magic[8];
+    if (fread(magic, 1, sizeof magic, file) != sizeof magic ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof magic) != 0) {
+        print_error(TITLE, "not a capture file");
+        fclose(file);
+        return NULL;
+    }
+    capture_reader_t* reader = (capture_reader_t*) calloc(1, sizeof(capture_reader_t));
+    assert(reader);
+    reader->file = file;
+    return reader;
+}
+
+
+/**
+ * Read the next call of a capture.
+ * @param reader the reader
+ * @param call   the returned call, whose payload's data2 is the caller's to free
+ * @return       1 if a call was read, 0 at the end of the capture, and ERROR if it is malformed
+ *               (or was cut short, as a capture that was not stopped is)
+ */
+int capture_next(capture_reader_t* reader, capture_call_t* call) {
+    char* TITLE = "capture_next";
+    while (1) {
+        int type = getc(reader->file);
+        if (type == EOF) return 0;
+        uint64_t v[8];
+
+        if (type == CAPTURE_FUNCTION) {
+            if (get_varint(reader->file, &v[0]) < 0 || get_varint(reader->file, &v[1]) < 0 ||
+                v[1] > MAX_NAME)
+                break;
+            char* name = (char*) malloc(v[1] + 1);
+            assert(name);
+            if (fread(name, 1, v[1], reader->file) != v[1]) {
+                free(name);
+                break;
+            }
+            name[v[1]] = '\0';
+            int n = reader->num_names;
+            reader->ids = (uint64_t*) realloc(reader->ids, (n + 1) * sizeof(uint64_t));
+            reader->names = (char**) realloc(reader->names, (n + 1) * sizeof(char*));
+            assert(reader->ids && reader->names);
+            reader->ids[n] = v[0];
+            reader->names[n] = name;
+            reader->num_names++;
+            continue;
+        }
+        if (type != CAPTURE_CALL) break;
+
+        int err = 0;
+        for (int i = 0; i < 8 && !err; i++)
+            err = get_varint(reader->file, &v[i]);
+        if (err || v[6] < v[7] || v[6] > SIZE_MAX) break;
+        call->kind = (int) v[0];
+        call->conn_id = v[1];
+        call->function_id = v[2];
+        call->name = NULL;
+        for (int i = 0; i < reader->num_names; i++)
+            if (reader->ids[i] == v[2]) call->name = reader->names[i];
+        reader->now_ns += v[3];
+        call->offset_ns = reader->now_ns;
+        call->budget_us = v[4];
+        call->payload.data1 = (int) (int64_t) ((v[5] >> 1) ^ -(v[5] & 1));
+        call->payload.data2_len = (size_t) v[6];
+        call->recorded_len = (size_t) v[7];
+        call->payload.data2 = NULL;
+        if (v[6] > 0) {
+            call->payload.data2 = calloc(1, (size_t) v[6]);
+            assert(call->payload.data2);
+            if (fread(call->payload.data2, 1, v[7], reader->file) != v[7]) {
+                free(call->payload.data2);
+                break;
+            }
+        }
+        if (call->name == NULL) {
+            free(call->payload.data2);
+            break;
+        }
+        return 1;
+    }
+    print_error(TITLE, "malformed capture");
+    return ERROR;
+}
+
+
+/**
+ * Close a capture reader, and free the function names it read.
+ * @param reader the reader
+ */
+void capture_close(capture_reader_t* reader) {
+    if (reader == NULL) return;
+    fclose(reader->file);
+    for (int i = 0; i < reader->num_names; i++)
+        free(reader->names[i]);
+    free(reader->ids);
+    free(reader->names);
+    free(reader);
+}
@@ -0,0 +1,218 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : coalesce.c
+ * Purpose : Request coalescing (singleflight). The first of identical calls in flight at the same
+ *           time leads: it alone is sent to the server. The others follow: they wait for its
+ *           outcome, and each gets a copy of its response.
+ *
+ * Calls in flight are kept in a hash table, sharded like the response cache, keyed on the
+ * function id, data1 and data2. A flight points to its leader's payload rather than a copy of
+ * it, which is safe since the leader is inside its call until the flight is taken off the
+ * table. Once the leader ends the flight, it shares a single copy of its response, which each
+ * follower copies in turn; the flight is freed by whoever leaves it last.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "coalesce.h"
+#include "rpc_utils.h"
+
+
+/* call in flight */
+struct flight {
+    uint64_t key_hash;
+    uint64_t id;
+    rpc_data* key;          // the leader's payload
+    int done;
+    int refs;               // the leader until it ends the flight, and the followers
+    rpc_data* response;     // shared by the followers, set once done
+    int status;
+    pthread_cond_t done_cond;
+    flight_t* chain;
+};
+
+/* shard data structure */
+typedef struct coalesce_shard {
+    pthread_mutex_t lock;
+    flight_t* buckets[COALESCE_BUCKETS];
+} coalesce_shard_t;
+
+/* coalescer data structure */
+struct rpc_coalescer {
+    coalesce_shard_t shards[COALESCE_SHARDS];
+    atomic_ullong requests;     // calls that led, and were sent
+    atomic_ullong coalesced;    // calls that followed, and were not
+};
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Hash a call key, the shard picked from the high bits and the bucket from the low bits.
+ * @param id  the function's id
+ * @param key the call's payload
+ * @return    the key's hash
+ */
+static uint64_t flight_hash(uint64_t id, rpc_data* key) {
+    uint64_t h = hash_bytes(key->data2, key->data2_len);
+    h ^= id + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= (uint64_t) (unsigned int) key->data1 * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Check whether a flight is for the given call.
+ * @return 1 if it matches, 0 if not
+ */
+static int flight_match(flight_t* f, uint64_t h, uint64_t id, rpc_data* key) {
+    return f->key_hash == h && f->id == id && f->key->data1 == key->data1 &&
+           f->key->data2_len == key->data2_len &&
+           (key->data2_len == 0 || memcmp(f->key->data2, key->data2, key->data2_len) == 0);
+}
+
+/**
+ * Get the shard of a key's hash.
+ */
+static coalesce_shard_t* shard_of(coalescer_t* co, uint64_t h) {
+    return &co->shards[(h >> 58) % COALESCE_SHARDS];
+}
+
+/**
+ * Leave a flight, freeing it if it was left last. The shard's lock must be held.
+ */
+static void flight_leave(flight_t* f) {
+    if (--(f->refs) > 0) return;
+    rpc_data_free(f->response);
+    pthread_cond_destroy(&f->done_cond);
+    free(f);
+}
+
+
+/* ----------------------------- COALESCING FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize a coalescer, with no calls in flight.
+ * @return the coalescer
+ */
+coalescer_t* coalescer_init(void) {
+    coalescer_t* co = (coalescer_t*) calloc(1, sizeof(coalescer_t));
+    assert(co);
+    for (int i = 0; i < COALESCE_SHARDS; i++)
+        pthread_mutex_init(&co->shards[i].lock, NULL);
+    atomic_init(&co->requests, 0);
+    atomic_init(&co->coalesced, 0);
+    return co;
+}
+
+
+/**
+ * Begin a call. If an identical call is in flight, wait for it to end and take its outcome;
+ * otherwise the call leads a new flight, and the caller must end it with coalesce_end.
+ * @param co       the coalescer
+ * @param id       the function's id
+ * @param payload  the call's payload, which must stay as is until the flight ends
+ * @param response the returned response (a copy of its own) if another call's outcome is taken
+ * @param status   the returned status if another call's outcome is taken
+ * @return         the flight if the call leads it, and NULL if the outcome was taken
+ */
+flight_t* coalesce_begin(coalescer_t* co, uint64_t id, rpc_data* payload, rpc_data** response,
+                         int* status) {
+    uint64_t h = flight_hash(id, payload);
+    coalesce_shard_t* s = shard_of(co, h);
+    flight_t** bucket = &s->buckets[h % COALESCE_BUCKETS];
+
+    pthread_mutex_lock(&s->lock);
+    flight_t* f = *bucket;
+    while (f != NULL && !flight_match(f, h, id, payload)) f = f->chain;
+
+    // no identical call in flight, so this one leads
+    if (f == NULL) {
+        f = (flight_t*) calloc(1, sizeof(flight_t));
+        assert(f);
+        f->key_hash = h;
+        f->id = id;
+        f->key = payload;
+        f->refs = 1;
+        pthread_cond_init(&f->done_cond, NULL);
+        f->chain = *bucket;
+        *bucket = f;
+        pthread_mutex_unlock(&s->lock);
+        atomic_fetch_add_explicit(&co->requests, 1, memory_order_relaxed);
+        return f;
+    }
+
+    // follow the call in flight; its response does not change once done, so it is copied
+    // without the lock
+    (f->refs)++;
+    while (!f->done)
+        pthread_cond_wait(&f->done_cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    *response = rpc_data_copy(f->response);
+    *status = f->status;
+    pthread_mutex_lock(&s->lock);
+    flight_leave(f);
+    pthread_mutex_unlock(&s->lock);
+    atomic_fetch_add_explicit(&co->coalesced, 1, memory_order_relaxed);
+    return NULL;
+}
+
+
+/**
+ * End a flight, handing its outcome to the calls following it. An identical call beginning
+ * from now on leads a flight of its own.
+ * @param co       the coalescer
+ * @param flight   the flight, as returned by coalesce_begin
+ * @param response the response of the call, still the leader's own
+ * @param status   the status of the call
+ */
+void coalesce_end(coalescer_t* co, flight_t* flight, rpc_data* response, int status) {
+    coalesce_shard_t* s = shard_of(co, flight->key_hash);
+    flight_t** link = &s->buckets[flight->key_hash % COALESCE_BUCKETS];
+
+    pthread_mutex_lock(&s->lock);
+    while (*link != flight) link = &(*link)->chain;
+    *link = flight->chain;
+    flight->key = NULL;
+
+    // off the table, no more calls follow the flight, and those that do share one copy of the
+    // response, made without the lock
+    if (flight->refs > 1) {
+        pthread_mutex_unlock(&s->lock);
+        rpc_data* shared = rpc_data_copy(response);
+        pthread_mutex_lock(&s->lock);
+        flight->response = shared;
+        flight->status = status;
+        flight->done = 1;
+        pthread_cond_broadcast(&flight->done_cond);
+    }
+    flight_leave(flight);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/**
+ * Get the counters of a coalescer.
+ * @param co    the coalescer
+ * @param stats the returned counters
+ */
+void coalescer_get_stats(coalescer_t* co, rpc_coalesce_stats* stats) {
+    stats->requests = atomic_load(&co->requests);
+    stats->coalesced = atomic_load(&co->coalesced);
+}
+
+
+/**
+ * Free a coalescer, once no call is in flight.
+ * @param co the coalescer
+ */
+void coalescer_free(coalescer_t* co) {
+    if (co == NULL) return;
+    for (int i = 0; i < COALESCE_SHARDS; i++)
+        pthread_mutex_destroy(&co->shards[i].lock);
+    free(co);
+}
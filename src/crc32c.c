@@ -0,0 +1,258 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : crc32c.c
+ * Purpose : CRC32C (Castagnoli), with the CPU's CRC instructions where there are some (SSE4.2 on
+ *           x86-64, the CRC extension on ARMv8) and slicing-by-8 tables where there are none.
+ *
+ * The implementation is picked once, on first use, from what the CPU reports at run time. The
+ * hardware paths are compiled for their instructions by function attributes, so the library
+ * itself needs no special compiler flags and still runs on CPUs without them. CRC32C is linear,
+ * so the checksums of consecutive blocks combine by shifting the first over the second's length,
+ * which is a table lookup per byte of the checksum (see build_shift).
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CRC32C_POLY (uint32_t) 0x82F63B78     // reflected Castagnoli polynomial
+#define LONG_BLOCK  (size_t) 8192             // blocks checksummed side by side, powers of 2
+#define SHORT_BLOCK (size_t) 256
+
+
+static uint32_t table[8][256];
+static uint32_t shift_long[4][256];
+static uint32_t shift_short[4][256];
+static uint32_t (*implementation)(uint32_t, const unsigned char*, size_t) = NULL;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Slicing-by-8: 8 bytes per step, through 8 tables of 256 entries.
+ * @param crc  the running checksum, already inverted
+ * @param data the bytes
+ * @param len  number of bytes
+ * @return     the running checksum, still inverted
+ */
+static uint32_t crc_portable(uint32_t crc, const unsigned char* data, size_t len) {
+    while (len > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^
+              table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF] ^
+              table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+/**
+ * Multiply a vector by a matrix over GF(2), the matrix being 32 columns of 32 bits.
+ */
+static uint32_t gf2_times(const uint32_t* matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++)
+        if (vector & 1) sum ^= *matrix;
+    return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* matrix) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_times(matrix, matrix[n]);
+}
+
+/**
+ * Build the tables shifting a checksum over len zero bytes (len a power of 2), which is what
+ * combining the checksums of consecutive blocks comes down to.
+ */
+static void build_shift(uint32_t shift[4][256], size_t len) {
+    uint32_t even[32], odd[32];
+
+    // operator for 1 zero bit, then squared up to 4 bits, then to len bytes
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++)
+        odd[n] = (uint32_t) 1 << (n - 1);
+    gf2_square(even, odd);
+    gf2_square(odd, even);
+    uint32_t* op = even;
+    while (1) {
+        gf2_square(even, odd);
+        op = even;
+        if ((len >>= 1) == 0) break;
+        gf2_square(odd, even);
+        op = odd;
+        if ((len >>= 1) == 0) break;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int b = 0; b < 4; b++)
+            shift[b][n] = gf2_times(op, n << (8 * b));
+}
+
+static uint32_t shift_crc(uint32_t shift[4][256], uint32_t crc) {
+    return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^
+           shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#if defined(__x86_64__)
+#define HARDWARE_TARGET __attribute__((target("sse4.2")))
+#define CRC_U8(crc, byte)  _mm_crc32_u8(crc, byte)
+#define CRC_U64(crc, word) ((uint32_t) _mm_crc32_u64(crc, word))
+
+static int hardware_supported(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#else
+#define HARDWARE_TARGET __attribute__((target("+crc")))
+#define CRC_U8(crc, byte)  __crc32cb(crc, byte)
+#define CRC_U64(crc, word) __crc32cd(crc, word)
+
+static int hardware_supported(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+/**
+ * The CPU's CRC instruction, 8 bytes at a time. An instruction's result is only ready a few
+ * cycles later, so large buffers are split into 3 blocks checksummed side by side and then
+ * combined, which keeps the instruction busy every cycle.
+ * @param crc  the running checksum, already inverted
+ * @param data the bytes
+ * @param len  number of bytes
+ * @return     the running checksum, still inverted
+ */
+HARDWARE_TARGET
+static uint32_t crc_hardware(uint32_t crc, const unsigned char* data, size_t len) {
+    while (len > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = CRC_U8(crc, *data++);
+        len--;
+    }
+
+    // 3 blocks at a time, long ones then short ones
+    size_t block = LONG_BLOCK;
+    uint32_t (*shift)[256] = shift_long;
+    for (int pass = 0; pass < 2; pass++) {
+        while (len >= 3 * block) {
+            uint32_t crc1 = 0, crc2 = 0;
+            const unsigned char* end = data + block;
+            do {
+                uint64_t w0, w1, w2;
+                memcpy(&w0, data, 8);
+                memcpy(&w1, data + block, 8);
+                memcpy(&w2, data + 2 * block, 8);
+                crc = CRC_U64(crc, w0);
+                crc1 = CRC_U64(crc1, w1);
+                crc2 = CRC_U64(crc2, w2);
+                data += 8;
+            } while (data < end);
+            crc = shift_crc(shift, crc) ^ crc1;
+            crc = shift_crc(shift, crc) ^ crc2;
+            data += 2 * block;
+            len -= 3 * block;
+        }
+        block = SHORT_BLOCK;
+        shift = shift_short;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = CRC_U64(crc, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = CRC_U8(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+
+#else
+#define crc_hardware crc_portable
+
+static int hardware_supported(void) {
+    return 0;
+}
+#endif
+
+/**
+ * Build the slicing tables, and pick the implementation.
+ */
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+    build_shift(shift_long, LONG_BLOCK);
+    build_shift(shift_short, SHORT_BLOCK);
+    implementation = hardware_supported() ? crc_hardware : crc_portable;
+}
+
+
+/* ----------------------------- CHECKSUM FUNCTIONS ----------------------------- */
+
+/**
+ * Extend a CRC32C checksum over more bytes, with the fastest implementation the CPU has.
+ * @param crc  the checksum of the bytes before, 0 to start
+ * @param data the bytes
+ * @param len  number of bytes
+ * @return     the checksum of all bytes so far
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&init_once, crc_init);
+    return ~implementation(~crc, (const unsigned char*) data, len);
+}
+
+
+/**
+ * Extend a CRC32C checksum over more bytes with the portable implementation, whatever the CPU.
+ * @param crc  the checksum of the bytes before, 0 to start
+ * @param data the bytes
+ * @param len  number of bytes
+ * @return     the checksum of all bytes so far
+ */
+uint32_t crc32c_portable(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&init_once, crc_init);
+    return ~crc_portable(~crc, (const unsigned char*) data, len);
+}
+
+
+/**
+ * Check whether crc32c uses the CPU's CRC instructions.
+ * @return 1 if it does, 0 if not
+ */
+int crc32c_hardware(void) {
+    pthread_once(&init_once, crc_init);
+    return implementation != crc_portable;
+}
@@ -0,0 +1,510 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : executor.c
+ * Purpose : The handler executor, a pool of work-stealing worker threads which run handlers on
+ *           behalf of the connection threads.
+ *
+ * Every connection has a home worker, and its calls are pushed onto that worker's deque. A worker
+ * takes from its own deque first, and once that is empty, steals from the deques of the others,
+ * meaning the calls of a few busy connections still spread over all workers.
+ *
+ * Every function belongs to an executor class. Each worker has a deque per class, and each class
+ * has an optional cap on how many of its handlers run at once, and a priority. A worker looks for
+ * a task class by class, highest priority first, skipping classes that are at their cap. As such,
+ * a class of slow handlers capped at c can never hold more than c workers, and the other classes
+ * always keep the rest.
+ *
+ * Workers may be pinned to CPUs, spread over the NUMA nodes of the set (see affinity.c). A
+ * connection is then homed on a worker of its own thread's node, and a thief looks at the deques
+ * of its node before the others', so a call mostly runs where its buffers were allocated.
+ *
+ * The pool is opt-in. An executor whose classes, workers and CPUs were never set is not started,
+ * and its tasks run on their submitter: each connection's thread runs its own handlers, so a
+ * handler that blocks only holds its own connection, never a worker other connections wait on.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "executor.h"
+#include "affinity.h"
+#include "rpc_utils.h"
+
+
+/* deque data structure, the tasks of one class pushed to one worker */
+typedef struct deque {
+    pthread_mutex_t lock;
+    task_t* head;
+    task_t* tail;
+    atomic_int size;        // read without the lock, so thieves skip empty deques
+} deque_t;
+
+/* worker data structure */
+typedef struct worker {
+    int index;
+    int group;              // CPU group the worker is pinned to, -1 if not pinned
+    int node;               // NUMA node of its group, -1 if unknown or not pinned
+    executor_t* ex;
+    deque_t deques[RPC_MAX_CLASSES];
+} worker_t;
+
+/* executor class data structure */
+typedef struct executor_class {
+    int configured;
+    int max_concurrency;    // 0 for no cap other than the number of workers
+    int priority;           // higher runs first
+    atomic_int running;
+    atomic_int queued;
+    atomic_ullong completed;
+    atomic_ullong stolen;
+} class_t;
+
+/* executor data structure */
+struct executor {
+    pthread_mutex_t lock;           // guards configuration, and idle workers going to sleep
+    pthread_cond_t work_cond;
+    class_t classes[RPC_MAX_CLASSES];
+    int order[RPC_MAX_CLASSES];     // class ids, by priority
+    int num_workers;                // 0 until set or started
+    int wanted;                     // whether classes, workers or CPUs were set, to start the pool
+    int started;
+    worker_t* workers;
+    atomic_uint epoch;              // bumped whenever a worker may find new work
+    atomic_int sleeping;
+    atomic_uint next_home;
+    affinity_t affinity;            // CPUs of the workers
+};
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Sort the class ids by priority, highest first. Classes of equal priority keep id order.
+ * Must be called with the executor's lock held.
+ */
+static void sort_classes(executor_t* ex) {
+    for (int i = 0; i < RPC_MAX_CLASSES; i++) ex->order[i] = i;
+    for (int i = 1; i < RPC_MAX_CLASSES; i++) {
+        int id = ex->order[i];
+        int j = i - 1;
+        while (j >= 0 && ex->classes[ex->order[j]].priority < ex->classes[id].priority) {
+            ex->order[j + 1] = ex->order[j];
+            j--;
+        }
+        ex->order[j + 1] = id;
+    }
+}
+
+/**
+ * Push a task to the back of a deque.
+ */
+static void deque_push(deque_t* dq, task_t* task) {
+    task->next = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail) dq->tail->next = task;
+    else dq->head = task;
+    dq->tail = task;
+    atomic_fetch_add(&dq->size, 1);
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/**
+ * Pop the oldest task of a deque. Both the owner and thieves take the oldest task: calls are
+ * independent of one another, so there is no locality to gain from the owner taking the newest,
+ * and taking the oldest keeps waiting times fair.
+ * @return the task, or NULL if the deque is empty
+ */
+static task_t* deque_pop(deque_t* dq) {
+    if (atomic_load(&dq->size) == 0) return NULL;
+    pthread_mutex_lock(&dq->lock);
+    task_t* task = dq->head;
+    if (task) {
+        dq->head = task->next;
+        if (dq->head == NULL) dq->tail = NULL;
+        atomic_fetch_sub(&dq->size, 1);
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/**
+ * Reserve a slot to run a task of a class, unless the class is at its cap.
+ * @return 1 if reserved, 0 if not
+ */
+static int reserve_slot(class_t* c) {
+    if (c->max_concurrency == 0) {
+        atomic_fetch_add(&c->running, 1);
+        return 1;
+    }
+    int running = atomic_load(&c->running);
+    while (running < c->max_concurrency) {
+        if (atomic_compare_exchange_weak(&c->running, &running, running + 1))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Let idle workers know there may be new work, waking one of them if any is asleep.
+ */
+static void wake_worker(executor_t* ex) {
+    atomic_fetch_add(&ex->epoch, 1);
+    if (atomic_load(&ex->sleeping) > 0) {
+        pthread_mutex_lock(&ex->lock);
+        pthread_cond_signal(&ex->work_cond);
+        pthread_mutex_unlock(&ex->lock);
+    }
+}
+
+/**
+ * Take the next task for a worker to run: from its own deque, or else stolen from another's.
+ * @param self     the worker
+ * @param class_id the returned class of the task
+ * @return         the task, or NULL if there is none to run
+ */
+static task_t* take_task(worker_t* self, int* class_id) {
+    executor_t* ex = self->ex;
+    for (int i = 0; i < RPC_MAX_CLASSES; i++) {
+        int id = ex->order[i];
+        class_t* c = &ex->classes[id];
+        if (atomic_load(&c->queued) == 0) continue;
+        if (!reserve_slot(c)) continue;
+
+        // thieves look on their own node first, then on the others
+        task_t* task = deque_pop(&self->deques[id]);
+        for (int pass = 0; task == NULL && pass < 2; pass++) {
+            for (int k = 1; task == NULL && k < ex->num_workers; k++) {
+                worker_t* victim = &ex->workers[(self->index + k) % ex->num_workers];
+                if ((victim->node == self->node) != (pass == 0)) continue;
+                task = deque_pop(&victim->deques[id]);
+                if (task) atomic_fetch_add(&c->stolen, 1);
+            }
+        }
+        if (task) {
+            atomic_fetch_sub(&c->queued, 1);
+            *class_id = id;
+            return task;
+        }
+        atomic_fetch_sub(&c->running, 1);
+    }
+    return NULL;
+}
+
+/**
+ * The worker, which is what each executor thread runs forever.
+ * @param worker_obj the worker
+ * @return           null pointer with no indication
+ */
+static void* worker_loop(void* worker_obj) {
+    worker_t* self = (worker_t*) worker_obj;
+    executor_t* ex = self->ex;
+    affinity_apply(&ex->affinity, self->group);
+    while (1) {
+        unsigned int epoch = atomic_load(&ex->epoch);
+        int class_id;
+        task_t* task = take_task(self, &class_id);
+
+        // nothing to run, so sleep unless work turned up since we started looking
+        if (task == NULL) {
+            pthread_mutex_lock(&ex->lock);
+            atomic_fetch_add(&ex->sleeping, 1);
+            if (atomic_load(&ex->epoch) == epoch)
+                pthread_cond_wait(&ex->work_cond, &ex->lock);
+            atomic_fetch_sub(&ex->sleeping, 1);
+            pthread_mutex_unlock(&ex->lock);
+            continue;
+        }
+
+        void* result = task->run(task->arg);
+        class_t* c = &ex->classes[class_id];
+        atomic_fetch_sub(&c->running, 1);
+        atomic_fetch_add(&c->completed, 1);
+
+        // the task belongs to its submitter, which may free it as soon as it is done
+        pthread_mutex_lock(&task->lock);
+        task->result = result;
+        task->done = 1;
+        pthread_cond_signal(&task->done_cond);
+        pthread_mutex_unlock(&task->lock);
+
+        // the freed slot may let a capped class run again
+        if (c->max_concurrency > 0 && atomic_load(&c->queued) > 0)
+            wake_worker(ex);
+    }
+    return NULL;
+}
+
+
+/* ----------------------------- EXECUTOR FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize an executor. It has no worker threads until it is started.
+ * @return the initialized executor
+ */
+executor_t* executor_init(void) {
+    executor_t* ex = (executor_t*) malloc(sizeof(executor_t));
+    assert(ex);
+    memset(ex, 0, sizeof(executor_t));
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->work_cond, NULL);
+    for (int i = 0; i < RPC_MAX_CLASSES; i++) {
+        class_t* c = &ex->classes[i];
+        atomic_init(&c->running, 0);
+        atomic_init(&c->queued, 0);
+        atomic_init(&c->completed, 0);
+        atomic_init(&c->stolen, 0);
+    }
+    atomic_init(&ex->epoch, 0);
+    atomic_init(&ex->sleeping, 0);
+    atomic_init(&ex->next_home, 0);
+    sort_classes(ex);
+    return ex;
+}
+
+
+/**
+ * Configure an executor class, before the executor is started: workers read the classes' order
+ * and caps without the lock.
+ * @param ex              the executor
+ * @param class_id        the class, from 0 to RPC_MAX_CLASSES - 1
+ * @param max_concurrency maximum handlers of the class running at once, 0 for no cap
+ * @param priority        the class's priority, higher runs first
+ * @return                0 if successful, and ERROR if otherwise
+ */
+int executor_set_class(executor_t* ex, int class_id, int max_concurrency, int priority) {
+    if (class_id < 0 || class_id >= RPC_MAX_CLASSES || max_concurrency < 0)
+        return ERROR;
+    pthread_mutex_lock(&ex->lock);
+    int err = ex->started ? ERROR : 0;
+    if (!err) {
+        class_t* c = &ex->classes[class_id];
+        c->configured = 1;
+        c->max_concurrency = max_concurrency;
+        c->priority = priority;
+        ex->wanted = 1;
+        sort_classes(ex);
+    }
+    pthread_mutex_unlock(&ex->lock);
+    return err;
+}
+
+
+/**
+ * Set the number of worker threads, before the executor is started.
+ * @param ex          the executor
+ * @param num_workers the number of workers
+ * @return            0 if successful, and ERROR if otherwise
+ */
+int executor_set_workers(executor_t* ex, int num_workers) {
+    if (num_workers <= 0 || num_workers > MAX_WORKERS) return ERROR;
+    pthread_mutex_lock(&ex->lock);
+    int err = ex->started ? ERROR : 0;
+    if (!err) {
+        ex->num_workers = num_workers;
+        ex->wanted = 1;
+    }
+    pthread_mutex_unlock(&ex->lock);
+    return err;
+}
+
+
+/**
+ * Set the CPUs the worker threads are pinned to, before the executor is started.
+ * @param ex   the executor
+ * @param cpus the CPUs, as a cpulist such as "0-7,16-23", or NULL not to pin the workers
+ * @return     0 if successful, and ERROR if otherwise
+ */
+int executor_set_affinity(executor_t* ex, const char* cpus) {
+    pthread_mutex_lock(&ex->lock);
+    int err = ex->started ? ERROR : affinity_set(&ex->affinity, cpus);
+    if (!err && cpus != NULL) ex->wanted = 1;
+    pthread_mutex_unlock(&ex->lock);
+    return err;
+}
+
+
+/**
+ * Start the worker threads, if the executor was configured. Unless set, there is one worker per
+ * CPU, and always at least one more than the capped classes can hold at once, so an uncapped
+ * class is never starved. An executor that was not configured is left unstarted, running tasks
+ * on their submitter.
+ * @param ex the executor
+ * @return   0 if successful, and ERROR if otherwise
+ */
+int executor_start(executor_t* ex) {
+    char* TITLE = "executor_start";
+    pthread_mutex_lock(&ex->lock);
+    if (ex->started || !ex->wanted) {
+        pthread_mutex_unlock(&ex->lock);
+        return 0;
+    }
+    int num_workers = ex->num_workers;
+    if (num_workers == 0) {
+        num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        int capped = 1;
+        for (int i = 0; i < RPC_MAX_CLASSES; i++)
+            capped += ex->classes[i].max_concurrency;
+        if (num_workers < capped) num_workers = capped;
+        if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+    }
+
+    // all deques exist before any worker may steal from them
+    ex->workers = (worker_t*) calloc(num_workers, sizeof(worker_t));
+    assert(ex->workers);
+    for (int i = 0; i < num_workers; i++) {
+        ex->workers[i].index = i;
+        ex->workers[i].group = affinity_next(&ex->affinity);
+        ex->workers[i].node = affinity_node(&ex->affinity, ex->workers[i].group);
+        ex->workers[i].ex = ex;
+        for (int j = 0; j < RPC_MAX_CLASSES; j++) {
+            pthread_mutex_init(&ex->workers[i].deques[j].lock, NULL);
+            atomic_init(&ex->workers[i].deques[j].size, 0);
+        }
+    }
+    ex->num_workers = num_workers;
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, worker_loop, &ex->workers[i]);
+        err += pthread_detach(thread);
+        if (err) {
+            print_error(TITLE, "cannot create/detach worker thread");
+            ex->num_workers = i;
+            break;
+        }
+    }
+    ex->started = ex->num_workers > 0;
+    pthread_mutex_unlock(&ex->lock);
+    return ex->started ? 0 : ERROR;
+}
+
+
+/**
+ * Pick the home worker of a new connection, round robin.
+ * @param ex the executor
+ * @return   the home worker's index, to be passed to executor_run
+ */
+int executor_home(executor_t* ex) {
+    return (int) (atomic_fetch_add(&ex->next_home, 1) % MAX_WORKERS);
+}
+
+
+/**
+ * Pick the home worker of a new connection among the workers of a NUMA node, round robin. If
+ * none of the workers is on the node, or the node is unknown, any worker may be picked.
+ * @param ex   the executor
+ * @param node the node of the connection's thread, -1 if unknown
+ * @return     the home worker's index, to be passed to executor_run
+ */
+int executor_home_near(executor_t* ex, int node) {
+    int home = executor_home(ex);
+    if (node < 0 || !ex->started) return home;
+    for (int k = 0; k < ex->num_workers; k++) {
+        int index = (home + k) % ex->num_workers;
+        if (ex->workers[index].node == node) return index;
+    }
+    return home;
+}
+
+
+/**
+ * Check whether an executor's workers are running, and so whether tasks run on them rather than
+ * on their submitter.
+ * @param ex the executor
+ * @return   1 if started, 0 if not
+ */
+int executor_started(executor_t* ex) {
+    return ex->started;
+}
+
+
+/**
+ * Submit a task to run on a worker, without waiting for it. The task is pushed onto its home
+ * worker's deque, from which any idle worker may steal it. A class that was never configured
+ * behaves as an uncapped class of priority 0. If the executor was never started, the task runs
+ * right here, before this returns.
+ * @param ex       the executor
+ * @param class_id the class, from 0 to RPC_MAX_CLASSES - 1
+ * @param home     the home worker, from executor_home
+ * @param task     the task, which must stay valid until executor_wait returns
+ * @param run      the task's function
+ * @param arg      the task function's argument
+ */
+void executor_submit(executor_t* ex, int class_id, int home, task_t* task,
+                     void* (*run)(void*), void* arg) {
+    assert(class_id >= 0 && class_id < RPC_MAX_CLASSES);
+    task->run = run;
+    task->arg = arg;
+    task->result = NULL;
+    task->done = 0;
+    task->next = NULL;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->done_cond, NULL);
+    if (!ex->started) {
+        task->result = run(arg);
+        task->done = 1;
+        return;
+    }
+
+    worker_t* w = &ex->workers[home % ex->num_workers];
+    atomic_fetch_add(&ex->classes[class_id].queued, 1);
+    deque_push(&w->deques[class_id], task);
+    wake_worker(ex);
+}
+
+
+/**
+ * Wait for a submitted task to be run.
+ * @param task the task
+ * @return     the task function's result
+ */
+void* executor_wait(task_t* task) {
+    pthread_mutex_lock(&task->lock);
+    while (!task->done)
+        pthread_cond_wait(&task->done_cond, &task->lock);
+    pthread_mutex_unlock(&task->lock);
+
+    pthread_cond_destroy(&task->done_cond);
+    pthread_mutex_destroy(&task->lock);
+    return task->result;
+}
+
+
+/**
+ * Run a task on a worker, and wait for its result.
+ * @param ex       the executor
+ * @param class_id the class, from 0 to RPC_MAX_CLASSES - 1
+ * @param home     the home worker, from executor_home
+ * @param run      the task's function
+ * @param arg      the task function's argument
+ * @return         the task function's result
+ */
+void* executor_run(executor_t* ex, int class_id, int home, void* (*run)(void*), void* arg) {
+    if (!ex->started) return run(arg);
+    task_t task;
+    executor_submit(ex, class_id, home, &task, run, arg);
+    return executor_wait(&task);
+}
+
+
+/**
+ * Get the queue depth and counters of an executor class.
+ * @param ex       the executor
+ * @param class_id the class
+ * @param stats    the returned counters
+ * @return         0 if successful, and ERROR if otherwise
+ */
+int executor_class_stats(executor_t* ex, int class_id, rpc_class_stats* stats) {
+    if (class_id < 0 || class_id >= RPC_MAX_CLASSES) return ERROR;
+    class_t* c = &ex->classes[class_id];
+    stats->queued = atomic_load(&c->queued);
+    stats->running = atomic_load(&c->running);
+    stats->max_concurrency = c->max_concurrency;
+    stats->priority = c->priority;
+    stats->completed = atomic_load(&c->completed);
+    stats->stolen = atomic_load(&c->stolen);
+    return 0;
+}
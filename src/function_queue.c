@@ -56,7 +56,14 @@ function_t* function_init(char* f_name, rpc_handler f_handler) {
     assert(f);
     uint64_t id = hash((unsigned char*) f_name);
     f->id = id;
+    f->name = strdup(f_name);
+    assert(f->name);
+    f->slot = ERROR;
     f->f_handler = f_handler;
+    f->f_stream = NULL;
+    f->flags = 0;
+    f->cache = NULL;
+    f->executor_class = 0;
     return f;
 }
 
@@ -103,6 +110,7 @@ int function_enqueue(queue_f* q, function_t* f) {
             return 1;
         curr = curr->next;
     }
+    f->slot = q->size;
     q->last->function = f;
     q->last->next = function_qnode_init();
     q->last = q->last->next;
@@ -142,14 +150,41 @@ function_t* function_search(queue_f* functions, uint64_t id) {
     qnode_f *curr = functions->node;
     for (int i=0; i < functions->size; i++) {
         if (id == curr->function->id)
-            break;
+            return curr->function;
         curr = curr->next;
     }
-    if (curr == NULL) return NULL;
+    return NULL;
+}
+
+
+/**
+ * Search for the function registered in the specified slot.
+ * @param functions function queue
+ * @param slot      the slot, which is the function's registration order
+ * @return          NULL if there is no such slot,
+ *                  or the function structure if found
+ */
+function_t* function_search_slot(queue_f* functions, int slot) {
+    if (slot < 0 || slot >= functions->size) return NULL;
+    qnode_f *curr = functions->node;
+    for (int i=0; i < slot; i++)
+        curr = curr->next;
     return curr->function;
 }
 
 
+/**
+ * Free memory of given function, which is not in a queue.
+ * @param f the function
+ */
+void function_free(function_t* f) {
+    if (f == NULL) return;
+    cache_free(f->cache);
+    free(f->name);
+    free(f);
+}
+
+
 /**
  * Free memory of given queue.
  * @param q  the queue
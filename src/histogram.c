@@ -0,0 +1,119 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : histogram.c
+ * Purpose : The latency histogram, a log-linear (HDR-style) histogram of nanosecond values.
+ *
+ * Values below 2 * HIST_SUB have a bucket each. Above that, every power of 2 is split into
+ * HIST_SUB equal buckets, so a bucket is never wider than 1 / HIST_SUB of its values, whatever
+ * their magnitude. Recording is a count of leading zeros, a shift and a few relaxed increments.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+#define RELAXED memory_order_relaxed
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Get the bucket of a value.
+ */
+static inline int bucket_of(uint64_t value) {
+    if (value < 2 * HIST_SUB) return (int) value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return HIST_SUB + shift * HIST_SUB + (int) (value >> shift) - HIST_SUB;
+}
+
+/**
+ * Get the middle value of a bucket, which is within half a bucket of every value in it.
+ */
+static uint64_t bucket_value(int bucket) {
+    if (bucket < 2 * HIST_SUB) return (uint64_t) bucket;
+    int shift = bucket / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (bucket % HIST_SUB + HIST_SUB) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+
+/* ----------------------------- HISTOGRAM FUNCTIONS ----------------------------- */
+
+/**
+ * Reset a histogram to empty. Also initializes a histogram.
+ * @param h the histogram
+ */
+void hist_reset(histogram_t* h) {
+    memset(h, 0, sizeof(histogram_t));
+}
+
+
+/**
+ * Record a value. Only one thread may record into a histogram.
+ * @param h     the histogram
+ * @param value the value, in nanoseconds
+ */
+void hist_record(histogram_t* h, uint64_t value) {
+    counter_add(&h->counts[bucket_of(value)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum, value);
+    if (value > atomic_load_explicit(&h->max, RELAXED))
+        atomic_store_explicit(&h->max, value, RELAXED);
+}
+
+
+/**
+ * Add the values of a histogram to another. The histogram added to must not be recorded into
+ * concurrently.
+ * @param into the histogram added to
+ * @param from the histogram added
+ */
+void hist_merge(histogram_t* into, histogram_t* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&from->counts[i], RELAXED);
+        if (n) counter_add(&into->counts[i], n);
+    }
+    counter_add(&into->count, atomic_load_explicit(&from->count, RELAXED));
+    counter_add(&into->sum, atomic_load_explicit(&from->sum, RELAXED));
+    uint64_t max = atomic_load_explicit(&from->max, RELAXED);
+    if (max > atomic_load_explicit(&into->max, RELAXED))
+        atomic_store_explicit(&into->max, max, RELAXED);
+}
+
+
+/**
+ * Get the value at a percentile.
+ * @param h          the histogram
+ * @param percentile the percentile, from 0 to 100
+ * @return           the value at the percentile, or 0 if the histogram is empty
+ */
+uint64_t hist_percentile(histogram_t* h, double percentile) {
+    uint64_t count = atomic_load_explicit(&h->count, RELAXED);
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t max = atomic_load_explicit(&h->max, RELAXED);
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->counts[i], RELAXED);
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+
+/**
+ * Get the mean of the recorded values.
+ * @param h the histogram
+ * @return  the mean, or 0 if the histogram is empty
+ */
+uint64_t hist_mean(histogram_t* h) {
+    uint64_t count = atomic_load_explicit(&h->count, RELAXED);
+    return count ? atomic_load_explicit(&h->sum, RELAXED) / count : 0;
+}
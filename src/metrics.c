@@ -0,0 +1,186 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : metrics.c
+ * Purpose : The server's per-function call metrics: call, error and byte counters, and
+ *           histograms of queue wait and handler time.
+ *
+ * Every connection thread records into its own metrics block, so recording takes no lock and no
+ * read-modify-write, only relaxed loads and stores that the thread alone writes. A reader sums the
+ * blocks up under the metrics lock. When a connection closes, its block is folded into the
+ * retired totals, so nothing recorded is lost.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+
+/* metrics of one function */
+typedef struct function_metrics {
+    atomic_ullong calls;
+    atomic_ullong errors;
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+    histogram_t queue_wait;
+    histogram_t handler_time;
+} function_metrics_t;
+
+/* metrics block data structure, functions indexed by their slot and allocated on first call */
+struct metrics_block {
+    _Atomic(function_metrics_t*) functions[MAX_METRIC_FUNCTIONS];
+    metrics_block_t* prev;
+    metrics_block_t* next;
+};
+
+/* metrics data structure */
+struct metrics {
+    pthread_mutex_t lock;
+    metrics_block_t* blocks;        // blocks of the open connections
+    metrics_block_t retired;        // totals of the closed connections
+};
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Add a function's metrics to another's. The metrics added to must not be recorded into.
+ */
+static void function_metrics_merge(function_metrics_t* into, function_metrics_t* from) {
+    counter_add(&into->calls, atomic_load_explicit(&from->calls, memory_order_relaxed));
+    counter_add(&into->errors, atomic_load_explicit(&from->errors, memory_order_relaxed));
+    counter_add(&into->bytes_in, atomic_load_explicit(&from->bytes_in, memory_order_relaxed));
+    counter_add(&into->bytes_out, atomic_load_explicit(&from->bytes_out, memory_order_relaxed));
+    hist_merge(&into->queue_wait, &from->queue_wait);
+    hist_merge(&into->handler_time, &from->handler_time);
+}
+
+/**
+ * Summarize a histogram.
+ */
+static void latency_summary(histogram_t* h, rpc_latency_stats* stats) {
+    stats->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    stats->mean = hist_mean(h);
+    stats->p50 = hist_percentile(h, 50.0);
+    stats->p90 = hist_percentile(h, 90.0);
+    stats->p99 = hist_percentile(h, 99.0);
+    stats->p999 = hist_percentile(h, 99.9);
+    stats->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+
+/* ----------------------------- METRICS FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize the metrics of a server.
+ * @return the initialized metrics
+ */
+metrics_t* metrics_init(void) {
+    metrics_t* metrics = (metrics_t*) calloc(1, sizeof(metrics_t));
+    assert(metrics);
+    pthread_mutex_init(&metrics->lock, NULL);
+    return metrics;
+}
+
+
+/**
+ * Attach a new metrics block, for a connection thread to record into.
+ * @param metrics the metrics
+ * @return        the block
+ */
+metrics_block_t* metrics_attach(metrics_t* metrics) {
+    metrics_block_t* block = (metrics_block_t*) calloc(1, sizeof(metrics_block_t));
+    assert(block);
+    pthread_mutex_lock(&metrics->lock);
+    block->next = metrics->blocks;
+    if (metrics->blocks) metrics->blocks->prev = block;
+    metrics->blocks = block;
+    pthread_mutex_unlock(&metrics->lock);
+    return block;
+}
+
+
+/**
+ * Detach a metrics block, folding what it recorded into the retired totals, and free it.
+ * @param metrics the metrics
+ * @param block   the block
+ */
+void metrics_detach(metrics_t* metrics, metrics_block_t* block) {
+    pthread_mutex_lock(&metrics->lock);
+    if (block->prev) block->prev->next = block->next;
+    else metrics->blocks = block->next;
+    if (block->next) block->next->prev = block->prev;
+
+    for (int i = 0; i < MAX_METRIC_FUNCTIONS; i++) {
+        function_metrics_t* fm = atomic_load(&block->functions[i]);
+        if (fm == NULL) continue;
+        function_metrics_t* total = atomic_load(&metrics->retired.functions[i]);
+        if (total == NULL) {
+            total = (function_metrics_t*) calloc(1, sizeof(function_metrics_t));
+            assert(total);
+            atomic_store(&metrics->retired.functions[i], total);
+        }
+        function_metrics_merge(total, fm);
+        free(fm);
+    }
+    pthread_mutex_unlock(&metrics->lock);
+    free(block);
+}
+
+
+/**
+ * Record a served call. Only the block's own connection thread may record into it.
+ * @param block  the block
+ * @param slot   the called function's metrics slot
+ * @param sample the call
+ */
+void metrics_record(metrics_block_t* block, int slot, call_sample_t* sample) {
+    if (slot < 0 || slot >= MAX_METRIC_FUNCTIONS) return;
+    function_metrics_t* fm = atomic_load_explicit(&block->functions[slot], memory_order_relaxed);
+    if (fm == NULL) {
+        fm = (function_metrics_t*) calloc(1, sizeof(function_metrics_t));
+        assert(fm);
+        atomic_store_explicit(&block->functions[slot], fm, memory_order_release);
+    }
+    counter_add(&fm->calls, 1);
+    counter_add(&fm->errors, sample->error != 0);
+    counter_add(&fm->bytes_in, sample->bytes_in);
+    counter_add(&fm->bytes_out, sample->bytes_out);
+    if (sample->ran) {
+        hist_record(&fm->queue_wait, sample->queue_wait_ns);
+        hist_record(&fm->handler_time, sample->handler_ns);
+    }
+}
+
+
+/**
+ * Read the metrics of a function, summed over all connections, open and closed.
+ * @param metrics the metrics
+ * @param slot    the function's metrics slot
+ * @param stats   the returned counters and latencies
+ */
+void metrics_read(metrics_t* metrics, int slot, rpc_function_stats* stats) {
+    memset(stats, 0, sizeof(rpc_function_stats));
+    if (slot < 0 || slot >= MAX_METRIC_FUNCTIONS) return;
+    function_metrics_t* sum = (function_metrics_t*) calloc(1, sizeof(function_metrics_t));
+    assert(sum);
+
+    pthread_mutex_lock(&metrics->lock);
+    function_metrics_t* fm = atomic_load(&metrics->retired.functions[slot]);
+    if (fm) function_metrics_merge(sum, fm);
+    for (metrics_block_t* block = metrics->blocks; block != NULL; block = block->next) {
+        fm = atomic_load_explicit(&block->functions[slot], memory_order_acquire);
+        if (fm) function_metrics_merge(sum, fm);
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    stats->calls = atomic_load(&sum->calls);
+    stats->errors = atomic_load(&sum->errors);
+    stats->bytes_in = atomic_load(&sum->bytes_in);
+    stats->bytes_out = atomic_load(&sum->bytes_out);
+    latency_summary(&sum->queue_wait, &stats->queue_wait);
+    latency_summary(&sum->handler_time, &stats->handler_time);
+    free(sum);
+}
@@ -6,6 +6,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -44,7 +45,31 @@ rpc_server* rpc_init_server(int port) {
     assert(server);
     server->listen_fd = listen_fd;
     server->functions = function_queue_init();
+    server->executor = executor_init();
+    affinity_set(&server->io_affinity, NULL);
+    server->metrics = metrics_init();
+    server->max_inflight = 0;
+    atomic_init(&server->inflight, 0);
+    atomic_init(&server->shed, 0);
+    server->max_payload = MAX_PAYLOAD_LEN;
+    server->poll_fd = ERROR;
+    atomic_init(&server->stopping, 0);
+    pthread_mutex_init(&server->conns_lock, NULL);
+    pthread_cond_init(&server->conns_drained, NULL);
+    server->conns = NULL;
+    server->num_conns = 0;
+    atomic_init(&server->num_accepted, 0);
+    capture_init(&server->capture);
+    wheel_init(&server->timers, conn_expire, server);
+    server->idle_timeout_ms = IDLE_TIMEOUT_MS;
+    server->request_timeout_ms = REQUEST_TIMEOUT_MS;
+    atomic_init(&server->timed_out, 0);
+    server->timer_fd = ERROR;
+    server->timer_fd_ns = 0;
     assert(server->listen_fd && server->functions);
+
+    // built-in functions
+    rpc_register(server, STATS_FUNCTION, rpc_serve_stats);
     return server;
 }
 
@@ -80,11 +105,19 @@ int rpc_register(rpc_server *server, char *name, rpc_handler handler) {
  * function as requested.
  * NOTE: There are 2 available methods for using serve all, 1 is thread pool, and the other
  * is simple multi-threaded architecture that takes in as many clients as needed.
+ * Once the server is shut down (see rpc_shutdown_server), the calling thread exits.
  * @param server the server RPC
  */
 _Noreturn void rpc_serve_all(rpc_server* server) {
     char* TITLE = "rpc-server: rpc_serve_all";
     int err;
+
+    // handlers run on the executor's workers if classes or workers were set, and on their
+    // connection's thread if not; the timer thread closes connections idle or stalled
+    err = executor_start(server->executor);
+    if (err) print_error(TITLE, "cannot start executor workers");
+    err = wheel_start(&server->timers);
+    if (err) print_error(TITLE, "cannot start timer thread, connections are not timed out");
     while (1) {
         // accept connection and update connection socket for server RPC
         struct sockaddr_storage client_addr;
@@ -92,6 +125,7 @@ _Noreturn void rpc_serve_all(rpc_server* server) {
         int accept_fd = accept(server->listen_fd,
                                (struct sockaddr *) &client_addr, &client_addr_size);
         if (accept_fd < 0) {
+            if (atomic_load(&server->stopping)) pthread_exit(NULL);
             print_error(TITLE, "connect socket cannot accept connections");
             continue;
         }
@@ -126,13 +160,24 @@ rpc_client* rpc_init_client(char *addr, int port) {
     rpc_client* client = (rpc_client*) malloc(sizeof(rpc_client));
     assert(client);
     client->conn_fd = conn_fd;
-    assert(client->conn_fd);
+    client->addr = strdup(addr);
+    client->port = port;
+    client->status = 0;
+    client->cache = NULL;
+    client->coalescer = NULL;
+    client->want_checksum = 0;
+    client->checksum = 0;
+    client->want_host_order = 0;
+    client->host_order = 0;
+    client->stream = NULL;
+    assert(client->conn_fd && client->addr);
     return client;
 }
 
 
 /**
- * Find a function from a specific name to get the requirements to make the call.
+ * Find a function from a specific name to get the requirements to make the call. The outcome is
+ * kept as the client's status, DECLINED if the server has no such function.
  * @param client the client RPC
  * @param name   the function's name
  * @return       the requirements to make the call (or the RPC handle), or NULL on error
@@ -140,6 +185,14 @@ rpc_client* rpc_init_client(char *addr, int port) {
 rpc_handle* rpc_find(rpc_client *client, char *name) {
     char* TITLE = "client: rpc_find";
     int err;
+    client->status = ERROR;
+
+    // a connection dropped by an expired call is re-established first
+    err = client_reconnect(client);
+    if (err) {
+        print_error(TITLE, "cannot reconnect to server");
+        return NULL;
+    }
 
     // send the flag to confirm client is calling find
     int request = FIND_SERVICE;
@@ -168,6 +221,7 @@ rpc_handle* rpc_find(rpc_client *client, char *name) {
     // check if the function exists or not
     if (flag == ERROR) {
         print_error(TITLE, "no function with name %s exists on server");
+        client->status = DECLINED;
         return NULL;
     }
 
@@ -182,6 +236,7 @@ rpc_handle* rpc_find(rpc_client *client, char *name) {
     // get the function handle
     rpc_handle* handle = (rpc_handle*) malloc(sizeof(rpc_handle));
     handle->function_id = id;
+    client->status = 0;
     return handle;
 }
 
@@ -195,46 +250,7 @@ rpc_handle* rpc_find(rpc_client *client, char *name) {
  * @return        the response data if successful, or NULL if otherwise
  */
 rpc_data* rpc_call(rpc_client *client, rpc_handle* handle, rpc_data* payload) {
-    char* TITLE = "rpc-client: rpc_call";
-    int err;
-
-    // send the flag to confirm client is calling call
-    int request = CALL_SERVICE;
-    err = rpc_send_int(client->conn_fd, request);
-    if (err) {
-        print_error(TITLE, "cannot send call service flag to server");
-        return NULL;
-    }
-
-    // send function's id for verification
-    err = rpc_send_uint(client->conn_fd, handle->function_id);
-    if (err) {
-        print_error(TITLE, "cannot send handle to server for verification");
-        return NULL;
-    }
-
-    // receive the verification flag, if negative then failure
-    int flag = ERROR;
-    err = rpc_receive_int(client->conn_fd, &flag);
-    if (err) {
-        print_error(TITLE, "cannot receive verification flag from server");
-        return NULL;
-    }
-    if (flag < 0) {
-        print_error(TITLE, "id verification failed");
-        return NULL;
-    }
-
-    // send payload to server
-    err = rpc_send_payload(client->conn_fd, payload);
-    if (err) {
-        print_error(TITLE, "cannot send payload to server");
-        return NULL;
-    }
-
-    // receive payload from server
-    rpc_data* response = rpc_receive_payload(client->conn_fd);
-    return response;
+    return client_call(client, handle, payload, 0);
 }
 
 
@@ -243,7 +259,9 @@ rpc_data* rpc_call(rpc_client *client, rpc_handle* handle, rpc_data* payload) {
  * @param client the client RPC
  */
 void rpc_close_client(rpc_client *client) {
-    close(client->conn_fd);
+    if (client->conn_fd >= 0)
+        close(client->conn_fd);
+    free(client->addr);
     free(client);
 }
 
@@ -0,0 +1,343 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : rpc_array.c
+ * Purpose : Typed array payloads, and the byte swapping kernels converting their elements
+ *           between the host's byte order and the network's.
+ *
+ * A typed array's data2 is an 8-byte header, tagging the element type and the order the elements
+ * are in, then the elements back to back. The sender puts them in network (big endian) order, or
+ * leaves them in its own if the connection negotiated that both ends share it; the receiver
+ * converts them in place only if the tag is not its own order, so an array between two hosts of
+ * the same order is never swapped at all, and one between hosts of different orders once.
+ *
+ * Swapping is a byte shuffle within each element, so it runs 16 or 32 bytes at a time with the
+ * CPU's shuffle instructions (SSSE3 or AVX2 on x86-64, NEON on ARMv8), picked once at run time
+ * like the CRC32C instructions (see crc32c.c), and one element at a time where there are none.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "rpc_array.h"
+#include "rpc_ext.h"
+#include "rpc_utils.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+static void (*implementation)(unsigned char*, const unsigned char*, size_t, size_t) = NULL;
+static const char* implementation_name = "portable";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* bytes of an element of each type, 0 for an unknown type */
+static const size_t elem_sizes[] = {
+    [RPC_ARRAY_INT8]  = 1, [RPC_ARRAY_UINT8]  = 1,
+    [RPC_ARRAY_INT16] = 2, [RPC_ARRAY_UINT16] = 2,
+    [RPC_ARRAY_INT32] = 4, [RPC_ARRAY_UINT32] = 4,
+    [RPC_ARRAY_INT64] = 8, [RPC_ARRAY_UINT64] = 8,
+    [RPC_ARRAY_FLOAT] = 4, [RPC_ARRAY_DOUBLE] = 8,
+};
+#define NUM_TYPES (int) (sizeof elem_sizes / sizeof elem_sizes[0])
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Swap the bytes of each element, one element at a time.
+ * @param dst  where the swapped elements go, either src or not overlapping it
+ * @param src  the elements
+ * @param len  number of bytes, a multiple of size
+ * @param size bytes of an element: 2, 4 or 8
+ */
+static void swap_portable(unsigned char* dst, const unsigned char* src, size_t len, size_t size) {
+    if (size == 2) {
+        for (size_t i = 0; i < len; i += 2) {
+            uint16_t v;
+            memcpy(&v, src + i, 2);
+            v = __builtin_bswap16(v);
+            memcpy(dst + i, &v, 2);
+        }
+    } else if (size == 4) {
+        for (size_t i = 0; i < len; i += 4) {
+            uint32_t v;
+            memcpy(&v, src + i, 4);
+            v = __builtin_bswap32(v);
+            memcpy(dst + i, &v, 4);
+        }
+    } else {
+        for (size_t i = 0; i < len; i += 8) {
+            uint64_t v;
+            memcpy(&v, src + i, 8);
+            v = __builtin_bswap64(v);
+            memcpy(dst + i, &v, 8);
+        }
+    }
+}
+
+#if defined(__x86_64__)
+/**
+ * The byte shuffle reversing each element of a 16-byte lane.
+ */
+static __m128i lane_mask(size_t size) {
+    if (size == 2) return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    if (size == 4) return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+}
+
+/**
+ * SSSE3's byte shuffle, 64 bytes per step.
+ */
+__attribute__((target("ssse3")))
+static void swap_ssse3(unsigned char* dst, const unsigned char* src, size_t len, size_t size) {
+    __m128i mask = lane_mask(size);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i*) (src + i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*) (src + i + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i*) (src + i + 48));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v0, mask));
+        _mm_storeu_si128((__m128i*) (dst + i + 16), _mm_shuffle_epi8(v1, mask));
+        _mm_storeu_si128((__m128i*) (dst + i + 32), _mm_shuffle_epi8(v2, mask));
+        _mm_storeu_si128((__m128i*) (dst + i + 48), _mm_shuffle_epi8(v3, mask));
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v, mask));
+    }
+    swap_portable(dst + i, src + i, len - i, size);
+}
+
+/**
+ * AVX2's byte shuffle, which shuffles within each 16-byte lane, 128 bytes per step.
+ */
+__attribute__((target("avx2")))
+static void swap_avx2(unsigned char* dst, const unsigned char* src, size_t len, size_t size) {
+    __m256i mask = _mm256_broadcastsi128_si256(lane_mask(size));
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*) (src + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*) (src + i + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*) (src + i + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i*) (src + i + 96));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(v0, mask));
+        _mm256_storeu_si256((__m256i*) (dst + i + 32), _mm256_shuffle_epi8(v1, mask));
+        _mm256_storeu_si256((__m256i*) (dst + i + 64), _mm256_shuffle_epi8(v2, mask));
+        _mm256_storeu_si256((__m256i*) (dst + i + 96), _mm256_shuffle_epi8(v3, mask));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+    swap_portable(dst + i, src + i, len - i, size);
+}
+
+#elif defined(__aarch64__)
+/**
+ * NEON's element reversals, which every ARMv8 CPU has, 64 bytes per step.
+ */
+static void swap_neon(unsigned char* dst, const unsigned char* src, size_t len, size_t size) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint8x16x4_t v = vld1q_u8_x4(src + i);
+        for (int k = 0; k < 4; k++)
+            v.val[k] = size == 2 ? vrev16q_u8(v.val[k]) :
+                       size == 4 ? vrev32q_u8(v.val[k]) : vrev64q_u8(v.val[k]);
+        vst1q_u8_x4(dst + i, v);
+    }
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        v = size == 2 ? vrev16q_u8(v) : size == 4 ? vrev32q_u8(v) : vrev64q_u8(v);
+        vst1q_u8(dst + i, v);
+    }
+    swap_portable(dst + i, src + i, len - i, size);
+}
+#endif
+
+/**
+ * Pick the implementation, from what the CPU reports.
+ */
+static void swap_init(void) {
+    implementation = swap_portable;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        implementation = swap_avx2;
+        implementation_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        implementation = swap_ssse3;
+        implementation_name = "ssse3";
+    }
+#elif defined(__aarch64__)
+    implementation = swap_neon;
+    implementation_name = "neon";
+#endif
+}
+
+/**
+ * Get the header of a typed array, checking that data is one.
+ * @param data  the RPC data
+ * @param count the returned number of elements
+ * @return      the header, or NULL if data is not a well-formed typed array
+ */
+static array_header_t* header_of(rpc_data* data, size_t* count) {
+    if (data == NULL || data->data2 == NULL || data->data2_len < ARRAY_HEADER) return NULL;
+    array_header_t* header = (array_header_t*) data->data2;
+    size_t size = array_elem_size(header->type);
+    if (header->magic != ARRAY_MAGIC || size == 0 ||
+        (header->order != ARRAY_BIG && header->order != ARRAY_LITTLE) ||
+        (data->data2_len - ARRAY_HEADER) % size != 0)
+        return NULL;
+    *count = (data->data2_len - ARRAY_HEADER) / size;
+    return header;
+}
+
+
+/* ----------------------------- SWAP FUNCTIONS ----------------------------- */
+
+/**
+ * Swap the bytes of each element, with the fastest kernel the CPU has.
+ * @param dst   where the swapped elements go, either src or not overlapping it
+ * @param src   the elements
+ * @param count number of elements
+ * @param size  bytes of an element: 1 (copied as is), 2, 4 or 8
+ */
+void array_swap(void* dst, const void* src, size_t count, size_t size) {
+    if (size == 1) {
+        if (dst != src) memcpy(dst, src, count);
+        return;
+    }
+    pthread_once(&init_once, swap_init);
+    implementation((unsigned char*) dst, (const unsigned char*) src, count * size, size);
+}
+
+
+/**
+ * Swap the bytes of each element with the portable kernel, whatever the CPU.
+ * @param dst   where the swapped elements go, either src or not overlapping it
+ * @param src   the elements
+ * @param count number of elements
+ * @param size  bytes of an element: 1 (copied as is), 2, 4 or 8
+ */
+void array_swap_portable(void* dst, const void* src, size_t count, size_t size) {
+    if (size == 1) {
+        if (dst != src) memcpy(dst, src, count);
+        return;
+    }
+    swap_portable((unsigned char*) dst, (const unsigned char*) src, count * size, size);
+}
+
+
+/**
+ * Get the name of the kernel array_swap uses.
+ * @return "avx2", "ssse3", "neon" or "portable"
+ */
+const char* array_swap_kernel(void) {
+    pthread_once(&init_once, swap_init);
+    return implementation_name;
+}
+
+
+/* ----------------------------- ARRAY FUNCTIONS ----------------------------- */
+
+/**
+ * Get the bytes of an element of a type.
+ * @param type the RPC_ARRAY_* element type
+ * @return     the bytes, 0 if the type is unknown
+ */
+size_t array_elem_size(int type) {
+    if (type <= 0 || type >= NUM_TYPES) return 0;
+    return elem_sizes[type];
+}
+
+
+/**
+ * Encode elements as a typed array, in the host's byte order if the receiving end shares it,
+ * and in network order if not (or if it is not known).
+ * @param type       the RPC_ARRAY_* element type
+ * @param elems      the elements, in the host's byte order
+ * @param count      number of elements
+ * @param host_order 1 if the receiving end has the host's byte order, as negotiated
+ * @return           the RPC data, its data1 0, or NULL if the type is unknown
+ */
+rpc_data* array_encode(int type, const void* elems, size_t count, int host_order) {
+    char* TITLE = "array_encode";
+    size_t size = array_elem_size(type);
+    if (size == 0 || (count > 0 && elems == NULL)) {
+        print_error(TITLE, "unknown element type, or no elements");
+        return NULL;
+    }
+    if (count > (SIZE_MAX - ARRAY_HEADER) / size) {
+        print_error(TITLE, "too many elements");
+        return NULL;
+    }
+
+    rpc_data* data = (rpc_data*) malloc(sizeof(rpc_data));
+    assert(data);
+    data->data1 = 0;
+    data->data2_len = ARRAY_HEADER + count * size;
+    data->data2 = malloc(data->data2_len);
+    assert(data->data2);
+    array_header_t* header = (array_header_t*) data->data2;
+    memset(header, 0, ARRAY_HEADER);
+    header->magic = ARRAY_MAGIC;
+    header->type = (uint8_t) type;
+    header->order = host_order ? ARRAY_HOST : ARRAY_BIG;
+
+    unsigned char* out = (unsigned char*) data->data2 + ARRAY_HEADER;
+    if (count == 0) return data;
+    if (header->order == ARRAY_HOST) memcpy(out, elems, count * size);
+    else array_swap(out, elems, count, size);
+    return data;
+}
+
+
+/**
+ * Get the element type of a typed array.
+ * @param data  the RPC data
+ * @param count the returned number of elements, may be NULL
+ * @return      the RPC_ARRAY_* element type, or ERROR if data is not a typed array
+ */
+int array_type(rpc_data* data, size_t* count) {
+    size_t n;
+    array_header_t* header = header_of(data, &n);
+    if (header == NULL) return ERROR;
+    if (count != NULL) *count = n;
+    return header->type;
+}
+
+
+/**
+ * Get the elements of a typed array, converting them in place to the host's byte order if they
+ * are not in it yet. The data is retagged, so later calls convert nothing.
+ * @param data  the RPC data, its data2 allocated as received (8-byte aligned)
+ * @param type  the RPC_ARRAY_* element type expected
+ * @param count the returned number of elements, may be NULL
+ * @return      the elements, or NULL if data is not a typed array of that type
+ */
+void* array_decode(rpc_data* data, int type, size_t* count) {
+    char* TITLE = "array_decode";
+    size_t n;
+    array_header_t* header = header_of(data, &n);
+    if (header == NULL || header->type != type) {
+        print_error(TITLE, "not a typed array of this type");
+        return NULL;
+    }
+    size_t size = array_elem_size(type);
+    unsigned char* elems = (unsigned char*) data->data2 + ARRAY_HEADER;
+    if ((uintptr_t) elems % size != 0) {
+        print_error(TITLE, "elements are not aligned");
+        return NULL;
+    }
+    if (header->order != ARRAY_HOST) {
+        array_swap(elems, elems, n, size);
+        header->order = ARRAY_HOST;
+    }
+    if (count != NULL) *count = n;
+    return elems;
+}
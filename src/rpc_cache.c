@@ -0,0 +1,339 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : rpc_cache.c
+ * Purpose : The response cache, a sharded LRU which maps a call (function id, data1, data2)
+ *           to the response of that call.
+ *
+ * Each shard has its own lock, hash table and recency list, so concurrent lookups on different
+ * keys rarely contend. Entries hold copies of both the key's data2 and the response, meaning a
+ * hash collision can never return the response of another call. A cache may be bounded by number
+ * of entries, by bytes held, or both; entries may also carry an expiry time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "rpc_cache.h"
+#include "rpc_utils.h"
+
+#define MIN_BUCKETS (size_t) 16
+
+
+/* cache entry, in both a hash bucket chain and the shard's recency list */
+typedef struct entry entry_t;
+struct entry {
+    uint64_t key_hash;
+    uint64_t id;
+    int data1;
+    size_t data2_len;
+    void* data2;
+    rpc_data* value;
+    size_t bytes;
+    uint64_t expires_ns;    // 0 if the entry never expires
+    entry_t* chain;
+    entry_t* prev;
+    entry_t* next;
+};
+
+/* shard data structure */
+typedef struct shard {
+    pthread_mutex_t lock;
+    entry_t** buckets;
+    size_t num_buckets;
+    size_t size;
+    size_t max_size;
+    size_t bytes;
+    size_t max_bytes;
+    entry_t* head;      // most recently used
+    entry_t* tail;      // least recently used
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} shard_t;
+
+/* cache data structure */
+struct cache {
+    shard_t shards[CACHE_SHARDS];
+};
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Hash a call key. The shard is picked from the high bits and the bucket from the low bits,
+ * so the two choices stay independent.
+ * @param id  the function's id
+ * @param key the call's payload
+ * @return    the key's hash
+ */
+static uint64_t key_hash(uint64_t id, rpc_data* key) {
+    uint64_t h = hash_bytes(key->data2, key->data2_len);
+    h ^= id + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= (uint64_t) (unsigned int) key->data1 * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Check whether an entry is for the given call.
+ * @return 1 if it matches, 0 if not
+ */
+static int entry_match(entry_t* e, uint64_t h, uint64_t id, rpc_data* key) {
+    return e->key_hash == h && e->id == id && e->data1 == key->data1 &&
+           e->data2_len == key->data2_len &&
+           (key->data2_len == 0 || memcmp(e->data2, key->data2, key->data2_len) == 0);
+}
+
+/**
+ * Unlink an entry from the shard's recency list.
+ */
+static void lru_unlink(shard_t* s, entry_t* e) {
+    if (e->prev) e->prev->next = e->next;
+    else s->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else s->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+/**
+ * Link an entry to the front (most recently used) of the shard's recency list.
+ */
+static void lru_push_front(shard_t* s, entry_t* e) {
+    e->prev = NULL;
+    e->next = s->head;
+    if (s->head) s->head->prev = e;
+    s->head = e;
+    if (s->tail == NULL) s->tail = e;
+}
+
+/**
+ * Double the shard's bucket count, keeping the load factor at most 1.
+ */
+static void shard_grow(shard_t* s) {
+    size_t num_buckets = s->num_buckets << 1;
+    entry_t** buckets = (entry_t**) calloc(num_buckets, sizeof(entry_t*));
+    assert(buckets);
+    for (entry_t* e = s->head; e != NULL; e = e->next) {
+        size_t i = e->key_hash & (num_buckets - 1);
+        e->chain = buckets[i];
+        buckets[i] = e;
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->num_buckets = num_buckets;
+}
+
+/**
+ * Remove an entry from the shard completely, and free it.
+ */
+static void shard_remove(shard_t* s, entry_t* e) {
+    entry_t** link = &s->buckets[e->key_hash & (s->num_buckets - 1)];
+    while (*link != e) link = &(*link)->chain;
+    *link = e->chain;
+    lru_unlink(s, e);
+    (s->size)--;
+    s->bytes -= e->bytes;
+    free(e->data2);
+    rpc_data_free(e->value);
+    free(e);
+}
+
+
+/* ----------------------------- CACHE FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize a cache. The bounds are split evenly over the shards, each shard holding at least
+ * one entry. A bound of 0 means that dimension is unbounded.
+ * @param max_entries the maximum number of cached responses
+ * @param max_bytes   the maximum bytes held by cached keys and responses
+ * @return            the initialized cache
+ */
+cache_t* cache_init(size_t max_entries, size_t max_bytes) {
+    cache_t* cache = (cache_t*) malloc(sizeof(cache_t));
+    assert(cache);
+    size_t per_shard = (max_entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if (max_entries == 0) per_shard = SIZE_MAX;
+    else if (per_shard == 0) per_shard = 1;
+    size_t bytes_per_shard = max_bytes ? (max_bytes + CACHE_SHARDS - 1) / CACHE_SHARDS : SIZE_MAX;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t* s = &cache->shards[i];
+        memset(s, 0, sizeof(shard_t));
+        pthread_mutex_init(&s->lock, NULL);
+        s->buckets = (entry_t**) calloc(MIN_BUCKETS, sizeof(entry_t*));
+        assert(s->buckets);
+        s->num_buckets = MIN_BUCKETS;
+        s->max_size = per_shard;
+        s->max_bytes = bytes_per_shard;
+    }
+    return cache;
+}
+
+
+/**
+ * Look up the response of a call. An expired entry is dropped and counts as a miss.
+ * @param cache the cache
+ * @param id    the function's id
+ * @param key   the call's payload
+ * @return      a copy of the cached response, or NULL on a miss
+ */
+rpc_data* cache_get(cache_t* cache, uint64_t id, rpc_data* key) {
+    uint64_t h = key_hash(id, key);
+    shard_t* s = &cache->shards[(h >> 56) % CACHE_SHARDS];
+    rpc_data* found = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    entry_t* e = s->buckets[h & (s->num_buckets - 1)];
+    for (; e != NULL; e = e->chain) {
+        if (entry_match(e, h, id, key)) {
+            if (e->expires_ns != 0 && e->expires_ns <= rpc_now_ns()) {
+                shard_remove(s, e);
+                break;
+            }
+            lru_unlink(s, e);
+            lru_push_front(s, e);
+            found = rpc_data_copy(e->value);
+            break;
+        }
+    }
+    if (found) (s->hits)++;
+    else (s->misses)++;
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+
+/**
+ * Cache the response of a call, evicting the least recently used entries of the shard if it
+ * is full. If the call is already cached (another thread got there first), the cache is left as is.
+ * @param cache      the cache
+ * @param id         the function's id
+ * @param key        the call's payload
+ * @param value      the call's response, which is copied
+ * @param expires_ns monotonic time (see rpc_now_ns) the entry expires at, 0 for never
+ */
+void cache_put(cache_t* cache, uint64_t id, rpc_data* key, rpc_data* value,
+               uint64_t expires_ns) {
+    if (value == NULL) return;
+    uint64_t h = key_hash(id, key);
+    shard_t* s = &cache->shards[(h >> 56) % CACHE_SHARDS];
+
+    // an entry that alone exceeds the shard's byte bound is never cached
+    size_t bytes = sizeof(entry_t) + sizeof(rpc_data) + key->data2_len + value->data2_len;
+    if (bytes > s->max_bytes) return;
+
+    // copy outside of the lock
+    entry_t* new_e = (entry_t*) malloc(sizeof(entry_t));
+    assert(new_e);
+    new_e->key_hash = h;
+    new_e->id = id;
+    new_e->data1 = key->data1;
+    new_e->data2_len = key->data2_len;
+    new_e->data2 = NULL;
+    if (key->data2_len > 0) {
+        new_e->data2 = malloc(key->data2_len);
+        assert(new_e->data2);
+        memcpy(new_e->data2, key->data2, key->data2_len);
+    }
+    new_e->value = rpc_data_copy(value);
+    new_e->bytes = bytes;
+    new_e->expires_ns = expires_ns;
+
+    pthread_mutex_lock(&s->lock);
+    entry_t** bucket = &s->buckets[h & (s->num_buckets - 1)];
+    for (entry_t* e = *bucket; e != NULL; e = e->chain) {
+        if (entry_match(e, h, id, key)) {
+            pthread_mutex_unlock(&s->lock);
+            free(new_e->data2);
+            rpc_data_free(new_e->value);
+            free(new_e);
+            return;
+        }
+    }
+    while ((s->size >= s->max_size || s->bytes + bytes > s->max_bytes) && s->tail != NULL) {
+        shard_remove(s, s->tail);
+        (s->evictions)++;
+    }
+    if (s->size >= s->num_buckets) {
+        shard_grow(s);
+        bucket = &s->buckets[h & (s->num_buckets - 1)];
+    }
+    new_e->chain = *bucket;
+    *bucket = new_e;
+    lru_push_front(s, new_e);
+    (s->size)++;
+    s->bytes += bytes;
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/**
+ * Drop all cached responses of a function.
+ * @param cache the cache
+ * @param id    the function's id
+ */
+void cache_invalidate(cache_t* cache, uint64_t id) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t* s = &cache->shards[i];
+        pthread_mutex_lock(&s->lock);
+        entry_t* e = s->head;
+        while (e != NULL) {
+            entry_t* next = e->next;
+            if (e->id == id) shard_remove(s, e);
+            e = next;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+
+/**
+ * Drop all cached responses.
+ * @param cache the cache
+ */
+void cache_clear(cache_t* cache) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t* s = &cache->shards[i];
+        pthread_mutex_lock(&s->lock);
+        while (s->head != NULL) shard_remove(s, s->head);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+
+/**
+ * Sum up the counters of all shards.
+ * @param cache the cache
+ * @param stats the returned counters
+ */
+void cache_get_stats(cache_t* cache, rpc_cache_stats* stats) {
+    memset(stats, 0, sizeof(rpc_cache_stats));
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t* s = &cache->shards[i];
+        pthread_mutex_lock(&s->lock);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->entries += s->size;
+        stats->bytes += s->bytes;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+
+/**
+ * Free memory of given cache and all of its entries.
+ * @param cache the cache
+ */
+void cache_free(cache_t* cache) {
+    if (cache == NULL) return;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t* s = &cache->shards[i];
+        while (s->head != NULL) shard_remove(s, s->head);
+        free(s->buckets);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(cache);
+}
@@ -5,11 +5,18 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 
+#include "rpc_server.h"
+#include "rpc_client.h"
 #include "rpc_utils.h"
+#include "rpc_array.h"
+#include "coalesce.h"
 
 
 /**
@@ -24,7 +31,7 @@ int create_connect_socket(char *addr, int port) {
 
     // connect socket and address information to connect to
     int conn_fd = ERROR;
-    struct addrinfo hints, *results;
+    struct addrinfo hints, *results = NULL;
 
     // set all fields in hints to 0, then set specific fields to correspond to IPv6 client
     memset(&hints, 0, sizeof hints);
@@ -48,8 +55,14 @@ int create_connect_socket(char *addr, int port) {
                          result->ai_protocol);
         if (conn_fd < 0) continue;
         err = connect(conn_fd, result->ai_addr, result->ai_addrlen);
-        if (err != -1) break;
+        if (err != -1) {
+            // no delay, as each call is a lockstep exchange of small messages
+            int nodelay = 1;
+            setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+            break;
+        }
         close(conn_fd);
+        conn_fd = ERROR;
     }
     // no result address found
     if (result == NULL) {
@@ -59,6 +72,475 @@ int create_connect_socket(char *addr, int port) {
 
     // cleanup and return the socket
     cleanup:
-    freeaddrinfo(results);
+    if (results != NULL) freeaddrinfo(results);
     return conn_fd;
 }
+
+
+/**
+ * Re-establish the client's connection if it was dropped, which happens when a call gives up
+ * half way through its exchange with the server (the connection would be out of step).
+ * @param client the client RPC
+ * @return       0 if the client is connected, and ERROR if otherwise, or if an open stream
+ *               has the connection
+ */
+int client_reconnect(rpc_client* client) {
+    if (client->stream != NULL) return ERROR;
+    if (client->conn_fd >= 0) return 0;
+    client->conn_fd = create_connect_socket(client->addr, client->port);
+    if (client->conn_fd < 0) return ERROR;
+    client->checksum = 0;
+    client->host_order = 0;
+    return client->want_checksum || client->want_host_order ? client_negotiate(client) : 0;
+}
+
+
+/**
+ * Negotiate the options of the client's connection with the server. A server that does not
+ * know about options drops the connection, in which case the client keeps none.
+ * @param client the client RPC
+ * @return       0 if negotiated (whether or not the server accepted), and ERROR if otherwise
+ */
+int client_negotiate(rpc_client* client) {
+    char* TITLE = "rpc-client: client_negotiate";
+    uint64_t requested = client->want_checksum ? OPTION_CHECKSUM : 0;
+    if (client->want_host_order)
+        requested |= OPTION_HOST_ORDER | (ARRAY_HOST == ARRAY_BIG ? OPTION_BIG_ENDIAN : 0);
+    uint64_t accepted;
+    if (rpc_send_int(client->conn_fd, OPTIONS_SERVICE) < 0 ||
+        rpc_send_uint(client->conn_fd, requested) < 0 ||
+        rpc_receive_uint(client->conn_fd, &accepted) < 0) {
+        print_error(TITLE, "cannot negotiate options with server");
+        close(client->conn_fd);
+        client->conn_fd = ERROR;
+        client->checksum = 0;
+        client->host_order = 0;
+        return ERROR;
+    }
+    client->checksum = (accepted & OPTION_CHECKSUM) != 0;
+    client->host_order = (accepted & OPTION_HOST_ORDER) != 0;
+    return 0;
+}
+
+
+/**
+ * Check whether typed arrays may go to the server in the host's byte order. The first time, the
+ * byte order is negotiated on the client's connection, and from then on whenever it reconnects;
+ * until it is, arrays go in network order, which the server reads all the same.
+ * @param client the client RPC
+ * @return       1 if the server shares the host's byte order, 0 if not or not known yet
+ */
+int client_host_order(rpc_client* client) {
+    if (!client->want_host_order) {
+        client->want_host_order = 1;
+        if (client->conn_fd >= 0 && client->stream == NULL) client_negotiate(client);
+    }
+    return client->host_order;
+}
+
+
+/**
+ * Drop the client's connection, to be re-established by the next request.
+ * @param client the client RPC
+ */
+static void client_disconnect(rpc_client* client) {
+    close(client->conn_fd);
+    client->conn_fd = ERROR;
+}
+
+
+/**
+ * The exchange of a call with the server.
+ * @param client      the client RPC
+ * @param handle      the RPC handle
+ * @param io          the call's payload, and where its response goes
+ * @param deadline_ns the call's deadline, 0 if it has none
+ * @param trace_id    the call's id if it is traced, 0 if not
+ * @return            the response data if successful and not received into a sink, or NULL
+ */
+static rpc_data* call_remote(rpc_client* client, rpc_handle* handle, call_io_t* io,
+                             uint64_t deadline_ns, uint64_t trace_id) {
+    char* TITLE = "rpc-client: rpc_call";
+    int err;
+    uint64_t phase_ns = trace_id ? rpc_now_ns() : 0;
+
+    // send the flag to confirm client is calling call
+    int request = trace_id ? CALL_TRACED_SERVICE :
+                  deadline_ns ? CALL_DEADLINE_SERVICE : CALL_SERVICE;
+    err = rpc_send_int(client->conn_fd, request);
+    if (err) {
+        print_error(TITLE, "cannot send call service flag to server");
+        return NULL;
+    }
+
+    // send function's id for verification
+    err = rpc_send_uint(client->conn_fd, handle->function_id);
+    if (err) {
+        print_error(TITLE, "cannot send handle to server for verification");
+        return NULL;
+    }
+
+    // send the remaining time in microseconds, rather than our clock's deadline. A traced call
+    // always sends it, 0 for no deadline (an expired deadline sends at least 1)
+    if (deadline_ns || trace_id) {
+        uint64_t now = rpc_now_ns();
+        uint64_t budget_us = deadline_ns > now ? (deadline_ns - now) / 1000 : 0;
+        if (trace_id && deadline_ns && budget_us == 0) budget_us = 1;
+        err = rpc_send_uint(client->conn_fd, budget_us);
+        if (err) {
+            print_error(TITLE, "cannot send deadline to server");
+            return NULL;
+        }
+    }
+
+    // send the call id, which the server traces the call under
+    if (trace_id) {
+        err = rpc_send_uint(client->conn_fd, trace_id);
+        if (err) {
+            print_error(TITLE, "cannot send call id to server");
+            return NULL;
+        }
+    }
+
+    // receive the verification flag, if negative then failure
+    int flag = ERROR;
+    err = rpc_receive_int(client->conn_fd, &flag);
+    if (err) {
+        print_error(TITLE, "cannot receive verification flag from server");
+        return NULL;
+    }
+    if (trace_id) {
+        uint64_t now = rpc_now_ns();
+        trace_event(trace_id, TRACE_CLIENT, PHASE_HEADER, phase_ns, now);
+        phase_ns = now;
+    }
+    if (flag < 0) {
+        print_error(TITLE, "id verification failed");
+        client->status = flag;
+        return NULL;
+    }
+
+    // send payload to server
+    err = io->vpayload ? rpc_send_payload_vec(client->conn_fd, io->vpayload) :
+                         rpc_send_payload(client->conn_fd, io->payload);
+    if (err) {
+        print_error(TITLE, "cannot send payload to server");
+        client->status = err;
+        return NULL;
+    }
+    if (trace_id) {
+        uint64_t now = rpc_now_ns();
+        trace_event(trace_id, TRACE_CLIENT, PHASE_PAYLOAD, phase_ns, now);
+        phase_ns = now;
+    }
+
+    // a caller no longer waiting for the response abandons the call, and with it the connection
+    if (io->await != NULL && io->await(io->await_arg, client->conn_fd) != 0) {
+        client_disconnect(client);
+        return NULL;
+    }
+
+    // receive payload from server
+    int status;
+    rpc_data* response = NULL;
+    if (io->target)
+        status = rpc_receive_payload_sink(client->conn_fd, io->target);
+    else if (io->sink)
+        status = rpc_receive_payload_vec(client->conn_fd, io->sink, &io->sink_len);
+    else response = rpc_receive_payload_status(client->conn_fd, &status, SIZE_MAX);
+    client->status = status;
+    if (trace_id)
+        trace_event(trace_id, TRACE_CLIENT, PHASE_RESPONSE, phase_ns, rpc_now_ns());
+    return response;
+}
+
+
+/**
+ * Call a remote function, with an optional deadline. This is what both rpc_call and
+ * rpc_call_with_deadline come down to. The outcome is kept as the client's status.
+ * @param client      the client RPC
+ * @param handle      the RPC handle
+ * @param payload     the RPC payload (the data to send to server)
+ * @param deadline_ns monotonic time (see rpc_now_ns) the call gives up at, 0 for never
+ * @return            the response data if successful, or NULL if otherwise
+ */
+rpc_data* client_call(rpc_client* client, rpc_handle* handle, rpc_data* payload,
+                      uint64_t deadline_ns) {
+    char* TITLE = "rpc-client: rpc_call";
+    client->status = ERROR;
+    if (handle == NULL) {
+        print_error(TITLE, "handle is NULL");
+        return NULL;
+    }
+
+    // an opted-in handle may be answered from the response cache without any I/O
+    uint64_t ttl_ns = 0;
+    if (payload != NULL)
+        ttl_ns = client_cache_ttl(client->cache, handle->function_id);
+    if (ttl_ns > 0) {
+        rpc_data* cached = cache_get(client->cache->cache, handle->function_id, payload);
+        if (cached != NULL) {
+            client->status = 0;
+            return cached;
+        }
+    }
+
+    // an identical call in flight on a client sharing the coalescer answers this one too. Calls
+    // with a deadline are not coalesced, as they may not wait for another call's
+    flight_t* flight = NULL;
+    if (client->coalescer != NULL && payload != NULL && deadline_ns == 0) {
+        rpc_data* response = NULL;
+        flight = coalesce_begin(client->coalescer, handle->function_id, payload, &response,
+                                &client->status);
+        if (flight == NULL) return response;
+    }
+
+    call_io_t io = { .payload = payload };
+    rpc_data* response = client_call_io(client, handle, &io, deadline_ns);
+    if (flight != NULL)
+        coalesce_end(client->coalescer, flight, response, client->status);
+
+    if (ttl_ns > 0 && response != NULL)
+        cache_put(client->cache->cache, handle->function_id, payload, response,
+                  rpc_now_ns() + ttl_ns);
+    return response;
+}
+
+
+/**
+ * Make a call's exchange with the server, given its payload either contiguous or vectored, and
+ * its response received either into a new rpc_data or into the caller's segments. The outcome
+ * is kept as the client's status.
+ * @param client      the client RPC
+ * @param handle      the RPC handle
+ * @param io          the call's payload, and where its response goes
+ * @param deadline_ns monotonic time (see rpc_now_ns) the call gives up at, 0 for never
+ * @return            the response data if successful and not received into a sink, or NULL
+ */
+rpc_data* client_call_io(rpc_client* client, rpc_handle* handle, call_io_t* io,
+                         uint64_t deadline_ns) {
+    char* TITLE = "rpc-client: rpc_call";
+    client->status = ERROR;
+    if (handle == NULL) {
+        print_error(TITLE, "handle is NULL");
+        return NULL;
+    }
+
+    // a call that has already expired is not sent at all
+    if (deadline_ns != 0 && rpc_now_ns() >= deadline_ns) {
+        client->status = EXPIRED;
+        return NULL;
+    }
+    if (client_reconnect(client) < 0) {
+        print_error(TITLE, "cannot reconnect to server");
+        return NULL;
+    }
+
+    // every send and receive of the call gives up once the deadline passes, which leaves the
+    // connection half way through the exchange (unlike an EXPIRED answer from the server)
+    uint64_t trace_id = trace_sample() ? trace_new_id() : 0;
+    uint64_t trace_start = trace_id ? rpc_now_ns() : 0;
+    rpc_set_io_deadline(deadline_ns);
+    rpc_set_io_checksum(client->checksum);
+    rpc_data* response = call_remote(client, handle, io, deadline_ns, trace_id);
+    rpc_set_io_checksum(0);
+    rpc_set_io_deadline(0);
+    if (trace_id)
+        trace_event(trace_id, TRACE_CLIENT, PHASE_CALL, trace_start, rpc_now_ns());
+    if (client->status != 0 && deadline_ns != 0 && rpc_now_ns() >= deadline_ns &&
+        client->status != EXPIRED) {
+        client->status = EXPIRED;
+        client_disconnect(client);
+    }
+    return response;
+}
+
+
+/**
+ * Cast a one-way call: write it, and return without waiting for anything from the server. A
+ * failed write leaves the connection out of step, so it is dropped and re-established by the
+ * next request.
+ * @param client  the client RPC
+ * @param handle  the RPC handle
+ * @param payload the RPC payload
+ * @return        0 if the call was written, and ERROR if otherwise
+ */
+int client_cast(rpc_client* client, rpc_handle* handle, rpc_data* payload) {
+    char* TITLE = "rpc-client: rpc_cast";
+    client->status = ERROR;
+    if (handle == NULL || payload == NULL) {
+        print_error(TITLE, "handle or payload is NULL");
+        return ERROR;
+    }
+    if (payload->data2_len > MAX_FRAME_LEN) {
+        print_error(TITLE, "payload exceeds MAX_FRAME_LEN, too large to cast");
+        client->status = OVERLENGTH;
+        return OVERLENGTH;
+    }
+    if (client_reconnect(client) < 0) {
+        print_error(TITLE, "cannot reconnect to server");
+        return ERROR;
+    }
+    rpc_set_io_checksum(client->checksum);
+    int err = rpc_send_oneway(client->conn_fd, CAST_SERVICE, handle->function_id, payload);
+    rpc_set_io_checksum(0);
+    if (err) {
+        print_error(TITLE, "cannot send one-way call to server");
+        client_disconnect(client);
+        return ERROR;
+    }
+    client->status = 0;
+    return 0;
+}
+
+
+/**
+ * Call a streaming function: send the call as for any call, and hand the connection over to a
+ * stream, from which the response frames are then read one by one.
+ * @param client  the client RPC
+ * @param handle  the RPC handle
+ * @param payload the RPC payload
+ * @return        the stream if successful, and NULL if otherwise (the client's status says why)
+ */
+rpc_stream* client_stream_open(rpc_client* client, rpc_handle* handle, rpc_data* payload) {
+    char* TITLE = "rpc-client: rpc_call_stream";
+    client->status = ERROR;
+    if (handle == NULL || payload == NULL) {
+        print_error(TITLE, "handle or payload is NULL");
+        return NULL;
+    }
+    if (client_reconnect(client) < 0) {
+        print_error(TITLE, "cannot reconnect to server, or a stream is open");
+        return NULL;
+    }
+
+    // send the flag and function's id, and receive the verification flag
+    int flag = ERROR;
+    if (rpc_send_int(client->conn_fd, STREAM_SERVICE) < 0 ||
+        rpc_send_uint(client->conn_fd, handle->function_id) < 0 ||
+        rpc_receive_int(client->conn_fd, &flag) < 0) {
+        print_error(TITLE, "cannot send stream call to server");
+        client_disconnect(client);
+        return NULL;
+    }
+    if (flag < 0) {
+        print_error(TITLE, "id verification failed");
+        client->status = flag;
+        return NULL;
+    }
+
+    // send payload to server
+    rpc_set_io_checksum(client->checksum);
+    int err = rpc_send_payload(client->conn_fd, payload);
+    rpc_set_io_checksum(0);
+    if (err) {
+        print_error(TITLE, "cannot send payload to server");
+        client->status = err;
+        client_disconnect(client);
+        return NULL;
+    }
+
+    rpc_stream* stream = (rpc_stream*) malloc(sizeof(rpc_stream));
+    assert(stream);
+    stream->client = client;
+    stream->function_id = handle->function_id;
+    stream->done = 0;
+    stream->status = 0;
+    client->stream = stream;
+    client->status = 0;
+    return stream;
+}
+
+
+/**
+ * End a stream, handing the connection back to its client (dropped already, if the stream
+ * failed half way, to be re-established by the next request).
+ * @param stream the stream
+ * @param status the stream's final status
+ */
+static void stream_end(rpc_stream* stream, int status) {
+    rpc_client* client = stream->client;
+    stream->done = 1;
+    stream->status = status;
+    client->status = status;
+    client->stream = NULL;
+}
+
+
+/**
+ * Read the next response frame of a stream. Each frame is a one-way frame under the STREAM_FRAME
+ * marker; a marker that is not STREAM_FRAME is the stream's end, and its status.
+ * @param stream the stream
+ * @return       the frame if successful, and NULL once the stream is over
+ */
+rpc_data* client_stream_next(rpc_stream* stream) {
+    char* TITLE = "rpc-client: rpc_stream_next";
+    if (stream->done) return NULL;
+    rpc_client* client = stream->client;
+
+    int marker;
+    if (rpc_receive_int(client->conn_fd, &marker) < 0) {
+        print_error(TITLE, "cannot receive the next frame's marker from server");
+        client_disconnect(client);
+        stream_end(stream, ERROR);
+        return NULL;
+    }
+    if (marker != STREAM_FRAME) {
+        stream_end(stream, marker > 0 ? ERROR : marker);
+        return NULL;
+    }
+
+    uint64_t id;
+    int status = ERROR;
+    rpc_data* frame = NULL;
+    rpc_set_io_checksum(client->checksum);
+    if (rpc_receive_uint(client->conn_fd, &id) == 0 && id == stream->function_id)
+        frame = rpc_receive_oneway(client->conn_fd, STREAM_FRAME, id, &status);
+    rpc_set_io_checksum(0);
+    if (frame == NULL) {
+        // a frame lost, to corruption or otherwise, ends the stream: dropping the connection
+        // stops the handler, which does not know about it
+        print_error(TITLE, "cannot receive the next frame from server");
+        client_disconnect(client);
+        stream_end(stream, status ? status : ERROR);
+    }
+    return frame;
+}
+
+
+/**
+ * Free a stream. One that has not ended yet drops the client's connection, rather than reading
+ * the rest of its frames; the server's handler then fails at its next write.
+ * @param stream the stream
+ * @return       the stream's status
+ */
+int client_stream_close(rpc_stream* stream) {
+    if (!stream->done) {
+        client_disconnect(stream->client);
+        stream_end(stream, ERROR);
+    }
+    int status = stream->status;
+    free(stream);
+    return status;
+}
+
+
+/**
+ * Get the time to live of a handle's cached responses.
+ * @param cache       the client response cache, may be NULL
+ * @param function_id the handle's function id
+ * @return            the time to live in nanoseconds, 0 if the handle is not cached
+ */
+uint64_t client_cache_ttl(struct rpc_client_cache* cache, uint64_t function_id) {
+    if (cache == NULL) return 0;
+    uint64_t ttl_ns = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->num_ttls; i++) {
+        if (cache->ttls[i].function_id == function_id) {
+            ttl_ns = cache->ttls[i].ttl_ns;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return ttl_ns;
+}
@@ -0,0 +1,918 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : rpc_ext.c
+ * Purpose : The extended Remote Procedure Call functions for its interface header file.
+ *           These build on top of the base functions in rpc.c.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "rpc_ext.h"
+#include "rpc_server.h"
+#include "rpc_client.h"
+#include "rpc_utils.h"
+#include "rpc_array.h"
+#include "coalesce.h"
+#include "balancer.h"
+
+#define DEFAULT_CACHE_SIZE (size_t) 1024
+
+
+/* ------------------------------------- SERVER STUB ------------------------------------- */
+
+
+/**
+ * Apply the registration options to a function, and register it to the server RPC. A pure
+ * function gets its own response cache, bounded by the options' cache size (or a default).
+ * @param server the server RPC
+ * @param f      the initialized function, freed if it cannot be registered
+ * @param opts   the registration options, NULL for none
+ * @param TITLE  the title of the calling function, for errors
+ * @return       0 if successful, and ERROR if otherwise
+ */
+static int register_function(rpc_server* server, function_t* f, rpc_function_opts* opts,
+                             char* TITLE) {
+    if (opts != NULL) {
+        if (opts->executor_class < 0 || opts->executor_class >= RPC_MAX_CLASSES) {
+            print_error(TITLE, "executor class out of range");
+            function_free(f);
+            return ERROR;
+        }
+        f->flags = opts->flags;
+        f->executor_class = opts->executor_class;
+        if (opts->flags & RPC_FUNCTION_PURE) {
+            size_t size = opts->cache_size ? opts->cache_size : DEFAULT_CACHE_SIZE;
+            f->cache = cache_init(size, 0);
+        }
+    }
+
+    // enqueue, which fails (with 1 rather than ERROR) on an already registered name
+    if (function_enqueue(server->functions, f) != 0) {
+        print_error(TITLE, "a function of that name is already registered");
+        function_free(f);
+        return ERROR;
+    }
+    return 0;
+}
+
+
+/**
+ * Register a function to the server RPC with registration options.
+ * @param server  the server RPC
+ * @param name    the function's name
+ * @param handler the function's handler
+ * @param opts    the registration options, NULL for none
+ * @return        0 if successful, and ERROR if otherwise
+ */
+int rpc_register_ex(rpc_server* server, char* name, rpc_handler handler,
+                    rpc_function_opts* opts) {
+    char* TITLE = "rpc-server: rpc_register_ex";
+
+    // checking if server can register the function or not
+    if (server == NULL || name == NULL) {
+        print_error(TITLE, "server or name is NULL");
+        return ERROR;
+    }
+
+    // initialize function for registration
+    function_t* f = function_init(name, handler);
+    if (f == NULL) {
+        print_error(TITLE, "function_init returns NULL");
+        return ERROR;
+    }
+    return register_function(server, f, opts, TITLE);
+}
+
+
+/**
+ * Register a streaming function to the server RPC. Its handler writes its response as frames,
+ * each sent as soon as it is written, so it need not hold all of its results at once. The
+ * options' executor class applies as for any function; a streaming function cannot be pure.
+ * @param server  the server RPC
+ * @param name    the function's name
+ * @param handler the function's streaming handler
+ * @param opts    the registration options, NULL for none
+ * @return        0 if successful, and ERROR if otherwise
+ */
+int rpc_register_stream(rpc_server* server, char* name, rpc_stream_handler handler,
+                        rpc_function_opts* opts) {
+    char* TITLE = "rpc-server: rpc_register_stream";
+    if (server == NULL || name == NULL || handler == NULL) {
+        print_error(TITLE, "server, name or handler is NULL");
+        return ERROR;
+    }
+    if (opts != NULL && (opts->flags & RPC_FUNCTION_PURE)) {
+        print_error(TITLE, "a streaming function cannot be pure");
+        return ERROR;
+    }
+    function_t* f = function_init(name, NULL);
+    if (f == NULL) {
+        print_error(TITLE, "function_init returns NULL");
+        return ERROR;
+    }
+    f->f_stream = handler;
+    return register_function(server, f, opts, TITLE);
+}
+
+
+/**
+ * Write a response frame of a streaming handler. The write returns once the frame is sent, or
+ * gathered to be flushed with the next ones, which waits for the client to make room once enough
+ * is gathered; the frame is still the handler's to free or reuse.
+ * @param writer the writer the handler was given
+ * @param frame  the frame
+ * @return       0 if successful, and ERROR if the client has gone (the handler should return)
+ */
+int rpc_stream_write(rpc_stream_writer* writer, rpc_data* frame) {
+    if (writer == NULL) return ERROR;
+    return server_stream_write(writer, frame);
+}
+
+
+/**
+ * Get the response cache counters of a pure function.
+ * @param server the server RPC
+ * @param name   the function's name
+ * @param stats  the returned counters
+ * @return       0 if successful, and ERROR if the function does not exist or is not pure
+ */
+int rpc_function_cache_stats(rpc_server* server, char* name, rpc_cache_stats* stats) {
+    char* TITLE = "rpc-server: rpc_function_cache_stats";
+    if (server == NULL || name == NULL || stats == NULL) {
+        print_error(TITLE, "server, name or stats is NULL");
+        return ERROR;
+    }
+    function_t* f = function_search(server->functions, hash((unsigned char*) name));
+    if (f == NULL || f->cache == NULL) {
+        print_error(TITLE, "function does not exist or has no cache");
+        return ERROR;
+    }
+    cache_get_stats(f->cache, stats);
+    return 0;
+}
+
+
+/**
+ * Set the server's admission limit. A call arriving while the limit is reached is shed: the
+ * server answers OVERLOADED right away, without receiving its payload, rather than queue it.
+ * @param server       the server RPC
+ * @param max_inflight maximum calls in flight server-wide, 0 for unlimited
+ * @return             0 if successful, and ERROR if otherwise
+ */
+int rpc_server_set_limits(rpc_server* server, int max_inflight) {
+    char* TITLE = "rpc-server: rpc_server_set_limits";
+    if (server == NULL || max_inflight < 0) {
+        print_error(TITLE, "server is NULL or the limit is negative");
+        return ERROR;
+    }
+    server->max_inflight = max_inflight;
+    return 0;
+}
+
+
+/**
+ * Get the number of calls the server has shed.
+ * @param server the server RPC
+ * @return       the number of calls answered with OVERLOADED
+ */
+unsigned long long rpc_server_shed_count(rpc_server* server) {
+    if (server == NULL) return 0;
+    return atomic_load(&server->shed);
+}
+
+
+/**
+ * Bound the data2 of the payloads the server takes, as it allocates the length a client claims.
+ * A longer one is refused as overlength before it is sent, which leaves the connection in step.
+ * @param server    the server RPC
+ * @param max_bytes the most data2 bytes of a call's payload, 0 for no bound
+ * @return          0 if successful, and ERROR if otherwise
+ */
+int rpc_server_set_max_payload(rpc_server* server, size_t max_bytes) {
+    if (server == NULL) return ERROR;
+    server->max_payload = max_bytes ? max_bytes : SIZE_MAX;
+    return 0;
+}
+
+
+/**
+ * Set the timeouts of the server's connections, timed by a timer wheel: each connection has a
+ * single timer, moved along lazily, so that idle connections cost nothing until they time out.
+ * @param server     the server RPC
+ * @param idle_ms    time a connection may go without a request, 0 for no limit
+ * @param request_ms time a request may take to arrive, and its response to be taken, 0 for no
+ *                   limit
+ * @return           0 if successful, and ERROR if otherwise
+ */
+int rpc_server_set_timeouts(rpc_server* server, unsigned int idle_ms, unsigned int request_ms) {
+    if (server == NULL) return ERROR;
+    server->idle_timeout_ms = idle_ms;
+    server->request_timeout_ms = request_ms;
+    return 0;
+}
+
+
+/**
+ * Get the number of connections the server closed because their client was idle or stalled.
+ * @param server the server RPC
+ * @return       the number of connections closed by a timeout
+ */
+unsigned long long rpc_server_timeout_count(rpc_server* server) {
+    if (server == NULL) return 0;
+    return atomic_load(&server->timed_out);
+}
+
+
+/**
+ * Configure an executor class, before serving. A capped class never holds more workers than its
+ * cap, leaving the rest to the other classes.
+ * @param server          the server RPC
+ * @param executor_class  the class, from 0 to RPC_MAX_CLASSES - 1
+ * @param max_concurrency maximum handlers of the class running at once, 0 for no cap
+ * @param priority        the class's priority, higher runs first when workers are contended
+ * @return                0 if successful, and ERROR if otherwise
+ */
+int rpc_server_set_class(rpc_server* server, int executor_class, int max_concurrency,
+                         int priority) {
+    char* TITLE = "rpc-server: rpc_server_set_class";
+    if (server == NULL) {
+        print_error(TITLE, "server is NULL");
+        return ERROR;
+    }
+    int err = executor_set_class(server->executor, executor_class, max_concurrency, priority);
+    if (err) print_error(TITLE, "invalid executor class or cap, or already serving");
+    return err;
+}
+
+
+/**
+ * Set the number of executor workers. Must be called before serving.
+ * @param server      the server RPC
+ * @param num_workers the number of workers
+ * @return            0 if successful, and ERROR if otherwise
+ */
+int rpc_server_set_workers(rpc_server* server, int num_workers) {
+    char* TITLE = "rpc-server: rpc_server_set_workers";
+    if (server == NULL) {
+        print_error(TITLE, "server is NULL");
+        return ERROR;
+    }
+    int err = executor_set_workers(server->executor, num_workers);
+    if (err) print_error(TITLE, "invalid number of workers, or already serving");
+    return err;
+}
+
+
+/**
+ * Pin a kind of server threads to a list of CPUs. Must be called before serving.
+ * @param server  the server RPC
+ * @param threads RPC_THREADS_IO or RPC_THREADS_WORKERS
+ * @param cpus    the CPUs, as a cpulist such as "0-7,16-23", or NULL not to pin the threads
+ * @return        0 if successful, and ERROR if otherwise
+ */
+int rpc_server_set_affinity(rpc_server* server, int threads, const char* cpus) {
+    char* TITLE = "rpc-server: rpc_server_set_affinity";
+    if (server == NULL) {
+        print_error(TITLE, "server is NULL");
+        return ERROR;
+    }
+    int err = ERROR;
+    if (threads == RPC_THREADS_IO) err = affinity_set(&server->io_affinity, cpus);
+    else if (threads == RPC_THREADS_WORKERS) err = executor_set_affinity(server->executor, cpus);
+    if (err) print_error(TITLE, "invalid kind of threads or CPUs, or already serving");
+    return err;
+}
+
+
+/**
+ * Get the queue depth and counters of an executor class.
+ * @param server         the server RPC
+ * @param executor_class the class
+ * @param stats          the returned counters
+ * @return               0 if successful, and ERROR if otherwise
+ */
+int rpc_server_class_stats(rpc_server* server, int executor_class, rpc_class_stats* stats) {
+    char* TITLE = "rpc-server: rpc_server_class_stats";
+    if (server == NULL || stats == NULL) {
+        print_error(TITLE, "server or stats is NULL");
+        return ERROR;
+    }
+    return executor_class_stats(server->executor, executor_class, stats);
+}
+
+
+/**
+ * Get the counters and latencies of a registered function, summed over all connections.
+ * @param server the server RPC
+ * @param name   the function's name
+ * @param stats  the returned counters and latencies
+ * @return       0 if successful, and ERROR if the function does not exist
+ */
+int rpc_server_function_stats(rpc_server* server, char* name, rpc_function_stats* stats) {
+    char* TITLE = "rpc-server: rpc_server_function_stats";
+    if (server == NULL || name == NULL || stats == NULL) {
+        print_error(TITLE, "server, name or stats is NULL");
+        return ERROR;
+    }
+    function_t* f = function_search(server->functions, hash((unsigned char*) name));
+    if (f == NULL) {
+        print_error(TITLE, "function does not exist");
+        return ERROR;
+    }
+    metrics_read(server->metrics, f->slot, stats);
+    return 0;
+}
+
+
+/**
+ * Record the calls the server receives, from now on, to a capture file for the replay tool. A
+ * capture already on is ended first.
+ * @param server      the server RPC
+ * @param path        the capture file, created or truncated, or NULL to stop recording
+ * @param max_payload most data2 bytes recorded per call, 0 for all of them
+ * @return            0 if successful, and ERROR if the file cannot be created
+ */
+int rpc_server_capture(rpc_server* server, const char* path, size_t max_payload) {
+    if (server == NULL) return ERROR;
+    if (path == NULL) {
+        capture_stop(&server->capture);
+        return 0;
+    }
+    return capture_start(&server->capture, path, max_payload);
+}
+
+
+/**
+ * Get the server's readiness fd, to embed the server in an event loop of the caller's own rather
+ * than give it a thread with rpc_serve_all. The fd is an epoll instance, which is readable
+ * whenever rpc_serve_poll has a connection to accept or a request to serve.
+ * @param server the server RPC
+ * @return       the readiness fd, and ERROR if it cannot be created
+ */
+int rpc_server_fd(rpc_server* server) {
+    if (server == NULL) return ERROR;
+    return server_poll_fd(server);
+}
+
+
+/**
+ * Do a bounded amount of the server's work on the calling thread, for a server embedded in an
+ * event loop: accept the connections waiting, and serve one request of each connection that has
+ * one ready. Handlers run on the calling thread, so no hand-off to a worker is involved. A
+ * request is served once its flag has arrived, after which a client stalling its exchange holds
+ * the thread up for POLL_IO_MS at most.
+ * @param server     the server RPC
+ * @param timeout_ms the longest to wait for work, -1 for indefinitely and 0 not to wait
+ * @return           number of connections accepted and requests served, and ERROR on failure
+ *                   or once the server is shut down
+ */
+int rpc_serve_poll(rpc_server* server, int timeout_ms) {
+    if (server == NULL) return ERROR;
+    return server_poll(server, timeout_ms);
+}
+
+
+/**
+ * Shut the server down gracefully: stop accepting connections, let the calls in flight complete
+ * and send their responses, and close every connection once it is idle. It returns once all
+ * connections are closed.
+ * @param server the server RPC
+ * @return       0 if successful, and ERROR if otherwise (including if already shut down)
+ */
+int rpc_shutdown_server(rpc_server* server) {
+    if (server == NULL) return ERROR;
+    return server_shutdown(server);
+}
+
+
+/**
+ * Get the time left before the deadline of the call this thread is handling. Handlers may use
+ * this to cut their work short, as their response is dropped once the deadline passes.
+ * @return milliseconds left, 0 if already expired, or -1 if the call has no deadline
+ */
+long rpc_time_left_ms(void) {
+    if (current_call.deadline_ns == 0) return -1;
+    uint64_t now = rpc_now_ns();
+    if (now >= current_call.deadline_ns) return 0;
+    return (long) ((current_call.deadline_ns - now) / 1000000);
+}
+
+
+/* ------------------------------------- CLIENT STUB ------------------------------------- */
+
+
+/**
+ * Run the remote procedure with a deadline. The deadline is enforced locally, with every send
+ * and receive giving up once it passes, and it travels with the call so the server drops it
+ * rather than run it once the client has given up. On timeout, NULL is returned with the
+ * client's status set to RPC_EXPIRED.
+ * @param client     the client RPC
+ * @param handle     the RPC handle
+ * @param payload    the RPC payload (the data to send to server)
+ * @param timeout_ms time (in milliseconds) the call may take
+ * @return           the response data if successful, or NULL if otherwise
+ */
+rpc_data* rpc_call_with_deadline(rpc_client* client, rpc_handle* handle, rpc_data* payload,
+                                 unsigned int timeout_ms) {
+    uint64_t deadline_ns = rpc_now_ns() + (uint64_t) timeout_ms * 1000000ULL;
+    return client_call(client, handle, payload, deadline_ns);
+}
+
+
+/**
+ * Run the remote procedure with a vectored payload. Its segments, for example a header struct
+ * and the large buffers that follow it, are sent back to back with scatter-gather I/O, so they
+ * need not be copied into one data2 first. The server sees an ordinary payload.
+ * @param client  the client RPC
+ * @param handle  the RPC handle
+ * @param payload the vectored payload
+ * @return        the response data if successful, or NULL if otherwise
+ */
+rpc_data* rpc_call_vec(rpc_client* client, rpc_handle* handle, rpc_vdata* payload) {
+    if (client == NULL || payload == NULL) return NULL;
+    call_io_t io = { .vpayload = payload };
+    return client_call_io(client, handle, &io, 0);
+}
+
+
+/**
+ * Run the remote procedure with a vectored payload, receiving the response straight into the
+ * caller's segments rather than a newly allocated data2. A response longer than the segments
+ * hold is refused, without breaking the connection.
+ * @param client       the client RPC
+ * @param handle       the RPC handle
+ * @param payload      the vectored payload
+ * @param response     the segments to receive the response's data2 into, in order, and the
+ *                     response's data1 on success
+ * @param response_len the returned length of the response's data2
+ * @return             RPC_OK if successful, and the failure status if otherwise
+ */
+int rpc_call_vec_into(rpc_client* client, rpc_handle* handle, rpc_vdata* payload,
+                      rpc_vdata* response, size_t* response_len) {
+    if (client == NULL || payload == NULL || response == NULL || response_len == NULL ||
+        response->num_segments < 0 || (response->num_segments > 0 && response->segments == NULL))
+        return RPC_ERROR;
+    call_io_t io = { .vpayload = payload, .sink = response };
+    client_call_io(client, handle, &io, 0);
+    *response_len = io.sink_len;
+    return client->status;
+}
+
+
+/**
+ * Run the remote procedure, receiving the response's data2 straight into a sink: the caller's
+ * buffer, a file descriptor, or a file mapped for the occasion. A file descriptor is spliced
+ * into from the socket when the kernel can, so the bytes never pass through user space. A
+ * response longer than the sink's capacity is refused, and a sink that fails part way is
+ * drained, both without breaking the connection.
+ * @param client  the client RPC
+ * @param handle  the RPC handle
+ * @param payload the RPC payload (the data to send to server)
+ * @param sink    the sink, its data1, data2_len and map set on success
+ * @return        RPC_OK if successful, and the failure status if otherwise
+ */
+int rpc_call_into(rpc_client* client, rpc_handle* handle, rpc_data* payload, rpc_sink* sink) {
+    if (client == NULL || sink == NULL) return RPC_ERROR;
+    if ((sink->kind == RPC_SINK_BUFFER && sink->buffer == NULL && sink->capacity > 0) ||
+        ((sink->kind == RPC_SINK_FD || sink->kind == RPC_SINK_MMAP) && sink->fd < 0) ||
+        sink->kind < RPC_SINK_BUFFER || sink->kind > RPC_SINK_MMAP)
+        return RPC_ERROR;
+    call_io_t io = { .payload = payload, .target = sink };
+    client_call_io(client, handle, &io, 0);
+    return client->status;
+}
+
+
+/**
+ * Call a streaming function. Its response frames are read with rpc_stream_next as the server's
+ * handler writes them, the first arriving while the handler is still going.
+ * @param client  the client RPC
+ * @param handle  the RPC handle
+ * @param payload the RPC payload (the data to send to server)
+ * @return        the stream if successful, and NULL if otherwise
+ */
+rpc_stream* rpc_call_stream(rpc_client* client, rpc_handle* handle, rpc_data* payload) {
+    if (client == NULL) return NULL;
+    return client_stream_open(client, handle, payload);
+}
+
+
+/**
+ * Read the next response frame of a stream.
+ * @param stream the stream
+ * @return       the frame if successful, and NULL once the stream is over
+ */
+rpc_data* rpc_stream_next(rpc_stream* stream) {
+    if (stream == NULL) return NULL;
+    return client_stream_next(stream);
+}
+
+
+/**
+ * Get the status of a stream, telling apart why rpc_stream_next returned NULL.
+ * @param stream the stream
+ * @return       RPC_OK if the stream goes on or ended well, or its failure status
+ */
+int rpc_stream_status(rpc_stream* stream) {
+    if (stream == NULL) return RPC_ERROR;
+    return stream->status;
+}
+
+
+/**
+ * Free a stream, giving its client's connection back. A stream that is not over yet is cut
+ * short, which the server's handler sees as a failed write.
+ * @param stream the stream
+ * @return       the stream's status
+ */
+int rpc_stream_close(rpc_stream* stream) {
+    if (stream == NULL) return RPC_ERROR;
+    return client_stream_close(stream);
+}
+
+
+/**
+ * Cast a one-way call, for notifications and the like whose result is not needed. The call is
+ * written in one go, without the verification and size negotiation a call waits for, and the
+ * server sends nothing back, so back to back casts are bound by bandwidth rather than round
+ * trips. A call after casts on the same client is served after them.
+ * @param client  the client RPC
+ * @param handle  the RPC handle
+ * @param payload the RPC payload (the data to send to server)
+ * @return        RPC_OK if the call was written, RPC_OVERLENGTH if data2 is longer than
+ *                MAX_FRAME_LEN, and RPC_ERROR if otherwise
+ */
+int rpc_cast(rpc_client* client, rpc_handle* handle, rpc_data* payload) {
+    if (client == NULL) return RPC_ERROR;
+    return client_cast(client, handle, payload);
+}
+
+
+/**
+ * Turn checksums of the client's payloads and responses on or off. Both ends then extend a
+ * CRC32C over data2 as it is sent and received, in the same pass, and a call whose payload or
+ * response fails the check is answered with RPC_CORRUPT rather than wrong data. The setting is
+ * negotiated with the server, and again on every reconnection.
+ * @param client  the client RPC
+ * @param enabled 1 to turn checksums on, 0 to turn them off
+ * @return        0 if successful, and -1 if the server cannot be reached or refuses checksums
+ */
+int rpc_client_set_checksum(rpc_client* client, int enabled) {
+    if (client == NULL || client->stream != NULL) return ERROR;
+    client->want_checksum = enabled != 0;
+    int err = client->conn_fd < 0 ? client_reconnect(client) : client_negotiate(client);
+    if (err == 0 && client->checksum == client->want_checksum) return 0;
+
+    // a server that does not know the option closes the connection, which is re-established
+    // without it
+    client->want_checksum = 0;
+    if (err) client_reconnect(client);
+    return ERROR;
+}
+
+
+/**
+ * Get the status of the client's last call, telling apart why it returned NULL.
+ * @param client the client RPC
+ * @return       RPC_OK if the last call succeeded, or its failure status
+ */
+int rpc_client_status(rpc_client* client) {
+    if (client == NULL) return RPC_ERROR;
+    return client->status;
+}
+
+
+/**
+ * Initialize a client response cache. The cache is thread-safe and may be attached to any
+ * number of clients, as long as they talk to servers registering the same functions.
+ * @param max_bytes the maximum bytes held by cached payloads and responses, 0 for unbounded
+ * @return          the client response cache
+ */
+rpc_client_cache* rpc_client_cache_init(size_t max_bytes) {
+    rpc_client_cache* cache = (rpc_client_cache*) malloc(sizeof(rpc_client_cache));
+    assert(cache);
+    cache->cache = cache_init(0, max_bytes);
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->ttls = NULL;
+    cache->num_ttls = 0;
+    return cache;
+}
+
+
+/**
+ * Attach a response cache to a client. Only handles opted in with rpc_client_cache_ttl
+ * are cached.
+ * @param client the client RPC
+ * @param cache  the client response cache, or NULL to detach
+ * @return       0 if successful, and ERROR if otherwise
+ */
+int rpc_client_set_cache(rpc_client* client, rpc_client_cache* cache) {
+    char* TITLE = "rpc-client: rpc_client_set_cache";
+    if (client == NULL) {
+        print_error(TITLE, "client is NULL");
+        return ERROR;
+    }
+    client->cache = cache;
+    return 0;
+}
+
+
+/**
+ * Set the time to live of a handle's cached responses. Only idempotent handles should be
+ * opted in, since a cached response is returned without calling the server.
+ * @param cache  the client response cache
+ * @param handle the RPC handle
+ * @param ttl_ms time to live in milliseconds, 0 to stop caching the handle
+ * @return       0 if successful, and ERROR if otherwise
+ */
+int rpc_client_cache_ttl(rpc_client_cache* cache, rpc_handle* handle, unsigned int ttl_ms) {
+    char* TITLE = "rpc-client: rpc_client_cache_ttl";
+    if (cache == NULL || handle == NULL) {
+        print_error(TITLE, "cache or handle is NULL");
+        return ERROR;
+    }
+    uint64_t ttl_ns = (uint64_t) ttl_ms * 1000000ULL;
+
+    pthread_mutex_lock(&cache->lock);
+    size_t i = 0;
+    while (i < cache->num_ttls && cache->ttls[i].function_id != handle->function_id) i++;
+    if (i == cache->num_ttls) {
+        cache->ttls = (cache_ttl_t*) realloc(cache->ttls, (i + 1) * sizeof(cache_ttl_t));
+        assert(cache->ttls);
+        cache->ttls[i].function_id = handle->function_id;
+        (cache->num_ttls)++;
+    }
+    cache->ttls[i].ttl_ns = ttl_ns;
+    pthread_mutex_unlock(&cache->lock);
+
+    // a handle opted out keeps nothing around
+    if (ttl_ns == 0) cache_invalidate(cache->cache, handle->function_id);
+    return 0;
+}
+
+
+/**
+ * Drop cached responses.
+ * @param cache  the client response cache
+ * @param handle the RPC handle whose responses are dropped, or NULL for all
+ */
+void rpc_client_cache_invalidate(rpc_client_cache* cache, rpc_handle* handle) {
+    if (cache == NULL) return;
+    if (handle == NULL) cache_clear(cache->cache);
+    else cache_invalidate(cache->cache, handle->function_id);
+}
+
+
+/**
+ * Get the counters of a client response cache.
+ * @param cache the client response cache
+ * @param stats the returned counters
+ * @return      0 if successful, and ERROR if otherwise
+ */
+int rpc_client_cache_stats(rpc_client_cache* cache, rpc_cache_stats* stats) {
+    char* TITLE = "rpc-client: rpc_client_cache_stats";
+    if (cache == NULL || stats == NULL) {
+        print_error(TITLE, "cache or stats is NULL");
+        return ERROR;
+    }
+    cache_get_stats(cache->cache, stats);
+    return 0;
+}
+
+
+/**
+ * Free a client response cache. It must be detached from (or outlive) all of its clients.
+ * @param cache the client response cache
+ */
+void rpc_client_cache_free(rpc_client_cache* cache) {
+    if (cache == NULL) return;
+    cache_free(cache->cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->ttls);
+    free(cache);
+}
+
+
+/**
+ * Initialize a multi-endpoint client over replicas of a server, which all register the same
+ * functions. Unlike an rpc_client, it may be shared by many threads: each call takes one of the
+ * replica's connections, and as many connections are opened as there are calls at once.
+ * @param endpoints     the replicas' addresses and ports
+ * @param num_endpoints the number of replicas
+ * @param policy        RPC_BALANCE_LEAST_OUTSTANDING or RPC_BALANCE_EWMA
+ * @return              the multi-endpoint client
+ */
+rpc_balancer* rpc_balancer_init(rpc_endpoint* endpoints, int num_endpoints, int policy) {
+    return balancer_init(endpoints, num_endpoints, policy);
+}
+
+
+/**
+ * Find a remote function, on any replica in rotation.
+ * @param balancer the multi-endpoint client
+ * @param name     the function's name
+ * @return         the RPC handle, or NULL on error
+ */
+rpc_handle* rpc_balancer_find(rpc_balancer* balancer, char* name) {
+    if (balancer == NULL || name == NULL) return NULL;
+    return balancer_find(balancer, name);
+}
+
+
+/**
+ * Call a remote function on the least loaded replica, per the client's policy. A call that
+ * fails counts against its replica, which is ejected after a few failures in a row (or at once
+ * if it cannot be connected to), and probed with a call again after a time out.
+ * @param balancer the multi-endpoint client
+ * @param handle   the RPC handle
+ * @param payload  the RPC payload (the data to send to server)
+ * @param status   the returned status of the call, may be NULL
+ * @return         the response data if successful, or NULL if otherwise
+ */
+rpc_data* rpc_balancer_call(rpc_balancer* balancer, rpc_handle* handle, rpc_data* payload,
+                            int* status) {
+    if (balancer == NULL || handle == NULL) {
+        if (status != NULL) *status = RPC_ERROR;
+        return NULL;
+    }
+    return balancer_call(balancer, handle, payload, status);
+}
+
+
+/**
+ * Opt a handle into hedged calls, or out of them. Only idempotent functions should be hedged,
+ * since a hedged call may run on two replicas.
+ * @param balancer   the multi-endpoint client
+ * @param handle     the RPC handle
+ * @param percentile the percentile of recent latencies a call is hedged at, 0 to opt out
+ * @param budget_pct the most hedges, in percent of the handle's calls
+ * @return           0 if successful, and ERROR if otherwise
+ */
+int rpc_balancer_hedge(rpc_balancer* balancer, rpc_handle* handle, double percentile,
+                       double budget_pct) {
+    if (balancer == NULL || handle == NULL) return ERROR;
+    return balancer_hedge(balancer, handle->function_id, percentile, budget_pct);
+}
+
+
+/**
+ * Get the hedging counters of a handle.
+ * @param balancer the multi-endpoint client
+ * @param handle   the RPC handle
+ * @param stats    the returned counters
+ * @return         0 if successful, and ERROR if otherwise
+ */
+int rpc_balancer_hedge_stats(rpc_balancer* balancer, rpc_handle* handle, rpc_hedge_stats* stats) {
+    if (balancer == NULL || handle == NULL || stats == NULL) return ERROR;
+    return balancer_hedge_stats(balancer, handle->function_id, stats);
+}
+
+
+/**
+ * Get the load and health of a replica.
+ * @param balancer the multi-endpoint client
+ * @param index    the replica's index in the endpoints given at init
+ * @param stats    the returned stats
+ * @return         0 if successful, and ERROR if otherwise
+ */
+int rpc_balancer_endpoint_stats(rpc_balancer* balancer, int index, rpc_endpoint_stats* stats) {
+    if (balancer == NULL || stats == NULL) return ERROR;
+    return balancer_endpoint_stats(balancer, index, stats);
+}
+
+
+/**
+ * Close a multi-endpoint client. No call may be in flight.
+ * @param balancer the multi-endpoint client
+ */
+void rpc_balancer_close(rpc_balancer* balancer) {
+    balancer_free(balancer);
+}
+
+
+/**
+ * Initialize a request coalescer. Attached to clients on different threads, it collapses their
+ * identical calls in flight at the same time (same handle, data1 and data2) into one request to
+ * the server, whose response each of them gets a copy of. Only idempotent calls should go
+ * through a client with a coalescer, since a call may be answered without being sent.
+ * @return the request coalescer
+ */
+rpc_coalescer* rpc_coalescer_init(void) {
+    return coalescer_init();
+}
+
+
+/**
+ * Attach a request coalescer to a client, or detach it with NULL.
+ * @param client    the client RPC
+ * @param coalescer the request coalescer
+ * @return          0 if successful, and ERROR if otherwise
+ */
+int rpc_client_set_coalescer(rpc_client* client, rpc_coalescer* coalescer) {
+    char* TITLE = "rpc-client: rpc_client_set_coalescer";
+    if (client == NULL) {
+        print_error(TITLE, "client is NULL");
+        return ERROR;
+    }
+    client->coalescer = coalescer;
+    return 0;
+}
+
+
+/**
+ * Get the counters of a request coalescer.
+ * @param coalescer the request coalescer
+ * @param stats     the returned counters
+ * @return          0 if successful, and ERROR if otherwise
+ */
+int rpc_coalescer_stats(rpc_coalescer* coalescer, rpc_coalesce_stats* stats) {
+    if (coalescer == NULL || stats == NULL) return ERROR;
+    coalescer_get_stats(coalescer, stats);
+    return 0;
+}
+
+
+/**
+ * Free a request coalescer. No client may use it anymore.
+ * @param coalescer the request coalescer
+ */
+void rpc_coalescer_free(rpc_coalescer* coalescer) {
+    coalescer_free(coalescer);
+}
+
+
+/* ----------------------------------- TYPED ARRAYS ----------------------------------- */
+
+
+/**
+ * Encode numeric elements as a typed array, to be sent as a payload or returned as a response.
+ * The elements are converted to network order, unless the other end shares the host's byte
+ * order: a client negotiates it with its server when it first encodes an array, and a handler
+ * uses what the client of the call being served negotiated.
+ * @param client the client RPC the array is sent on, NULL for a handler's response
+ * @param type   the RPC_ARRAY_* element type
+ * @param elems  the elements, in the host's byte order
+ * @param count  number of elements
+ * @return       the RPC data if successful, and NULL if otherwise
+ */
+rpc_data* rpc_array_new(rpc_client* client, int type, const void* elems, size_t count) {
+    int host_order = client != NULL ? client_host_order(client) :
+                     current_call.server != NULL && current_call.host_order;
+    return array_encode(type, elems, count, host_order);
+}
+
+
+/**
+ * Get the element type and number of elements of a typed array.
+ * @param data  the payload or response
+ * @param count the returned number of elements, may be NULL
+ * @return      the RPC_ARRAY_* element type, and ERROR if data is not a typed array
+ */
+int rpc_array_type(rpc_data* data, size_t* count) {
+    return array_type(data, count);
+}
+
+
+/**
+ * Get the elements of a typed array, in the host's byte order. They are converted in place, at
+ * most once, and only if the sender had another byte order or sent them in network order.
+ * @param data  the payload or response, as received
+ * @param type  the RPC_ARRAY_* element type expected
+ * @param count the returned number of elements, may be NULL
+ * @return      the elements if successful, and NULL if data is not a typed array of that type
+ */
+void* rpc_array_elems(rpc_data* data, int type, size_t* count) {
+    return array_decode(data, type, count);
+}
+
+
+/* ------------------------------------- TRACING ------------------------------------- */
+
+
+/**
+ * Turn call tracing on or off. Every phase of a traced call is timestamped: header, payload,
+ * queue, handler and send at the server, and header, payload and response at the client. A call
+ * the client traces carries its call id to the server, which traces it too if tracing is on
+ * there, so both ends of the call share the id.
+ * @param sample_every trace every n-th call of each thread, 1 for all calls, 0 to stop tracing
+ */
+void rpc_trace_enable(unsigned int sample_every) {
+    trace_set_sampling(sample_every);
+}
+
+
+/**
+ * Dump the most recent traced calls of every thread as Chrome trace event JSON. It is safe to
+ * dump while calls are being traced.
+ * @param path the file to write
+ * @return     0 if successful, and ERROR if otherwise
+ */
+int rpc_trace_dump(const char* path) {
+    char* TITLE = "rpc_trace_dump";
+    if (path == NULL) {
+        print_error(TITLE, "path is NULL");
+        return ERROR;
+    }
+    return trace_dump(path);
+}
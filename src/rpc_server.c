@@ -3,7 +3,8 @@
  * File    : rpc_server.c
  * Purpose : Server RPC functions specifically related to serving the client's requests.
  *
- * The file also supports multi-threading for server to handle multiple clients at once.
+ * The file also supports multi-threading for server to handle multiple clients at once, and
+ * embedding the server in the caller's own event loop instead (see rpc_serve_poll).
  */
 
 #include <stdio.h>
@@ -11,9 +12,22 @@
 #include <string.h>
 #include <assert.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "rpc_server.h"
 #include "rpc_utils.h"
+#include "rpc_array.h"
+
+#define POLL_EVENTS  (int) 64     // most ready connections served by a single rpc_serve_poll
+#define POLL_ACCEPTS (int) 16     // most connections accepted by a single rpc_serve_poll
+
+__thread call_context_t current_call = { 0 };
 
 
 /* ----------------------------- INITIALIZATION ----------------------------- */
@@ -21,7 +35,8 @@
 /**
  * Create the listen socket for server.
  * @param port        port number
- * @param timeout_sec time (in seconds) before timeout for receive/send occurs
+ * @param timeout_sec time (in seconds) a send may block before it fails. Receives are not timed
+ *                    out by the socket, but by the connection's timer (see conn_expire)
  * @param queue_size  the queue size for accepting clients
  * @return            -1 on failure, and the listen socket on success
  */
@@ -69,12 +84,13 @@ int create_listen_socket(int port, int timeout_sec, int queue_size) {
         return ERROR;
     }
 
-    // set options to reusable address
+    // set options to reusable address, and to no delay which accepted sockets inherit
+    // (each call is a lockstep exchange of small messages, which Nagle's algorithm would stall)
     int re = 1;
     err  = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
                       &re, sizeof re);
-    err += setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO,
-                      &timeout, sizeof timeout);
+    err += setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY,
+                      &re, sizeof re);
     err += setsockopt(listen_fd, SOL_SOCKET, SO_SNDTIMEO,
                       &timeout, sizeof timeout);
     if (err < 0) {
@@ -144,58 +160,917 @@ function_t* rpc_serve_find(struct rpc_server* server, int accept_fd) {
 }
 
 
+/**
+ * Admit a call, if the server has room for another call in flight. A connection serves one call
+ * at a time, so only the server-wide limit can be reached.
+ * @param server the server RPC
+ * @return       0 if admitted, and OVERLOADED if otherwise
+ */
+static int admit_call(struct rpc_server* server) {
+    int server_inflight = atomic_fetch_add(&server->inflight, 1);
+    if (server->max_inflight > 0 && server_inflight >= server->max_inflight) {
+        atomic_fetch_sub(&server->inflight, 1);
+        atomic_fetch_add(&server->shed, 1);
+        return OVERLOADED;
+    }
+    return 0;
+}
+
+/**
+ * Release an admitted call, once its response has been sent.
+ * @param server the server RPC
+ */
+static void release_call(struct rpc_server* server) {
+    atomic_fetch_sub(&server->inflight, 1);
+}
+
+/**
+ * Time a timeout from now ends at.
+ * @param timeout_ms the timeout, 0 for no limit
+ * @return           the time (see rpc_now_ns), 0 for no limit
+ */
+static uint64_t due_in(unsigned int timeout_ms) {
+    return timeout_ms ? rpc_now_ns() + (uint64_t) timeout_ms * 1000000ULL : 0;
+}
+
+/**
+ * Set when the client must have sent what the connection waits on next, or taken the response,
+ * for the connection's timer to close it once that passes. Mostly a store, the timer checking it
+ * as it fires: the timer is only moved when it would fire too late otherwise. The polling thread
+ * of a polled connection is the one advancing the timers, so its sends and receives give up by
+ * then themselves instead, and within POLL_IO_MS, not to hold up the other connections.
+ * @param server the server RPC
+ * @param conn   the client's connection
+ * @param due_ns the time (see rpc_now_ns), 0 for no limit
+ */
+static void conn_expect(struct rpc_server* server, connection_t* conn, uint64_t due_ns) {
+    atomic_store_explicit(&conn->due_ns, due_ns, memory_order_relaxed);
+    if (conn->polled) {
+        uint64_t io_due_ns = due_in(POLL_IO_MS);
+        rpc_set_io_deadline(due_ns != 0 && due_ns < io_due_ns ? due_ns : io_due_ns);
+        return;
+    }
+    if (due_ns != 0 && due_ns < atomic_load_explicit(&conn->timer_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&conn->timer_ns, due_ns, memory_order_relaxed);
+        wheel_arm(&server->timers, &conn->timer, due_ns);
+    }
+}
+
+/**
+ * Note that the connection waits on nothing of the client's while its handler runs, which its
+ * timer does not count against the client.
+ * @param conn the client's connection
+ */
+static void conn_handling(connection_t* conn) {
+    atomic_store_explicit(&conn->due_ns, 0, memory_order_relaxed);
+    if (conn->polled) rpc_set_io_deadline(0);
+}
+
+/**
+ * Call the function's handler, or answer from the function's response cache if it is pure.
+ * @param server      the server RPC
+ * @param function    the function
+ * @param payload     the call's payload
+ * @param deadline_ns the call's deadline, 0 if it has none
+ * @param host_order  whether the client shares the host's byte order, as negotiated
+ * @return            the handler's response
+ */
+static rpc_data* call_handler(struct rpc_server* server, function_t* function, rpc_data* payload,
+                              uint64_t deadline_ns, int host_order) {
+    // a pure function's response may already be cached, in which case the handler is skipped
+    rpc_data* response = NULL;
+    if (function->cache != NULL)
+        response = cache_get(function->cache, function->id, payload);
+    if (response == NULL) {
+        rpc_handler handler = function->f_handler;
+        current_call.server = server;
+        current_call.deadline_ns = deadline_ns;
+        current_call.host_order = host_order;
+        response = handler(payload);
+        current_call.server = NULL;
+        current_call.deadline_ns = 0;
+        current_call.host_order = 0;
+        if (function->cache != NULL)
+            cache_put(function->cache, function->id, payload, response, 0);
+    }
+    return response;
+}
+
+
+/* a handler call, handed over to an executor worker */
+typedef struct handler_call {
+    struct rpc_server* server;
+    function_t* function;
+    rpc_data* payload;
+    uint64_t deadline_ns;
+    int host_order;
+    uint64_t started_ns;
+    uint64_t finished_ns;
+} handler_call_t;
+
+/**
+ * Run a handler call on an executor worker.
+ * @param call_obj the handler call
+ * @return         the handler's response
+ */
+static void* run_handler_call(void* call_obj) {
+    handler_call_t* call = (handler_call_t*) call_obj;
+    call->started_ns = rpc_now_ns();
+    rpc_data* response = call_handler(call->server, call->function, call->payload,
+                                      call->deadline_ns, call->host_order);
+    call->finished_ns = rpc_now_ns();
+    return response;
+}
+
+
+/**
+ * Get the bytes of an RPC data on the wire, its data1 and data2.
+ * @param data the RPC data
+ * @return     the bytes, 0 for NULL
+ */
+static size_t data_bytes(rpc_data* data) {
+    return data ? sizeof(uint64_t) + data->data2_len : 0;
+}
+
+
+/**
+ * Serve an admitted call, from receiving its payload to sending its response. This thread only
+ * does the call's I/O, the handler itself runs on an executor worker.
+ * @param server      the server RPC
+ * @param conn        the client's connection
+ * @param function    the called function
+ * @param deadline_ns the call's deadline, 0 if it has none
+ * @param sample      the call's sample, in which its bytes and timings are recorded
+ * @param trace_id    the call's id if it is traced, 0 if not
+ * @return            0 if successful, and otherwise if not
+ */
+static int serve_admitted(struct rpc_server* server, connection_t* conn, function_t* function,
+                          uint64_t deadline_ns, call_sample_t* sample, uint64_t trace_id) {
+    char* TITLE = "server: rpc_serve_all";
+    int err;
+
+    // read the function's payload
+    uint64_t payload_ns = trace_id ? rpc_now_ns() : 0;
+    int status;
+    rpc_data* payload = rpc_receive_payload_status(conn->fd, &status, server->max_payload);
+    if (payload == NULL && status == CORRUPT) {
+        // all of the payload was received, so the client is still in step and waits for an answer
+        print_error(TITLE, "payload failed its checksum");
+        err = rpc_send_status(conn->fd, CORRUPT);
+        return err ? ERROR : CORRUPT;
+    }
+    if (payload == NULL && status == OVERLENGTH) {
+        // refused before its data2 was sent, which the client was told, so it waits for nothing
+        print_error(TITLE, "payload exceeds the server's max payload");
+        return OVERLENGTH;
+    }
+    if (payload == NULL)
+        return ERROR;
+    sample->bytes_in = data_bytes(payload);
+    capture_record(&server->capture, CAPTURE_KIND_CALL, conn->id, function, payload, deadline_ns);
+    if (trace_id)
+        trace_event(trace_id, TRACE_SERVER, PHASE_PAYLOAD, payload_ns, rpc_now_ns());
+
+    // drop the call if it expired while its payload was in transit
+    if (deadline_ns != 0 && rpc_now_ns() >= deadline_ns) {
+        rpc_data_free(payload);
+        print_error(TITLE, "call expired before its handler was called");
+        err = rpc_send_status(conn->fd, EXPIRED);
+        return err ? ERROR : EXPIRED;
+    }
+
+    // call the function
+    if (function->f_handler == NULL) {
+        rpc_data_free(payload);
+        return ERROR;
+    }
+    handler_call_t call = { server, function, payload, deadline_ns, conn->host_order, 0, 0 };
+    uint64_t queued_ns = rpc_now_ns();
+    conn_handling(conn);
+    rpc_data* response = executor_run(server->executor, function->executor_class, conn->home,
+                                      run_handler_call, &call);
+    conn_expect(server, conn, due_in(server->request_timeout_ms));
+    rpc_data_free(payload);
+    sample->ran = 1;
+    sample->queue_wait_ns = call.started_ns - queued_ns;
+    sample->handler_ns = call.finished_ns - call.started_ns;
+    sample->bytes_out = data_bytes(response);
+    sample->error = response == NULL;
+    if (trace_id) {
+        trace_event(trace_id, TRACE_SERVER, PHASE_QUEUE, queued_ns, call.started_ns);
+        trace_event(trace_id, TRACE_SERVER, PHASE_HANDLER, call.started_ns, call.finished_ns);
+    }
+
+    // send the response to client
+    uint64_t send_ns = trace_id ? rpc_now_ns() : 0;
+    err = rpc_send_payload(conn->fd, response);
+    rpc_data_free(response);
+    if (trace_id)
+        trace_event(trace_id, TRACE_SERVER, PHASE_SEND, send_ns, rpc_now_ns());
+    if (err)
+        print_error(TITLE, "cannot send the response data to client");
+    return err;
+}
+
+
 /**
  * Server RPC function to serve the call request from client. It will first try to receive
  * from the client the appropriate RPC data packet, and call the handler accordingly.
- * @param server   the server RPC
- * @param accept_fd  the connection socket to a specific client
- * @return         0 if successful, and otherwise if not
+ * A call with a deadline that has already passed is answered with EXPIRED, and a call beyond
+ * the server's in-flight limits is answered with OVERLOADED, both without calling the handler.
+ * @param server  the server RPC
+ * @param conn    the client's connection
+ * @param service the requested service, CALL_SERVICE, CALL_DEADLINE_SERVICE or
+ *                CALL_TRACED_SERVICE
+ * @return        0 if successful, and otherwise if not
  */
-int rpc_serve_call(struct rpc_server* server, int accept_fd) {
+int rpc_serve_call(struct rpc_server* server, connection_t* conn, int service) {
     char* TITLE = "server: rpc_serve_all";
 
+    // a call is traced if sampled here, or if the client traced it and tracing is on here too
+    uint64_t trace_start = trace_enabled() ? rpc_now_ns() : 0;
+    uint64_t trace_id = 0;
+    if (trace_start && service != CALL_TRACED_SERVICE && trace_sample())
+        trace_id = trace_new_id();
+
     // read the function's id to get the function for call
     int err;
     uint64_t id;
-    err = rpc_receive_uint(accept_fd, &id);
+    err = rpc_receive_uint(conn->fd, &id);
     if (err) {
         print_error(TITLE, "cannot receive function's id verification from client");
         return ERROR;
     }
 
-    // send verification flag to client
+    // the client's remaining time (in microseconds) becomes our own deadline, which avoids
+    // comparing clocks of the 2 end systems. A traced call always sends it, 0 for no deadline
+    uint64_t deadline_ns = 0;
+    if (service == CALL_DEADLINE_SERVICE || service == CALL_TRACED_SERVICE) {
+        uint64_t budget_us;
+        err = rpc_receive_uint(conn->fd, &budget_us);
+        if (err) {
+            print_error(TITLE, "cannot receive call's deadline from client");
+            return ERROR;
+        }
+        if (service == CALL_DEADLINE_SERVICE || budget_us != 0)
+            deadline_ns = rpc_now_ns() + budget_us * 1000;
+
+        // nor is its payload waited on past then, as the client gives up on the exchange too
+        uint64_t due_ns = atomic_load_explicit(&conn->due_ns, memory_order_relaxed);
+        if (deadline_ns != 0 && (due_ns == 0 || deadline_ns < due_ns))
+            conn_expect(server, conn, deadline_ns);
+    }
+
+    // the call id of a call the client traced
+    if (service == CALL_TRACED_SERVICE) {
+        uint64_t call_id;
+        err = rpc_receive_uint(conn->fd, &call_id);
+        if (err) {
+            print_error(TITLE, "cannot receive call's id from client");
+            return ERROR;
+        }
+        if (trace_start) trace_id = call_id;
+    }
+
+    // send verification flag to client, shedding the call right away if we have no room for it
     function_t* function = function_search(server->functions, id);
-    int flag = -(function == NULL);
-    err = rpc_send_int(accept_fd, flag);
+    int flag = -(function == NULL || function->f_handler == NULL);
+    if (flag == 0 && deadline_ns != 0 && rpc_now_ns() >= deadline_ns)
+        flag = EXPIRED;
+    if (flag == 0)
+        flag = admit_call(server);
+    err = rpc_send_int(conn->fd, flag);
     if (err) {
+        if (flag == 0) release_call(server);
         print_error(TITLE, "cannot send verification flag to client");
         return ERROR;
     }
-    if (flag < 0) {
+    if (flag == ERROR) {
         print_error(TITLE,
-                    "verification failed; handle and handler have different ids");
+                    "verification failed; handle and handler have different ids, or streams");
         return ERROR;
     }
 
-    // read the function's payload
-    rpc_data* payload = rpc_receive_payload(accept_fd);
-    if (payload == NULL)
-        return ERROR;
+    if (trace_id)
+        trace_event(trace_id, TRACE_SERVER, PHASE_HEADER, trace_start, rpc_now_ns());
 
-    // call the function
+    // calls to a registered function are recorded, whether they are served or not
+    call_sample_t sample = { .error = flag != 0 };
+    if (flag == EXPIRED) {
+        print_error(TITLE, "call expired before its payload was received");
+        err = EXPIRED;
+    }
+    else if (flag == OVERLOADED) {
+        print_error(TITLE, "call shed, too many calls in flight");
+        err = OVERLOADED;
+    }
+    else {
+        err = serve_admitted(server, conn, function, deadline_ns, &sample, trace_id);
+        release_call(server);
+        sample.error |= err != 0;
+    }
+    metrics_record(conn->metrics, function->slot, &sample);
+    if (trace_id)
+        trace_event(trace_id, TRACE_SERVER, PHASE_CALL, trace_start, rpc_now_ns());
+    return err;
+}
+
+
+/**
+ * Server RPC function to serve a one-way call from client. The call is read in one go, and its
+ * handler runs as for any call, but nothing is sent back: its response is discarded, and a call
+ * that cannot be served (unknown function, no room in flight, corrupt payload) is dropped.
+ * @param server the server RPC
+ * @param conn   the client's connection
+ * @return       0 once the frame is received in full, whether its call ran or was dropped, and
+ *               ERROR if not, as the connection is then out of step
+ */
+int rpc_serve_cast(struct rpc_server* server, connection_t* conn) {
+    char* TITLE = "server: rpc_serve_cast";
+    uint64_t id;
+    if (rpc_receive_uint(conn->fd, &id) < 0) {
+        print_error(TITLE, "cannot receive function's id from client");
+        return ERROR;
+    }
+    int status;
+    rpc_data* payload = rpc_receive_oneway(conn->fd, CAST_SERVICE, id, &status);
+    if (payload == NULL) {
+        print_error(TITLE, "cannot receive one-way call's payload from client");
+        return status == CORRUPT ? 0 : ERROR;
+    }
+    function_t* function = function_search(server->functions, id);
     if (function == NULL || function->f_handler == NULL) {
+        print_error(TITLE, "one-way call to an unknown function dropped");
         rpc_data_free(payload);
+        return 0;
+    }
+    capture_record(&server->capture, CAPTURE_KIND_CAST, conn->id, function, payload, 0);
+
+    // a cast is recorded like a call, and shed like one, only silently
+    call_sample_t sample = { .bytes_in = data_bytes(payload) };
+    int err = admit_call(server);
+    if (err == 0) {
+        handler_call_t call = { server, function, payload, 0, conn->host_order, 0, 0 };
+        uint64_t queued_ns = rpc_now_ns();
+        conn_handling(conn);
+        rpc_data* response = executor_run(server->executor, function->executor_class, conn->home,
+                                          run_handler_call, &call);
+        release_call(server);
+        sample.ran = 1;
+        sample.queue_wait_ns = call.started_ns - queued_ns;
+        sample.handler_ns = call.finished_ns - call.started_ns;
+        sample.error = response == NULL;
+        rpc_data_free(response);
+    }
+    else {
+        print_error(TITLE, "one-way call shed, too many calls in flight");
+        sample.error = 1;
+    }
+    rpc_data_free(payload);
+    metrics_record(conn->metrics, function->slot, &sample);
+    return 0;
+}
+
+
+/* a streaming handler call, handed over to an executor worker */
+typedef struct stream_call {
+    struct rpc_server* server;
+    function_t* function;
+    rpc_data* payload;
+    rpc_stream_writer* writer;
+    int status;
+    uint64_t started_ns;
+    uint64_t finished_ns;
+} stream_call_t;
+
+/**
+ * Run a streaming handler call on an executor worker, which writes the frames itself.
+ * @param call_obj the streaming handler call
+ * @return         NULL, the handler's status is kept in the call
+ */
+static void* run_stream_call(void* call_obj) {
+    stream_call_t* call = (stream_call_t*) call_obj;
+    call->started_ns = rpc_now_ns();
+    current_call.server = call->server;
+    current_call.host_order = call->writer->conn->host_order;
+    rpc_set_io_checksum(call->writer->conn->checksum);
+    call->status = call->function->f_stream(call->payload, call->writer);
+    rpc_set_io_checksum(0);
+    current_call.server = NULL;
+    current_call.host_order = 0;
+    call->finished_ns = rpc_now_ns();
+
+    // the connection's thread flushes what is left, then ends the stream
+    rpc_stream_writer* writer = call->writer;
+    pthread_mutex_lock(&writer->lock);
+    writer->finished = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+
+/**
+ * Gather a frame for the connection's thread to flush, or what is left of it after a partial
+ * write, then wait while too much is gathered already. The lock must be held.
+ * @param writer the stream's writer
+ * @param frame  the frame
+ * @param size   the frame's encoded size
+ * @param sent   bytes of the frame already written
+ */
+static void stream_gather(rpc_stream_writer* writer, rpc_data* frame, size_t size, size_t sent) {
+    stream_block_t* block = writer->tail;
+    if (block == NULL || block->capacity - block->len < size) {
+        size_t capacity = size > STREAM_BLOCK ? size : STREAM_BLOCK;
+        block = (stream_block_t*) malloc(sizeof(stream_block_t) + capacity);
+        assert(block);
+        block->next = NULL;
+        block->len = 0;
+        block->capacity = capacity;
+        if (writer->tail) writer->tail->next = block;
+        else writer->head = block;
+        writer->tail = block;
+    }
+    char* p = block->data + block->len;
+    rpc_encode_oneway(STREAM_FRAME, writer->function_id, frame, p);
+    if (sent > 0) memmove(p, p + sent, size - sent);
+    block->len += size - sent;
+    writer->queued += size - sent;
+    pthread_cond_broadcast(&writer->cond);
+
+    while (!writer->err && writer->queued > STREAM_MAX_QUEUED)
+        pthread_cond_wait(&writer->cond, &writer->lock);
+}
+
+
+/**
+ * Flush the frames a streaming handler gathers, from the connection's thread, until the handler
+ * returns. Before each flush, the thread waits for the client to make room, then for a block's
+ * worth of frames up to STREAM_WINDOW_NS, as frames keep gathering meanwhile: the faster the
+ * handler writes, or the more the client lags, the more frames a single sendmsg carries.
+ * @param writer the stream's writer
+ */
+static void stream_flush(rpc_stream_writer* writer) {
+    int fd = writer->conn->fd;
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->head == NULL && !writer->finished)
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        if (writer->head == NULL) break;
+        if (!writer->err) {
+            pthread_mutex_unlock(&writer->lock);
+            struct pollfd ready = { fd, POLLOUT, 0 };
+            while (poll(&ready, 1, -1) < 0 && errno == EINTR);
+            pthread_mutex_lock(&writer->lock);
+
+            struct timespec window;
+            clock_gettime(CLOCK_REALTIME, &window);
+            window.tv_nsec += (long) STREAM_WINDOW_NS;
+            if (window.tv_nsec >= 1000000000L) {
+                window.tv_sec++;
+                window.tv_nsec -= 1000000000L;
+            }
+            while (!writer->err && !writer->finished && writer->queued < STREAM_BLOCK &&
+                   pthread_cond_timedwait(&writer->cond, &writer->lock, &window) == 0);
+        }
+
+        // all gathered frames, in as few sendmsg as the client's window allows
+        stream_block_t* blocks = writer->head;
+        writer->head = writer->tail = NULL;
+        writer->queued = 0;
+        writer->flushing = 1;
+        pthread_cond_broadcast(&writer->cond);
+        int err = writer->err;
+        pthread_mutex_unlock(&writer->lock);
+
+        int num_blocks = 0;
+        for (stream_block_t* b = blocks; b != NULL; b = b->next) num_blocks++;
+        struct iovec* segments = (struct iovec*) malloc(num_blocks * sizeof(struct iovec));
+        assert(segments);
+        int i = 0;
+        for (stream_block_t* b = blocks; b != NULL; b = b->next, i++) {
+            segments[i].iov_base = b->data;
+            segments[i].iov_len = b->len;
+        }
+        if (!err && rpc_send_bytes_vec(fd, segments, num_blocks) < 0) {
+            print_error("server: rpc_stream_write", "cannot send the frames to client");
+            err = ERROR;
+        }
+        free(segments);
+        while (blocks != NULL) {
+            stream_block_t* next = blocks->next;
+            free(blocks);
+            blocks = next;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (err) writer->err = ERROR;
+        writer->flushing = 0;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+/**
+ * Write a response frame of a streaming call, as a one-way frame under the STREAM_FRAME marker,
+ * so frames follow each other without waiting for the client.
+ *
+ * Writing is adaptive, much like Nagle's algorithm. A small frame coming STREAM_WINDOW_NS or more
+ * after the previous one is written right away, if the client's connection has room for it, so
+ * at low load each frame goes out as soon as it is written. Under load, when frames come in a
+ * burst or the connection is full, the frame is copied out and gathered instead, for the
+ * connection's thread to flush along with the frames after it: frames then go out many to a
+ * syscall. The handler only waits once STREAM_MAX_QUEUED bytes are gathered, so it still goes
+ * only as fast as its client reads. A large frame waits for the gathered frames to go, then is
+ * written on its own, blocking while the client's window is full.
+ * @param writer the stream's writer
+ * @param frame  the frame
+ * @return       0 if successful, and ERROR if the frame is invalid or the client has gone
+ */
+int server_stream_write(rpc_stream_writer* writer, rpc_data* frame) {
+    char* TITLE = "server: rpc_stream_write";
+    if (frame == NULL || (frame->data2_len > 0) != (frame->data2 != NULL) ||
+        frame->data2_len > MAX_FRAME_LEN) {
+        print_error(TITLE, "frame is NULL, inconsistent or larger than MAX_FRAME_LEN");
+        return ERROR;
+    }
+    int fd = writer->conn->fd;
+    size_t size = rpc_encode_oneway(STREAM_FRAME, writer->function_id, frame, NULL);
+    uint64_t now = rpc_now_ns();
+    int burst = now - writer->last_write_ns < STREAM_WINDOW_NS;
+    writer->last_write_ns = now;
+
+    // with no thread to flush, or for a large frame, once nothing is gathered before it
+    pthread_mutex_lock(&writer->lock);
+    int alone = !writer->gather || size > STREAM_SMALL_FRAME;
+    while (alone && !writer->err && (writer->head != NULL || writer->flushing))
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    int idle = writer->head == NULL && !writer->flushing && !burst;
+    int err = writer->err;
+    pthread_mutex_unlock(&writer->lock);
+    if (err) return ERROR;
+
+    ssize_t sent = 0;
+    if (alone) err = rpc_send_oneway(fd, STREAM_FRAME, writer->function_id, frame);
+    else if (idle) {
+        sent = rpc_send_oneway_nowait(fd, STREAM_FRAME, writer->function_id, frame);
+        err = sent < 0 ? ERROR : 0;
+    }
+    if (err) {
+        print_error(TITLE, "cannot send the frame to client");
+        pthread_mutex_lock(&writer->lock);
+        writer->err = ERROR;
+        pthread_mutex_unlock(&writer->lock);
+        return ERROR;
+    }
+
+    // under load, the frame is gathered behind those waiting already
+    if (!alone && (size_t) sent < size) {
+        pthread_mutex_lock(&writer->lock);
+        stream_gather(writer, frame, size, (size_t) sent);
+        err = writer->err;
+        pthread_mutex_unlock(&writer->lock);
+        if (err) return ERROR;
+    }
+    writer->bytes_out += data_bytes(frame);
+    return 0;
+}
+
+
+/**
+ * Server RPC function to serve a call to a streaming function. It is verified and its payload
+ * received as for any call, then its handler writes the response frames straight to the client,
+ * and the stream ends with the handler's status in place of a frame marker.
+ * @param server the server RPC
+ * @param conn   the client's connection
+ * @return       0 if successful, and otherwise if not
+ */
+int rpc_serve_stream(struct rpc_server* server, connection_t* conn) {
+    char* TITLE = "server: rpc_serve_stream";
+    uint64_t id;
+    if (rpc_receive_uint(conn->fd, &id) < 0) {
+        print_error(TITLE, "cannot receive function's id verification from client");
+        return ERROR;
+    }
+
+    // send verification flag to client, shedding the call right away if we have no room for it
+    function_t* function = function_search(server->functions, id);
+    int flag = -(function == NULL || function->f_stream == NULL);
+    if (flag == 0)
+        flag = admit_call(server);
+    if (rpc_send_int(conn->fd, flag) < 0) {
+        if (flag == 0) release_call(server);
+        print_error(TITLE, "cannot send verification flag to client");
+        return ERROR;
+    }
+    if (flag == ERROR) {
+        print_error(TITLE, "verification failed; handle and handler have different ids, "
+                           "or does not stream");
         return ERROR;
     }
-    rpc_handler handler = function->f_handler;
-    rpc_data* response = handler(payload);
+    call_sample_t sample = { .error = 1 };
+    if (flag == OVERLOADED) {
+        print_error(TITLE, "call shed, too many calls in flight");
+        metrics_record(conn->metrics, function->slot, &sample);
+        return OVERLOADED;
+    }
+
+    // read the function's payload, a corrupt one ending the stream before it starts
+    int status;
+    int err = 0;
+    rpc_data* payload = rpc_receive_payload_status(conn->fd, &status, server->max_payload);
+    if (payload == NULL) {
+        release_call(server);
+        metrics_record(conn->metrics, function->slot, &sample);
+        if (status == OVERLENGTH) return OVERLENGTH;
+        if (status != CORRUPT) return ERROR;
+        print_error(TITLE, "payload failed its checksum");
+        return rpc_send_status(conn->fd, CORRUPT) ? ERROR : CORRUPT;
+    }
+    sample.bytes_in = data_bytes(payload);
+    capture_record(&server->capture, CAPTURE_KIND_STREAM, conn->id, function, payload, 0);
+
+    // the handler writes its frames from the worker, while this thread flushes those it gathers
+    rpc_stream_writer writer = { .conn = conn, .function_id = id };
+    writer.gather = executor_started(server->executor);
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.cond, NULL);
+    stream_call_t call = { server, function, payload, &writer, 0, 0, 0 };
+    uint64_t queued_ns = rpc_now_ns();
+    task_t task;
+    conn_handling(conn);
+    executor_submit(server->executor, function->executor_class, conn->home, &task,
+                    run_stream_call, &call);
+    stream_flush(&writer);
+    executor_wait(&task);
+    conn_expect(server, conn, due_in(server->request_timeout_ms));
+    pthread_cond_destroy(&writer.cond);
+    pthread_mutex_destroy(&writer.lock);
     rpc_data_free(payload);
+    release_call(server);
+    sample.ran = 1;
+    sample.queue_wait_ns = call.started_ns - queued_ns;
+    sample.handler_ns = call.finished_ns - call.started_ns;
+    sample.bytes_out = writer.bytes_out;
+    sample.error = call.status != 0 || writer.err != 0;
+    metrics_record(conn->metrics, function->slot, &sample);
 
-    // send the response to client
-    err = rpc_send_payload(accept_fd, response);
-    rpc_data_free(response);
-    if (err)
-        print_error(TITLE, "cannot send the response data to client");
+    // end the stream, unless the client is gone already
+    if (writer.err) return ERROR;
+    err = rpc_send_int(conn->fd, call.status == 0 ? 0 : ERROR);
+    if (err) print_error(TITLE, "cannot send the end of the stream to client");
+    return err;
+}
+
+
+/**
+ * Server RPC function to serve the options request from client, which negotiates the options of
+ * the connection: the client asks for options, and both ends use those the server supports.
+ * @param conn the client's connection
+ * @return     0 if successful, and otherwise if not
+ */
+int rpc_serve_options(connection_t* conn) {
+    char* TITLE = "server: rpc_serve_options";
+    uint64_t requested;
+    if (rpc_receive_uint(conn->fd, &requested) < 0) {
+        print_error(TITLE, "cannot receive requested options from client");
+        return ERROR;
+    }
+    uint64_t accepted = requested & OPTIONS_SUPPORTED;
+    int client_big = (requested & OPTION_BIG_ENDIAN) != 0;
+    if (client_big != (ARRAY_HOST == ARRAY_BIG)) accepted &= ~OPTION_HOST_ORDER;
+    if (rpc_send_uint(conn->fd, accepted) < 0) {
+        print_error(TITLE, "cannot send accepted options to client");
+        return ERROR;
+    }
+
+    // the option holds from the connection's next request on (see rpc_serve_request)
+    conn->checksum = (accepted & OPTION_CHECKSUM) != 0;
+    conn->host_order = (accepted & OPTION_HOST_ORDER) != 0;
+    return 0;
+}
+
+
+/**
+ * The built-in stats function, answering with the metrics of every registered function as
+ * text: a header line, then a line per function. data1 is the number of functions.
+ * @param payload the call's payload, which is ignored
+ * @return        the metrics
+ */
+rpc_data* rpc_serve_stats(rpc_data* payload) {
+    struct rpc_server* server = current_call.server;
+    if (server == NULL) return NULL;
+
+    size_t size = 256, len = 0;
+    char* text = (char*) malloc(size);
+    assert(text);
+    len += snprintf(text, size, "%s %s %s %s %s %s %s %s %s %s %s %s\n",
+                    "function", "calls", "errors", "bytes_in", "bytes_out",
+                    "wait_p50_ns", "wait_p99_ns", "wait_p999_ns",
+                    "handler_p50_ns", "handler_p99_ns", "handler_p999_ns", "handler_max_ns");
+
+    int slot = 0;
+    function_t* f;
+    while ((f = function_search_slot(server->functions, slot)) != NULL) {
+        rpc_function_stats stats;
+        metrics_read(server->metrics, slot, &stats);
+        size_t needed = strlen(f->name) + 12 * 21;
+        if (len + needed >= size) {
+            size = (len + needed) * 2;
+            text = (char*) realloc(text, size);
+            assert(text);
+        }
+        len += snprintf(text + len, size - len,
+                        "%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+                        f->name, stats.calls, stats.errors, stats.bytes_in, stats.bytes_out,
+                        stats.queue_wait.p50, stats.queue_wait.p99, stats.queue_wait.p999,
+                        stats.handler_time.p50, stats.handler_time.p99,
+                        stats.handler_time.p999, stats.handler_time.max);
+        slot++;
+    }
+
+    rpc_data* response = (rpc_data*) malloc(sizeof(rpc_data));
+    assert(response);
+    response->data1 = slot;
+    response->data2_len = len + 1;
+    response->data2 = text;
+    return response;
+}
+
+
+/* ----------------------------- CONNECTIONS ----------------------------- */
+
+/**
+ * Add a connection to the server's open connections, unless the server is shutting down.
+ * @param server the server RPC
+ * @param conn   the connection
+ * @return       0 if added, and ERROR if the server is shutting down
+ */
+static int conn_register(struct rpc_server* server, connection_t* conn) {
+    pthread_mutex_lock(&server->conns_lock);
+    if (atomic_load(&server->stopping)) {
+        pthread_mutex_unlock(&server->conns_lock);
+        return ERROR;
+    }
+    conn->prev = NULL;
+    conn->next = server->conns;
+    if (server->conns) server->conns->prev = conn;
+    server->conns = conn;
+    server->num_conns++;
+    pthread_mutex_unlock(&server->conns_lock);
+    return 0;
+}
+
+/**
+ * Remove a connection from the server's open connections, waking a shutdown waiting for the
+ * last one.
+ * @param server the server RPC
+ * @param conn   the connection
+ */
+static void conn_unregister(struct rpc_server* server, connection_t* conn) {
+    pthread_mutex_lock(&server->conns_lock);
+    if (conn->prev) conn->prev->next = conn->next;
+    else server->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    if (--(server->num_conns) == 0)
+        pthread_cond_broadcast(&server->conns_drained);
+    pthread_mutex_unlock(&server->conns_lock);
+}
+
+/**
+ * Create a connection for an accepted socket.
+ * @param server the server RPC
+ * @param fd     the accepted socket
+ * @param polled whether rpc_serve_poll serves it, rather than a thread of its own
+ * @return       the connection, or NULL if the server is shutting down
+ */
+static connection_t* conn_open(struct rpc_server* server, int fd, int polled) {
+    connection_t* conn = (connection_t*) calloc(1, sizeof(connection_t));
+    assert(conn);
+    conn->fd = fd;
+    conn->id = atomic_fetch_add(&server->num_accepted, 1);
+
+    // in accept order, and on the node of the connection's thread once it is pinned
+    conn->group = polled ? -1 : affinity_next(&server->io_affinity);
+    conn->home = executor_home_near(server->executor,
+                                    affinity_node(&server->io_affinity, conn->group));
+    atomic_init(&conn->state, CONN_IDLE);
+    conn->polled = polled;
+    conn->metrics = metrics_attach(server->metrics);
+    if (conn_register(server, conn) < 0) {
+        metrics_detach(server->metrics, conn->metrics);
+        free(conn);
+        return NULL;
+    }
+
+    // idle from now on, with its timer armed for good: it is moved along lazily as it fires
+    uint64_t due_ns = due_in(server->idle_timeout_ms);
+    uint64_t timer_ns = due_ns ? due_ns : due_in(server->request_timeout_ms);
+    atomic_init(&conn->due_ns, due_ns);
+    atomic_init(&conn->timer_ns, timer_ns ? timer_ns : UINT64_MAX);
+    if (timer_ns)
+        wheel_arm(&server->timers, &conn->timer, timer_ns);
+    return conn;
+}
+
+/**
+ * Fire a connection's timer, closing the connection if its client is past due: idle for too
+ * long, or too slow to send a request or take a response (such as a slowloris client, trickling
+ * a request in to hold a thread). Its socket is shut down, which wakes its thread, or the polling
+ * thread, to close it; connections are only closed by what serves them. A connection that is not
+ * due yet has its timer moved to when it is.
+ * @param timer      the connection's timer
+ * @param now_ns     the time
+ * @param server_obj the server RPC
+ * @return           when to fire the timer again, 0 once the connection is shut down
+ */
+uint64_t conn_expire(timer_node_t* timer, uint64_t now_ns, void* server_obj) {
+    struct rpc_server* server = (struct rpc_server*) server_obj;
+    connection_t* conn = (connection_t*) ((char*) timer - offsetof(connection_t, timer));
+    uint64_t due_ns = atomic_load_explicit(&conn->due_ns, memory_order_relaxed);
+    uint64_t again_ns = 0;
+    if (due_ns == 0) {
+        unsigned int check_ms = server->request_timeout_ms ? server->request_timeout_ms :
+                                server->idle_timeout_ms;
+        if (check_ms) again_ns = now_ns + (uint64_t) check_ms * 1000000ULL;
+    }
+    else if (due_ns > now_ns) again_ns = due_ns;
+    else {
+        shutdown(conn->fd, SHUT_RDWR);
+        atomic_fetch_add(&server->timed_out, 1);
+    }
+    atomic_store_explicit(&conn->timer_ns, again_ns ? again_ns : UINT64_MAX,
+                          memory_order_relaxed);
+    return again_ns;
+}
+
+/**
+ * Close a connection, once it is not served anymore.
+ * @param server the server RPC
+ * @param conn   the connection
+ */
+static void conn_close(struct rpc_server* server, connection_t* conn) {
+    wheel_cancel(&server->timers, &conn->timer);
+    metrics_detach(server->metrics, conn->metrics);
+    conn_unregister(server, conn);
+    close(conn->fd);
+    free(conn);
+}
+
+
+/**
+ * Serve the next request of a client, from its request flag to the end of its exchange. A
+ * request that started is always served in full, even if the server is shutting down.
+ * @param server the server RPC
+ * @param conn   the client's connection
+ * @return       0 if the connection stays open, 1 if it does but only part of a polled client's
+ *               request flag has arrived, and ERROR if it is to be closed
+ */
+int rpc_serve_request(struct rpc_server* server, connection_t* conn) {
+    // a polled connection is readable, but its client may have sent only part of the flag, which
+    // is kept until the rest arrives; a connection with a thread of its own waits on it idle
+    int flag = ERROR;
+    int err;
+    if (conn->polled) {
+        err = rpc_receive_request_nowait(conn->fd, conn->flag_bytes, &conn->flag_len, &flag);
+        if (err == 0) return 1;
+        err = err < 0 ? ERROR : 0;
+    }
+    else err = rpc_receive_request(conn->fd, &flag);
+
+    // a shutdown may have closed the connection while it was idle
+    int idle = CONN_IDLE;
+    if (err == 0 && !atomic_compare_exchange_strong(&conn->state, &idle, CONN_BUSY))
+        err = ERROR;
+    if (err) return ERROR;
+
+    // the rest of the request is to arrive, and its response to be taken, in the time left
+    unsigned long io_timeouts = rpc_io_timeouts();
+    conn_expect(server, conn, due_in(server->request_timeout_ms));
+    rpc_set_io_checksum(conn->checksum);
+    if      (flag == FIND_SERVICE) rpc_serve_find(server, conn->fd);
+    else if (flag == CALL_SERVICE || flag == CALL_DEADLINE_SERVICE ||
+             flag == CALL_TRACED_SERVICE)
+        rpc_serve_call(server, conn, flag);
+    else if (flag == CAST_SERVICE) err = rpc_serve_cast(server, conn);
+    else if (flag == STREAM_SERVICE) rpc_serve_stream(server, conn);
+    else if (flag == OPTIONS_SERVICE) rpc_serve_options(conn);
+    else    err = ERROR;
+    rpc_set_io_checksum(0);
+
+    // a request whose exchange ran out of time was cut short, leaving the connection out of step
+    if (rpc_io_timeouts() != io_timeouts) {
+        atomic_fetch_add(&server->timed_out, 1);
+        err = ERROR;
+    }
+
+    // back to idle, which a shutdown either sees, or happened before and is seen here; the
+    // polling thread does not wait on the connection while it is
+    atomic_store(&conn->state, CONN_IDLE);
+    conn_expect(server, conn, due_in(server->idle_timeout_ms));
+    if (conn->polled) rpc_set_io_deadline(0);
+    if (atomic_load(&server->stopping)) return ERROR;
     return err;
 }
 
@@ -206,7 +1081,7 @@ int rpc_serve_call(struct rpc_server* server, int accept_fd) {
  * to pass in thread package handler
  */
 struct thread_package {
-    int thread_fd;
+    connection_t* conn;
     rpc_server* server;
 };
 
@@ -218,22 +1093,28 @@ void* package_handler(void* package_obj);
  * @param server the server RPC
  */
 int package_init(rpc_server* server) {
-    // create package
+    // create package, with the connection open from now on so that a shutdown waits for it
+    connection_t* conn = conn_open(server, server->accept_fd, 0);
+    if (conn == NULL) {
+        close(server->accept_fd);
+        return ERROR;
+    }
     package_t* package = (package_t*) malloc(sizeof(package_t));
     assert(package && server);
     package->server = server;
-    package->thread_fd = server->accept_fd;
+    package->conn = conn;
 
     // create thread
     int err;
     pthread_t thread;
-    err  = pthread_create(&thread, NULL, package_handler, package);
-    err += pthread_detach(thread);
-    if (err < 0) {
+    err = pthread_create(&thread, NULL, package_handler, package);
+    if (err != 0) {
         free(package);
-        pthread_cancel(thread);
-        print_error("package_init", "cannot create/detach thread");
+        conn_close(server, conn);
+        print_error("package_init", "cannot create thread");
+        return ERROR;
     }
+    pthread_detach(thread);
     return 0;
 }
 
@@ -249,18 +1130,216 @@ void* package_handler(void* package_obj) {
     if (package_obj) {
 
         // unpacking the package
-        rpc_server *server = package->server;
-        int thread_fd      = package->thread_fd;
+        rpc_server* server = package->server;
+        connection_t* conn = package->conn;
         free(package_obj);
         package_obj = NULL;
 
+        // pinned before serving, so that what the thread allocates is on its node
+        affinity_apply(&server->io_affinity, conn->group);
+
         // serve the client
-        int flag = ERROR;
-        while (rpc_receive_request(thread_fd, &flag) == 0) {
-            if      (flag == FIND_SERVICE) rpc_serve_find(server, thread_fd);
-            else if (flag == CALL_SERVICE) rpc_serve_call(server, thread_fd);
-            else    break;
-        }
+        while (rpc_serve_request(server, conn) == 0);
+        conn_close(server, conn);
     }
     return NULL;
 }
+
+
+/* ----------------------------- EMBEDDING ----------------------------- */
+
+/**
+ * Get the epoll instance rpc_serve_poll waits on, creating it along with its listen socket's
+ * registration the first time. The listen socket is made non-blocking, so that accepting never
+ * blocks the caller's thread.
+ * @param server the server RPC
+ * @return       the epoll instance, or ERROR if it cannot be created
+ */
+int server_poll_fd(struct rpc_server* server) {
+    char* TITLE = "rpc-server: rpc_server_fd";
+    if (server->poll_fd >= 0) return server->poll_fd;
+
+    int poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll_fd < 0) {
+        print_error(TITLE, "cannot create epoll instance");
+        return ERROR;
+    }
+    int flags = fcntl(server->listen_fd, F_GETFL, 0);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (flags < 0 || fcntl(server->listen_fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        epoll_ctl(poll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) < 0) {
+        print_error(TITLE, "cannot register listen socket");
+        close(poll_fd);
+        return ERROR;
+    }
+
+    // the connections' timers are advanced by the polling thread, woken by a timerfd for them
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    event.data.ptr = &server->timers;
+    if (timer_fd < 0 || epoll_ctl(poll_fd, EPOLL_CTL_ADD, timer_fd, &event) < 0) {
+        print_error(TITLE, "cannot register timerfd");
+        if (timer_fd >= 0) close(timer_fd);
+        close(poll_fd);
+        return ERROR;
+    }
+    server->timer_fd = timer_fd;
+    server->poll_fd = poll_fd;
+    return poll_fd;
+}
+
+
+/**
+ * Accept the connections waiting on the listen socket, up to a bound, and add them to the epoll
+ * instance. Accepted sockets do not inherit the listen socket's O_NONBLOCK, so a request's
+ * exchange, once started, is read the same blocking way as with a thread per connection.
+ * @param server the server RPC
+ * @return       number of connections accepted
+ */
+static int poll_accept(struct rpc_server* server) {
+    int accepted = 0;
+    while (accepted < POLL_ACCEPTS) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) break;
+        connection_t* conn = conn_open(server, fd, 1);
+        if (conn == NULL) {
+            close(fd);
+            break;
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(server->poll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            conn_close(server, conn);
+            continue;
+        }
+        accepted++;
+    }
+    return accepted;
+}
+
+/**
+ * Fire the connections' timers that are due, once the timerfd goes off. A connection timed out
+ * is shut down, for its socket to report readiness and be closed as it fails to serve a request.
+ * @param server the server RPC
+ */
+static void poll_timers(struct rpc_server* server) {
+    uint64_t expirations;
+    while (read(server->timer_fd, &expirations, sizeof expirations) < 0 && errno == EINTR);
+    server->timer_fd_ns = 0;
+    wheel_advance(&server->timers, rpc_now_ns());
+}
+
+/**
+ * Close a connection served by rpc_serve_poll.
+ * @param server the server RPC
+ * @param conn   the connection
+ */
+static void poll_close(struct rpc_server* server, connection_t* conn) {
+    epoll_ctl(server->poll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn_close(server, conn);
+}
+
+
+/**
+ * Do a bounded amount of the server's work on the calling thread: accept waiting connections,
+ * and serve one request of each connection that has one ready. Handlers run on the calling
+ * thread too, as the executor's workers are not started in this mode, so nothing is handed off.
+ * A request flag is gathered without blocking, and the exchange that follows gives up after
+ * POLL_IO_MS without progress from the client (see conn_expect).
+ * @param server     the server RPC
+ * @param timeout_ms the longest to wait for work, -1 for indefinitely and 0 not to wait
+ * @return           number of connections accepted and requests served, or ERROR on failure or
+ *                   once the server is shut down
+ */
+int server_poll(struct rpc_server* server, int timeout_ms) {
+    if (atomic_load(&server->stopping) || server_poll_fd(server) < 0) return ERROR;
+
+    struct epoll_event events[POLL_EVENTS];
+    int n = epoll_wait(server->poll_fd, events, POLL_EVENTS, timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : ERROR;
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        connection_t* conn = (connection_t*) events[i].data.ptr;
+        if (conn == NULL)
+            done += poll_accept(server);
+        else if (events[i].data.ptr == &server->timers)
+            poll_timers(server);
+        else {
+            int served = rpc_serve_request(server, conn);
+            if (served < 0) poll_close(server, conn);
+            else if (served == 0) done++;
+        }
+    }
+
+    // connections accepted have their timers armed, so the timerfd may have to go off earlier
+    uint64_t next_ns = wheel_next(&server->timers);
+    if (next_ns != server->timer_fd_ns) {
+        struct itimerspec at = { .it_value = {
+                .tv_sec  = (time_t) (next_ns / 1000000000ULL),
+                .tv_nsec = (long) (next_ns % 1000000000ULL)
+        } };
+        timerfd_settime(server->timer_fd, TFD_TIMER_ABSTIME, &at, NULL);
+        server->timer_fd_ns = next_ns;
+    }
+    return done;
+}
+
+
+/**
+ * Shut the server down gracefully. It stops accepting connections, serves the requests that
+ * already arrived, lets the calls in flight complete, and closes every connection once it is
+ * idle. A thread in rpc_serve_all exits; with rpc_serve_poll, this is to be called from the
+ * polling thread, between polls.
+ * @param server the server RPC
+ * @return       0 if successful, and ERROR if the server was already shut down
+ */
+int server_shutdown(struct rpc_server* server) {
+    int running = 0;
+    if (!atomic_compare_exchange_strong(&server->stopping, &running, 1)) return ERROR;
+
+    // wakes rpc_serve_all from accept
+    shutdown(server->listen_fd, SHUT_RDWR);
+
+    // polled connections: requests already ready are served, then every one is closed
+    if (server->poll_fd >= 0) {
+        struct epoll_event events[POLL_EVENTS];
+        int n;
+        while ((n = epoll_wait(server->poll_fd, events, POLL_EVENTS, 0)) > 0) {
+            int served = 0;
+            for (int i = 0; i < n; i++) {
+                connection_t* conn = (connection_t*) events[i].data.ptr;
+                if (conn == NULL || events[i].data.ptr == &server->timers) continue;
+                rpc_serve_request(server, conn);
+                poll_close(server, conn);
+                served++;
+            }
+            if (served == 0) break;
+        }
+        while (1) {
+            pthread_mutex_lock(&server->conns_lock);
+            connection_t* conn = server->conns;
+            while (conn && !conn->polled) conn = conn->next;
+            pthread_mutex_unlock(&server->conns_lock);
+            if (conn == NULL) break;
+            poll_close(server, conn);
+        }
+        close(server->timer_fd);
+        close(server->poll_fd);
+        server->timer_fd = ERROR;
+        server->poll_fd = ERROR;
+    }
+
+    // connection threads: an idle one is woken up to close, a busy one closes after its request
+    pthread_mutex_lock(&server->conns_lock);
+    for (connection_t* conn = server->conns; conn != NULL; conn = conn->next) {
+        int idle = CONN_IDLE;
+        if (atomic_compare_exchange_strong(&conn->state, &idle, CONN_CLOSING))
+            shutdown(conn->fd, SHUT_RD);
+    }
+    while (server->num_conns > 0)
+        pthread_cond_wait(&server->conns_drained, &server->conns_lock);
+    pthread_mutex_unlock(&server->conns_lock);
+
+    wheel_stop(&server->timers);
+    capture_stop(&server->capture);
+    close(server->listen_fd);
+    return 0;
+}
@@ -4,14 +4,30 @@
  * Purpose : Utility functions including string hashing, and RPC send/receive data.
  */
 
+#define _GNU_SOURCE     // splice, pipe2, F_SETPIPE_SZ
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
 #include <netdb.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
 #include "rpc_utils.h"
+#include "crc32c.h"
+
+#define IOV_WINDOW (int) 64         // most segments given to a single sendmsg/recvmsg
+#define CRC_CHUNK  (size_t) 262144  // most bytes per send/receive when checksummed, so they
+                                    // are still in cache when the checksum goes over them
+#define PIPE_SIZE  (int) 1048576    // pipe asked for when splicing from a socket to a file
+#define BOUNCE     (size_t) 262144  // buffer of a file sink that cannot be spliced into
 
 /*
  * Unsigned integer 64-bit network and system conversion functions. This is used to
@@ -38,6 +54,20 @@ uint64_t hash(unsigned char* str) {
     return hash_val;
 }
 
+/**
+ * DJB2 hash over a byte buffer of known length, used where the bytes may contain NUL.
+ * @param bytes the buffer
+ * @param len   length of the buffer
+ * @return      hashed buffer value
+ */
+uint64_t hash_bytes(void* bytes, size_t len) {
+    uint64_t hash_val = 5381;
+    unsigned char* curr = (unsigned char*) bytes;
+    for (size_t i = 0; i < len; i++)
+        hash_val = ((hash_val << 5) + hash_val) + curr[i];
+    return hash_val;
+}
+
 /**
  * Debug print error messages.
  * @param title   the function's name and domain
@@ -50,6 +80,300 @@ void print_error(__attribute__((unused)) char* title,
 }
 
 
+/**
+ * Read the monotonic clock, which is unaffected by changes to the system's wall clock.
+ * @return the current monotonic time in nanoseconds
+ */
+uint64_t rpc_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+/* deadline of this thread's socket I/O, 0 if it may block indefinitely */
+static __thread uint64_t io_deadline_ns = 0;
+static __thread unsigned long io_timeouts = 0;  // sends/receives that gave up at the deadline
+
+/**
+ * Set the deadline of the calling thread's socket I/O. Every send/receive below fails once the
+ * deadline has passed, rather than blocking past it.
+ * @param deadline_ns monotonic time (see rpc_now_ns) of the deadline, 0 to remove it
+ */
+void rpc_set_io_deadline(uint64_t deadline_ns) {
+    io_deadline_ns = deadline_ns;
+}
+
+
+/**
+ * Count the calling thread's sends and receives that gave up at its I/O deadline, for a caller
+ * to tell whether an exchange was cut short, leaving the connection out of step.
+ * @return the number of sends and receives so far
+ */
+unsigned long rpc_io_timeouts(void) {
+    return io_timeouts;
+}
+
+
+/* whether this thread's payloads carry a checksum, as negotiated for the connection */
+static __thread int io_checksum = 0;
+
+/**
+ * Set whether the calling thread's payloads carry a CRC32C checksum. This must match at both
+ * ends of the connection, which is why it is negotiated (see OPTIONS_SERVICE).
+ * @param enabled 1 to checksum payloads, 0 not to
+ */
+void rpc_set_io_checksum(int enabled) {
+    io_checksum = enabled;
+}
+
+/**
+ * Wait until the socket is ready, or the thread's I/O deadline passes.
+ * @param socket the RPC socket
+ * @param events poll events to wait for
+ * @return       0 if ready, -1 on timeout (errno set to ETIMEDOUT) or error
+ */
+static int wait_ready(int socket, short events) {
+    if (io_deadline_ns == 0) return 0;
+    struct pollfd pfd = { .fd = socket, .events = events, .revents = 0 };
+    while (1) {
+        uint64_t now = rpc_now_ns();
+        if (now >= io_deadline_ns) {
+            io_timeouts++;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        // round up, so that we never spin on a 0ms timeout
+        int timeout_ms = (int) ((io_deadline_ns - now + 999999) / 1000000);
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n > 0) return 0;
+        if (n < 0 && errno != EINTR) return -1;
+    }
+}
+
+/**
+ * Send all bytes of a buffer, extending a checksum over them as they go out.
+ * @param socket the RPC socket
+ * @param buffer the bytes to send
+ * @param len    number of bytes
+ * @param crc    the running checksum, NULL for none
+ * @return       0 if successful, and otherwise if not
+ */
+static int send_bytes(int socket, void* buffer, size_t len, uint32_t* crc) {
+    char* curr = (char*) buffer;
+    while (len > 0) {
+        if (wait_ready(socket, POLLOUT) < 0) return -1;
+        size_t chunk = crc && len > CRC_CHUNK ? CRC_CHUNK : len;
+        ssize_t n = send(socket, curr, chunk, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (crc) *crc = crc32c(*crc, curr, (size_t) n);
+        curr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receive exactly len bytes, extending a checksum over each part right after it is received.
+ * @param socket the RPC socket
+ * @param buffer the buffer to receive into
+ * @param len    number of bytes
+ * @param crc    the running checksum, NULL for none
+ * @return       0 if successful, and otherwise if not (including the other end closing)
+ */
+static int receive_bytes(int socket, void* buffer, size_t len, uint32_t* crc) {
+    char* curr = (char*) buffer;
+    while (len > 0) {
+        if (wait_ready(socket, POLLIN) < 0) return -1;
+        size_t chunk = crc && len > CRC_CHUNK ? CRC_CHUNK : len;
+        ssize_t n = recv(socket, curr, chunk, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (crc) *crc = crc32c(*crc, curr, (size_t) n);
+        curr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send all bytes of a buffer over the RPC network, as a single send may only take part of it.
+ * @param socket the RPC socket
+ * @param buffer the bytes to send
+ * @param len    number of bytes
+ * @return       0 if successful, and otherwise if not
+ */
+int rpc_send_bytes(int socket, void* buffer, size_t len) {
+    return send_bytes(socket, buffer, len, NULL);
+}
+
+/**
+ * Receive exactly len bytes over the RPC network, as a single receive may only return part of it.
+ * @param socket the RPC socket
+ * @param buffer the buffer to receive into
+ * @param len    number of bytes
+ * @return       0 if successful, and otherwise if not (including the other end closing)
+ */
+int rpc_receive_bytes(int socket, void* buffer, size_t len) {
+    return receive_bytes(socket, buffer, len, NULL);
+}
+
+/**
+ * Gather the unsent part of segments into a window for a single sendmsg/recvmsg, as there is a
+ * limit to how many segments a single call takes.
+ * @param segments     the segments
+ * @param num_segments number of segments
+ * @param next         first segment with bytes left
+ * @param offset       bytes of the first segment already done
+ * @param limit        most bytes to gather
+ * @param window       the returned window, of IOV_WINDOW entries
+ * @return             number of entries of the window
+ */
+static int fill_window(const struct iovec* segments, int num_segments, int next, size_t offset,
+                       size_t limit, struct iovec* window) {
+    int count = 0;
+    for (int i = next; i < num_segments && count < IOV_WINDOW && limit > 0; i++) {
+        size_t skip = i == next ? offset : 0;
+        size_t len = segments[i].iov_len - skip;
+        if (len == 0) continue;
+        if (len > limit) len = limit;
+        window[count].iov_base = (char*) segments[i].iov_base + skip;
+        window[count].iov_len = len;
+        limit -= len;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Move past the bytes a sendmsg/recvmsg has done.
+ * @param segments the segments
+ * @param next     first segment with bytes left, updated
+ * @param offset   bytes of the first segment already done, updated
+ * @param done     bytes done
+ */
+static void advance_window(const struct iovec* segments, int* next, size_t* offset, size_t done) {
+    while (done > 0) {
+        size_t left = segments[*next].iov_len - *offset;
+        if (done < left) {
+            *offset += done;
+            return;
+        }
+        done -= left;
+        (*next)++;
+        *offset = 0;
+    }
+}
+
+/**
+ * Extend a checksum over the first bytes of a window.
+ * @param window the window
+ * @param done   bytes of the window to go over
+ * @param crc    the running checksum
+ */
+static void crc_window(const struct iovec* window, size_t done, uint32_t* crc) {
+    for (int i = 0; done > 0; i++) {
+        size_t len = window[i].iov_len < done ? window[i].iov_len : done;
+        *crc = crc32c(*crc, window[i].iov_base, len);
+        done -= len;
+    }
+}
+
+/**
+ * Send segments back to back with scatter-gather I/O, extending a checksum over them as they go.
+ * @param socket       the RPC socket
+ * @param segments     the segments to send
+ * @param num_segments number of segments
+ * @param crc          the running checksum, NULL for none
+ * @return             0 if successful, and otherwise if not
+ */
+static int send_bytes_vec(int socket, const struct iovec* segments, int num_segments,
+                          uint32_t* crc) {
+    struct iovec window[IOV_WINDOW];
+    int next = 0;
+    size_t offset = 0;
+    size_t limit = crc ? CRC_CHUNK : SIZE_MAX;
+    while (1) {
+        int count = fill_window(segments, num_segments, next, offset, limit, window);
+        if (count == 0) return 0;
+        if (wait_ready(socket, POLLOUT) < 0) return -1;
+        struct msghdr msg = { .msg_iov = window, .msg_iovlen = (size_t) count };
+        ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (crc) crc_window(window, (size_t) n, crc);
+        advance_window(segments, &next, &offset, (size_t) n);
+    }
+}
+
+/**
+ * Receive exactly len bytes scattered into segments in order, extending a checksum over each
+ * part right after it is received.
+ * @param socket       the RPC socket
+ * @param segments     the segments to receive into, holding at least len bytes
+ * @param num_segments number of segments
+ * @param len          number of bytes
+ * @param crc          the running checksum, NULL for none
+ * @return             0 if successful, and otherwise if not (including the other end closing)
+ */
+static int receive_bytes_vec(int socket, const struct iovec* segments, int num_segments,
+                             size_t len, uint32_t* crc) {
+    struct iovec window[IOV_WINDOW];
+    int next = 0;
+    size_t offset = 0;
+    while (len > 0) {
+        size_t limit = crc && len > CRC_CHUNK ? CRC_CHUNK : len;
+        int count = fill_window(segments, num_segments, next, offset, limit, window);
+        if (count == 0) return -1;
+        if (wait_ready(socket, POLLIN) < 0) return -1;
+        struct msghdr msg = { .msg_iov = window, .msg_iovlen = (size_t) count };
+        ssize_t n = recvmsg(socket, &msg, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (crc) crc_window(window, (size_t) n, crc);
+        advance_window(segments, &next, &offset, (size_t) n);
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * Send segments back to back over the RPC network with scatter-gather I/O, without first
+ * copying them into one buffer.
+ * @param socket       the RPC socket
+ * @param segments     the segments to send
+ * @param num_segments number of segments
+ * @return             0 if successful, and otherwise if not
+ */
+int rpc_send_bytes_vec(int socket, const struct iovec* segments, int num_segments) {
+    return send_bytes_vec(socket, segments, num_segments, NULL);
+}
+
+/**
+ * Receive exactly len bytes over the RPC network, scattered into segments in order.
+ * @param socket       the RPC socket
+ * @param segments     the segments to receive into, holding at least len bytes
+ * @param num_segments number of segments
+ * @param len          number of bytes
+ * @return             0 if successful, and otherwise if not (including the other end closing)
+ */
+int rpc_receive_bytes_vec(int socket, const struct iovec* segments, int num_segments,
+                          size_t len) {
+    return receive_bytes_vec(socket, segments, num_segments, len, NULL);
+}
+
+
 /**
  * Send an unsigned integer 64-bit over the RPC network.
  * @param socket the RPC socket
@@ -58,8 +382,7 @@ void print_error(__attribute__((unused)) char* title,
  */
 int rpc_send_uint(int socket, uint64_t val) {
     uint64_t val_ntw = htonll(val);
-    ssize_t n = send(socket, &val_ntw, sizeof val_ntw, 0);
-    return -(n < 0);
+    return rpc_send_bytes(socket, &val_ntw, sizeof val_ntw);
 }
 
 /**
@@ -70,8 +393,7 @@ int rpc_send_uint(int socket, uint64_t val) {
  */
 int rpc_receive_uint(int socket, uint64_t* ret) {
     uint64_t ret_ntw;
-    ssize_t n = recv(socket, &ret_ntw, sizeof ret_ntw, 0);
-    if (n < 0) return -1;
+    if (rpc_receive_bytes(socket, &ret_ntw, sizeof ret_ntw) < 0) return -1;
     *ret = ntohll(ret_ntw);
     return 0;
 }
@@ -85,8 +407,7 @@ int rpc_receive_uint(int socket, uint64_t* ret) {
  */
 int rpc_send_int(int socket, int val) {
     uint64_t val_ntw = htonll((uint64_t) val);
-    ssize_t n = send(socket, &val_ntw, sizeof val_ntw, 0);
-    return -(n < 0);
+    return rpc_send_bytes(socket, &val_ntw, sizeof val_ntw);
 }
 
 /**
@@ -97,8 +418,7 @@ int rpc_send_int(int socket, int val) {
  */
 int rpc_receive_int(int socket, int* ret) {
     uint64_t ret_ntw;
-    ssize_t n = recv(socket, &ret_ntw, sizeof ret_ntw, 0);
-    if (n < 0) return -1;
+    if (rpc_receive_bytes(socket, &ret_ntw, sizeof ret_ntw) < 0) return -1;
     uint64_t ret64 = ntohll(ret_ntw);
 
     // negative integer conversion
@@ -118,8 +438,7 @@ int rpc_receive_int(int socket, int* ret) {
  */
 int rpc_receive_request(int socket, int* ret) {
     uint64_t ret_ntw;
-    ssize_t n = recv(socket, &ret_ntw, sizeof ret_ntw, 0);
-    if (n <= 0) return -1;
+    if (rpc_receive_bytes(socket, &ret_ntw, sizeof ret_ntw) < 0) return -1;
     uint64_t ret64 = ntohll(ret_ntw);
     if (ret64 >= INT_MAX) *ret = -(int) (-ret64);
     else *ret = (int) ret64;
@@ -128,18 +447,67 @@ int rpc_receive_request(int socket, int* ret) {
 
 
 /**
- * Send a payload via a socket to the other end. Naturally, this works for both client and server.
- * @param socket  the specified socket
- * @param payload the specified RPC data payload
- * @return        0 if successful, and otherwise if not
+ * Receive what has arrived of a client's request flag, without blocking, for a thread serving
+ * many clients that cannot wait on one of them. The bytes received so far are kept by the
+ * caller between calls, until the whole flag is in.
+ * @param socket the socket connected to client
+ * @param buffer the flag's bytes received so far, REQUEST_BYTES of them
+ * @param have   number of bytes in buffer, updated, and back to 0 once the flag is in
+ * @param ret    the client's request flag, once all its bytes are in
+ * @return       1 once the flag is in, 0 if the rest of it is yet to arrive, and -1 on error or
+ *               once the client is gone
  */
-int rpc_send_payload(int socket, rpc_data* payload) {
+int rpc_receive_request_nowait(int socket, unsigned char* buffer, size_t* have, int* ret) {
+    while (*have < REQUEST_BYTES) {
+        ssize_t n = recv(socket, buffer + *have, REQUEST_BYTES - *have, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        *have += (size_t) n;
+    }
+    *have = 0;
+    uint64_t ret_ntw;
+    memcpy(&ret_ntw, buffer, sizeof ret_ntw);
+    uint64_t ret64 = ntohll(ret_ntw);
+    if (ret64 >= INT_MAX) *ret = -(int) (-ret64);
+    else *ret = (int) ret64;
+    return 1;
+}
+
+
+/**
+ * Start a payload's checksum, which covers its data1 and data2's length before data2 itself.
+ * @param data1     the payload's data1
+ * @param data2_len the length of data2
+ * @return          the checksum so far
+ */
+static uint32_t payload_crc_start(int data1, size_t data2_len) {
+    uint64_t header[2] = { htonll((uint64_t) data1), htonll((uint64_t) data2_len) };
+    return crc32c(0, header, sizeof header);
+}
+
+
+/**
+ * Send a payload's data1 and data2, with data2 gathered from segments. This is the part of the
+ * exchange shared by contiguous and vectored payloads.
+ * @param socket       the specified socket
+ * @param present      whether there is a payload at all
+ * @param valid        whether the payload's data2 is consistent with its length
+ * @param data1        the payload's data1
+ * @param segments     data2, as segments sent back to back
+ * @param num_segments number of segments
+ * @return             0 if successful, and otherwise if not
+ */
+static int send_payload_segments(int socket, int present, int valid, int data1,
+                                 const struct iovec* segments, int num_segments) {
     char* TITLE = "rpc-helper: rpc_send_payload";
     int err;
     int flag;
 
     // send payload verification flag
-    flag = -(payload == NULL);
+    flag = -(!present);
     err = rpc_send_int(socket, flag);
     if (err) {
         print_error(TITLE, "cannot send payload verification flag to other end");
@@ -150,14 +518,8 @@ int rpc_send_payload(int socket, rpc_data* payload) {
         return ERROR;
     }
 
-    // get the relevant properties from payload
-    int data1 = payload->data1;
-    size_t data2_len = payload->data2_len;
-    void* data2 = payload->data2;
-
     // send data2 verification flag
-    if ((data2_len > 0 && data2 == NULL) || (data2_len == 0 && data2 != NULL))
-        flag = -1;
+    flag = -(!valid);
     err = rpc_send_int(socket, flag);
     if (err) {
         print_error(TITLE, "cannot send data2 verification flag to other end");
@@ -196,6 +558,9 @@ int rpc_send_payload(int socket, rpc_data* payload) {
     }
 
     // for data2 - due to it being size_t, it may exceed pivot
+    size_t data2_len = 0;
+    for (int i = 0; i < num_segments; i++)
+        data2_len += segments[i].iov_len;
     uint64_t num_exceed = data2_len / pivot;
     size_t remainder = data2_len % pivot;
 
@@ -229,39 +594,115 @@ int rpc_send_payload(int socket, rpc_data* payload) {
 
     // send data2 if flag verifies data2 is not NULL
     // since void type takes up 1 byte, we do not need to do byte ordering
+    uint32_t crc = io_checksum ? payload_crc_start(data1, data2_len) : 0;
+    uint32_t* crc_ptr = io_checksum ? &crc : NULL;
     if (data2_len > 0) {
-        char buffer[data2_len + 1];
-        memcpy(buffer, data2, data2_len);
-        buffer[data2_len] = '\0';
-        ssize_t n = send(socket, buffer, data2_len, 0);
-        if (n < 0) {
+        err = num_segments == 1 ?
+              send_bytes(socket, segments[0].iov_base, data2_len, crc_ptr) :
+              send_bytes_vec(socket, segments, num_segments, crc_ptr);
+        if (err) {
             print_error(TITLE, "cannot send data2 to other end");
             return ERROR;
         }
     }
+
+    // on a checksummed connection, the checksum follows data2
+    if (io_checksum) {
+        err = rpc_send_uint(socket, crc);
+        if (err) {
+            print_error(TITLE, "cannot send payload's checksum to other end");
+            return ERROR;
+        }
+    }
     return 0;
 }
 
 
+/**
+ * Send a payload via a socket to the other end. Naturally, this works for both client and server.
+ * @param socket  the specified socket
+ * @param payload the specified RPC data payload
+ * @return        0 if successful, and otherwise if not
+ */
+int rpc_send_payload(int socket, rpc_data* payload) {
+    if (payload == NULL)
+        return send_payload_segments(socket, 0, 0, 0, NULL, 0);
+    int valid = (payload->data2_len > 0) == (payload->data2 != NULL);
+    struct iovec data2 = { .iov_base = payload->data2, .iov_len = payload->data2_len };
+    return send_payload_segments(socket, 1, valid, payload->data1, &data2,
+                                 payload->data2_len > 0);
+}
+
+
+/**
+ * Send a vectored payload, its data2 being its segments back to back. The segments are sent with
+ * scatter-gather I/O, so they need not be copied into one buffer first. The other end cannot tell
+ * it apart from a contiguous payload.
+ * @param socket  the specified socket
+ * @param payload the specified vectored payload
+ * @return        0 if successful, and otherwise if not
+ */
+int rpc_send_payload_vec(int socket, rpc_vdata* payload) {
+    if (payload == NULL)
+        return send_payload_segments(socket, 0, 0, 0, NULL, 0);
+    int valid = payload->num_segments >= 0 &&
+                (payload->num_segments == 0 || payload->segments != NULL);
+    for (int i = 0; valid && i < payload->num_segments; i++)
+        if (payload->segments[i].iov_len > 0 && payload->segments[i].iov_base == NULL)
+            valid = 0;
+    return send_payload_segments(socket, 1, valid, payload->data1, payload->segments,
+                                 valid ? payload->num_segments : 0);
+}
+
+
+/**
+ * Send a status in place of a payload, which the other end receives as a NULL payload. This is
+ * how a call that was not served (for example, because its deadline passed) is answered.
+ * @param socket the specified socket
+ * @param status the status, a negative value
+ * @return       0 if successful, and otherwise if not
+ */
+int rpc_send_status(int socket, int status) {
+    assert(status < 0);
+    return rpc_send_int(socket, status);
+}
+
+
 /**
  * Receive a payload via a socket from the other end. This works for both client and server.
  * @param socket the specified socket
  * @return       the response payload on success, and NULL on failure
  */
 rpc_data* rpc_receive_payload(int socket) {
+    return rpc_receive_payload_status(socket, NULL, SIZE_MAX);
+}
+
+
+/**
+ * Receive a payload's header, from its verification flags up to its size negotiation, after
+ * which data2 follows. data2 is refused as overlength if it is longer than the receiving end
+ * can hold.
+ * @param socket    the specified socket
+ * @param data1     the returned data1
+ * @param data2_len the returned length of data2
+ * @param capacity  the most data2 bytes the receiving end can hold
+ * @return          0 on success, the other end's status if it sent one in place of the payload
+ *                  (DECLINED for a NULL payload), and ERROR/OVERLENGTH otherwise
+ */
+static int receive_payload_header(int socket, int* data1, size_t* data2_len, size_t capacity) {
     char* TITLE = "rpc-helper: rpc_receive_payload";
     int err;
     int flag;
 
-    // receive payload verification flag
+    // receive payload verification flag, a negative flag being the other end's status
     err = rpc_receive_int(socket, &flag);
     if (err) {
         print_error(TITLE, "cannot receive payload verification flag from other end");
-        return NULL;
+        return ERROR;
     }
     if (flag != 0) {
         print_error(TITLE, "payload is NULL");
-        return NULL;
+        return flag == ERROR ? DECLINED : flag;
     }
 
     // receive data2 verification flag
@@ -269,27 +710,26 @@ rpc_data* rpc_receive_payload(int socket) {
     if (err) {
         print_error(TITLE,
                     "cannot receive data2 verification flag from other end");
-        return NULL;
+        return ERROR;
     }
     // verify data2
     if (flag != 0) {
         print_error(TITLE, "data2 is NULL");
-        return NULL;
+        return ERROR;
     }
 
     // receive data1
-    int data1;
-    err = rpc_receive_int(socket, &data1);
+    err = rpc_receive_int(socket, data1);
     if (err) {
         print_error(TITLE, "cannot receive payload's data1 from other end");
-        return NULL;
+        return ERROR;
     }
 
     // send our UINT_MAX
     err = rpc_send_uint(socket, UINT_MAX);
     if (err) {
         print_error(TITLE, "cannot send this end's UINT_MAX");
-        return NULL;
+        return ERROR;
     }
 
     // receive pivot UINT_MAX
@@ -297,7 +737,7 @@ rpc_data* rpc_receive_payload(int socket) {
     err = rpc_receive_uint(socket, &pivot);
     if (err) {
         print_error(TITLE, "cannot receive other end's UINT_MAX");
-        return NULL;
+        return ERROR;
     }
 
     // receive number of times taken to send data2_len
@@ -306,7 +746,7 @@ rpc_data* rpc_receive_payload(int socket) {
     if (err) {
         print_error(TITLE, "cannot receive from other end the number of times "
                            "required to send data2_len");
-        return NULL;
+        return ERROR;
     }
 
     // receive the remainder
@@ -314,7 +754,7 @@ rpc_data* rpc_receive_payload(int socket) {
     err = rpc_receive_uint(socket, &remainder);
     if (err) {
         print_error(TITLE, "cannot receive data2_len remainder from other end");
-        return NULL;
+        return ERROR;
     }
 
     // to really compare against SIZE_MAX, we cannot do it directly (looped to 0 if exceeded)
@@ -326,41 +766,496 @@ rpc_data* rpc_receive_payload(int socket) {
         uint64_t interval_remainder = SIZE_MAX % pivot;
         if (interval_remainder <= remainder) flag = OVERLENGTH;
     }
+    // within SIZE_MAX, data2 must still fit where it is received into
+    if (flag != OVERLENGTH && pivot * num_send + remainder > capacity)
+        flag = OVERLENGTH;
 
     // verify data2 size does not exceed limit
     err = rpc_send_int(socket, flag);
     if (err) {
         print_error(TITLE, "cannot send limit flag to other end");
-        return NULL;
+        return ERROR;
     }
     // OVERLENGTH ERROR
     if (flag == OVERLENGTH) {
         fprintf(stderr, "Overlength error\n");
-        return NULL;
+        return OVERLENGTH;
     }
+    *data2_len = pivot * num_send + remainder;
+    return 0;
+}
 
-    // otherwise, receive the package
-    size_t data2_len = pivot * num_send + remainder;
-    void* data2 = NULL;
 
-    // receive data2
+/**
+ * Receive the checksum that follows data2 on a checksummed connection, and check it against
+ * the one computed while receiving.
+ * @param socket the specified socket
+ * @param crc    the checksum computed while receiving
+ * @return       0 if they match, CORRUPT if they do not, and ERROR if it cannot be received
+ */
+static int receive_payload_crc(int socket, uint32_t crc) {
+    char* TITLE = "rpc-helper: rpc_receive_payload";
+    uint64_t sent_crc;
+    if (rpc_receive_uint(socket, &sent_crc) < 0) {
+        print_error(TITLE, "cannot receive payload's checksum from other end");
+        return ERROR;
+    }
+    if (sent_crc != crc) {
+        print_error(TITLE, "payload's checksum does not match, payload is corrupt");
+        return CORRUPT;
+    }
+    return 0;
+}
+
+
+/**
+ * Receive a payload via a socket from the other end, along with the reason if there is none.
+ * data2 is allocated to the length the other end claims, so a receiving end that does not trust
+ * it bounds it: a longer data2 is refused as overlength, which leaves both ends in step.
+ * @param socket   the specified socket
+ * @param status   the returned status: 0 on success, the other end's status if it sent one
+ *                 in place of the payload, or ERROR/OVERLENGTH otherwise. May be NULL
+ * @param capacity the most data2 bytes accepted, SIZE_MAX for as many as can be allocated
+ * @return         the response payload on success, and NULL on failure
+ */
+rpc_data* rpc_receive_payload_status(int socket, int* status, size_t capacity) {
+    char* TITLE = "rpc-helper: rpc_receive_payload";
+    int ignored;
+    if (status == NULL) status = &ignored;
+
+    int data1;
+    size_t data2_len;
+    *status = receive_payload_header(socket, &data1, &data2_len, capacity);
+    if (*status != 0) return NULL;
+    *status = ERROR;
+
+    // receive data2, checksummed in the same pass on a checksummed connection
+    uint32_t crc = io_checksum ? payload_crc_start(data1, data2_len) : 0;
+    void* data2 = NULL;
     if (data2_len > 0) {
-        char buffer[data2_len + 1];
-        ssize_t n = recv(socket, buffer, data2_len, 0);
-        if (n < 0) {
+        data2 = (void *) malloc(data2_len);
+        if (data2 == NULL) {
+            print_error(TITLE, "cannot allocate data2");
+            return NULL;
+        }
+        int err = receive_bytes(socket, data2, data2_len, io_checksum ? &crc : NULL);
+        if (err) {
             print_error(TITLE, "cannot receive data2 from other end");
+            free(data2);
             return NULL;
         }
-        buffer[data2_len] = '\0';
-        data2 = (void *) malloc(data2_len * sizeof(void));
-        assert(data2_len == n);
-        memcpy(data2, buffer, n);
+    }
+    if (io_checksum && (*status = receive_payload_crc(socket, crc)) != 0) {
+        free(data2);
+        return NULL;
     }
 
     // return the payload
     rpc_data* payload = (rpc_data*) malloc(sizeof(rpc_data));
+    assert(payload);
     payload->data1 = data1;
     payload->data2_len = data2_len;
     payload->data2 = data2;
+    *status = 0;
     return payload;
 }
+
+
+/**
+ * Receive a payload into the caller's segments rather than a new buffer, filling them in order.
+ * A payload whose data2 is longer than the segments hold is refused as overlength, which leaves
+ * both ends in step.
+ * @param socket    the specified socket
+ * @param sink      the segments to receive data2 into, its data1 is set on success
+ * @param data2_len the returned number of data2 bytes received
+ * @return          0 on success, the other end's status if it sent one in place of the payload,
+ *                  and ERROR/OVERLENGTH otherwise
+ */
+int rpc_receive_payload_vec(int socket, rpc_vdata* sink, size_t* data2_len) {
+    char* TITLE = "rpc-helper: rpc_receive_payload_vec";
+    size_t capacity = 0;
+    for (int i = 0; i < sink->num_segments; i++)
+        capacity += sink->segments[i].iov_len;
+
+    int data1;
+    int status = receive_payload_header(socket, &data1, data2_len, capacity);
+    if (status != 0) return status;
+    uint32_t crc = io_checksum ? payload_crc_start(data1, *data2_len) : 0;
+    if (*data2_len > 0 && receive_bytes_vec(socket, sink->segments, sink->num_segments,
+                                            *data2_len, io_checksum ? &crc : NULL) < 0) {
+        print_error(TITLE, "cannot receive data2 from other end");
+        return ERROR;
+    }
+    if (io_checksum && (status = receive_payload_crc(socket, crc)) != 0)
+        return status;
+    sink->data1 = data1;
+    return 0;
+}
+
+
+/**
+ * Write all bytes of a buffer to a file descriptor.
+ * @return 0 if successful, and -1 if otherwise
+ */
+static int write_all(int fd, const char* buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buffer += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * Move the bytes spliced into a pipe on to a file descriptor. Whatever cannot be spliced on (a
+ * file opened with O_APPEND, for one) is read out of the pipe and written instead.
+ * @param pipe_fd   the pipe's read end
+ * @param fd        the file descriptor
+ * @param len       bytes in the pipe
+ * @param bounce    buffer of BOUNCE bytes, for what is read out
+ * @param splice_ok whether fd takes splices, cleared once it does not
+ * @return          0 if successful, and -1 if the file descriptor failed (the pipe is emptied)
+ */
+static int drain_pipe(int pipe_fd, int fd, size_t len, char* bounce, int* splice_ok) {
+    int failed = 0;
+    while (len > 0) {
+        if (*splice_ok && !failed) {
+            ssize_t n = splice(pipe_fd, NULL, fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n > 0) {
+                len -= (size_t) n;
+                continue;
+            }
+            if (n < 0 && errno == EINVAL) *splice_ok = 0;
+            else failed = 1;
+            continue;
+        }
+        ssize_t n = read(pipe_fd, bounce, len < BOUNCE ? len : BOUNCE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (!failed && write_all(fd, bounce, (size_t) n) < 0) failed = 1;
+        len -= (size_t) n;
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * Receive exactly len bytes, writing them to a file descriptor as they come. Unless they are
+ * checksummed, they are spliced from the socket through a pipe, so they never pass through user
+ * space; otherwise, or where the kernel cannot splice them, they go through a bounce buffer. If
+ * the file descriptor fails, the rest of the bytes are still received and discarded, so that the
+ * connection stays in step.
+ * @param socket the RPC socket
+ * @param fd     the file descriptor, written at its offset
+ * @param len    number of bytes
+ * @param crc    the running checksum, NULL for none
+ * @param failed set if the file descriptor failed
+ * @return       0 if the bytes were all received, and -1 if the socket failed
+ */
+static int receive_to_fd(int socket, int fd, size_t len, uint32_t* crc, int* failed) {
+    int pipe_fds[2] = { ERROR, ERROR };
+    int splice_ok = crc == NULL && pipe2(pipe_fds, O_CLOEXEC) == 0;
+    size_t pipe_size = 0;
+    if (splice_ok) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        int size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+        pipe_size = size > 0 ? (size_t) size : 65536;
+    }
+    char* bounce = (char*) malloc(BOUNCE);
+    assert(bounce);
+
+    int err = 0;
+    while (len > 0) {
+        if (wait_ready(socket, POLLIN) < 0) {
+            err = -1;
+            break;
+        }
+        if (splice_ok && !*failed) {
+            size_t chunk = len < pipe_size ? len : pipe_size;
+            ssize_t n = splice(socket, NULL, pipe_fds[1], NULL, chunk,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL) {
+                splice_ok = 0;
+                continue;
+            }
+            if (n <= 0) {
+                err = -1;
+                break;
+            }
+            if (drain_pipe(pipe_fds[0], fd, (size_t) n, bounce, &splice_ok) < 0) *failed = 1;
+            len -= (size_t) n;
+            continue;
+        }
+        ssize_t n = recv(socket, bounce, len < BOUNCE ? len : BOUNCE, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            err = -1;
+            break;
+        }
+        if (crc) *crc = crc32c(*crc, bounce, (size_t) n);
+        if (!*failed && write_all(fd, bounce, (size_t) n) < 0) *failed = 1;
+        len -= (size_t) n;
+    }
+    free(bounce);
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    return err;
+}
+
+/**
+ * Resize a file to len bytes and map it, to be received into.
+ * @param fd  the file, opened for reading and writing
+ * @param len the file's new size
+ * @return    the mapping, NULL for an empty file, and MAP_FAILED if it cannot be mapped
+ */
+static void* map_file(int fd, size_t len) {
+    if (ftruncate(fd, (off_t) len) < 0) return MAP_FAILED;
+    if (len == 0) return NULL;
+    void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) madvise(map, len, MADV_SEQUENTIAL);
+    return map;
+}
+
+
+/**
+ * Receive a payload into a sink: the caller's buffer, a file descriptor, or a file mapped for
+ * the occasion, rather than a new buffer. A payload whose data2 is longer than the sink's
+ * capacity is refused as overlength, which leaves both ends in step; so does a sink that fails
+ * part way through, the rest of data2 being received and discarded.
+ * @param socket the specified socket
+ * @param sink   the sink, its data1, data2_len (and map) set on success
+ * @return       0 on success, the other end's status if it sent one in place of the payload,
+ *               and ERROR/OVERLENGTH otherwise
+ */
+int rpc_receive_payload_sink(int socket, rpc_sink* sink) {
+    char* TITLE = "rpc-helper: rpc_receive_payload_sink";
+    size_t capacity = sink->capacity;
+    if (sink->kind != RPC_SINK_BUFFER && capacity == 0) capacity = SIZE_MAX;
+
+    int data1;
+    size_t data2_len;
+    int status = receive_payload_header(socket, &data1, &data2_len, capacity);
+    if (status != 0) return status;
+    uint32_t crc = io_checksum ? payload_crc_start(data1, data2_len) : 0;
+    uint32_t* crc_ptr = io_checksum ? &crc : NULL;
+
+    // a file that cannot be mapped is written to instead, so that data2 is drained all the same
+    void* map = NULL;
+    int failed = 0;
+    if (sink->kind == RPC_SINK_MMAP && (map = map_file(sink->fd, data2_len)) == MAP_FAILED) {
+        print_error(TITLE, "cannot map the sink's file");
+        map = NULL;
+        failed = 1;
+    }
+    int err = 0;
+    if (data2_len > 0) {
+        if (sink->kind == RPC_SINK_BUFFER)
+            err = receive_bytes(socket, sink->buffer, data2_len, crc_ptr);
+        else if (map != NULL)
+            err = receive_bytes(socket, map, data2_len, crc_ptr);
+        else err = receive_to_fd(socket, sink->fd, data2_len, crc_ptr, &failed);
+    }
+    if (err) {
+        print_error(TITLE, "cannot receive data2 from other end");
+        if (map != NULL) munmap(map, data2_len);
+        return ERROR;
+    }
+    if (io_checksum) status = receive_payload_crc(socket, crc);
+    if (status == 0 && failed) {
+        print_error(TITLE, "cannot write data2 to the sink");
+        status = ERROR;
+    }
+    if (status != 0) {
+        if (map != NULL) munmap(map, data2_len);
+        return status;
+    }
+    sink->data1 = data1;
+    sink->data2_len = data2_len;
+    sink->map = map;
+    return 0;
+}
+
+
+/**
+ * Send a one-way frame: a request, its function id and its payload, written in one go with no
+ * negotiation, as the sender will not wait for anything in return. On a checksummed connection,
+ * the checksum covers the whole frame and follows it.
+ * @param socket      the specified socket
+ * @param request     the request flag
+ * @param function_id the called function's id
+ * @param payload     the payload, which must not be NULL
+ * @return            0 if successful, and ERROR if otherwise
+ */
+int rpc_send_oneway(int socket, int request, uint64_t function_id, rpc_data* payload) {
+    char* TITLE = "rpc-helper: rpc_send_oneway";
+    if (payload == NULL || (payload->data2_len > 0) != (payload->data2 != NULL)) {
+        print_error(TITLE, "payload is NULL or inconsistent");
+        return ERROR;
+    }
+    uint64_t header[4] = {
+        htonll((uint64_t) request), htonll(function_id),
+        htonll((uint64_t) payload->data1), htonll((uint64_t) payload->data2_len)
+    };
+    struct iovec frame[2] = {
+        { .iov_base = header, .iov_len = sizeof header },
+        { .iov_base = payload->data2, .iov_len = payload->data2_len }
+    };
+    uint32_t crc = 0;
+    if (send_bytes_vec(socket, frame, 2, io_checksum ? &crc : NULL) < 0 ||
+        (io_checksum && rpc_send_uint(socket, crc) < 0)) {
+        print_error(TITLE, "cannot send one-way frame to other end");
+        return ERROR;
+    }
+    return 0;
+}
+
+
+/**
+ * Send as much of a one-way frame as the socket takes right now, in a single sendmsg that does
+ * not wait for room. The frame is the same as rpc_send_oneway's, its checksum computed up front
+ * so that it goes in the same sendmsg.
+ * @param socket      the specified socket
+ * @param request     the request flag
+ * @param function_id the called function's id
+ * @param payload     the payload, which must not be NULL
+ * @return            bytes of the frame sent, 0 if the socket is full, and ERROR on failure
+ */
+ssize_t rpc_send_oneway_nowait(int socket, int request, uint64_t function_id,
+                               rpc_data* payload) {
+    char* TITLE = "rpc-helper: rpc_send_oneway_nowait";
+    if (payload == NULL || (payload->data2_len > 0) != (payload->data2 != NULL)) {
+        print_error(TITLE, "payload is NULL or inconsistent");
+        return ERROR;
+    }
+    uint64_t header[4] = {
+        htonll((uint64_t) request), htonll(function_id),
+        htonll((uint64_t) payload->data1), htonll((uint64_t) payload->data2_len)
+    };
+    uint64_t trailer = 0;
+    if (io_checksum) {
+        uint32_t crc = crc32c(0, header, sizeof header);
+        crc = crc32c(crc, payload->data2, payload->data2_len);
+        trailer = htonll((uint64_t) crc);
+    }
+    struct iovec frame[3] = {
+        { .iov_base = header, .iov_len = sizeof header },
+        { .iov_base = payload->data2, .iov_len = payload->data2_len },
+        { .iov_base = &trailer, .iov_len = io_checksum ? sizeof trailer : 0 }
+    };
+    struct msghdr msg = { .msg_iov = frame, .msg_iovlen = 3 };
+    ssize_t n;
+    do n = sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : ERROR;
+    return n;
+}
+
+
+/**
+ * Encode a one-way frame into a buffer, byte for byte as rpc_send_oneway sends it.
+ * @param request     the request flag
+ * @param function_id the called function's id
+ * @param payload     the payload, which must not be NULL
+ * @param buffer      the buffer, or NULL to only get the frame's size
+ * @return            the frame's size
+ */
+size_t rpc_encode_oneway(int request, uint64_t function_id, rpc_data* payload, void* buffer) {
+    size_t header_len = 4 * sizeof(uint64_t);
+    size_t size = header_len + payload->data2_len + (io_checksum ? sizeof(uint64_t) : 0);
+    if (buffer == NULL) return size;
+
+    uint64_t header[4] = {
+        htonll((uint64_t) request), htonll(function_id),
+        htonll((uint64_t) payload->data1), htonll((uint64_t) payload->data2_len)
+    };
+    char* p = (char*) buffer;
+    memcpy(p, header, header_len);
+    if (payload->data2_len > 0) memcpy(p + header_len, payload->data2, payload->data2_len);
+    if (io_checksum) {
+        uint64_t trailer = htonll((uint64_t) crc32c(0, p, header_len + payload->data2_len));
+        memcpy(p + header_len + payload->data2_len, &trailer, sizeof trailer);
+    }
+    return size;
+}
+
+
+/**
+ * Receive the payload of a one-way frame, whose request flag and function id were already
+ * received. A frame's length is not negotiated, so one longer than MAX_FRAME_LEN is refused
+ * rather than allocated, and the connection is to be dropped.
+ * @param socket      the specified socket
+ * @param request     the frame's request flag
+ * @param function_id the frame's function id
+ * @param status      the returned status: 0 on success, CORRUPT if the payload failed its
+ *                    checksum (the frame was received in full), and ERROR otherwise
+ * @return            the payload on success, and NULL on failure
+ */
+rpc_data* rpc_receive_oneway(int socket, int request, uint64_t function_id, int* status) {
+    char* TITLE = "rpc-helper: rpc_receive_oneway";
+    *status = ERROR;
+    uint64_t header[4] = { htonll((uint64_t) request), htonll(function_id), 0, 0 };
+    if (rpc_receive_bytes(socket, &header[2], 2 * sizeof(uint64_t)) < 0) {
+        print_error(TITLE, "cannot receive payload's data1 and data2_len from other end");
+        return NULL;
+    }
+    uint64_t data1 = ntohll(header[2]);
+    uint64_t data2_len = ntohll(header[3]);
+    if (data2_len > MAX_FRAME_LEN) {
+        print_error(TITLE, "frame's data2_len exceeds MAX_FRAME_LEN");
+        return NULL;
+    }
+
+    // receive data2, checksummed in the same pass on a checksummed connection
+    uint32_t crc = io_checksum ? crc32c(0, header, sizeof header) : 0;
+    void* data2 = NULL;
+    if (data2_len > 0) {
+        data2 = malloc(data2_len);
+        if (data2 == NULL) {
+            print_error(TITLE, "cannot allocate the frame's data2");
+            return NULL;
+        }
+        if (receive_bytes(socket, data2, data2_len, io_checksum ? &crc : NULL) < 0) {
+            print_error(TITLE, "cannot receive data2 from other end");
+            free(data2);
+            return NULL;
+        }
+    }
+    if (io_checksum && (*status = receive_payload_crc(socket, crc)) != 0) {
+        free(data2);
+        return NULL;
+    }
+
+    rpc_data* payload = (rpc_data*) malloc(sizeof(rpc_data));
+    assert(payload);
+    payload->data1 = data1 >= INT_MAX ? -(int) (-data1) : (int) data1;
+    payload->data2_len = data2_len;
+    payload->data2 = data2;
+    *status = 0;
+    return payload;
+}
+
+
+/**
+ * Deep copy a payload, so the copy can be freed independently with rpc_data_free.
+ * @param data the payload to copy
+ * @return     the copy, or NULL if data is NULL
+ */
+rpc_data* rpc_data_copy(rpc_data* data) {
+    if (data == NULL) return NULL;
+    rpc_data* copy = (rpc_data*) malloc(sizeof(rpc_data));
+    assert(copy);
+    copy->data1 = data->data1;
+    copy->data2_len = data->data2_len;
+    copy->data2 = NULL;
+    if (data->data2_len > 0 && data->data2 != NULL) {
+        copy->data2 = malloc(data->data2_len);
+        assert(copy->data2);
+        memcpy(copy->data2, data->data2, data->data2_len);
+    }
+    return copy;
+}
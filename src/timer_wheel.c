@@ -0,0 +1,302 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : timer_wheel.c
+ * Purpose : The timer wheel: timers hashed by their expiry tick into slots of WHEEL_LEVELS
+ *           wheels, each WHEEL_SLOTS times coarser than the one below.
+ *
+ * A timer goes into the finest level whose range covers it, at the slot of its expiry, so arming
+ * and cancelling are a link and an unlink. Level 0 slots are fired tick by tick; a slot of a
+ * higher level is cascaded, its timers re-hashed into the levels below, when the wheel turns to
+ * it. A bitmap per level tells which slots have timers, so the next tick with work is found with
+ * a bit scan per level, and idle stretches of time are skipped in one step rather than ticked
+ * through. The wheel is advanced either by a thread of its own, sleeping until that next tick,
+ * or by the caller (see wheel_advance).
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+#include "rpc_utils.h"
+
+#define WHEEL_MASK (uint64_t) (WHEEL_SLOTS - 1)
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Rotate a slot bitmap right, so that slot index becomes bit 0.
+ */
+static inline uint64_t rotate(uint64_t bits, uint64_t index) {
+    return index ? (bits >> index) | (bits << (WHEEL_SLOTS - index)) : bits;
+}
+
+/**
+ * Link a timer into the slot of its expiry, in the finest level that covers it. A timer beyond
+ * the last level is put at its far end, and fires early, for its callback to arm it again. The
+ * expiry is not before the wheel's tick; at it, only for a timer cascaded down while that tick
+ * is processed, whose level 0 slot is fired next.
+ */
+static void insert(timer_wheel_t* wheel, timer_node_t* timer, uint64_t expires) {
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           (expires >> (level * WHEEL_BITS)) - (wheel->now >> (level * WHEEL_BITS)) >= WHEEL_SLOTS)
+        level++;
+    int shift = level * WHEEL_BITS;
+    if ((expires >> shift) - (wheel->now >> shift) >= WHEEL_SLOTS)
+        expires = ((wheel->now >> shift) + WHEEL_SLOTS - 1) << shift;
+
+    uint64_t index = (expires >> shift) & WHEEL_MASK;
+    timer_node_t** head = &wheel->slots[level][index];
+    timer->expires = expires;
+    timer->slot = level * WHEEL_SLOTS + (int) index;
+    timer->next = *head;
+    timer->pprev = head;
+    if (*head) (*head)->pprev = &timer->next;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << index;
+    wheel->num_timers++;
+}
+
+/**
+ * Unlink an armed timer from its slot.
+ */
+static void unlink_timer(timer_wheel_t* wheel, timer_node_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    int level = timer->slot / WHEEL_SLOTS, index = timer->slot % WHEEL_SLOTS;
+    if (wheel->slots[level][index] == NULL)
+        wheel->occupied[level] &= ~(1ULL << index);
+    wheel->num_timers--;
+}
+
+/**
+ * Take all timers out of a slot.
+ * @return the slot's list of timers, still linked through next
+ */
+static timer_node_t* take_slot(timer_wheel_t* wheel, int level, uint64_t index) {
+    timer_node_t* list = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~(1ULL << index);
+    for (timer_node_t* t = list; t != NULL; t = t->next)
+        wheel->num_timers--;
+    return list;
+}
+
+/**
+ * The next tick at which the wheel has work, a slot to fire or to cascade.
+ * @return the tick, 0 if the wheel has no timers
+ */
+static uint64_t next_tick(timer_wheel_t* wheel) {
+    uint64_t next = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level] == 0) continue;
+        int shift = level * WHEEL_BITS;
+        uint64_t unit = (wheel->now >> shift) + 1;
+        uint64_t bits = rotate(wheel->occupied[level], unit & WHEEL_MASK);
+        uint64_t tick = (unit + (uint64_t) __builtin_ctzll(bits)) << shift;
+        if (next == 0 || tick < next) next = tick;
+    }
+    return next;
+}
+
+/**
+ * Process a tick: cascade the higher level slots the wheel turns to, then fire the timers of
+ * the level 0 slot.
+ * @return number of timers fired
+ */
+static int process_tick(timer_wheel_t* wheel, uint64_t tick, uint64_t now_ns) {
+    wheel->now = tick;
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        int shift = level * WHEEL_BITS;
+        if ((tick & ((1ULL << shift) - 1)) != 0) continue;
+        timer_node_t* list = take_slot(wheel, level, (tick >> shift) & WHEEL_MASK);
+        while (list != NULL) {
+            timer_node_t* t = list;
+            list = list->next;
+            insert(wheel, t, t->expires);
+        }
+    }
+
+    int fired = 0;
+    timer_node_t* list = take_slot(wheel, 0, tick & WHEEL_MASK);
+    while (list != NULL) {
+        timer_node_t* t = list;
+        list = list->next;
+        t->next = NULL;
+        t->pprev = NULL;
+        uint64_t again_ns = wheel->fire(t, now_ns, wheel->arg);
+        uint64_t again = (again_ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+        if (again_ns != 0)
+            insert(wheel, t, again > tick ? again : tick + 1);
+        fired++;
+    }
+    return fired;
+}
+
+/**
+ * Advance the wheel to a time. The wheel must be locked.
+ */
+static int advance(timer_wheel_t* wheel, uint64_t now_ns) {
+    uint64_t target = now_ns / WHEEL_TICK_NS;
+    int fired = 0;
+    while (wheel->now < target) {
+        uint64_t tick = next_tick(wheel);
+        if (tick == 0 || tick > target) {
+            wheel->now = target;
+            break;
+        }
+        fired += process_tick(wheel, tick, now_ns);
+    }
+    return fired;
+}
+
+/**
+ * The wheel's thread, firing timers as they expire until the wheel is stopped.
+ */
+static void* wheel_loop(void* wheel_obj) {
+    timer_wheel_t* wheel = (timer_wheel_t*) wheel_obj;
+    pthread_mutex_lock(&wheel->lock);
+    while (!wheel->stopping) {
+        advance(wheel, rpc_now_ns());
+        uint64_t next = next_tick(wheel);
+        if (next == 0) {
+            wheel->wake_ns = UINT64_MAX;
+            pthread_cond_wait(&wheel->cond, &wheel->lock);
+            continue;
+        }
+        wheel->wake_ns = next * WHEEL_TICK_NS;
+        struct timespec at = {
+                .tv_sec  = (time_t) (wheel->wake_ns / 1000000000ULL),
+                .tv_nsec = (long) (wheel->wake_ns % 1000000000ULL)
+        };
+        pthread_cond_timedwait(&wheel->cond, &wheel->lock, &at);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return NULL;
+}
+
+
+/* ----------------------------- TIMER WHEEL FUNCTIONS ----------------------------- */
+
+/**
+ * Initialize a timer wheel, with no timers and its thread not started.
+ * @param wheel the timer wheel
+ * @param fire  the function called for each timer that expires
+ * @param arg   argument passed to it
+ */
+void wheel_init(timer_wheel_t* wheel, timer_fire fire, void* arg) {
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++)
+            wheel->slots[level][i] = NULL;
+        wheel->occupied[level] = 0;
+    }
+    wheel->now = rpc_now_ns() / WHEEL_TICK_NS;
+    wheel->wake_ns = UINT64_MAX;
+    wheel->num_timers = 0;
+    wheel->fire = fire;
+    wheel->arg = arg;
+    wheel->running = 0;
+    wheel->stopping = 0;
+}
+
+
+/**
+ * Arm a timer, or move it if it is armed already. It fires at the first tick at or after the
+ * time, and the wheel's thread is woken up if it sleeps past that.
+ * @param wheel      the timer wheel
+ * @param timer      the timer, zeroed before it is first armed
+ * @param expires_ns when it fires (see rpc_now_ns)
+ */
+void wheel_arm(timer_wheel_t* wheel, timer_node_t* timer, uint64_t expires_ns) {
+    uint64_t expires = (expires_ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->pprev) unlink_timer(wheel, timer);
+    insert(wheel, timer, expires > wheel->now ? expires : wheel->now + 1);
+    if (wheel->running && timer->expires * WHEEL_TICK_NS < wheel->wake_ns)
+        pthread_cond_signal(&wheel->cond);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+
+/**
+ * Cancel a timer. Once this returns, the timer is not firing and will not fire, so what it is
+ * embedded in can be freed.
+ * @param wheel the timer wheel
+ * @param timer the timer, armed or not
+ */
+void wheel_cancel(timer_wheel_t* wheel, timer_node_t* timer) {
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->pprev) unlink_timer(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+
+/**
+ * Advance the wheel to a time, firing the timers that expired by then, for a wheel without a
+ * thread of its own.
+ * @param wheel  the timer wheel
+ * @param now_ns the time (see rpc_now_ns)
+ * @return       number of timers fired
+ */
+int wheel_advance(timer_wheel_t* wheel, uint64_t now_ns) {
+    pthread_mutex_lock(&wheel->lock);
+    int fired = advance(wheel, now_ns);
+    pthread_mutex_unlock(&wheel->lock);
+    return fired;
+}
+
+
+/**
+ * Get the time the wheel next has work at, for the caller to advance it then.
+ * @param wheel the timer wheel
+ * @return      the time (see rpc_now_ns), 0 if the wheel has no timers
+ */
+uint64_t wheel_next(timer_wheel_t* wheel) {
+    pthread_mutex_lock(&wheel->lock);
+    uint64_t next = next_tick(wheel);
+    pthread_mutex_unlock(&wheel->lock);
+    return next * WHEEL_TICK_NS;
+}
+
+
+/**
+ * Start the wheel's thread, which advances it from then on. Starting it again does nothing.
+ * @param wheel the timer wheel
+ * @return      0 if successful, and ERROR if the thread cannot be created
+ */
+int wheel_start(timer_wheel_t* wheel) {
+    pthread_mutex_lock(&wheel->lock);
+    int err = 0;
+    if (!wheel->running && !wheel->stopping) {
+        err = pthread_create(&wheel->thread, NULL, wheel_loop, wheel);
+        wheel->running = err == 0;
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    if (err) print_error("wheel_start", "cannot create timer thread");
+    return err ? ERROR : 0;
+}
+
+
+/**
+ * Stop the wheel's thread, waiting for it to exit. Timers armed are left, and no longer fire.
+ * @param wheel the timer wheel
+ */
+void wheel_stop(timer_wheel_t* wheel) {
+    pthread_mutex_lock(&wheel->lock);
+    int running = wheel->running;
+    wheel->stopping = 1;
+    wheel->running = 0;
+    pthread_cond_signal(&wheel->cond);
+    pthread_mutex_unlock(&wheel->lock);
+    if (running) pthread_join(wheel->thread, NULL);
+}
@@ -0,0 +1,222 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : trace.c
+ * Purpose : Call tracing. The phases of traced calls are timestamped into per-thread ring
+ *           buffers, and dumped on demand as Chrome trace event JSON (chrome://tracing, Perfetto).
+ *
+ * A ring has a single writer, its thread, which fills the next event and then publishes it by
+ * advancing the ring's head, so tracing takes no lock. The dump copies each ring and keeps only
+ * the events that were not overwritten while it copied. A ring whose thread exits is handed to
+ * the next thread that traces, so short-lived connection threads do not pile up rings.
+ *
+ * Calls carry a call id shared by client and server, and both use the monotonic clock, so the
+ * dumps of a client and a server on the same host line up once their event arrays are merged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+#include "rpc_utils.h"
+
+
+/* trace event */
+typedef struct trace_event {
+    uint64_t call_id;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int side;
+    int phase;
+} trace_event_t;
+
+/* per-thread ring buffer of events */
+typedef struct trace_ring trace_ring_t;
+struct trace_ring {
+    trace_event_t events[TRACE_RING_SIZE];
+    atomic_ullong head;     // events written so far
+    atomic_int owned;       // whether a thread writes to the ring
+    int tid;
+    trace_ring_t* next;
+};
+
+static char* PHASE_NAMES[NUM_PHASES] = {
+    "call", "header", "payload", "queue", "handler", "send", "response"
+};
+
+static atomic_uint sample_every = 0;
+static atomic_ullong next_id = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t* rings = NULL;
+static int num_rings = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t* thread_ring = NULL;
+static __thread unsigned int thread_calls = 0;
+
+
+/* ----------------------------- HELPERS ----------------------------- */
+
+/**
+ * Hand the ring of an exiting thread over to the next thread that traces.
+ */
+static void ring_release(void* ring_obj) {
+    atomic_store(&((trace_ring_t*) ring_obj)->owned, 0);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/**
+ * Get the ring of this thread, taking over a released ring or adding a new one.
+ */
+static trace_ring_t* ring_acquire(void) {
+    if (thread_ring != NULL) return thread_ring;
+    pthread_once(&ring_key_once, ring_key_create);
+
+    pthread_mutex_lock(&rings_lock);
+    trace_ring_t* ring = rings;
+    for (; ring != NULL; ring = ring->next) {
+        int released = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &released, 1)) break;
+    }
+    if (ring == NULL) {
+        ring = (trace_ring_t*) calloc(1, sizeof(trace_ring_t));
+        assert(ring);
+        atomic_init(&ring->owned, 1);
+        ring->tid = ++num_rings;
+        ring->next = rings;
+        rings = ring;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * Write an event as a Chrome trace event, with the call's flow linking client to server.
+ */
+static void write_event(FILE* file, trace_event_t* e, int tid, int* first) {
+    int pid = (int) getpid();
+    char* side = e->side == TRACE_SERVER ? "server" : "client";
+    double ts = (double) e->start_ns / 1000.0;
+    double dur = (double) (e->end_ns - e->start_ns) / 1000.0;
+    fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                  "\"pid\":%d,\"tid\":%d,\"args\":{\"call_id\":\"%016llx\"}}",
+            *first ? "" : ",\n", PHASE_NAMES[e->phase], side, ts, dur, pid, tid,
+            (unsigned long long) e->call_id);
+    *first = 0;
+    if (e->phase == PHASE_CALL)
+        fprintf(file, ",\n{\"name\":\"call\",\"cat\":\"rpc\",\"ph\":\"%s\",\"id\":\"%016llx\","
+                      "\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}",
+                e->side == TRACE_SERVER ? "f" : "s", (unsigned long long) e->call_id, ts, pid,
+                tid, e->side == TRACE_SERVER ? ",\"bp\":\"e\"" : "");
+}
+
+
+/* ----------------------------- TRACE FUNCTIONS ----------------------------- */
+
+/**
+ * Set how calls are sampled for tracing, for the whole process.
+ * @param every trace every n-th call of each thread, 1 for every call, 0 to stop tracing
+ */
+void trace_set_sampling(unsigned int every) {
+    atomic_store(&sample_every, every);
+}
+
+
+/**
+ * Check whether tracing is on.
+ * @return 1 if on, 0 if not
+ */
+int trace_enabled(void) {
+    return atomic_load_explicit(&sample_every, memory_order_relaxed) != 0;
+}
+
+
+/**
+ * Decide whether this thread's next call is traced.
+ * @return 1 if it is, 0 if not
+ */
+int trace_sample(void) {
+    unsigned int every = atomic_load_explicit(&sample_every, memory_order_relaxed);
+    if (every == 0) return 0;
+    return ++thread_calls % every == 0;
+}
+
+
+/**
+ * Get a new call id, unique across the processes of a host.
+ * @return the call id
+ */
+uint64_t trace_new_id(void) {
+    uint64_t n = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+    return ((uint64_t) getpid() << 40) | (n & ((1ULL << 40) - 1));
+}
+
+
+/**
+ * Record a phase of a traced call into this thread's ring.
+ * @param call_id  the call's id
+ * @param side     TRACE_CLIENT or TRACE_SERVER
+ * @param phase    the phase
+ * @param start_ns monotonic time (see rpc_now_ns) the phase started at
+ * @param end_ns   monotonic time the phase ended at
+ */
+void trace_event(uint64_t call_id, int side, int phase, uint64_t start_ns, uint64_t end_ns) {
+    trace_ring_t* ring = ring_acquire();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t* e = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    e->call_id = call_id;
+    e->start_ns = start_ns;
+    e->end_ns = end_ns;
+    e->side = side;
+    e->phase = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+/**
+ * Dump the traced events of all threads, as a Chrome trace event JSON array.
+ * @param path the file to write
+ * @return     0 if successful, and ERROR if otherwise
+ */
+int trace_dump(const char* path) {
+    char* TITLE = "trace_dump";
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        print_error(TITLE, "cannot open trace file");
+        return ERROR;
+    }
+    trace_event_t* copy = (trace_event_t*) malloc(TRACE_RING_SIZE * sizeof(trace_event_t));
+    assert(copy);
+
+    fprintf(file, "[\n");
+    int first = 1;
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring_t* ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = from; i < head; i++)
+            copy[i - from] = ring->events[i & (TRACE_RING_SIZE - 1)];
+
+        // events the writer went over while we copied are torn, and dropped
+        uint64_t now = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t valid = now > TRACE_RING_SIZE ? now - TRACE_RING_SIZE : 0;
+        for (uint64_t i = from > valid ? from : valid; i < head; i++)
+            write_event(file, &copy[i - from], ring->tid, &first);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(file, "\n]\n");
+
+    free(copy);
+    int err = fclose(file);
+    return err ? ERROR : 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : admission.c
+ * Purpose : Tests of the server's admission control, run by `make test` against a local server
+ *           limited to a single call in flight.
+ *
+ * Tests:
+ *     limits - a negative limit is refused
+ *     shed   - a call arriving while the limit is reached is answered with RPC_OVERLOADED, the
+ *              connection staying in step, and calls are admitted again once it is not
+ *     count  - rpc_server_shed_count counts every call shed
+ *
+ * Usage: test-admission [port]
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define SLOW_MS    (int) 500     // time taken by slow, holding the only call in flight
+
+static rpc_server* served = NULL;   // the server, set before it is forked
+
+
+/* handler taking SLOW_MS, then answering without a response */
+static rpc_data* slow(rpc_data* payload) {
+    usleep(SLOW_MS * 1000);
+    return NULL;
+}
+
+/* handler answering with the calls the server has shed so far */
+static rpc_data* shed(rpc_data* payload) {
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = (int) rpc_server_shed_count(served);
+    return response;
+}
+
+/**
+ * Call shed until it is answered, or until it is shed, counting the calls shed.
+ * @param client    the client
+ * @param handle    the handle of shed
+ * @param until_ok  1 to call until answered, 0 until shed
+ * @param num_shed  the calls shed so far, counted on
+ * @return          the last response, NULL if none came before READY_MS
+ */
+static rpc_data* call_until(rpc_client* client, rpc_handle* handle, int until_ok, int* num_shed) {
+    rpc_data payload = { 0, 0, NULL };
+    for (int waited = 0; waited < READY_MS; waited += 10) {
+        rpc_data* response = rpc_call(client, handle, &payload);
+        *num_shed += response == NULL && rpc_client_status(client) == RPC_OVERLOADED;
+        if (until_ok ? response != NULL : rpc_client_status(client) == RPC_OVERLOADED)
+            return response;
+        rpc_data_free(response);
+        usleep(10000);
+    }
+    return NULL;
+}
+
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 7350;
+
+    // limits: only counts of calls in flight, 0 for unlimited, are taken
+    served = rpc_init_server(port);
+    if (served == NULL || rpc_register(served, "slow", slow) < 0 ||
+        rpc_register(served, "shed", shed) < 0)
+        return setup_failed("cannot set up server", ERROR);
+    check(rpc_server_set_limits(served, -1) == ERROR, "limits", "negative limit taken");
+    check(rpc_server_set_limits(served, 1) == 0, "limits", "limit not taken");
+
+    // the server runs in a child process of its own, its handlers on its connection threads
+    pid_t child = server_start(served, port);
+    rpc_client* holder = child > 0 ? rpc_init_client("::1", port) : NULL;
+    rpc_client* client = child > 0 ? rpc_init_client("::1", port) : NULL;
+    rpc_handle* slow_h = holder ? rpc_find(holder, "slow") : NULL;
+    rpc_handle* shed_h = client ? rpc_find(client, "shed") : NULL;
+    if (slow_h == NULL || shed_h == NULL) {
+        free(slow_h);
+        if (holder != NULL) rpc_close_client(holder);
+        if (client != NULL) rpc_close_client(client);
+        return setup_failed("cannot find the server's functions", child);
+    }
+
+    // shed: while a cast of slow holds the only call in flight, calls are answered at once
+    int num_shed = 0;
+    rpc_data payload = { 0, 0, NULL };
+    check(rpc_cast(holder, slow_h, &payload) == RPC_OK, "shed", "cast not written");
+    usleep(SLOW_MS * 1000 / 5);     // for the cast to be admitted, as a call ahead of it sheds it
+    call_until(client, shed_h, 0, &num_shed);
+    check(num_shed == 1, "shed", "no call shed while the limit was reached");
+
+    // count: once slow is done, the calls shed meanwhile, on the same connection, are counted
+    rpc_data* response = call_until(client, shed_h, 1, &num_shed);
+    check(response != NULL, "shed", "no call admitted once the limit was not reached");
+    check(response != NULL && response->data1 == num_shed, "count", "calls shed not counted");
+    rpc_data_free(response);
+
+    free(slow_h);
+    free(shed_h);
+    rpc_close_client(holder);
+    rpc_close_client(client);
+    server_stop(child);
+    return test_done("admission");
+}
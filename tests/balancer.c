@@ -0,0 +1,164 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : balancer.c
+ * Purpose : Tests of the multi-endpoint client, run by `make test` against 3 local replicas.
+ *
+ * Tests:
+ *     balance  - calls are spread over every replica in rotation
+ *     declined - a handler returning NULL, or a function not found, does not eject a replica
+ *     eject    - a replica killed is ejected, and calls go to the others without failing
+ *     probe    - the replica, restarted, is probed once its time out is up and back in rotation
+ *
+ * Every replica is a child process of its own, answering with its port, so a response tells
+ * which replica served it.
+ *
+ * Usage: test-balancer [port]
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "balancer.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define NUM_REPLICAS (int) 3
+#define NUM_CALLS    (int) 30
+
+static int own_port = 0;    // the port of the replica, set before it is forked
+
+
+/* handler answering with the replica's port */
+static rpc_data* whoami(rpc_data* payload) {
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = own_port;
+    return response;
+}
+
+/* handler answering without a response */
+static rpc_data* decline(rpc_data* payload) {
+    return NULL;
+}
+
+/**
+ * Start a replica, and wait for it to accept connections.
+ * @param port the replica's port
+ * @return     the replica's pid, or ERROR if it did not come up
+ */
+static pid_t replica_start(int port) {
+    own_port = port;
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "whoami", whoami) < 0 ||
+        rpc_register(server, "decline", decline) < 0)
+        return ERROR;
+    return server_start(server, port);
+}
+
+/**
+ * Call the balancer a number of times, counting the calls each replica served.
+ * @param b      the balancer
+ * @param handle the handle of whoami
+ * @param ports  the replicas' ports
+ * @param served the returned calls served per replica
+ * @param calls  the number of calls
+ * @return       the number of calls that failed
+ */
+static int call_many(rpc_balancer* b, rpc_handle* handle, int* ports, int* served, int calls) {
+    int failed = 0;
+    for (int i = 0; i < NUM_REPLICAS; i++) served[i] = 0;
+    for (int i = 0; i < calls; i++) {
+        rpc_data payload = { i, 0, NULL };
+        rpc_data* response = rpc_balancer_call(b, handle, &payload, NULL);
+        if (response == NULL) failed++;
+        for (int r = 0; response != NULL && r < NUM_REPLICAS; r++)
+            if (response->data1 == ports[r]) served[r]++;
+        rpc_data_free(response);
+    }
+    return failed;
+}
+
+/* stop every replica started so far */
+static void replicas_kill(pid_t* children) {
+    for (int i = 0; i < NUM_REPLICAS; i++) server_kill(children[i]);
+}
+
+/* read a replica's stats, zeroed if they cannot be read */
+static rpc_endpoint_stats stats_of(rpc_balancer* b, int index) {
+    rpc_endpoint_stats stats = { 0 };
+    rpc_balancer_endpoint_stats(b, index, &stats);
+    return stats;
+}
+
+
+int main(int argc, char* argv[]) {
+    int base = argc > 1 ? atoi(argv[1]) : 7300;
+    int ports[NUM_REPLICAS];
+    pid_t children[NUM_REPLICAS] = { ERROR, ERROR, ERROR };
+    rpc_endpoint endpoints[NUM_REPLICAS];
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        ports[i] = base + i;
+        endpoints[i].addr = "::1";
+        endpoints[i].port = ports[i];
+        children[i] = replica_start(ports[i]);
+        if (children[i] < 0) {
+            replicas_kill(children);
+            return setup_failed("a replica did not come up", ERROR);
+        }
+    }
+
+    rpc_balancer* b = rpc_balancer_init(endpoints, NUM_REPLICAS, RPC_BALANCE_LEAST_OUTSTANDING);
+    rpc_handle* whoami_h = b ? rpc_balancer_find(b, "whoami") : NULL;
+    rpc_handle* decline_h = b ? rpc_balancer_find(b, "decline") : NULL;
+    if (whoami_h == NULL || decline_h == NULL) {
+        replicas_kill(children);
+        return setup_failed("cannot find the replicas' functions", ERROR);
+    }
+    int served[NUM_REPLICAS];
+
+    // balance: ties go round robin, so every replica serves some of the calls
+    check(call_many(b, whoami_h, ports, served, NUM_CALLS) == 0, "balance", "calls failed");
+    for (int i = 0; i < NUM_REPLICAS; i++)
+        check(served[i] > 0, "balance", "a replica served no calls");
+
+    // declined: answers without a response, and a function not found, are not failures
+    for (int i = 0; i < NUM_CALLS; i++) {
+        rpc_data payload = { i, 0, NULL };
+        int status = RPC_OK;
+        rpc_data* response = rpc_balancer_call(b, decline_h, &payload, &status);
+        check(response == NULL && status == RPC_DECLINED, "declined", "status not RPC_DECLINED");
+        rpc_data_free(response);
+    }
+    check(rpc_balancer_find(b, "missing") == NULL, "declined", "found a missing function");
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        rpc_endpoint_stats stats = stats_of(b, i);
+        check(stats.errors == 0 && stats.ejections == 0 && !stats.ejected, "declined",
+              "a replica was counted as failing");
+    }
+
+    // eject: the pooled connection to the killed replica fails at most one call, after which it
+    // cannot be connected to, is ejected at once, and its calls are moved to the others
+    server_kill(children[2]);
+    int failed = call_many(b, whoami_h, ports, served, NUM_CALLS);
+    check(failed <= 1, "eject", "more than one call failed");
+    check(stats_of(b, 2).ejected && stats_of(b, 2).ejections == 1, "eject",
+          "the killed replica was not ejected");
+    check(call_many(b, whoami_h, ports, served, NUM_CALLS) == 0, "eject",
+          "calls failed with the replica ejected");
+    check(served[2] == 0, "eject", "the ejected replica served calls");
+
+    // probe: once its time out is up, the restarted replica's probe succeeds and it is back
+    children[2] = replica_start(ports[2]);
+    check(children[2] > 0, "probe", "replica did not restart");
+    usleep((useconds_t) (EJECT_BASE_NS / 1000 + 100000));
+    check(call_many(b, whoami_h, ports, served, NUM_CALLS) == 0, "probe", "calls failed");
+    check(served[2] > 0, "probe", "the restarted replica served no calls");
+    check(!stats_of(b, 2).ejected, "probe", "the restarted replica is still ejected");
+
+    free(whoami_h);
+    free(decline_h);
+    rpc_balancer_close(b);
+    replicas_kill(children);
+    return test_done("balancer");
+}
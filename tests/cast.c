@@ -0,0 +1,178 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : cast.c
+ * Purpose : Tests of one-way calls, run by `make test` against a local server.
+ *
+ * Tests:
+ *     order      - casts all run, in order with the client's calls
+ *     declined   - a cast whose handler returns NULL leaves the connection in step
+ *     overlength - a cast over MAX_FRAME_LEN is refused with RPC_OVERLENGTH, without being sent
+ *     frame      - a frame claiming more than MAX_FRAME_LEN closes only its own connection, and
+ *                  the server goes on serving the others
+ *     payload    - a call's payload over the server's max payload, up to one no allocation could
+ *                  hold, is refused with RPC_OVERLENGTH, its connection left in step
+ *
+ * Usage: test-cast [port]
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_client.h"
+#include "rpc_server.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define NUM_CASTS  (int) 1000
+
+/* casts seen in order by the server, or ERROR once one came out of order */
+static int in_order = 0;
+
+
+/* cast handler, counting casts as long as they come in order */
+static rpc_data* record(rpc_data* payload) {
+    if (in_order != ERROR) in_order = payload->data1 == in_order + 1 ? in_order + 1 : ERROR;
+    return NULL;
+}
+
+/* handler answering with the casts seen in order so far */
+static rpc_data* report(rpc_data* payload) {
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = in_order;
+    return response;
+}
+
+/* the casts the server has seen in order, or ERROR if the call fails */
+static int reported(rpc_client* client, rpc_handle* handle) {
+    rpc_data payload = { 0, 0, NULL };
+    rpc_data* response = rpc_call(client, handle, &payload);
+    int seen = response != NULL ? response->data1 : ERROR;
+    rpc_data_free(response);
+    return seen;
+}
+
+/**
+ * Send the header of a cast frame claiming data2_len bytes, on a connection of its own, and
+ * wait for the server to close it. A server still waiting for data2 fails this after READY_MS.
+ * @param port        the server's port
+ * @param function_id the cast function's id
+ * @param data2_len   the claimed length of data2
+ * @return            1 if the server closed the connection, and 0 if otherwise
+ */
+static int cast_frame_closed(int port, uint64_t function_id, uint64_t data2_len) {
+    int fd = create_connect_socket("::1", port);
+    if (fd < 0) return 0;
+    struct timeval timeout = { READY_MS / 1000, 0 };
+    int err = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    err |= rpc_send_int(fd, CAST_SERVICE);
+    err |= rpc_send_uint(fd, function_id);
+    err |= rpc_send_int(fd, 1);
+    err |= rpc_send_uint(fd, data2_len);
+    char byte;
+    int closed = !err && recv(fd, &byte, 1, 0) == 0;
+    close(fd);
+    return closed;
+}
+
+/**
+ * Send a call whose payload claims data2_len bytes, on a connection of its own, then the header
+ * of a second call on it, as the server should have refused the first payload before its data2.
+ * @param port        the server's port
+ * @param function_id the called function's id
+ * @param data2_len   the claimed length of data2
+ * @return            1 if the payload was refused with OVERLENGTH and the second call accepted,
+ *                    and 0 if otherwise
+ */
+static int call_payload_refused(int port, uint64_t function_id, uint64_t data2_len) {
+    int fd = create_connect_socket("::1", port);
+    if (fd < 0) return 0;
+    struct timeval timeout = { READY_MS / 1000, 0 };
+    int err = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    int flag = ERROR;
+    uint64_t pivot = 0;
+    err |= rpc_send_int(fd, CALL_SERVICE);
+    err |= rpc_send_uint(fd, function_id);
+    err |= rpc_receive_int(fd, &flag) || flag != 0;
+    err |= rpc_send_int(fd, 0);
+    err |= rpc_send_int(fd, 0);
+    err |= rpc_send_int(fd, 0);
+    err |= rpc_receive_uint(fd, &pivot) || pivot == 0;
+    if (!err) {
+        err |= rpc_send_uint(fd, pivot);
+        err |= rpc_send_uint(fd, data2_len / pivot);
+        err |= rpc_send_uint(fd, data2_len % pivot);
+        err |= rpc_receive_int(fd, &flag) || flag != OVERLENGTH;
+    }
+    err |= rpc_send_int(fd, CALL_SERVICE);
+    err |= rpc_send_uint(fd, function_id);
+    int refused = !err && rpc_receive_int(fd, &flag) == 0 && flag == 0;
+    close(fd);
+    return refused;
+}
+
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 7320;
+
+    // the server runs in a child process of its own, its handlers on its connection threads
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "record", record) < 0 ||
+        rpc_register(server, "report", report) < 0 ||
+        rpc_server_set_max_payload(server, MAX_FRAME_LEN) < 0)
+        return setup_failed("cannot set up server", ERROR);
+    pid_t child = server_start(server, port);
+    rpc_client* client = child > 0 ? rpc_init_client("::1", port) : NULL;
+    rpc_handle* record_h = client ? rpc_find(client, "record") : NULL;
+    rpc_handle* report_h = client ? rpc_find(client, "report") : NULL;
+    if (record_h == NULL || report_h == NULL) {
+        free(record_h);
+        if (client != NULL) rpc_close_client(client);
+        return setup_failed("cannot find the server's functions", child);
+    }
+
+    // order and declined: every cast has run by the time the next call is answered, and the
+    // NULL each returned left the connection in step for it
+    int sent = 0;
+    for (int i = 1; i <= NUM_CASTS; i++) {
+        rpc_data payload = { i, 0, NULL };
+        sent += rpc_cast(client, record_h, &payload) == RPC_OK;
+    }
+    check(sent == NUM_CASTS, "order", "casts not written");
+    check(reported(client, report_h) == NUM_CASTS, "order", "casts lost or out of order");
+
+    // overlength: refused before anything is written, so the server sees nothing of it
+    rpc_data big = { NUM_CASTS + 1, MAX_FRAME_LEN + 1, calloc(1, MAX_FRAME_LEN + 1) };
+    check(big.data2 != NULL && rpc_cast(client, record_h, &big) == RPC_OVERLENGTH,
+          "overlength", "cast over MAX_FRAME_LEN not refused");
+    check(rpc_client_status(client) == RPC_OVERLENGTH, "overlength", "status not overlength");
+    check(reported(client, report_h) == NUM_CASTS, "overlength", "the server saw the cast");
+
+    // frame: lengths past MAX_FRAME_LEN, up to one no allocation could hold, are refused
+    uint64_t lengths[] = { MAX_FRAME_LEN + 1, (uint64_t) 1 << 40, UINT64_MAX };
+    for (size_t i = 0; i < sizeof lengths / sizeof lengths[0]; i++)
+        check(cast_frame_closed(port, record_h->function_id, lengths[i]), "frame",
+              "the server did not close the connection");
+    check(reported(client, report_h) == NUM_CASTS, "frame", "the server stopped serving");
+
+    // payload: refused before data2 is sent, then the same lengths as frame claimed by calls
+    rpc_data* response = rpc_call(client, report_h, &big);
+    check(response == NULL && rpc_client_status(client) == RPC_OVERLENGTH, "payload",
+          "call over the max payload not refused");
+    rpc_data_free(response);
+    check(reported(client, report_h) == NUM_CASTS, "payload", "the connection is out of step");
+    for (size_t i = 0; i < sizeof lengths / sizeof lengths[0]; i++)
+        check(call_payload_refused(port, report_h->function_id, lengths[i]), "payload",
+              "the payload was not refused, or its connection left out of step");
+    check(reported(client, report_h) == NUM_CASTS, "payload", "the server stopped serving");
+
+    free(big.data2);
+    free(record_h);
+    free(report_h);
+    rpc_close_client(client);
+    server_stop(child);
+    return test_done("cast");
+}
@@ -0,0 +1,216 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : checksum.c
+ * Purpose : Tests of negotiated CRC32C checksums, run by `make test` against a local server.
+ *
+ * Tests:
+ *     roundtrip - checksummed calls of every size and kind (contiguous, vectored, into a sink)
+ *     payload   - a payload corrupted on its way is answered with RPC_CORRUPT
+ *     response  - a response corrupted on its way is received as RPC_CORRUPT
+ *     unchecked - without checksums, the same corruption goes unnoticed
+ *
+ * The client reaches the server through a relay, which flips one byte of data2 on demand. A run
+ * of FILL bytes marks data2, as no header has one, so the byte flipped is always in data2. After
+ * RPC_CORRUPT the connection must still be in step: the next call succeeds on it, the relay
+ * having accepted no other.
+ *
+ * Usage: test-checksum [port]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_client.h"
+#include "rpc_server.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define FILL       (unsigned char) 0x61    // every byte of data2
+#define FILL_RUN   (int) 16                // bytes of FILL in a row before one is flipped
+#define BIG        (size_t) 65536
+
+#define TO_SERVER  (int) 1
+#define TO_CLIENT  (int) 2
+
+/* relay between the client and the server */
+typedef struct {
+    int listen_fd;
+    int server_port;
+    atomic_int flip;            // TO_SERVER or TO_CLIENT to flip a byte that way, once
+    atomic_int accepted;        // connections accepted from clients
+} relay_t;
+
+
+/* echo handler, answering with a copy of the payload */
+static rpc_data* echo(rpc_data* payload) {
+    return rpc_data_copy(payload);
+}
+
+/**
+ * Forward what one end sent to the other, flipping a byte of data2 if asked to.
+ * @param relay the relay
+ * @param from  the socket read from
+ * @param to    the socket written to
+ * @param dir   the direction, TO_SERVER or TO_CLIENT
+ * @param run   the FILL bytes in a row seen that way so far
+ * @return      0 if successful, and ERROR once either end is gone
+ */
+static int relay_forward(relay_t* relay, int from, int to, int dir, int* run) {
+    unsigned char buffer[BIG];
+    ssize_t n = recv(from, buffer, sizeof buffer, 0);
+    if (n <= 0) return ERROR;
+    for (ssize_t i = 0; i < n; i++) {
+        *run = buffer[i] == FILL ? *run + 1 : 0;
+        int expected = dir;
+        if (*run > FILL_RUN && atomic_compare_exchange_strong(&relay->flip, &expected, 0))
+            buffer[i] ^= 1;
+    }
+    for (ssize_t sent = 0; sent < n; ) {
+        ssize_t m = send(to, buffer + sent, n - sent, MSG_NOSIGNAL);
+        if (m <= 0) return ERROR;
+        sent += m;
+    }
+    return 0;
+}
+
+/* relay thread, serving one client connection at a time */
+static void* relay_run(void* relay_obj) {
+    relay_t* relay = (relay_t*) relay_obj;
+    for (;;) {
+        int client_fd = accept(relay->listen_fd, NULL, NULL);
+        if (client_fd < 0) continue;
+        atomic_fetch_add(&relay->accepted, 1);
+        int server_fd = create_connect_socket("::1", relay->server_port);
+        int runs[2] = { 0, 0 };
+        while (server_fd >= 0) {
+            struct pollfd fds[2] = { { client_fd, POLLIN, 0 }, { server_fd, POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0) break;
+            if (fds[0].revents && relay_forward(relay, client_fd, server_fd, TO_SERVER, &runs[0]))
+                break;
+            if (fds[1].revents && relay_forward(relay, server_fd, client_fd, TO_CLIENT, &runs[1]))
+                break;
+        }
+        if (server_fd >= 0) close(server_fd);
+        close(client_fd);
+    }
+    return NULL;
+}
+
+/* a payload of len FILL bytes, its data2 to be freed */
+static rpc_data filled(size_t len) {
+    rpc_data payload = { 7, len, NULL };
+    if (len > 0) {
+        payload.data2 = malloc(len);
+        memset(payload.data2, FILL, len);
+    }
+    return payload;
+}
+
+/* whether a response is the echo of a payload */
+static int echoed(rpc_data* response, rpc_data* payload) {
+    return response != NULL && response->data1 == payload->data1 &&
+           response->data2_len == payload->data2_len &&
+           (payload->data2_len == 0 || memcmp(response->data2, payload->data2,
+                                              payload->data2_len) == 0);
+}
+
+/**
+ * Call echo with a payload corrupted one way, then again unharmed on the same connection.
+ * @param client  the client, through the relay
+ * @param handle  the handle of echo
+ * @param relay   the relay
+ * @param dir     the way the byte is flipped, TO_SERVER or TO_CLIENT
+ * @param test    the test's name
+ * @param status  the expected status of the corrupted call
+ */
+static void call_corrupted(rpc_client* client, rpc_handle* handle, relay_t* relay, int dir,
+                           char* test, int status) {
+    rpc_data payload = filled(BIG);
+    int accepted = atomic_load(&relay->accepted);
+    atomic_store(&relay->flip, dir);
+    rpc_data* response = rpc_call(client, handle, &payload);
+    check(atomic_load(&relay->flip) == 0, test, "the relay flipped no byte");
+    if (status == RPC_OK)
+        check(response != NULL && !echoed(response, &payload), test,
+              "the corrupted call did not return the corrupted bytes");
+    else check(response == NULL && rpc_client_status(client) == status, test,
+               "the corrupted call did not fail with its status");
+    rpc_data_free(response);
+
+    response = rpc_call(client, handle, &payload);
+    check(echoed(response, &payload), test, "the next call failed");
+    check(atomic_load(&relay->accepted) == accepted, test, "the client reconnected");
+    rpc_data_free(response);
+    free(payload.data2);
+}
+
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 7310;
+
+    // the server runs in a child process of its own
+    rpc_server* server = rpc_init_server(port + 1);
+    if (server == NULL || rpc_register(server, "echo", echo) < 0)
+        return setup_failed("cannot set up server", ERROR);
+    pid_t child = server_start(server, port + 1);
+    if (child < 0) return setup_failed("server did not come up", ERROR);
+
+    relay_t relay = { .listen_fd = create_listen_socket(port, 0, 16), .server_port = port + 1 };
+    pthread_t relay_thread;
+    if (relay.listen_fd < 0 || pthread_create(&relay_thread, NULL, relay_run, &relay) != 0)
+        return setup_failed("cannot start the relay", child);
+    rpc_client* client = rpc_init_client("::1", port);
+    rpc_handle* handle = client ? rpc_find(client, "echo") : NULL;
+    if (handle == NULL) {
+        if (client != NULL) rpc_close_client(client);
+        return setup_failed("cannot find echo through the relay", child);
+    }
+
+    // unchecked: with no checksums, a flipped byte reaches the other end as it is
+    call_corrupted(client, handle, &relay, TO_SERVER, "unchecked", RPC_OK);
+
+    // roundtrip: every size, across the boundaries of the checksum's blocks, and every kind
+    check(rpc_client_set_checksum(client, 1) == 0, "roundtrip", "checksums not negotiated");
+    size_t sizes[] = { 0, 1, 7, 8, 63, 4096, 65535, 1 << 20, (1 << 20) + 3 };
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        rpc_data payload = filled(sizes[i]);
+        rpc_data* response = rpc_call(client, handle, &payload);
+        check(echoed(response, &payload), "roundtrip", "contiguous call not echoed");
+        rpc_data_free(response);
+
+        size_t half = sizes[i] / 2;
+        struct iovec segments[2] = { { payload.data2, half },
+                                     { (char*) payload.data2 + half, sizes[i] - half } };
+        rpc_vdata vpayload = { payload.data1, 2, segments };
+        response = rpc_call_vec(client, handle, &vpayload);
+        check(echoed(response, &payload), "roundtrip", "vectored call not echoed");
+        rpc_data_free(response);
+
+        void* buffer = malloc(sizes[i] + 1);
+        rpc_sink sink = { .kind = RPC_SINK_BUFFER, .buffer = buffer, .capacity = sizes[i] };
+        rpc_data received = { 0, 0, buffer };
+        check(rpc_call_into(client, handle, &payload, &sink) == RPC_OK, "roundtrip",
+              "call into a sink failed");
+        received.data1 = sink.data1;
+        received.data2_len = sink.data2_len;
+        check(echoed(&received, &payload), "roundtrip", "call into a sink not echoed");
+        free(buffer);
+        free(payload.data2);
+    }
+
+    // payload and response: a flipped byte either way is caught, and the connection kept
+    call_corrupted(client, handle, &relay, TO_SERVER, "payload", RPC_CORRUPT);
+    call_corrupted(client, handle, &relay, TO_CLIENT, "response", RPC_CORRUPT);
+
+    free(handle);
+    rpc_close_client(client);
+    server_stop(child);
+    return test_done("checksum");
+}
@@ -0,0 +1,151 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : deadline.c
+ * Purpose : Tests of calls with a deadline, run by `make test` against a local server.
+ *
+ * Tests:
+ *     expired - a call outliving its deadline returns RPC_EXPIRED once it passes, not once the
+ *               handler is done, and the next call on the client succeeds
+ *     left    - a handler sees the time left before its call's deadline, and -1 without one
+ *     dropped - a call whose deadline has passed is not sent, and one the server sees expired
+ *               is answered with EXPIRED without its handler being called
+ *
+ * Usage: test-deadline [port]
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_client.h"
+#include "rpc_server.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define SLOW_MS     (int) 500     // time taken by slow
+#define DEADLINE_MS (int) 50      // deadline of the calls that outlive it
+#define LEFT_MS     (int) 1000    // deadline of the calls to left
+
+/* calls of count run by the server, the server's own */
+static int runs = 0;
+
+
+/* handler taking SLOW_MS to answer with its payload's data1 */
+static rpc_data* slow(rpc_data* payload) {
+    usleep(SLOW_MS * 1000);
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = payload->data1;
+    return response;
+}
+
+/* handler answering with the time left before its call's deadline */
+static rpc_data* left(rpc_data* payload) {
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = (int) rpc_time_left_ms();
+    return response;
+}
+
+/* handler counting the calls it ran, with data1 1, and answering with that count */
+static rpc_data* count(rpc_data* payload) {
+    runs += payload->data1 == 1;
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = runs;
+    return response;
+}
+
+/* milliseconds since start */
+static long elapsed_ms(struct timeval* start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/* data1 of the response to a call, or ERROR if the call fails */
+static int answered(rpc_client* client, rpc_handle* handle, int data1, unsigned int timeout_ms) {
+    rpc_data payload = { data1, 0, NULL };
+    rpc_data* response = timeout_ms ? rpc_call_with_deadline(client, handle, &payload, timeout_ms)
+                                    : rpc_call(client, handle, &payload);
+    int answer = response != NULL ? response->data1 : ERROR;
+    rpc_data_free(response);
+    return answer;
+}
+
+/**
+ * Send the header of a call whose deadline has already passed, on a connection of its own.
+ * @param port        the server's port
+ * @param function_id the called function's id
+ * @return            1 if the server answered the call with EXPIRED, and 0 if otherwise
+ */
+static int expired_call_refused(int port, uint64_t function_id) {
+    int fd = create_connect_socket("::1", port);
+    if (fd < 0) return 0;
+    struct timeval timeout = { READY_MS / 1000, 0 };
+    int err = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    err |= rpc_send_int(fd, CALL_DEADLINE_SERVICE);
+    err |= rpc_send_uint(fd, function_id);
+    err |= rpc_send_uint(fd, 0);
+    int flag = 0;
+    int refused = !err && rpc_receive_int(fd, &flag) == 0 && flag == EXPIRED;
+    close(fd);
+    return refused;
+}
+
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 7340;
+
+    // the server runs in a child process of its own
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "slow", slow) < 0 ||
+        rpc_register(server, "left", left) < 0 || rpc_register(server, "count", count) < 0)
+        return setup_failed("cannot set up server", ERROR);
+    pid_t child = server_start(server, port);
+    rpc_client* client = child > 0 ? rpc_init_client("::1", port) : NULL;
+    rpc_handle* slow_h = client ? rpc_find(client, "slow") : NULL;
+    rpc_handle* left_h = client ? rpc_find(client, "left") : NULL;
+    rpc_handle* count_h = client ? rpc_find(client, "count") : NULL;
+    if (slow_h == NULL || left_h == NULL || count_h == NULL) {
+        free(slow_h);
+        free(left_h);
+        if (client != NULL) rpc_close_client(client);
+        return setup_failed("cannot find the server's functions", child);
+    }
+
+    // expired: the client gives up at the deadline, dropping the connection it left half way,
+    // which the next call re-establishes
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    check(answered(client, slow_h, 1, DEADLINE_MS) == ERROR &&
+          rpc_client_status(client) == RPC_EXPIRED, "expired", "status not RPC_EXPIRED");
+    check(elapsed_ms(&start) < SLOW_MS, "expired", "the call waited on the handler");
+    check(answered(client, slow_h, 2, 0) == 2, "expired", "the next call failed");
+
+    // left: the deadline travels with the call, as the time left rather than a clock time
+    int ms = answered(client, left_h, 0, LEFT_MS);
+    check(ms > 0 && ms <= LEFT_MS, "left", "time left out of the deadline's range");
+    rpc_data payload = { 0, 0, NULL };
+    rpc_data* response = rpc_call(client, left_h, &payload);
+    check(response != NULL && response->data1 == -1, "left", "time left without a deadline");
+    rpc_data_free(response);
+
+    // dropped: neither a call already expired at the client, nor one expired at the server, runs
+    check(answered(client, count_h, 1, 0) == 1, "dropped", "count failed");
+    payload.data1 = 1;
+    response = rpc_call_with_deadline(client, count_h, &payload, 0);
+    check(response == NULL && rpc_client_status(client) == RPC_EXPIRED, "dropped",
+          "a call already expired was sent");
+    rpc_data_free(response);
+    check(expired_call_refused(port, count_h->function_id), "dropped",
+          "a call expired at the server was not answered with EXPIRED");
+    check(answered(client, count_h, 0, 0) == 1, "dropped", "an expired call ran");
+
+    free(slow_h);
+    free(left_h);
+    free(count_h);
+    rpc_close_client(client);
+    server_stop(child);
+    return test_done("deadline");
+}
@@ -0,0 +1,113 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : fixture.c
+ * Purpose : What every test shares: its checks, and the local servers it runs in child processes
+ *           of their own.
+ *
+ * A test reports each failed check as it goes, on stderr, and ends with test_done, whose result
+ * is its exit status. A server is set up (registered and configured) by the test, then served by
+ * a child process; the test keeps no copy of its listening socket, so a server stopped or killed
+ * refuses connections at once.
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "fixture.h"
+#include "rpc_server.h"
+#include "rpc_utils.h"
+
+static int failures = 0;
+
+
+/**
+ * Check a condition, reporting the test as failed if it does not hold.
+ * @param ok   the condition
+ * @param test the test's name
+ * @param what what was checked
+ */
+void check(int ok, char* test, char* what) {
+    if (ok) return;
+    fprintf(stderr, "FAIL %s: %s\n", test, what);
+    failures++;
+}
+
+
+/**
+ * Report a test's outcome, once all its checks are done.
+ * @param name the test's name
+ * @return     the test's exit status, 0 if all its checks held
+ */
+int test_done(char* name) {
+    printf("%s %s\n", failures ? "FAIL" : "ok  ", name);
+    return failures ? 1 : 0;
+}
+
+
+/**
+ * Serve a server in a child process, and wait for it to accept connections.
+ * @param server the server, set up and not yet serving
+ * @param port   the server's port
+ * @return       the child's pid, or ERROR if it did not come up
+ */
+pid_t server_start(rpc_server* server, int port) {
+    if (server == NULL) return ERROR;
+    pid_t child = fork();
+    if (child == 0) rpc_serve_all(server);
+    close(server->listen_fd);
+    if (child < 0) return ERROR;
+
+    rpc_client* client = server_connect(port);
+    if (client == NULL) {
+        server_kill(child);
+        return ERROR;
+    }
+    rpc_close_client(client);
+    return child;
+}
+
+
+/**
+ * Connect to a local server, waiting up to READY_MS for it to accept connections.
+ * @param port the server's port
+ * @return     the client, or NULL if the server did not accept the connection
+ */
+rpc_client* server_connect(int port) {
+    rpc_client* client = NULL;
+    for (int waited = 0; client == NULL && waited < READY_MS; waited += 10) {
+        client = rpc_init_client("::1", port);
+        if (client == NULL) usleep(10000);
+    }
+    return client;
+}
+
+
+/* stop a server gracefully, and wait for it */
+void server_stop(pid_t child) {
+    if (child <= 0) return;
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+}
+
+
+/* stop a server at once, as if it crashed, and wait for it */
+void server_kill(pid_t child) {
+    if (child <= 0) return;
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+}
+
+
+/**
+ * Give up on a test whose setup failed, stopping its server.
+ * @param what  what failed
+ * @param child the test's server, ERROR if it has none
+ * @return      the test's exit status
+ */
+int setup_failed(char* what, pid_t child) {
+    fprintf(stderr, "FAIL setup: %s\n", what);
+    server_stop(child);
+    return 1;
+}
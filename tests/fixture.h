@@ -0,0 +1,28 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : fixture.h
+ * Purpose : Header file for what every test shares: its checks, and the local servers it runs in
+ *           child processes of their own.
+ */
+
+#ifndef PROJECT2_FIXTURE_H
+#define PROJECT2_FIXTURE_H
+
+#include <sys/types.h>
+#include "rpc.h"
+
+#define READY_MS (int) 2000     // time a server has to come up, and a client to wait on a server
+
+
+/* checks, counted into the test's outcome */
+void check(int ok, char* test, char* what);
+int test_done(char* name);
+
+/* local servers */
+pid_t server_start(rpc_server* server, int port);
+rpc_client* server_connect(int port);
+void server_stop(pid_t child);
+void server_kill(pid_t child);
+int setup_failed(char* what, pid_t child);
+
+#endif //PROJECT2_FIXTURE_H
@@ -0,0 +1,215 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : stream.c
+ * Purpose : Tests of server-streaming calls, run by `make test` against a local server.
+ *
+ * Tests:
+ *     frames   - every frame arrives whole and in order, with and without checksums
+ *     fail     - a handler returning -1 ends its stream with RPC_ERROR after the frames it wrote
+ *     oversize - a frame over MAX_FRAME_LEN is refused by rpc_stream_write, the stream going on
+ *     close    - a stream closed half way drops its connection, and the next stream reconnects
+ *     bound    - a frame claiming more than MAX_FRAME_LEN, from a rogue server, ends the stream
+ *                with RPC_ERROR rather than being allocated
+ *
+ * Usage: test-stream [port]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_client.h"
+#include "rpc_server.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define NUM_FRAMES (int) 200
+#define FRAME_STEP (size_t) 1000    // data2 bytes added by each frame over the last
+#define FAIL_AFTER (int) 3
+#define ROGUE_ID   (uint64_t) 42
+
+/* rogue server, answering a stream call with a frame header claiming data2_len bytes */
+typedef struct {
+    int listen_fd;
+    uint64_t data2_len;
+} rogue_t;
+
+
+/* streaming handler, writing data1 frames, frame i holding i * FRAME_STEP bytes of i */
+static int count(rpc_data* payload, rpc_stream_writer* writer) {
+    for (int i = 0; i < payload->data1; i++) {
+        rpc_data frame = { i, i * FRAME_STEP, NULL };
+        if (frame.data2_len > 0) {
+            frame.data2 = malloc(frame.data2_len);
+            memset(frame.data2, i & 0xff, frame.data2_len);
+        }
+        int err = rpc_stream_write(writer, &frame);
+        free(frame.data2);
+        if (err) return ERROR;
+    }
+    return 0;
+}
+
+/* streaming handler, failing after FAIL_AFTER frames */
+static int fail(rpc_data* payload, rpc_stream_writer* writer) {
+    for (int i = 0; i < FAIL_AFTER; i++) {
+        rpc_data frame = { i, 0, NULL };
+        if (rpc_stream_write(writer, &frame)) break;
+    }
+    return ERROR;
+}
+
+/* streaming handler, writing a frame over MAX_FRAME_LEN, then one with what that write returned */
+static int oversize(rpc_data* payload, rpc_stream_writer* writer) {
+    rpc_data big = { 0, MAX_FRAME_LEN + 1, calloc(1, MAX_FRAME_LEN + 1) };
+    rpc_data frame = { big.data2 ? rpc_stream_write(writer, &big) : 0, 0, NULL };
+    free(big.data2);
+    return rpc_stream_write(writer, &frame);
+}
+
+/* whether a frame is frame i of count */
+static int counted(rpc_data* frame, int i) {
+    if (frame == NULL || frame->data1 != i || frame->data2_len != i * FRAME_STEP) return 0;
+    for (size_t j = 0; j < frame->data2_len; j++)
+        if (((unsigned char*) frame->data2)[j] != (i & 0xff)) return 0;
+    return 1;
+}
+
+/**
+ * Read a whole stream of count, checking each of its frames.
+ * @param client the client
+ * @param handle the handle of count
+ * @param frames the number of frames asked for
+ * @param test   the test's name
+ */
+static void read_counted(rpc_client* client, rpc_handle* handle, int frames, char* test) {
+    rpc_data payload = { frames, 0, NULL };
+    rpc_stream* stream = rpc_call_stream(client, handle, &payload);
+    check(stream != NULL, test, "stream not opened");
+    if (stream == NULL) return;
+    int i = 0;
+    for (rpc_data* frame; (frame = rpc_stream_next(stream)) != NULL; i++) {
+        check(counted(frame, i), test, "frame out of order or damaged");
+        rpc_data_free(frame);
+    }
+    check(i == frames, test, "frames missing");
+    check(rpc_stream_close(stream) == RPC_OK, test, "stream did not end well");
+}
+
+/* rogue server thread, answering one stream call */
+static void* rogue_run(void* rogue_obj) {
+    rogue_t* rogue = (rogue_t*) rogue_obj;
+    int fd = accept(rogue->listen_fd, NULL, NULL);
+    if (fd < 0) return NULL;
+    int request;
+    uint64_t id;
+    if (rpc_receive_int(fd, &request) == 0 && rpc_receive_uint(fd, &id) == 0 &&
+        rpc_send_int(fd, 0) == 0) {
+        rpc_data_free(rpc_receive_payload(fd));
+        rpc_send_int(fd, STREAM_FRAME);
+        rpc_send_uint(fd, id);
+        rpc_send_int(fd, 0);
+        rpc_send_uint(fd, rogue->data2_len);
+        char byte;
+        recv(fd, &byte, 1, 0);
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Open a stream on a rogue server, whose first frame claims data2_len bytes.
+ * @param port      the rogue server's port
+ * @param data2_len the claimed length of data2
+ * @return          1 if the stream ended with RPC_ERROR and no frame, and 0 if otherwise
+ */
+static int rogue_frame_refused(int port, uint64_t data2_len) {
+    rogue_t rogue = { create_listen_socket(port, 0, 1), data2_len };
+    pthread_t thread;
+    if (rogue.listen_fd < 0 || pthread_create(&thread, NULL, rogue_run, &rogue) != 0) return 0;
+    rpc_client* client = rpc_init_client("::1", port);
+    struct rpc_handle handle = { ROGUE_ID };
+    rpc_data payload = { 0, 0, NULL };
+    rpc_stream* stream = client ? rpc_call_stream(client, &handle, &payload) : NULL;
+    rpc_data* frame = stream ? rpc_stream_next(stream) : NULL;
+    int refused = stream != NULL && frame == NULL && rpc_stream_status(stream) == RPC_ERROR;
+    rpc_data_free(frame);
+    if (stream != NULL) rpc_stream_close(stream);
+    if (client != NULL) rpc_close_client(client);
+    pthread_join(thread, NULL);
+    close(rogue.listen_fd);
+    return refused;
+}
+
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 7330;
+
+    // the server runs in a child process of its own
+    rpc_server* server = rpc_init_server(port);
+    if (server == NULL || rpc_register_stream(server, "count", count, NULL) < 0 ||
+        rpc_register_stream(server, "fail", fail, NULL) < 0 ||
+        rpc_register_stream(server, "oversize", oversize, NULL) < 0)
+        return setup_failed("cannot set up server", ERROR);
+    pid_t child = server_start(server, port);
+    rpc_client* client = child > 0 ? rpc_init_client("::1", port) : NULL;
+    rpc_handle* count_h = client ? rpc_find(client, "count") : NULL;
+    rpc_handle* fail_h = client ? rpc_find(client, "fail") : NULL;
+    rpc_handle* oversize_h = client ? rpc_find(client, "oversize") : NULL;
+    if (count_h == NULL || fail_h == NULL || oversize_h == NULL) {
+        free(count_h);
+        free(fail_h);
+        if (client != NULL) rpc_close_client(client);
+        return setup_failed("cannot find the server's functions", child);
+    }
+
+    // frames: whole and in order, then again with every frame checksummed
+    read_counted(client, count_h, NUM_FRAMES, "frames");
+    check(rpc_client_set_checksum(client, 1) == 0, "frames", "checksums not negotiated");
+    read_counted(client, count_h, NUM_FRAMES, "frames");
+
+    // fail: the frames written before the handler failed arrive, then its status
+    rpc_data payload = { 0, 0, NULL };
+    rpc_stream* stream = rpc_call_stream(client, fail_h, &payload);
+    int frames = 0;
+    for (rpc_data* frame; stream != NULL && (frame = rpc_stream_next(stream)) != NULL; frames++)
+        rpc_data_free(frame);
+    check(stream != NULL && frames == FAIL_AFTER, "fail", "frames missing");
+    check(stream != NULL && rpc_stream_close(stream) == RPC_ERROR, "fail", "status not RPC_ERROR");
+    read_counted(client, count_h, FAIL_AFTER, "fail");
+
+    // oversize: the frame is refused, and the handler's next frame says so
+    stream = rpc_call_stream(client, oversize_h, &payload);
+    rpc_data* frame = stream ? rpc_stream_next(stream) : NULL;
+    check(frame != NULL && frame->data1 == ERROR && frame->data2_len == 0, "oversize",
+          "the frame over MAX_FRAME_LEN was not refused");
+    rpc_data_free(frame);
+    check(stream != NULL && rpc_stream_next(stream) == NULL &&
+          rpc_stream_close(stream) == RPC_OK, "oversize", "stream did not end well");
+
+    // close: a stream left half way drops the connection, which the next stream re-establishes
+    payload.data1 = NUM_FRAMES;
+    stream = rpc_call_stream(client, count_h, &payload);
+    frame = stream ? rpc_stream_next(stream) : NULL;
+    check(counted(frame, 0), "close", "first frame damaged");
+    rpc_data_free(frame);
+    check(stream != NULL && rpc_stream_close(stream) == RPC_ERROR, "close",
+          "status not RPC_ERROR");
+    read_counted(client, count_h, NUM_FRAMES, "close");
+
+    // bound: frame lengths past MAX_FRAME_LEN, up to one no allocation could hold
+    uint64_t lengths[] = { MAX_FRAME_LEN + 1, (uint64_t) 1 << 40, UINT64_MAX };
+    for (size_t i = 0; i < sizeof lengths / sizeof lengths[0]; i++)
+        check(rogue_frame_refused(port + 1, lengths[i]), "bound", "frame not refused");
+
+    free(count_h);
+    free(fail_h);
+    free(oversize_h);
+    rpc_close_client(client);
+    server_stop(child);
+    return test_done("stream");
+}
@@ -0,0 +1,144 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : timeout.c
+ * Purpose : Tests of the server's connection timeouts, run by `make test` against a local server
+ *           with short ones.
+ *
+ * Tests:
+ *     idle    - a connection without a request is closed once it has been idle for IDLE_MS
+ *     flag    - a client going silent part way through its request flag is closed as idle
+ *     payload - a client going silent part way through its payload is closed once the request
+ *               has taken REQUEST_MS
+ *     busy    - a client calling more often than that is never closed
+ *     count   - rpc_server_timeout_count counts every connection closed
+ *
+ * Every slow client is a raw connection, whose end is seen as the server closing it.
+ *
+ * Usage: test-timeout [port]
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_client.h"
+#include "rpc_server.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define IDLE_MS    (int) 400
+#define REQUEST_MS (int) 200
+#define NUM_BUSY   (int) 12     // calls of the busy client, IDLE_MS / 4 apart
+
+static rpc_server* served = NULL;   // the server, set before it is forked
+
+
+/* handler answering with the connections the server has closed by a timeout so far */
+static rpc_data* timeouts(rpc_data* payload) {
+    rpc_data* response = (rpc_data*) calloc(1, sizeof(rpc_data));
+    if (response != NULL) response->data1 = (int) rpc_server_timeout_count(served);
+    return response;
+}
+
+/* the connections the server has closed by a timeout, or ERROR if it cannot be asked */
+static int timed_out(int port) {
+    rpc_client* client = rpc_init_client("::1", port);
+    rpc_handle* handle = client ? rpc_find(client, "timeouts") : NULL;
+    rpc_data payload = { 0, 0, NULL };
+    rpc_data* response = handle ? rpc_call(client, handle, &payload) : NULL;
+    int count = response != NULL ? response->data1 : ERROR;
+    rpc_data_free(response);
+    free(handle);
+    if (client != NULL) rpc_close_client(client);
+    return count;
+}
+
+/* a raw connection to the server, giving up on a receive after READY_MS */
+static int connect_raw(int port) {
+    int fd = create_connect_socket("::1", port);
+    struct timeval timeout = { READY_MS / 1000, 0 };
+    if (fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0) {
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+}
+
+/**
+ * Wait for the server to close a raw connection, which is then closed here too.
+ * @param fd       the connection
+ * @param start_ns when the server may have started timing it (see rpc_now_ns)
+ * @param least_ms the least time it should have been left open for
+ * @return         1 if it was closed, not before least_ms, and 0 if otherwise
+ */
+static int closed_after(int fd, uint64_t start_ns, int least_ms) {
+    if (fd < 0) return 0;
+    char byte;
+    int closed = recv(fd, &byte, 1, 0) == 0;
+    uint64_t open_ns = rpc_now_ns() - start_ns;
+    close(fd);
+    return closed && open_ns >= (uint64_t) least_ms * 1000000ULL;
+}
+
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 7360;
+
+    // the server runs in a child process of its own
+    served = rpc_init_server(port);
+    if (served == NULL || rpc_register(served, "timeouts", timeouts) < 0 ||
+        rpc_server_set_timeouts(served, IDLE_MS, REQUEST_MS) < 0)
+        return setup_failed("cannot set up server", ERROR);
+    pid_t child = server_start(served, port);
+    if (child < 0) return setup_failed("server did not come up", ERROR);
+    int before = timed_out(port);
+    if (before < 0) return setup_failed("cannot ask the server for its timeouts", child);
+
+    // idle: a connection never sending anything
+    uint64_t start_ns = rpc_now_ns();
+    int fd = connect_raw(port);
+    check(closed_after(fd, start_ns, IDLE_MS), "idle", "the idle connection was not closed");
+
+    // flag: a client trickling in its request flag is still idle until all of it has arrived
+    start_ns = rpc_now_ns();
+    fd = connect_raw(port);
+    char half[4] = { 0 };       // the first half of the 8 bytes of a request flag
+    check(fd >= 0 && send(fd, half, sizeof half, 0) == sizeof half, "flag", "flag not sent");
+    check(closed_after(fd, start_ns, IDLE_MS), "flag", "the silent client was not closed");
+
+    // payload: a client stalling half way through its call's payload
+    rpc_client* client = rpc_init_client("::1", port);
+    rpc_handle* handle = client ? rpc_find(client, "timeouts") : NULL;
+    if (client != NULL) rpc_close_client(client);
+    fd = handle ? connect_raw(port) : ERROR;
+    start_ns = rpc_now_ns();
+    int flag = ERROR;
+    check(fd >= 0 && rpc_send_int(fd, CALL_SERVICE) == 0 &&
+          rpc_send_uint(fd, handle->function_id) == 0 && rpc_receive_int(fd, &flag) == 0 &&
+          flag == 0 && rpc_send_int(fd, 0) == 0 && rpc_send_int(fd, 0) == 0, "payload",
+          "call not started");
+    check(closed_after(fd, start_ns, REQUEST_MS), "payload", "the stalled client was not closed");
+
+    // busy: calls coming often enough keep the connection open throughout
+    client = handle ? rpc_init_client("::1", port) : NULL;
+    int answered = 0;
+    rpc_data payload = { 0, 0, NULL };
+    for (int i = 0; client != NULL && i < NUM_BUSY; i++) {
+        rpc_data* response = rpc_call(client, handle, &payload);
+        answered += response != NULL;
+        rpc_data_free(response);
+        usleep(IDLE_MS * 1000 / 4);
+    }
+    check(answered == NUM_BUSY, "busy", "the busy client's calls failed");
+
+    // count: the idle, flag and payload connections, and none other
+    check(timed_out(port) == before + 3, "count", "timeouts not counted");
+
+    free(handle);
+    if (client != NULL) rpc_close_client(client);
+    server_stop(child);
+    return test_done("timeout");
+}
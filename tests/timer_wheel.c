@@ -0,0 +1,171 @@
+/*
+ * Author  : The Duy Nguyen - 1100548
+ * File    : timer_wheel.c
+ * Purpose : Tests of the timer wheel, advanced by the test itself rather than by its thread, so
+ *           that hours of ticks pass at once.
+ *
+ * Tests:
+ *     order   - timers across the boundaries of every level, armed out of order, each fire at
+ *               their own tick, in order, cascaded down from the higher levels in one advance
+ *     early   - advanced up to the tick before each wheel_next, the wheel fires nothing, nor
+ *               any timer before its tick
+ *     clamp   - a timer beyond the last level fires early, but only at the far end of the wheel,
+ *               and re-armed from there fires at its own tick
+ *     cancel  - a timer cancelled does not fire, and an empty wheel has no next tick
+ *
+ * Usage: test-timer_wheel
+ */
+
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+#include "rpc_utils.h"
+#include "fixture.h"
+
+#define NUM_RANDOM  (int) 200
+#define NUM_TIMERS  (int) (NUM_RANDOM + 3 * (WHEEL_LEVELS - 1) + 1)
+#define LEVEL_TICKS(level) ((uint64_t) 1 << ((level) * WHEEL_BITS))     // ticks of a slot
+
+/* timer of the tests, the node first so that the wheel's timer is the test's */
+typedef struct {
+    timer_node_t node;
+    int id;
+    uint64_t due;           // tick it should fire at
+    uint64_t armed_at;      // tick it was last armed at
+    uint64_t fired_at;      // tick it fired at, 0 if it did not
+    int early;              // times it fired before its tick
+} timed_t;
+
+static timer_wheel_t wheel;
+static int fired_ids[NUM_TIMERS];
+static int num_fired = 0;
+static int early_far = 1;   // whether every early fire was at the far end of the wheel
+
+
+/* the wheel's callback, recording the timer, or re-arming it if it fired early */
+static uint64_t fire(timer_node_t* timer, uint64_t now_ns, void* arg) {
+    timed_t* t = (timed_t*) timer;
+    if (wheel.now < t->due) {
+        early_far &= wheel.now > t->armed_at + (WHEEL_SLOTS - 2) * LEVEL_TICKS(WHEEL_LEVELS - 1);
+        t->early++;
+        t->armed_at = wheel.now;
+        return t->due * WHEEL_TICK_NS;
+    }
+    t->fired_at = wheel.now;
+    if (num_fired < NUM_TIMERS) fired_ids[num_fired] = t->id;
+    num_fired++;
+    return 0;
+}
+
+/* arm a timer at a tick */
+static void arm(timed_t* t, int id, uint64_t due) {
+    t->node = (timer_node_t) { 0 };
+    t->id = id;
+    t->due = due;
+    t->armed_at = wheel.now;
+    t->fired_at = 0;
+    t->early = 0;
+    wheel_arm(&wheel, &t->node, due * WHEEL_TICK_NS);
+}
+
+/**
+ * Arm timers at ticks on either side of the first boundary of every level, and at ticks spread
+ * up to the last level, in an order of their own.
+ * @param timers the timers, NUM_TIMERS of them
+ * @return       the last tick of a timer
+ */
+static uint64_t arm_all(timed_t* timers) {
+    uint64_t dues[NUM_TIMERS];
+    int n = 0;
+    uint64_t now = wheel.now;
+    dues[n++] = now + 1;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        uint64_t boundary = ((now + 1) / LEVEL_TICKS(level) + 1) * LEVEL_TICKS(level);
+        dues[n++] = boundary - 1;
+        dues[n++] = boundary;
+        dues[n++] = boundary + 1;
+    }
+    srand(1100548);
+    while (n < NUM_TIMERS) {
+        int level = rand() % WHEEL_LEVELS;
+        dues[n++] = now + 1 + (uint64_t) rand() % (LEVEL_TICKS(level) * (WHEEL_SLOTS - 1));
+    }
+
+    // shuffled, so that timers are not armed in the order they fire
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        uint64_t due = dues[i];
+        dues[i] = dues[j];
+        dues[j] = due;
+    }
+    uint64_t last = 0;
+    num_fired = 0;
+    for (int i = 0; i < n; i++) {
+        arm(&timers[i], i, dues[i]);
+        if (dues[i] > last) last = dues[i];
+    }
+    return last;
+}
+
+/**
+ * Check that every timer fired once, at its own tick, and in order.
+ * @param timers the timers
+ * @param test   the test's name
+ */
+static void check_fired(timed_t* timers, char* test) {
+    check(num_fired == NUM_TIMERS, test, "timers missing, or fired twice");
+    int on_time = 1, in_order = 1;
+    for (int i = 0; i < NUM_TIMERS; i++)
+        on_time &= timers[i].fired_at == timers[i].due && timers[i].early == 0;
+    for (int i = 1; i < num_fired && i < NUM_TIMERS; i++)
+        in_order &= timers[fired_ids[i - 1]].due <= timers[fired_ids[i]].due;
+    check(on_time, test, "a timer did not fire at its tick");
+    check(in_order, test, "timers fired out of order");
+}
+
+
+int main(int argc, char* argv[]) {
+    wheel_init(&wheel, fire, NULL);
+    timed_t* timers = (timed_t*) calloc(NUM_TIMERS, sizeof(timed_t));
+    if (timers == NULL) return setup_failed("cannot allocate the timers", ERROR);
+
+    // order: one advance past the last timer turns every level, cascading each slot it reaches
+    uint64_t last = arm_all(timers);
+    check(wheel_advance(&wheel, last * WHEEL_TICK_NS) == NUM_TIMERS, "order",
+          "advance did not fire every timer");
+    check_fired(timers, "order");
+
+    // early: advanced a tick short of the wheel's next work, then to it
+    last = arm_all(timers);
+    int quiet = 1;
+    for (uint64_t next; (next = wheel_next(&wheel)) != 0; ) {
+        quiet &= wheel_advance(&wheel, next - WHEEL_TICK_NS) == 0;
+        wheel_advance(&wheel, next);
+    }
+    check(quiet, "early", "a timer fired before the wheel's next tick");
+    check(wheel.now == last, "early", "the wheel did not stop at the last timer");
+    check_fired(timers, "early");
+
+    // clamp: twice beyond the last level, fired at the far end of the wheel on its way
+    timed_t far;
+    uint64_t due = wheel.now + 2 * LEVEL_TICKS(WHEEL_LEVELS) + 7;
+    num_fired = 0;
+    arm(&far, 0, due);
+    check(wheel_next(&wheel) < due * WHEEL_TICK_NS, "clamp", "the timer was not clamped");
+    check(wheel_advance(&wheel, (due - 1) * WHEEL_TICK_NS) == far.early && far.early > 0,
+          "clamp", "the timer did not fire early, at the far end");
+    check(early_far, "clamp", "the timer fired early before the far end of the wheel");
+    check(far.fired_at == 0 && wheel_advance(&wheel, due * WHEEL_TICK_NS) == 1 &&
+          far.fired_at == due, "clamp", "the timer did not fire at its tick");
+
+    // cancel: neither armed nor cancelled timers are left behind
+    arm(&far, 0, wheel.now + LEVEL_TICKS(2));
+    wheel_cancel(&wheel, &far.node);
+    check(wheel_next(&wheel) == 0, "cancel", "the wheel has a next tick");
+    check(wheel_advance(&wheel, (wheel.now + LEVEL_TICKS(3)) * WHEEL_TICK_NS) == 0, "cancel",
+          "the cancelled timer fired");
+    check(wheel.num_timers == 0, "cancel", "timers left in the wheel");
+
+    free(timers);
+    return test_done("timer_wheel");
+}